@@ -0,0 +1,462 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+/* Allocation accounting.
+ *
+ * On glibc we interpose malloc() and friends in the benchmark executable, so
+ * that allocations made by libwocky, GLib and libxml2 are all counted. The
+ * counters are only updated while a measured run is in progress. GSlice
+ * allocations are only seen when G_SLICE=always-malloc is set (or with GLib
+ * >= 2.76, where GSlice is a thin wrapper around malloc()); "make bench" does
+ * this for you.
+ */
+static gint counting = 0;
+static guint64 alloc_count = 0;
+static guint64 alloc_bytes = 0;
+
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNTERS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static inline void
+account (size_t size)
+{
+  if (G_UNLIKELY (counting))
+    {
+      __atomic_fetch_add (&alloc_count, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add (&alloc_bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void *
+malloc (size_t size)
+{
+  account (size);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+    size_t size)
+{
+  account (nmemb * size);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+    size_t size)
+{
+  account (size);
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+#endif
+
+const BenchStanza bench_corpus[] = {
+  { "presence",
+    "<presence from='juliet@example.com/balcony' to='romeo@example.net'>"
+      "<show>away</show>"
+      "<status>Wherefore art thou?</status>"
+      "<priority>1</priority>"
+      "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1'"
+      " node='http://telepathy.freedesktop.org/wiki/Wocky'"
+      " ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>"
+      "<x xmlns='vcard-temp:x:update'>"
+        "<photo>01b87fcd030b72895ff8e88db57ec525450f000d</photo>"
+      "</x>"
+    "</presence>" },
+  { "message",
+    "<message from='romeo@example.net/orchard' to='juliet@example.com'"
+    " type='chat' id='ktx72v49' xml:lang='en'>"
+      "<body>Art thou not Romeo, and a Montague? Neither, fair saint, "
+      "if either thee dislike.</body>"
+      "<thread>e0ffe42b28561960c6b12b944a092794b9683a38</thread>"
+      "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+      "<request xmlns='urn:xmpp:receipts'/>"
+    "</message>" },
+  { "roster",
+    "<iq to='juliet@example.com/balcony' id='roster_1' type='result'>"
+      "<query xmlns='jabber:iq:roster' ver='ver11'>"
+        "<item jid='romeo@example.net' name='Romeo'"
+        " subscription='both'><group>Friends</group></item>"
+        "<item jid='mercutio@example.org' name='Mercutio'"
+        " subscription='from'><group>Friends</group></item>"
+        "<item jid='benvolio@example.org' name='Benvolio'"
+        " subscription='both'><group>Friends</group>"
+        "<group>Montagues</group></item>"
+        "<item jid='nurse@example.com' name='Nurse'"
+        " subscription='to'/>"
+        "<item jid='tybalt@example.com' name='Tybalt'"
+        " subscription='none' ask='subscribe'>"
+        "<group>Capulets</group></item>"
+      "</query>"
+    "</iq>" },
+  { "pubsub",
+    "<message from='pubsub.shakespeare.lit' to='francisco@denmark.lit'"
+    " id='foo'>"
+      "<event xmlns='http://jabber.org/protocol/pubsub#event'>"
+        "<items node='http://jabber.org/protocol/geoloc'>"
+          "<item id='ae890ac52d0df67ed7cfdf51b644e901'>"
+            "<geoloc xmlns='http://jabber.org/protocol/geoloc'"
+            " xml:lang='en'>"
+              "<accuracy>20</accuracy>"
+              "<country>Italy</country>"
+              "<lat>45.44</lat>"
+              "<locality>Venice</locality>"
+              "<lon>12.33</lon>"
+            "</geoloc>"
+          "</item>"
+        "</items>"
+      "</event>"
+      "<addresses xmlns='http://jabber.org/protocol/address'>"
+        "<address type='replyto' jid='bernardo@denmark.lit/castle'/>"
+      "</addresses>"
+    "</message>" },
+  { "jingle",
+    "<iq from='romeo@montague.lit/orchard' id='ph37a419'"
+    " to='juliet@capulet.lit/balcony' type='set'>"
+      "<jingle xmlns='urn:xmpp:jingle:1' action='session-initiate'"
+      " initiator='romeo@montague.lit/orchard' sid='a73sjjvkla37jfea'>"
+        "<content creator='initiator' name='voice'>"
+          "<description xmlns='urn:xmpp:jingle:apps:rtp:1' media='audio'>"
+            "<payload-type id='96' name='speex' clockrate='16000'/>"
+            "<payload-type id='97' name='speex' clockrate='8000'/>"
+            "<payload-type id='18' name='G729'/>"
+            "<payload-type id='0' name='PCMU'/>"
+            "<payload-type id='103' name='L16' clockrate='16000'"
+            " channels='2'/>"
+            "<payload-type id='98' name='x-ISAC' clockrate='8000'/>"
+          "</description>"
+          "<transport xmlns='urn:xmpp:jingle:transports:ice-udp:1'"
+          " pwd='asd88fgpdd777uzjYhagZg' ufrag='8hhy'>"
+            "<candidate component='1' foundation='1' generation='0'"
+            " id='el0747fg11' ip='10.0.1.1' network='1' port='8998'"
+            " priority='2130706431' protocol='udp' type='host'/>"
+            "<candidate component='1' foundation='2' generation='0'"
+            " id='y3s2b30v3r' ip='192.0.2.3' network='1' port='45664'"
+            " priority='1694498815' protocol='udp' rel-addr='10.0.1.1'"
+            " rel-port='8998' type='srflx'/>"
+          "</transport>"
+        "</content>"
+      "</jingle>"
+    "</iq>" },
+  { "form",
+    "<iq from='coven@chat.shakespeare.lit' id='create1'"
+    " to='crone1@shakespeare.lit/desktop' type='result'>"
+      "<query xmlns='http://jabber.org/protocol/muc#owner'>"
+        "<x xmlns='jabber:x:data' type='form'>"
+          "<title>Configuration for coven Room</title>"
+          "<field type='hidden' var='FORM_TYPE'>"
+            "<value>http://jabber.org/protocol/muc#roomconfig</value>"
+          "</field>"
+          "<field label='Natural-Language Room Name' type='text-single'"
+          " var='muc#roomconfig_roomname'/>"
+          "<field label='Short Description of Room' type='text-single'"
+          " var='muc#roomconfig_roomdesc'/>"
+          "<field label='Maximum Number of Occupants' type='list-single'"
+          " var='muc#roomconfig_maxusers'>"
+            "<value>20</value>"
+            "<option label='10'><value>10</value></option>"
+            "<option label='20'><value>20</value></option>"
+            "<option label='30'><value>30</value></option>"
+            "<option label='50'><value>50</value></option>"
+            "<option label='None'><value>none</value></option>"
+          "</field>"
+          "<field label='Roles for which Presence is Broadcasted'"
+          " type='list-multi' var='muc#roomconfig_presencebroadcast'>"
+            "<value>moderator</value>"
+            "<value>participant</value>"
+            "<option label='Moderator'><value>moderator</value></option>"
+            "<option label='Participant'><value>participant</value></option>"
+            "<option label='Visitor'><value>visitor</value></option>"
+          "</field>"
+          "<field label='Make Room Persistent?' type='boolean'"
+          " var='muc#roomconfig_persistentroom'><value>0</value></field>"
+          "<field label='Password Required to Enter?' type='boolean'"
+          " var='muc#roomconfig_passwordprotectedroom'>"
+            "<value>0</value>"
+          "</field>"
+        "</x>"
+      "</query>"
+    "</iq>" },
+  { NULL, NULL }
+};
+
+/**
+ * bench_parse_stanza:
+ * @xml: a single serialized stanza, in the jabber:client namespace
+ *
+ * Returns: a new #WockyStanza parsed from @xml
+ */
+WockyStanza *
+bench_parse_stanza (const gchar *xml)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+
+  reader = wocky_xmpp_reader_new_no_stream_ns (WOCKY_XMPP_NS_JABBER_CLIENT);
+  wocky_xmpp_reader_push (reader, (const guint8 *) xml, strlen (xml));
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  g_object_unref (reader);
+
+  return stanza;
+}
+
+typedef struct {
+  gchar *name;
+  BenchFunc func;
+  gpointer user_data;
+  gsize bytes_per_op;
+} Bench;
+
+static GPtrArray *benches = NULL;
+
+static gboolean machine_output = FALSE;
+static gdouble min_time = 0.5;
+static gint repeat = 5;
+static gchar **paths = NULL;
+
+static GOptionEntry entries[] = {
+  { "machine", 'm', 0, G_OPTION_ARG_NONE, &machine_output,
+    "Print one tab-separated record per benchmark", NULL },
+  { "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &min_time,
+    "Minimum measured time per run in seconds (default 0.5)", "SECONDS" },
+  { "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat,
+    "Number of measured runs, the best is reported (default 5)", "N" },
+  { "path", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &paths,
+    "Only run benchmarks whose name starts with PATH", "PATH" },
+  { NULL }
+};
+
+static void
+bench_free (gpointer data)
+{
+  Bench *bench = data;
+
+  g_free (bench->name);
+  g_slice_free (Bench, bench);
+}
+
+/**
+ * bench_add_sized:
+ * @name: a path-like name, such as "/xmpp-reader/presence"
+ * @func: the operation to measure
+ * @user_data: data to pass to @func
+ * @bytes_per_op: the number of input bytes processed by one call to @func,
+ *  used to report throughput; or 0
+ *
+ * Registers a benchmark to be run by bench_run().
+ */
+void
+bench_add_sized (const gchar *name,
+    BenchFunc func,
+    gpointer user_data,
+    gsize bytes_per_op)
+{
+  Bench *bench = g_slice_new0 (Bench);
+
+  bench->name = g_strdup (name);
+  bench->func = func;
+  bench->user_data = user_data;
+  bench->bytes_per_op = bytes_per_op;
+
+  g_ptr_array_add (benches, bench);
+}
+
+void
+bench_add (const gchar *name,
+    BenchFunc func,
+    gpointer user_data)
+{
+  bench_add_sized (name, func, user_data, 0);
+}
+
+void
+bench_init (int argc,
+    char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new ("- run Wocky microbenchmarks");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  g_option_context_free (context);
+
+  if (repeat < 1)
+    repeat = 1;
+
+  g_type_init ();
+  wocky_init ();
+
+  benches = g_ptr_array_new_with_free_func (bench_free);
+
+#ifndef HAVE_ALLOC_COUNTERS
+  g_printerr ("Allocation counters are not available on this platform\n");
+#endif
+}
+
+void
+bench_deinit (void)
+{
+  g_ptr_array_unref (benches);
+  benches = NULL;
+  g_strfreev (paths);
+  paths = NULL;
+
+  wocky_deinit ();
+}
+
+static gboolean
+bench_selected (Bench *bench)
+{
+  gchar **p;
+
+  if (paths == NULL)
+    return TRUE;
+
+  for (p = paths; *p != NULL; p++)
+    {
+      if (g_str_has_prefix (bench->name, *p))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gint64
+run_iterations (Bench *bench,
+    guint64 iterations)
+{
+  gint64 start;
+  guint64 i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < iterations; i++)
+    bench->func (bench->user_data);
+
+  return g_get_monotonic_time () - start;
+}
+
+/* Find an iteration count for which one run takes at least min_time */
+static guint64
+calibrate (Bench *bench)
+{
+  gint64 target = (gint64) (min_time * G_USEC_PER_SEC);
+  guint64 iterations = 1;
+
+  while (TRUE)
+    {
+      gint64 elapsed = run_iterations (bench, iterations);
+      gdouble factor;
+
+      if (elapsed >= target)
+        return iterations;
+
+      if (elapsed <= 0)
+        factor = 100;
+      else
+        factor = MIN (100, MAX (2, 1.2 * target / elapsed));
+
+      iterations = (guint64) (iterations * factor);
+    }
+}
+
+static void
+run_bench (Bench *bench)
+{
+  guint64 iterations;
+  gdouble best_ns = G_MAXDOUBLE;
+  gdouble allocs = 0, bytes = 0;
+  gint i;
+
+  iterations = calibrate (bench);
+
+  for (i = 0; i < repeat; i++)
+    {
+      gint64 elapsed;
+      gdouble ns;
+
+      alloc_count = 0;
+      alloc_bytes = 0;
+      g_atomic_int_set (&counting, 1);
+      elapsed = run_iterations (bench, iterations);
+      g_atomic_int_set (&counting, 0);
+
+      ns = (gdouble) elapsed * 1000 / iterations;
+
+      if (ns < best_ns)
+        best_ns = ns;
+
+      /* allocations are deterministic, so any run will do */
+      allocs = (gdouble) alloc_count / iterations;
+      bytes = (gdouble) alloc_bytes / iterations;
+    }
+
+  if (machine_output)
+    {
+      g_print ("%s\t%" G_GUINT64_FORMAT "\t%.1f\t%.2f\t%.1f\t%.2f\n",
+          bench->name, iterations, best_ns, allocs, bytes,
+          bench->bytes_per_op == 0 ? 0 :
+            bench->bytes_per_op * 1000.0 / best_ns);
+    }
+  else
+    {
+      g_print ("%-48s %12.1f ns/op %10.2f allocs/op %12.1f B/op",
+          bench->name, best_ns, allocs, bytes);
+
+      if (bench->bytes_per_op != 0)
+        g_print (" %10.2f MB/s", bench->bytes_per_op * 1000.0 / best_ns);
+
+      g_print ("\n");
+    }
+}
+
+int
+bench_run (void)
+{
+  guint i;
+
+  if (machine_output)
+    g_print ("# %s\n# name\titerations\tns/op\tallocs/op\tB/op\tMB/s\n",
+        PACKAGE_STRING);
+
+  for (i = 0; i < benches->len; i++)
+    {
+      Bench *bench = g_ptr_array_index (benches, i);
+
+      if (bench_selected (bench))
+        run_bench (bench);
+    }
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef __WOCKY_BENCH_HELPER_H__
+#define __WOCKY_BENCH_HELPER_H__
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+G_BEGIN_DECLS
+
+/* A single operation of a benchmark. It is called in a loop by the harness;
+ * anything which should not be measured has to be set up before
+ * bench_add() and passed in as @user_data. */
+typedef void (*BenchFunc) (gpointer user_data);
+
+typedef struct {
+  const gchar *name;
+  const gchar *xml;
+} BenchStanza;
+
+/* Stream header to push into a streaming #WockyXmppReader before any of the
+ * corpus stanzas */
+#define BENCH_STREAM_HEADER \
+  "<?xml version='1.0' encoding='UTF-8'?>" \
+  "<stream:stream xmlns='jabber:client'" \
+  " xmlns:stream='http://etherx.jabber.org/streams'" \
+  " from='example.com' id='bench' version='1.0'>"
+
+/* NULL-terminated corpus of realistic client stanzas */
+extern const BenchStanza bench_corpus[];
+
+WockyStanza *bench_parse_stanza (const gchar *xml);
+
+void bench_add (const gchar *name,
+    BenchFunc func,
+    gpointer user_data);
+
+void bench_add_sized (const gchar *name,
+    BenchFunc func,
+    gpointer user_data,
+    gsize bytes_per_op);
+
+void bench_init (int argc,
+    char **argv);
+
+int bench_run (void);
+
+void bench_deinit (void);
+
+G_END_DECLS
+
+#endif /* #ifndef __WOCKY_BENCH_HELPER_H__*/
@@ -0,0 +1,113 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+static void
+compute_hash (gpointer user_data)
+{
+  WockyStanza *stanza = user_data;
+
+  g_free (wocky_caps_hash_compute_from_node (
+      wocky_stanza_get_top_node (stanza)));
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  WockyStanza *simple, *complex;
+  int result;
+
+  bench_init (argc, argv);
+
+  /* Simple example from XEP-0115 */
+  simple = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_RESULT, NULL, NULL,
+      '(', "query", ':', WOCKY_NS_DISCO_INFO,
+        '(', "identity",
+          '@', "category", "client",
+          '@', "name", "Exodus 0.9.1",
+          '@', "type", "pc",
+        ')',
+        '(', "feature",
+            '@', "var", "http://jabber.org/protocol/disco#info", ')',
+        '(', "feature",
+            '@', "var", "http://jabber.org/protocol/disco#items", ')',
+        '(', "feature", '@', "var", "http://jabber.org/protocol/muc", ')',
+        '(', "feature", '@', "var", "http://jabber.org/protocol/caps", ')',
+      ')',
+      NULL);
+
+  /* Complex example from XEP-0115 */
+  complex = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_RESULT, NULL, NULL,
+      '(', "query", ':', WOCKY_NS_DISCO_INFO,
+        '(', "identity",
+          '@', "category", "client",
+          '@', "name", "Psi 0.11",
+          '@', "type", "pc",
+          '#', "en",
+        ')',
+        '(', "identity",
+          '@', "category", "client",
+          '@', "name", "Ψ 0.11",
+          '@', "type", "pc",
+          '#', "el",
+        ')',
+        '(', "feature",
+            '@', "var", "http://jabber.org/protocol/disco#info", ')',
+        '(', "feature",
+            '@', "var", "http://jabber.org/protocol/disco#items", ')',
+        '(', "feature", '@', "var", "http://jabber.org/protocol/muc", ')',
+        '(', "feature", '@', "var", "http://jabber.org/protocol/caps", ')',
+        '(', "x", ':', "jabber:x:data",
+          '@', "type", "result",
+          '(', "field",
+            '@', "var", "FORM_TYPE",
+            '@', "type", "hidden",
+            '(', "value", '$', "urn:xmpp:dataforms:softwareinfo", ')',
+          ')',
+          '(', "field",
+            '@', "var", "ip_version",
+            '(', "value", '$', "ipv4", ')',
+            '(', "value", '$', "ipv6", ')',
+          ')',
+          '(', "field",
+            '@', "var", "os",
+            '(', "value", '$', "Mac", ')',
+          ')',
+          '(', "field",
+            '@', "var", "os_version",
+            '(', "value", '$', "10.5.1", ')',
+          ')',
+          '(', "field",
+            '@', "var", "software",
+            '(', "value", '$', "Psi", ')',
+          ')',
+          '(', "field",
+            '@', "var", "software_version",
+            '(', "value", '$', "0.11", ')',
+          ')',
+        ')',
+      ')',
+      NULL);
+
+  bench_add ("/caps-hash/compute/simple", compute_hash,
+      wocky_node_get_first_child (wocky_stanza_get_top_node (simple)));
+  bench_add ("/caps-hash/compute/complex", compute_hash,
+      wocky_node_get_first_child (wocky_stanza_get_top_node (complex)));
+
+  result = bench_run ();
+
+  g_object_unref (simple);
+  g_object_unref (complex);
+  bench_deinit ();
+
+  return result;
+}
@@ -0,0 +1,92 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+typedef struct {
+  WockyStanza *stanza;
+  WockyStanza *pattern;
+} SupersetBench;
+
+static void
+superset_bench_free (SupersetBench *b)
+{
+  g_object_unref (b->stanza);
+  g_object_unref (b->pattern);
+  g_slice_free (SupersetBench, b);
+}
+
+static void
+is_superset (gpointer user_data)
+{
+  SupersetBench *b = user_data;
+
+  wocky_node_is_superset (wocky_stanza_get_top_node (b->stanza),
+      wocky_stanza_get_top_node (b->pattern));
+}
+
+static void
+add_superset_bench (GPtrArray *fixtures,
+    const gchar *name,
+    const gchar *xml,
+    WockyStanza *pattern)
+{
+  SupersetBench *b = g_slice_new0 (SupersetBench);
+
+  b->stanza = bench_parse_stanza (xml);
+  b->pattern = pattern;
+
+  g_ptr_array_add (fixtures, b);
+  bench_add (name, is_superset, b);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GPtrArray *fixtures;
+  int result;
+
+  bench_init (argc, argv);
+
+  fixtures = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) superset_bench_free);
+
+  /* The kind of patterns the porter matches every incoming stanza against */
+  add_superset_bench (fixtures, "/node/is-superset/roster-match",
+      bench_corpus[2].xml,
+      wocky_stanza_build (WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_NONE,
+        NULL, NULL,
+        '(', "query", ':', WOCKY_XMPP_NS_ROSTER, ')',
+        NULL));
+
+  add_superset_bench (fixtures, "/node/is-superset/pubsub-match",
+      bench_corpus[3].xml,
+      wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+        WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+        '(', "event", ':', WOCKY_XMPP_NS_PUBSUB_EVENT,
+          '(', "items",
+            '@', "node", "http://jabber.org/protocol/geoloc",
+          ')',
+        ')',
+        NULL));
+
+  add_superset_bench (fixtures, "/node/is-superset/jingle-mismatch",
+      bench_corpus[4].xml,
+      wocky_stanza_build (WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_NONE,
+        NULL, NULL,
+        '(', "query", ':', WOCKY_XMPP_NS_ROSTER, ')',
+        NULL));
+
+  result = bench_run ();
+
+  g_ptr_array_unref (fixtures);
+  bench_deinit ();
+
+  return result;
+}
@@ -0,0 +1,259 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gio/gio.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+/* Stanzas sent per operation; the connection is drained between batches */
+#define BATCH 64
+
+/* An output stream which throws everything away, completing writes from the
+ * main loop like a socket would */
+typedef struct {
+  GOutputStream parent;
+} BenchSinkOutputStream;
+
+typedef struct {
+  GOutputStreamClass parent_class;
+} BenchSinkOutputStreamClass;
+
+static GType bench_sink_output_stream_get_type (void);
+
+G_DEFINE_TYPE (BenchSinkOutputStream, bench_sink_output_stream,
+    G_TYPE_OUTPUT_STREAM);
+
+static gssize
+bench_sink_output_stream_write (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error)
+{
+  return count;
+}
+
+static void
+bench_sink_output_stream_write_async (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    int io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = g_simple_async_result_new (G_OBJECT (stream),
+      callback, user_data, bench_sink_output_stream_write_async);
+
+  g_simple_async_result_set_op_res_gssize (simple, count);
+  g_simple_async_result_complete_in_idle (simple);
+  g_object_unref (simple);
+}
+
+static gssize
+bench_sink_output_stream_write_finish (GOutputStream *stream,
+    GAsyncResult *result,
+    GError **error)
+{
+  return g_simple_async_result_get_op_res_gssize (
+      G_SIMPLE_ASYNC_RESULT (result));
+}
+
+static void
+bench_sink_output_stream_init (BenchSinkOutputStream *self)
+{
+}
+
+static void
+bench_sink_output_stream_class_init (BenchSinkOutputStreamClass *klass)
+{
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  stream_class->write_fn = bench_sink_output_stream_write;
+  stream_class->write_async = bench_sink_output_stream_write_async;
+  stream_class->write_finish = bench_sink_output_stream_write_finish;
+}
+
+typedef struct {
+  GIOStream parent;
+  GInputStream *input;
+  GOutputStream *output;
+} BenchSinkIOStream;
+
+typedef struct {
+  GIOStreamClass parent_class;
+} BenchSinkIOStreamClass;
+
+static GType bench_sink_io_stream_get_type (void);
+
+G_DEFINE_TYPE (BenchSinkIOStream, bench_sink_io_stream, G_TYPE_IO_STREAM);
+
+static GInputStream *
+bench_sink_io_stream_get_input_stream (GIOStream *stream)
+{
+  return ((BenchSinkIOStream *) stream)->input;
+}
+
+static GOutputStream *
+bench_sink_io_stream_get_output_stream (GIOStream *stream)
+{
+  return ((BenchSinkIOStream *) stream)->output;
+}
+
+static void
+bench_sink_io_stream_finalize (GObject *object)
+{
+  BenchSinkIOStream *self = (BenchSinkIOStream *) object;
+
+  g_object_unref (self->input);
+  g_object_unref (self->output);
+
+  G_OBJECT_CLASS (bench_sink_io_stream_parent_class)->finalize (object);
+}
+
+static void
+bench_sink_io_stream_init (BenchSinkIOStream *self)
+{
+  /* Nothing is ever read: the porter is not started */
+  self->input = g_memory_input_stream_new ();
+  self->output = g_object_new (bench_sink_output_stream_get_type (), NULL);
+}
+
+static void
+bench_sink_io_stream_class_init (BenchSinkIOStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GIOStreamClass *stream_class = G_IO_STREAM_CLASS (klass);
+
+  object_class->finalize = bench_sink_io_stream_finalize;
+  stream_class->get_input_stream = bench_sink_io_stream_get_input_stream;
+  stream_class->get_output_stream = bench_sink_io_stream_get_output_stream;
+}
+
+typedef struct {
+  GIOStream *stream;
+  WockyXmppConnection *connection;
+  WockyPorter *porter;
+  WockyStanza *stanza;
+} PorterBench;
+
+static void
+open_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  gboolean *done = user_data;
+
+  if (!wocky_xmpp_connection_send_open_finish (
+          WOCKY_XMPP_CONNECTION (source), result, NULL))
+    g_error ("couldn't open the bench connection");
+
+  *done = TRUE;
+}
+
+static PorterBench *
+porter_bench_new (const gchar *xml)
+{
+  PorterBench *b = g_slice_new0 (PorterBench);
+  gboolean done = FALSE;
+
+  b->stream = g_object_new (bench_sink_io_stream_get_type (), NULL);
+  b->connection = wocky_xmpp_connection_new (b->stream);
+  b->porter = wocky_c2s_porter_new (b->connection, "juliet@example.com/bench");
+  b->stanza = bench_parse_stanza (xml);
+
+  wocky_xmpp_connection_send_open_async (b->connection, "example.com",
+      "juliet@example.com", "1.0", NULL, NULL, NULL, open_sent_cb, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return b;
+}
+
+static void
+porter_bench_free (PorterBench *b)
+{
+  g_object_unref (b->stanza);
+  g_object_unref (b->porter);
+  g_object_unref (b->connection);
+  g_object_unref (b->stream);
+  g_slice_free (PorterBench, b);
+}
+
+static void
+drain (void)
+{
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+}
+
+static void
+send_async_no_callback (gpointer user_data)
+{
+  PorterBench *b = user_data;
+  guint i;
+
+  for (i = 0; i < BATCH; i++)
+    wocky_porter_send_async (b->porter, b->stanza, NULL, NULL, NULL);
+
+  drain ();
+}
+
+static void
+send_no_reply (gpointer user_data)
+{
+  PorterBench *b = user_data;
+  guint i;
+
+  for (i = 0; i < BATCH; i++)
+    wocky_porter_send (b->porter, b->stanza);
+
+  drain ();
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GPtrArray *fixtures;
+  const BenchStanza *s;
+  int result;
+
+  bench_init (argc, argv);
+
+  fixtures = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) porter_bench_free);
+
+  for (s = bench_corpus; s->name != NULL; s++)
+    {
+      PorterBench *b;
+      gchar *name;
+
+      /* Broadcast-style traffic is what the cheap path is for */
+      if (!g_str_equal (s->name, "presence") &&
+          !g_str_equal (s->name, "message"))
+        continue;
+
+      b = porter_bench_new (s->xml);
+      g_ptr_array_add (fixtures, b);
+
+      name = g_strdup_printf ("/porter/send-async-%u/%s", BATCH, s->name);
+      bench_add (name, send_async_no_callback, b);
+      g_free (name);
+
+      name = g_strdup_printf ("/porter/send-%u/%s", BATCH, s->name);
+      bench_add (name, send_no_reply, b);
+      g_free (name);
+    }
+
+  result = bench_run ();
+
+  g_ptr_array_unref (fixtures);
+  bench_deinit ();
+
+  return result;
+}
@@ -0,0 +1,269 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+static void
+build_message (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT,
+      "romeo@example.net/orchard", "juliet@example.com",
+      '@', "id", "ktx72v49",
+      '(', "body", '$', "Art thou not Romeo, and a Montague?", ')',
+      '(', "active", ':', "http://jabber.org/protocol/chatstates", ')',
+      NULL);
+
+  g_object_unref (stanza);
+}
+
+static void
+build_iq_set (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_SET, NULL, "pubsub.example.com",
+      '@', "id", "publish1",
+      '(', "pubsub", ':', WOCKY_XMPP_NS_PUBSUB,
+        '(', "publish", '@', "node", "http://jabber.org/protocol/tune",
+          '(', "item",
+            '(', "tune", ':', "http://jabber.org/protocol/tune",
+              '(', "artist", '$', "Yes", ')',
+              '(', "length", '$', "686", ')',
+              '(', "source", '$', "Yessongs", ')',
+              '(', "title", '$', "Heart of the Sunrise", ')',
+              '(', "track", '$', "3", ')',
+            ')',
+          ')',
+        ')',
+      ')',
+      NULL);
+
+  g_object_unref (stanza);
+}
+
+static void
+build_sm_ack (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_build (WOCKY_STANZA_TYPE_SM_A,
+      WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+      '@', "h", "4294967295",
+      NULL);
+
+  g_object_unref (stanza);
+}
+
+static void
+instantiate_message (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_template_instantiate (user_data,
+      "juliet@example.com", "ktx72v49",
+      "Art thou not Romeo, and a Montague?");
+
+  g_object_unref (stanza);
+}
+
+static void
+instantiate_iq_set (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_template_instantiate (user_data,
+      "publish1", "Yes", "686", "Yessongs", "Heart of the Sunrise", "3");
+
+  g_object_unref (stanza);
+}
+
+static void
+instantiate_sm_ack (gpointer user_data)
+{
+  WockyStanza *stanza;
+
+  stanza = wocky_stanza_template_instantiate (user_data, "4294967295");
+
+  g_object_unref (stanza);
+}
+
+#define FAN_OUT_RECIPIENTS 1000
+
+typedef struct {
+  WockyStanza *stanza;
+  /* NULL to only copy and address the stanzas */
+  WockyXmppWriter *writer;
+  gchar *to[FAN_OUT_RECIPIENTS];
+  gchar *id[FAN_OUT_RECIPIENTS];
+} FanOut;
+
+static FanOut *
+fan_out_new (const gchar *xml,
+    gboolean write)
+{
+  FanOut *f = g_slice_new0 (FanOut);
+  guint i;
+
+  f->stanza = bench_parse_stanza (xml);
+
+  if (write)
+    {
+      const guint8 *data;
+      gsize length;
+
+      f->writer = wocky_xmpp_writer_new ();
+      wocky_xmpp_writer_stream_open (f->writer, "example.com", NULL, "1.0",
+          NULL, NULL, &data, &length);
+    }
+
+  for (i = 0; i < FAN_OUT_RECIPIENTS; i++)
+    {
+      f->to[i] = g_strdup_printf ("contact%u@example.com/wocky", i);
+      f->id[i] = g_strdup_printf ("fan-out-%u", i);
+    }
+
+  return f;
+}
+
+static void
+fan_out_free (FanOut *f)
+{
+  guint i;
+
+  for (i = 0; i < FAN_OUT_RECIPIENTS; i++)
+    {
+      g_free (f->to[i]);
+      g_free (f->id[i]);
+    }
+
+  if (f->writer != NULL)
+    g_object_unref (f->writer);
+
+  g_object_unref (f->stanza);
+  g_slice_free (FanOut, f);
+}
+
+/* Sends the same stanza to every recipient, as a copy differing only in its
+ * addressing */
+static void
+fan_out (gpointer user_data)
+{
+  FanOut *f = user_data;
+  guint i;
+
+  for (i = 0; i < FAN_OUT_RECIPIENTS; i++)
+    {
+      WockyStanza *copy = wocky_stanza_copy (f->stanza);
+      WockyNode *top = wocky_stanza_get_top_node (copy);
+
+      wocky_node_set_attribute (top, "to", f->to[i]);
+      wocky_node_set_attribute (top, "id", f->id[i]);
+
+      if (f->writer != NULL)
+        {
+          const guint8 *data;
+          gsize length;
+
+          wocky_xmpp_writer_write_stanza (f->writer, copy, &data, &length);
+        }
+
+      g_object_unref (copy);
+    }
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  WockyStanzaTemplate *message, *iq_set, *sm_ack;
+  GPtrArray *fan_outs;
+  const BenchStanza *s;
+  int result;
+
+  bench_init (argc, argv);
+
+  message = wocky_stanza_template_new (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT,
+      "romeo@example.net/orchard", WOCKY_STANZA_TEMPLATE_SLOT,
+      '@', "id", WOCKY_STANZA_TEMPLATE_SLOT,
+      '(', "body", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+      '(', "active", ':', "http://jabber.org/protocol/chatstates", ')',
+      NULL);
+
+  iq_set = wocky_stanza_template_new (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_SET, NULL, "pubsub.example.com",
+      '@', "id", WOCKY_STANZA_TEMPLATE_SLOT,
+      '(', "pubsub", ':', WOCKY_XMPP_NS_PUBSUB,
+        '(', "publish", '@', "node", "http://jabber.org/protocol/tune",
+          '(', "item",
+            '(', "tune", ':', "http://jabber.org/protocol/tune",
+              '(', "artist", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+              '(', "length", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+              '(', "source", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+              '(', "title", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+              '(', "track", '$', WOCKY_STANZA_TEMPLATE_SLOT, ')',
+            ')',
+          ')',
+        ')',
+      ')',
+      NULL);
+
+  sm_ack = wocky_stanza_template_new (WOCKY_STANZA_TYPE_SM_A,
+      WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+      '@', "h", WOCKY_STANZA_TEMPLATE_SLOT,
+      NULL);
+
+  bench_add ("/stanza/build/message", build_message, NULL);
+  bench_add ("/stanza/build/pubsub-publish", build_iq_set, NULL);
+  bench_add ("/stanza/build/sm-ack", build_sm_ack, NULL);
+
+  bench_add ("/stanza/template/message", instantiate_message, message);
+  bench_add ("/stanza/template/pubsub-publish", instantiate_iq_set, iq_set);
+  bench_add ("/stanza/template/sm-ack", instantiate_sm_ack, sm_ack);
+
+  fan_outs = g_ptr_array_new_with_free_func ((GDestroyNotify) fan_out_free);
+
+  for (s = bench_corpus; s->name != NULL; s++)
+    {
+      FanOut *f;
+      gchar *name;
+
+      if (strcmp (s->name, "presence") && strcmp (s->name, "pubsub"))
+        continue;
+
+      f = fan_out_new (s->xml, FALSE);
+      g_ptr_array_add (fan_outs, f);
+      name = g_strdup_printf ("/stanza/fan-out/copy/%s", s->name);
+      bench_add (name, fan_out, f);
+      g_free (name);
+
+      f = fan_out_new (s->xml, TRUE);
+      g_ptr_array_add (fan_outs, f);
+      name = g_strdup_printf ("/stanza/fan-out/send/%s", s->name);
+      bench_add (name, fan_out, f);
+      g_free (name);
+    }
+
+  result = bench_run ();
+
+  g_ptr_array_unref (fan_outs);
+
+  wocky_stanza_template_free (message);
+  wocky_stanza_template_free (iq_set);
+  wocky_stanza_template_free (sm_ack);
+
+  bench_deinit ();
+
+  return result;
+}
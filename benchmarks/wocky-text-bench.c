@@ -0,0 +1,153 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+/* The kernels aren't public API */
+#define WOCKY_COMPILATION
+#include <wocky/wocky-text.h>
+#undef WOCKY_COMPILATION
+
+#include "wocky-bench-helper.h"
+
+/* Large enough for the per-call overhead not to matter, small enough to
+ * stay in the cache as a stanza being handled would */
+#define TEXT_SIZE (64 * 1024)
+
+typedef struct {
+  WockyTextIsa isa;
+  const gchar *text;
+  gsize len;
+  gchar *encoded;
+} TextBench;
+
+static void
+utf8_validate (gpointer user_data)
+{
+  TextBench *b = user_data;
+
+  wocky_text_set_isa (b->isa);
+
+  if (!wocky_text_utf8_validate (b->text, b->len, NULL))
+    g_error ("benchmark text doesn't validate");
+}
+
+static void
+escape (gpointer user_data)
+{
+  TextBench *b = user_data;
+  GString *out = g_string_sized_new (b->len * 2);
+
+  wocky_text_set_isa (b->isa);
+  wocky_text_escape_append (out, b->text, b->len);
+  g_string_free (out, TRUE);
+}
+
+static void
+base64_encode (gpointer user_data)
+{
+  TextBench *b = user_data;
+
+  wocky_text_set_isa (b->isa);
+  g_free (wocky_text_base64_encode ((const guchar *) b->text, b->len));
+}
+
+static void
+base64_decode (gpointer user_data)
+{
+  TextBench *b = user_data;
+  gsize len;
+
+  wocky_text_set_isa (b->isa);
+  g_free (wocky_text_base64_decode (b->encoded, &len));
+}
+
+/* Chat-like text: ASCII with markup characters, or with a non-ASCII word
+ * every so often */
+static gchar *
+make_text (gboolean markup,
+    gboolean non_ascii)
+{
+  const gchar *words[] = { "wherefore ", "art ", "thou ", "Romeo? ",
+      markup ? "<3 " : "deny ", markup ? "&c. " : "thy ",
+      non_ascii ? "Ромео " : "father ", non_ascii ? "ロミオ " : "and ",
+      "refuse ", "thy ", "name " };
+  GString *text = g_string_sized_new (TEXT_SIZE + 32);
+  guint i = 0;
+
+  while (text->len < TEXT_SIZE)
+    g_string_append (text, words[i++ % G_N_ELEMENTS (words)]);
+
+  return g_string_free (text, FALSE);
+}
+
+static void
+add (const gchar *kernel,
+    const gchar *variant,
+    BenchFunc func,
+    WockyTextIsa isa,
+    const gchar *text,
+    gsize bytes)
+{
+  TextBench *b = g_slice_new0 (TextBench);
+  gchar *name;
+
+  b->isa = isa;
+  b->text = text;
+  b->len = strlen (text);
+  b->encoded = wocky_text_base64_encode ((const guchar *) text, b->len);
+
+  name = g_strdup_printf ("/text/%s/%s/%s", kernel, variant,
+      wocky_text_isa_name (isa));
+  bench_add_sized (name, func, b, bytes);
+  g_free (name);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  gchar *ascii = make_text (FALSE, FALSE);
+  gchar *markup = make_text (TRUE, FALSE);
+  gchar *non_ascii = make_text (FALSE, TRUE);
+  WockyTextIsa best, isa;
+  int result;
+
+  bench_init (argc, argv);
+
+  best = wocky_text_get_isa ();
+
+  /* GLib and libxml2 speeds, more or less, and whatever this CPU can do
+   * better */
+  for (isa = WOCKY_TEXT_ISA_SCALAR; isa <= WOCKY_TEXT_ISA_NEON; isa++)
+    {
+      if (!wocky_text_set_isa (isa))
+        continue;
+
+      add ("utf8-validate", "ascii", utf8_validate, isa, ascii,
+          strlen (ascii));
+      add ("utf8-validate", "non-ascii", utf8_validate, isa, non_ascii,
+          strlen (non_ascii));
+      add ("escape", "plain", escape, isa, ascii, strlen (ascii));
+      add ("escape", "markup", escape, isa, markup, strlen (markup));
+      add ("base64", "encode", base64_encode, isa, ascii, strlen (ascii));
+      add ("base64", "decode", base64_decode, isa, ascii,
+          (strlen (ascii) + 2) / 3 * 4);
+    }
+
+  wocky_text_set_isa (best);
+
+  result = bench_run ();
+
+  bench_deinit ();
+  g_free (ascii);
+  g_free (markup);
+  g_free (non_ascii);
+
+  return result;
+}
@@ -0,0 +1,466 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+/* Handshakes kept in flight while a variant runs */
+#define STORM 16
+
+#define PING "<r xmlns='urn:xmpp:sm:3'/>"
+
+/* Bytes sent and echoed back per bulk transfer */
+#define BULK_SIZE (256 * 1024)
+
+/* A TLS echo server, run entirely in its own threads so that its half of the
+ * handshakes doesn't compete with the client for the main loop */
+static gpointer
+echo_thread (gpointer data)
+{
+  GSocketConnection *conn = data;
+  WockyTLSSession *session;
+  WockyTLSConnection *tls;
+  GInputStream *input;
+  GOutputStream *output;
+  gchar buf[16384];
+  gssize n;
+
+  session = wocky_tls_session_server_new (G_IO_STREAM (conn), 1024,
+      TLS_SERVER_KEY_FILE, TLS_SERVER_CRT_FILE);
+  tls = wocky_tls_session_handshake (session, NULL, NULL);
+
+  if (tls != NULL)
+    {
+      input = g_io_stream_get_input_stream (G_IO_STREAM (tls));
+      output = g_io_stream_get_output_stream (G_IO_STREAM (tls));
+
+      while ((n = g_input_stream_read (input, buf, sizeof (buf), NULL,
+                  NULL)) > 0)
+        {
+          if (!g_output_stream_write_all (output, buf, n, NULL, NULL, NULL))
+            break;
+        }
+
+      g_object_unref (tls);
+    }
+
+  g_object_unref (session);
+  g_object_unref (conn);
+  return NULL;
+}
+
+static gpointer
+listen_thread (gpointer data)
+{
+  GSocketListener *listener = data;
+  GSocketConnection *conn;
+
+  while ((conn = g_socket_listener_accept (listener, NULL, NULL,
+              NULL)) != NULL)
+    g_thread_unref (g_thread_new ("echo", echo_thread, conn));
+
+  return NULL;
+}
+
+static guint16
+echo_server_start (void)
+{
+  GSocketListener *listener = g_socket_listener_new ();
+  GError *error = NULL;
+  guint16 port;
+
+  port = g_socket_listener_add_any_inet_port (listener, NULL, &error);
+  g_assert_no_error (error);
+
+  g_thread_unref (g_thread_new ("listen", listen_thread, listener));
+  return port;
+}
+
+static GIOStream *
+connect_to (guint16 port)
+{
+  GSocketClient *client = g_socket_client_new ();
+  GSocketConnection *conn;
+  GError *error = NULL;
+
+  conn = g_socket_client_connect_to_host (client, "127.0.0.1", port, NULL,
+      &error);
+  g_assert_no_error (error);
+  g_object_unref (client);
+
+  return G_IO_STREAM (conn);
+}
+
+/* Handshakes started over and over through a WockyTLSConnector, the way a
+ * server-side component setting up many sessions at once would */
+typedef struct {
+  guint16 port;
+  WockyTLSHandler *handler;
+  gboolean running;
+  guint active;
+} Storm;
+
+static void storm_connect (Storm *storm);
+
+static void
+storm_secured_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Storm *storm = user_data;
+  WockyXmppConnection *connection;
+  GError *error = NULL;
+
+  connection = wocky_tls_connector_secure_finish (
+      WOCKY_TLS_CONNECTOR (source), result, &error);
+  g_assert_no_error (error);
+  g_object_unref (connection);
+  g_object_unref (source);
+
+  storm->active--;
+
+  if (storm->running)
+    storm_connect (storm);
+}
+
+static void
+storm_connect (Storm *storm)
+{
+  WockyTLSConnector *connector = wocky_tls_connector_new (storm->handler);
+  GIOStream *stream = connect_to (storm->port);
+  WockyXmppConnection *connection = wocky_xmpp_connection_new (stream);
+
+  storm->active++;
+  wocky_tls_connector_secure_async (connector, connection, TRUE,
+      "localhost", NULL, NULL, storm_secured_cb, storm);
+
+  g_object_unref (connection);
+  g_object_unref (stream);
+}
+
+static Storm *
+storm_new (guint16 port,
+    gboolean worker_pool)
+{
+  Storm *storm = g_slice_new0 (Storm);
+
+  storm->port = port;
+  storm->handler = wocky_tls_handler_new (TRUE);
+  g_object_set (storm->handler, "worker-pool", worker_pool, NULL);
+
+  return storm;
+}
+
+static void
+storm_start (Storm *storm)
+{
+  guint i;
+
+  storm->running = TRUE;
+
+  for (i = 0; i < STORM; i++)
+    storm_connect (storm);
+}
+
+static void
+storm_stop (Storm *storm)
+{
+  storm->running = FALSE;
+
+  while (storm->active > 0)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+storm_free (Storm *storm)
+{
+  g_object_unref (storm->handler);
+  g_slice_free (Storm, storm);
+}
+
+/* The established session whose responsiveness is measured */
+typedef struct {
+  GIOStream *stream;
+  WockyTLSSession *session;
+  WockyTLSConnection *tls;
+  GInputStream *input;
+  GOutputStream *output;
+  gchar buf[sizeof (PING)];
+  gsize received;
+  gboolean sent;
+} Client;
+
+static Client *
+client_new (guint16 port)
+{
+  Client *c = g_slice_new0 (Client);
+  GError *error = NULL;
+
+  c->stream = connect_to (port);
+  c->session = wocky_tls_session_new (c->stream);
+  c->tls = wocky_tls_session_handshake (c->session, NULL, &error);
+  g_assert_no_error (error);
+
+  c->input = g_io_stream_get_input_stream (G_IO_STREAM (c->tls));
+  c->output = g_io_stream_get_output_stream (G_IO_STREAM (c->tls));
+
+  return c;
+}
+
+static void
+client_free (Client *c)
+{
+  g_io_stream_close (G_IO_STREAM (c->tls), NULL, NULL);
+  g_object_unref (c->tls);
+  g_object_unref (c->session);
+  g_object_unref (c->stream);
+  g_slice_free (Client, c);
+}
+
+static void client_read (Client *c);
+
+static void
+ping_read_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Client *c = user_data;
+  gssize n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, NULL);
+  g_assert (n > 0);
+  c->received += n;
+
+  if (c->received < strlen (PING))
+    client_read (c);
+}
+
+static void
+client_read (Client *c)
+{
+  g_input_stream_read_async (c->input, c->buf + c->received,
+      strlen (PING) - c->received, G_PRIORITY_DEFAULT, NULL, ping_read_cb,
+      c);
+}
+
+static void
+ping_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Client *c = user_data;
+
+  if (g_output_stream_write_finish (G_OUTPUT_STREAM (source), result,
+          NULL) != (gssize) strlen (PING))
+    g_error ("couldn't send the ping");
+
+  c->sent = TRUE;
+}
+
+typedef struct {
+  Client *client;
+  /* NULL for the idle baseline */
+  Storm *storm;
+} DispatchBench;
+
+static Storm *current_storm = NULL;
+
+static void
+switch_storm (Storm *storm)
+{
+  if (current_storm != storm)
+    {
+      if (current_storm != NULL)
+        storm_stop (current_storm);
+
+      current_storm = storm;
+
+      if (current_storm != NULL)
+        storm_start (current_storm);
+    }
+}
+
+/* Sends a stanza-sized ping on the established session and waits for it to
+ * come back, while the fixture's handshakes keep going */
+static void
+ping (gpointer user_data)
+{
+  DispatchBench *b = user_data;
+  Client *c = b->client;
+
+  switch_storm (b->storm);
+
+  c->received = 0;
+  c->sent = FALSE;
+
+  g_output_stream_write_async (c->output, PING, strlen (PING),
+      G_PRIORITY_DEFAULT, NULL, ping_sent_cb, c);
+  client_read (c);
+
+  while (!c->sent || c->received < strlen (PING))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Streams BULK_SIZE bytes through the echo server in writes of @chunk
+ * bytes, reading the echo back as it comes */
+typedef struct {
+  Client *client;
+  gsize chunk;
+  gchar *data;
+  gchar *echo;
+  gsize sent;
+  gsize received;
+} BulkBench;
+
+static void bulk_write (BulkBench *b);
+static void bulk_read (BulkBench *b);
+
+static void
+bulk_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  BulkBench *b = user_data;
+  gssize n;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source), result, NULL);
+  g_assert (n > 0);
+  b->sent += n;
+
+  if (b->sent < BULK_SIZE)
+    bulk_write (b);
+}
+
+static void
+bulk_write (BulkBench *b)
+{
+  g_output_stream_write_async (b->client->output, b->data + b->sent,
+      MIN (b->chunk, BULK_SIZE - b->sent), G_PRIORITY_DEFAULT, NULL,
+      bulk_sent_cb, b);
+}
+
+static void
+bulk_read_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  BulkBench *b = user_data;
+  gssize n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, NULL);
+  g_assert (n > 0);
+  b->received += n;
+
+  if (b->received < BULK_SIZE)
+    bulk_read (b);
+}
+
+static void
+bulk_read (BulkBench *b)
+{
+  g_input_stream_read_async (b->client->input, b->echo + b->received,
+      BULK_SIZE - b->received, G_PRIORITY_DEFAULT, NULL, bulk_read_cb, b);
+}
+
+static void
+bulk (gpointer user_data)
+{
+  BulkBench *b = user_data;
+
+  switch_storm (NULL);
+
+  b->sent = 0;
+  b->received = 0;
+
+  bulk_write (b);
+  bulk_read (b);
+
+  while (b->sent < BULK_SIZE || b->received < BULK_SIZE)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert (memcmp (b->data, b->echo, BULK_SIZE) == 0);
+}
+
+static void
+bulk_init (BulkBench *b,
+    Client *client,
+    gsize chunk)
+{
+  gsize i;
+
+  b->client = client;
+  b->chunk = chunk;
+  b->data = g_malloc (BULK_SIZE);
+  b->echo = g_malloc (BULK_SIZE);
+
+  for (i = 0; i < BULK_SIZE; i++)
+    b->data[i] = 'a' + i % 26;
+}
+
+static void
+bulk_clear (BulkBench *b)
+{
+  g_free (b->data);
+  g_free (b->echo);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  DispatchBench idle = { NULL, NULL };
+  DispatchBench main_loop = { NULL, NULL };
+  DispatchBench worker_pool = { NULL, NULL };
+  BulkBench small_writes;
+  BulkBench large_writes;
+  gchar *name;
+  guint16 port;
+  int result;
+
+  bench_init (argc, argv);
+
+  port = echo_server_start ();
+
+  idle.client = client_new (port);
+  main_loop.client = idle.client;
+  main_loop.storm = storm_new (port, FALSE);
+  worker_pool.client = idle.client;
+  worker_pool.storm = storm_new (port, TRUE);
+
+  bench_add ("/tls/dispatch/idle", ping, &idle);
+
+  name = g_strdup_printf ("/tls/dispatch/main-loop-%u", STORM);
+  bench_add (name, ping, &main_loop);
+  g_free (name);
+
+  name = g_strdup_printf ("/tls/dispatch/worker-pool-%u", STORM);
+  bench_add (name, ping, &worker_pool);
+  g_free (name);
+
+  /* stanza-sized writes, which the backend can batch into bigger records,
+   * and writes of a whole record each */
+  bulk_init (&small_writes, idle.client, 256);
+  bench_add_sized ("/tls/bulk/small-writes", bulk, &small_writes, BULK_SIZE);
+  bulk_init (&large_writes, idle.client, 16384);
+  bench_add_sized ("/tls/bulk/large-writes", bulk, &large_writes, BULK_SIZE);
+
+  result = bench_run ();
+
+  if (current_storm != NULL)
+    storm_stop (current_storm);
+
+  storm_free (main_loop.storm);
+  storm_free (worker_pool.storm);
+  bulk_clear (&small_writes);
+  bulk_clear (&large_writes);
+  client_free (idle.client);
+  bench_deinit ();
+
+  return result;
+}
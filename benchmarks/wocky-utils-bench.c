@@ -0,0 +1,46 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+static void
+decode_jid (gpointer user_data)
+{
+  const gchar *jid = user_data;
+  gchar *node, *domain, *resource;
+
+  wocky_decode_jid (jid, &node, &domain, &resource);
+
+  g_free (node);
+  g_free (domain);
+  g_free (resource);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int result;
+
+  bench_init (argc, argv);
+
+  bench_add ("/utils/decode-jid/domain", decode_jid, "example.com");
+  bench_add ("/utils/decode-jid/bare", decode_jid, "juliet@example.com");
+  bench_add ("/utils/decode-jid/full", decode_jid,
+      "juliet@example.com/balcony");
+  bench_add ("/utils/decode-jid/muc", decode_jid,
+      "coven@chat.shakespeare.lit/thirdwitch of the heath");
+  bench_add ("/utils/decode-jid/non-ascii", decode_jid,
+      "Σωκράτης@Ελλάδα.example/φιλοσοφία");
+
+  result = bench_run ();
+
+  bench_deinit ();
+
+  return result;
+}
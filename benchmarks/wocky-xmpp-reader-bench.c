@@ -0,0 +1,236 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+typedef struct {
+  WockyXmppReader *reader;
+  const guint8 *data;
+  gsize length;
+} ReaderBench;
+
+typedef struct {
+  const gchar *prefix;
+  gboolean native;
+  gboolean lazy;
+} ReaderMode;
+
+static const ReaderMode modes[] = {
+  { "/xmpp-reader", FALSE, FALSE },
+  { "/xmpp-reader/native", TRUE, FALSE },
+  { "/xmpp-reader/lazy", FALSE, TRUE },
+};
+
+static ReaderBench *
+reader_bench_new (const gchar *xml,
+    const ReaderMode *mode)
+{
+  ReaderBench *b = g_slice_new0 (ReaderBench);
+
+  b->reader = g_object_new (WOCKY_TYPE_XMPP_READER,
+      "native-tokenizer", mode->native,
+      "lazy-subtrees", mode->lazy,
+      NULL);
+  wocky_xmpp_reader_push (b->reader, (const guint8 *) BENCH_STREAM_HEADER,
+      strlen (BENCH_STREAM_HEADER));
+  g_assert_cmpuint (wocky_xmpp_reader_get_state (b->reader), ==,
+      WOCKY_XMPP_READER_STATE_OPENED);
+
+  b->data = (const guint8 *) xml;
+  b->length = strlen (xml);
+
+  return b;
+}
+
+static void
+reader_bench_free (ReaderBench *b)
+{
+  g_object_unref (b->reader);
+  g_slice_free (ReaderBench, b);
+}
+
+static void
+parse_stanza (gpointer user_data)
+{
+  ReaderBench *b = user_data;
+  WockyStanza *stanza;
+
+  wocky_xmpp_reader_push (b->reader, b->data, b->length);
+
+  while ((stanza = wocky_xmpp_reader_pop_stanza (b->reader)) != NULL)
+    g_object_unref (stanza);
+}
+
+static guint
+walk_node (WockyNode *node)
+{
+  WockyNodeIter iter;
+  WockyNode *child;
+  guint n = 1;
+
+  wocky_node_iter_init (&iter, node, NULL, NULL);
+
+  while (wocky_node_iter_next (&iter, &child))
+    n += walk_node (child);
+
+  return n;
+}
+
+/* What a handler which looks at every element of a stanza costs on top of
+ * parsing it */
+static void
+parse_and_walk_stanza (gpointer user_data)
+{
+  ReaderBench *b = user_data;
+  WockyStanza *stanza;
+
+  wocky_xmpp_reader_push (b->reader, b->data, b->length);
+
+  while ((stanza = wocky_xmpp_reader_pop_stanza (b->reader)) != NULL)
+    {
+      g_assert_cmpuint (walk_node (wocky_stanza_get_top_node (stanza)), >,
+          0);
+      g_object_unref (stanza);
+    }
+}
+
+/* The size of the reads WockyXmppConnection does */
+#define READ_SIZE 1024
+
+/* A message whose body is @size bytes of base64-looking text, pushed a read
+ * at a time, the way an avatar or an in-band bytestream chunk arrives */
+static ReaderBench *
+large_text_bench_new (gsize size,
+    const ReaderMode *mode)
+{
+  static const gchar alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  GString *xml = g_string_sized_new (size + 128);
+  ReaderBench *b;
+  gsize i;
+
+  g_string_append (xml, "<message to='juliet@example.com/balcony'"
+      " from='romeo@example.net/orchard' type='chat'><body>");
+
+  for (i = 0; i < size; i++)
+    g_string_append_c (xml, alphabet[i % 64]);
+
+  g_string_append (xml, "</body></message>");
+
+  b = reader_bench_new (xml->str, mode);
+  b->data = (const guint8 *) g_string_free (xml, FALSE);
+
+  return b;
+}
+
+static void
+large_text_bench_free (ReaderBench *b)
+{
+  g_free ((gpointer) b->data);
+  reader_bench_free (b);
+}
+
+static void
+parse_in_reads (gpointer user_data)
+{
+  ReaderBench *b = user_data;
+  WockyStanza *stanza;
+  gsize offset;
+
+  for (offset = 0; offset < b->length; offset += READ_SIZE)
+    wocky_xmpp_reader_push (b->reader, b->data + offset,
+        MIN (READ_SIZE, b->length - offset));
+
+  stanza = wocky_xmpp_reader_pop_stanza (b->reader);
+  g_assert (stanza != NULL);
+  g_object_unref (stanza);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GPtrArray *fixtures;
+  GPtrArray *large;
+  GString *corpus;
+  static const guint large_sizes[] = { 64, 512, 2048, 8192 };
+  guint i, n;
+  const BenchStanza *s;
+  int result;
+
+  bench_init (argc, argv);
+
+  fixtures = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) reader_bench_free);
+  large = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) large_text_bench_free);
+  corpus = g_string_new ("");
+
+  for (s = bench_corpus; s->name != NULL; s++)
+    g_string_append (corpus, s->xml);
+
+  for (n = 0; n < G_N_ELEMENTS (modes); n++)
+    {
+      const ReaderMode *mode = &modes[n];
+      ReaderBench *b;
+      gchar *name;
+
+      for (s = bench_corpus; s->name != NULL; s++)
+        {
+          b = reader_bench_new (s->xml, mode);
+          name = g_strdup_printf ("%s/parse/%s", mode->prefix, s->name);
+
+          g_ptr_array_add (fixtures, b);
+          bench_add_sized (name, parse_stanza, b, b->length);
+          g_free (name);
+
+          b = reader_bench_new (s->xml, mode);
+          name = g_strdup_printf ("%s/parse-and-walk/%s", mode->prefix,
+              s->name);
+
+          g_ptr_array_add (fixtures, b);
+          bench_add_sized (name, parse_and_walk_stanza, b, b->length);
+          g_free (name);
+        }
+
+      /* every corpus stanza in a single chunk, as read off a busy socket */
+      b = reader_bench_new (corpus->str, mode);
+      name = g_strdup_printf ("%s/parse/corpus", mode->prefix);
+      g_ptr_array_add (fixtures, b);
+      bench_add_sized (name, parse_stanza, b, corpus->len);
+      g_free (name);
+
+      /* large text is in a child of the top-level element, which lazy
+       * readers build as they parse all the same */
+      if (mode->lazy)
+        continue;
+
+      /* 64 KiB to 8 MiB of text in a single element */
+      for (i = 0; i < G_N_ELEMENTS (large_sizes); i++)
+        {
+          b = large_text_bench_new (large_sizes[i] * 1024, mode);
+          name = g_strdup_printf ("%s/large-text/%uk", mode->prefix,
+              large_sizes[i]);
+
+          g_ptr_array_add (large, b);
+          bench_add_sized (name, parse_in_reads, b, b->length);
+          g_free (name);
+        }
+    }
+
+  result = bench_run ();
+
+  g_ptr_array_unref (large);
+  g_ptr_array_unref (fixtures);
+  g_string_free (corpus, TRUE);
+  bench_deinit ();
+
+  return result;
+}
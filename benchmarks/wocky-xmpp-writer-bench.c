@@ -0,0 +1,227 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-bench-helper.h"
+
+typedef struct {
+  WockyXmppWriter *writer;
+  WockyStanza *stanza;
+} WriterBench;
+
+static void
+writer_bench_free (WriterBench *b)
+{
+  g_object_unref (b->writer);
+  g_object_unref (b->stanza);
+  g_slice_free (WriterBench, b);
+}
+
+static void
+write_stanza (gpointer user_data)
+{
+  WriterBench *b = user_data;
+  const guint8 *data;
+  gsize length;
+
+  wocky_xmpp_writer_write_stanza (b->writer, b->stanza, &data, &length);
+}
+
+#define BROADCAST_CONNECTIONS 100
+
+/* The same presence written on every connection, as a server or a
+ * link-local client broadcasting it to all its peers would */
+typedef struct {
+  WockyStanza *stanza;
+  WockyXmppWriter *writers[BROADCAST_CONNECTIONS];
+} Broadcast;
+
+static WockyXmppWriter *
+open_writer (void)
+{
+  WockyXmppWriter *writer = wocky_xmpp_writer_new ();
+  const guint8 *data;
+  gsize length;
+
+  wocky_xmpp_writer_stream_open (writer, "example.com", NULL, "1.0",
+      NULL, NULL, &data, &length);
+
+  return writer;
+}
+
+static void
+broadcast_free (Broadcast *b)
+{
+  guint i;
+
+  for (i = 0; i < BROADCAST_CONNECTIONS; i++)
+    g_object_unref (b->writers[i]);
+
+  wocky_stanza_release_serialization (b->stanza);
+  g_object_unref (b->stanza);
+  g_slice_free (Broadcast, b);
+}
+
+static void
+broadcast (gpointer user_data)
+{
+  Broadcast *b = user_data;
+  guint i;
+
+  for (i = 0; i < BROADCAST_CONNECTIONS; i++)
+    {
+      const guint8 *data;
+      gsize length;
+
+      wocky_xmpp_writer_write_stanza (b->writers[i], b->stanza, &data,
+          &length);
+    }
+}
+
+#define REPLAY_QUEUE 100
+
+/* The stanzas a stream management session still has to see acknowledged,
+ * written again once it's resumed on a new connection */
+typedef struct {
+  WockyXmppWriter *writer;
+  WockyStanza *queue[REPLAY_QUEUE];
+} Replay;
+
+static void
+replay_free (Replay *r)
+{
+  guint i;
+
+  for (i = 0; i < REPLAY_QUEUE; i++)
+    {
+      wocky_stanza_release_serialization (r->queue[i]);
+      g_object_unref (r->queue[i]);
+    }
+
+  g_object_unref (r->writer);
+  g_slice_free (Replay, r);
+}
+
+static void
+replay (gpointer user_data)
+{
+  Replay *r = user_data;
+  guint i;
+
+  for (i = 0; i < REPLAY_QUEUE; i++)
+    {
+      const guint8 *data;
+      gsize length;
+
+      wocky_xmpp_writer_write_stanza (r->writer, r->queue[i], &data,
+          &length);
+    }
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  GPtrArray *fixtures;
+  GPtrArray *broadcasts;
+  Replay *replay_queue;
+  gsize replay_bytes = 0;
+  const BenchStanza *s;
+  guint i;
+  int result;
+
+  bench_init (argc, argv);
+
+  fixtures = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) writer_bench_free);
+  broadcasts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) broadcast_free);
+
+  for (s = bench_corpus; s->name != NULL; s++)
+    {
+      WriterBench *b = g_slice_new0 (WriterBench);
+      gchar *name = g_strdup_printf ("/xmpp-writer/write/%s", s->name);
+      const guint8 *data;
+      gsize length;
+
+      b->writer = wocky_xmpp_writer_new ();
+      b->stanza = bench_parse_stanza (s->xml);
+
+      /* Put the writer in the same namespace context as a real connection */
+      wocky_xmpp_writer_stream_open (b->writer, "example.com", NULL, "1.0",
+          NULL, NULL, &data, &length);
+
+      /* Report throughput in terms of the serialized output */
+      wocky_xmpp_writer_write_stanza (b->writer, b->stanza, &data, &length);
+
+      g_ptr_array_add (fixtures, b);
+      bench_add_sized (name, write_stanza, b, length);
+      g_free (name);
+    }
+
+  for (s = bench_corpus; s->name != NULL; s++)
+    {
+      Broadcast *b;
+      const guint8 *data;
+      gsize length;
+      guint i;
+
+      if (strcmp (s->name, "presence"))
+        continue;
+
+      b = g_slice_new0 (Broadcast);
+      b->stanza = bench_parse_stanza (s->xml);
+      wocky_stanza_hold_serialization (b->stanza);
+
+      for (i = 0; i < BROADCAST_CONNECTIONS; i++)
+        b->writers[i] = open_writer ();
+
+      wocky_xmpp_writer_write_stanza (b->writers[0], b->stanza, &data,
+          &length);
+
+      g_ptr_array_add (broadcasts, b);
+      bench_add_sized ("/xmpp-writer/broadcast/presence", broadcast, b,
+          length * BROADCAST_CONNECTIONS);
+    }
+
+  replay_queue = g_slice_new0 (Replay);
+  replay_queue->writer = open_writer ();
+
+  /* the corpus over and over, each stanza written once already on the
+   * connection which was lost */
+  for (i = 0, s = bench_corpus; i < REPLAY_QUEUE; i++, s++)
+    {
+      WockyXmppWriter *lost = open_writer ();
+      const guint8 *data;
+      gsize length;
+
+      if (s->name == NULL)
+        s = bench_corpus;
+
+      /* held by the session since it was first sent */
+      replay_queue->queue[i] = bench_parse_stanza (s->xml);
+      wocky_stanza_hold_serialization (replay_queue->queue[i]);
+      wocky_xmpp_writer_write_stanza (lost, replay_queue->queue[i], &data,
+          &length);
+      replay_bytes += length;
+      g_object_unref (lost);
+    }
+
+  bench_add_sized ("/xmpp-writer/sm-replay", replay, replay_queue,
+      replay_bytes);
+
+  result = bench_run ();
+
+  replay_free (replay_queue);
+  g_ptr_array_unref (broadcasts);
+  g_ptr_array_unref (fixtures);
+  bench_deinit ();
+
+  return result;
+}
@@ -62,6 +62,15 @@ enum
 
 typedef struct _fake_host { char *key; char *addr; } fake_host;
 typedef struct _fake_serv { char *key; GSrvTarget *srv; } fake_serv;
+typedef struct _fake_delay { char *key; guint delay; } fake_delay;
+
+/* a lookup which only completes after a while, unless it's cancelled */
+typedef struct {
+  GSimpleAsyncResult *res;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+  guint timeout_id;
+} delayed_lookup;
 
 G_DEFINE_TYPE (TestResolver, test_resolver, G_TYPE_RESOLVER);
 
@@ -114,6 +123,69 @@ find_fake_hosts (TestResolver *tr, const char *name)
   return rval;
 }
 
+static guint
+find_fake_delay (TestResolver *tr, const char *name)
+{
+  GList *fake = NULL;
+
+  for (fake = tr->fake_delays; fake; fake = fake->next)
+    {
+      fake_delay *entry = fake->data;
+      if (entry && !g_strcmp0 (entry->key, name))
+        return entry->delay;
+    }
+  return 0;
+}
+
+static void
+delayed_lookup_complete (delayed_lookup *lookup)
+{
+  if (lookup->cancellable != NULL)
+    {
+      g_signal_handler_disconnect (lookup->cancellable,
+          lookup->cancelled_id);
+      g_object_unref (lookup->cancellable);
+    }
+
+  g_simple_async_result_complete (lookup->res);
+  g_object_unref (lookup->res);
+  g_slice_free (delayed_lookup, lookup);
+}
+
+static gboolean
+delayed_lookup_timeout_cb (gpointer data)
+{
+  delayed_lookup_complete (data);
+  return FALSE;
+}
+
+static gboolean
+delayed_lookup_cancelled_idle_cb (gpointer data)
+{
+  delayed_lookup *lookup = data;
+
+  g_simple_async_result_set_op_res_gpointer (lookup->res, NULL, NULL);
+  g_simple_async_result_set_error (lookup->res, G_IO_ERROR,
+      G_IO_ERROR_CANCELLED, "Fake lookup cancelled");
+  delayed_lookup_complete (lookup);
+  return FALSE;
+}
+
+static void
+delayed_lookup_cancelled_cb (GCancellable *cancellable,
+    gpointer data)
+{
+  delayed_lookup *lookup = data;
+
+  /* can't disconnect from within the handler */
+  if (lookup->timeout_id != 0)
+    {
+      g_source_remove (lookup->timeout_id);
+      lookup->timeout_id = 0;
+      g_idle_add (delayed_lookup_cancelled_idle_cb, lookup);
+    }
+}
+
 static GList *
 srv_target_list_copy (GList *addr)
 {
@@ -213,6 +285,7 @@ lookup_by_name_async (GResolver *resolver,
   GList *addr = find_fake_hosts (tr, hostname);
   GObject *source = G_OBJECT (resolver);
   GSimpleAsyncResult *res = NULL;
+  guint delay;
 #ifdef DEBUG_FAKEDNS
   GList *x;
   char a[32];
@@ -237,6 +310,26 @@ lookup_by_name_async (GResolver *resolver,
 
   g_simple_async_result_set_op_res_gpointer (res, addr,
       (GDestroyNotify) object_list_free);
+
+  delay = find_fake_delay (tr, hostname);
+  if (delay > 0)
+    {
+      delayed_lookup *lookup = g_slice_new0 (delayed_lookup);
+
+      lookup->res = res;
+      lookup->timeout_id = g_timeout_add (delay, delayed_lookup_timeout_cb,
+          lookup);
+
+      if (cancellable != NULL)
+        {
+          lookup->cancellable = g_object_ref (cancellable);
+          lookup->cancelled_id = g_signal_connect (cancellable, "cancelled",
+              G_CALLBACK (delayed_lookup_cancelled_cb), lookup);
+        }
+
+      return;
+    }
+
   g_simple_async_result_complete_in_idle (res);
   g_object_unref (res);
 }
@@ -349,6 +442,15 @@ test_resolver_reset (TestResolver *tr)
     }
   g_list_free (tr->fake_SRV);
   tr->fake_SRV = NULL;
+
+  for (fake = tr->fake_delays; fake; fake = fake->next)
+    {
+      fake_delay *entry = fake->data;
+      g_free (entry->key);
+      g_free (entry);
+    }
+  g_list_free (tr->fake_delays);
+  tr->fake_delays = NULL;
 }
 
 gboolean
@@ -378,3 +480,15 @@ gboolean test_resolver_add_SRV (TestResolver *tr,
   tr->fake_SRV = g_list_append (tr->fake_SRV, entry);
   return TRUE;
 }
+
+/* makes lookups of @hostname take @delay_ms milliseconds to complete */
+void
+test_resolver_set_delay (TestResolver *tr,
+    const char *hostname,
+    guint delay_ms)
+{
+  fake_delay *entry = g_new0 (fake_delay, 1);
+  entry->key = g_strdup (hostname);
+  entry->delay = delay_ms;
+  tr->fake_delays = g_list_prepend (tr->fake_delays, entry);
+}
@@ -45,6 +45,7 @@ typedef struct {
   GResolver *real_resolver;
   GList *fake_A;
   GList *fake_SRV;
+  GList *fake_delays;
 } TestResolver;
 
 typedef struct {
@@ -62,6 +63,9 @@ gboolean test_resolver_add_SRV (TestResolver *tr,
     const char *domain,
     const char *addr,
     guint16 port);
+void test_resolver_set_delay (TestResolver *tr,
+    const char *hostname,
+    guint delay_ms);
 
 G_END_DECLS
 
@@ -127,6 +127,9 @@ struct _ServerParameters {
   /* Extra server for see-other-host problem */
   ServerParameters *extra_server;
 
+  /* Have the server count the round trips the client needed */
+  gboolean count_round_trips;
+
   /* Runtime */
   TestConnectorServer *server;
   GIOChannel *channel;
@@ -144,6 +147,7 @@ typedef struct {
            gpointer xmpp;
            gchar *jid;
            gchar *sid;
+           guint round_trips;
   } result;
   ServerParameters server_parameters;
   struct { char *srv; guint port; char *host; char *addr; char *srvhost; } dns;
@@ -165,6 +169,63 @@ static void _set_connector_email_prop (test_t *test)
   g_object_set (G_OBJECT (test->connector), "email", "foo@bar.org", NULL);
 }
 
+static void _set_connector_racing (test_t *test)
+{
+  g_object_set (G_OBJECT (test->connector), "connection-racing", TRUE, NULL);
+  wocky_connector_clear_dns_cache ();
+}
+
+/* The first SRV target takes forever to resolve: racing must not wait */
+static void _set_connector_racing_slow_target (test_t *test)
+{
+  TestResolver *tr = TEST_RESOLVER (kludged);
+
+  _set_connector_racing (test);
+
+  test_resolver_reset (tr);
+  test_resolver_add_SRV (tr, "xmpp-client", "tcp", "weasel-juice.org",
+      "slow.host", 5050);
+  test_resolver_add_SRV (tr, "xmpp-client", "tcp", "weasel-juice.org",
+      "thud.org", 5050);
+  test_resolver_add_A (tr, "slow.host", REACHABLE);
+  test_resolver_add_A (tr, "thud.org", REACHABLE);
+  test_resolver_set_delay (tr, "slow.host", 60000);
+}
+
+static void _set_connector_pipelining (test_t *test)
+{
+  g_object_set (G_OBJECT (test->connector), "pipelining", TRUE, NULL);
+}
+
+static void _set_tls_worker_pool (test_t *test)
+{
+  WockyTLSHandler *handler;
+
+  g_object_get (G_OBJECT (test->connector), "tls-handler", &handler, NULL);
+  g_object_set (G_OBJECT (handler), "worker-pool", TRUE, NULL);
+  g_object_unref (handler);
+}
+
+/* weasel-juice.org also has a Direct TLS SRV record, pointing at port 5050 */
+static void _set_connector_direct_tls (test_t *test)
+{
+  TestResolver *tr = TEST_RESOLVER (kludged);
+
+  g_object_set (G_OBJECT (test->connector), "direct-tls", TRUE, NULL);
+  wocky_connector_clear_dns_cache ();
+
+  test_resolver_add_SRV (tr, "xmpps-client", "tcp", "weasel-juice.org",
+      "tls.thud.org", 5050);
+  test_resolver_add_A (tr, "tls.thud.org", REACHABLE);
+}
+
+/* Only the records cached by a previous connection are available */
+static void _set_connector_racing_cached (test_t *test)
+{
+  g_object_set (G_OBJECT (test->connector), "connection-racing", TRUE, NULL);
+  test_resolver_reset (TEST_RESOLVER (kludged));
+}
+
 ServerParameters see_other_host_extra_server =
   { { TLS, NULL },
     { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
@@ -476,6 +537,154 @@ test_t tests[] =
         { "moose@not.an.xmpp.server", "something", PLAIN, NOTLS },
         { NULL, 0 } } },
 
+    /* The same tests, racing connection attempts */
+    { "/connector/race/noserv/nohost/noport",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+      { NULL, 0, "weasel-juice.org", REACHABLE, NULL },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    { "/connector/race/serv/nohost/noport",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        5050 },
+      { "weasel-juice.org", 5050, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    { "/connector/race/serv/host/port",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        5656 },
+      { "weasel-juice.org", 5050, "thud.org", UNREACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { VISIBLE_HOST, 5656 }, OP_CONNECT,
+        (test_setup) _set_connector_racing } },
+
+    { "/connector/race/serv/duffhost/noport",
+      NOISY,
+      { S_G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND, -1 },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, REACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { DUFF_H0ST, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    { "/connector/race/facebook-chat-srv-workaround",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", UNREACHABLE, REACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    /* The error from the SRV target is reported, not the fallback's */
+    { "/connector/race/duffserv/nohost/noport",
+      NOISY,
+      { S_G_IO_ERROR, G_IO_ERROR_NETWORK_UNREACHABLE, G_IO_ERROR_FAILED },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_NONE },
+      { "not.an.xmpp.server", PORT_XMPP, "thud.org", UNREACHABLE, REACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@not.an.xmpp.server", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    /* Would take a minute without racing */
+    { "/connector/race/slow-srv-target",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        5050 },
+      { NULL, 0, NULL, NULL, NULL },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT,
+        (test_setup) _set_connector_racing_slow_target } },
+
+    /* Direct TLS (XEP-0368): the server only speaks TLS on the xmpps-client
+     * target; the xmpp-client one is unreachable */
+    { "/connector/direct-tls/srv",
+      NOISY,
+      { S_NO_ERROR, 0, 0, "PLAIN" },
+      { { TLS, "PLAIN" },
+        { SERVER_PROBLEM_NO_PROBLEM,
+          { XMPP_PROBLEM_DIRECT_TLS, OK, OK, OK, OK } },
+        { "moose", "something" },
+        5050 },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", UNREACHABLE, UNREACHABLE },
+      { TLS_REQUIRED,
+        { "moose@weasel-juice.org", "something", PLAIN, TLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_direct_tls } },
+
+    /* Nothing listens on the xmpps-client target: fall back to STARTTLS on
+     * the xmpp-client one */
+    { "/connector/direct-tls/starttls-fallback",
+      NOISY,
+      { S_NO_ERROR, 0, 0, "PLAIN" },
+      { { TLS, "PLAIN" },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+      { TLS_REQUIRED,
+        { "moose@weasel-juice.org", "something", PLAIN, TLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_direct_tls } },
+
+    /* Pipelined stream negotiation, with a server which refuses the early
+     * bind iq and sm enable request: the connector binds again instead */
+    { "/connector/pipelining/fallback",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM,
+          { XMPP_PROBLEM_SM | XMPP_PROBLEM_OPTIONAL_SESSION,
+            BIND_PROBLEM_TOO_EARLY, OK, OK, OK, OK } },
+        { "moose", "something" },
+        PORT_XMPP },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_pipelining } },
+
+    /* Pipelining against a server without stream management, which wants a
+     * session */
+    { "/connector/pipelining/no-sm",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_pipelining } },
+
     /* Bad SRV record, port specified, ignore SRV and connect to domain host */
     { "/connector/basic/duffserv/nohost/port",
       NOISY,
@@ -2845,6 +3054,46 @@ test_t tests[] =
           { "moose@weasel-juice.org", "something", PLAIN, TLS },
           { NULL, 0, XMPP_V1, STARTTLS, CERT_CHECK_LENIENT, TLS_CA_DIR } } },
 
+    /* handshakes and verification on the TLS worker threads */
+    { "/connector/cert-verification/tls/worker-pool/ok",
+      QUIET,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+        { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+        { PLAINTEXT_OK,
+          { "moose@weasel-juice.org", "something", PLAIN, TLS },
+          { NULL, 0, XMPP_V1 }, OP_CONNECT,
+          (test_setup) _set_tls_worker_pool } },
+
+    { "/connector/cert-verification/tls/worker-pool/fail/name-mismatch",
+      QUIET,
+      { S_WOCKY_TLS_CERT_ERROR, WOCKY_TLS_CERT_NAME_MISMATCH, -1 },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_XMPP },
+        { "tomato-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+        { PLAINTEXT_OK,
+          { "moose@tomato-juice.org", "something", PLAIN, TLS },
+          { NULL, 0, XMPP_V1 }, OP_CONNECT,
+          (test_setup) _set_tls_worker_pool } },
+
+    { "/connector/cert-verification/ssl/worker-pool/ok",
+      QUIET,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, { XMPP_PROBLEM_OLD_SSL, OK, OK, OK, OK } },
+        { "moose", "something" },
+        PORT_XMPP },
+        { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+        { PLAINTEXT_OK,
+          { "moose@weasel-juice.org", "something", PLAIN, TLS },
+          { NULL, 0, XMPP_V1, OLD_SSL }, OP_CONNECT,
+          (test_setup) _set_tls_worker_pool } },
+
     /* ********************************************************************* */
     /* as above but with legacy ssl                                          */
     { "/connector/cert-verification/ssl/nohost/ok",
@@ -3215,6 +3464,83 @@ test_t tests[] =
     { NULL }
   };
 
+/* Connects with racing on, then again once the fake DNS records are gone, then
+ * once more after flushing the DNS cache */
+test_t race_cache_tests[] =
+  { { "/connector/race/dns-cache/fill",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        5050 },
+      { "weasel-juice.org", 5050, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    { "/connector/race/dns-cache/hit",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        5050 },
+      { NULL, 0, NULL, NULL, NULL },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT,
+        (test_setup) _set_connector_racing_cached } },
+
+    { "/connector/race/dns-cache/cleared",
+      NOISY,
+      { S_G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND, -1 },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM, CONNECTOR_OK },
+        { "moose", "something" },
+        PORT_NONE },
+      { NULL, 0, NULL, NULL, NULL },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_racing } },
+
+    { NULL }
+  };
+
+/* Connects to a server offering stream management and an optional session,
+ * one step at a time then pipelined, counting the round trips */
+test_t pipelining_tests[] =
+  { { "/connector/pipelining/round-trips/serial",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM,
+          { XMPP_PROBLEM_SM | XMPP_PROBLEM_OPTIONAL_SESSION,
+            OK, OK, OK, OK, OK } },
+        { "moose", "something" },
+        PORT_XMPP, CERT_STANDARD, NULL, TRUE },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT } },
+
+    { "/connector/pipelining/round-trips/pipelined",
+      NOISY,
+      { S_NO_ERROR, },
+      { { TLS, NULL },
+        { SERVER_PROBLEM_NO_PROBLEM,
+          { XMPP_PROBLEM_SM | XMPP_PROBLEM_OPTIONAL_SESSION,
+            OK, OK, OK, OK, OK } },
+        { "moose", "something" },
+        PORT_XMPP, CERT_STANDARD, NULL, TRUE },
+      { "weasel-juice.org", PORT_XMPP, "thud.org", REACHABLE, UNREACHABLE },
+      { PLAINTEXT_OK,
+        { "moose@weasel-juice.org", "something", PLAIN, NOTLS },
+        { NULL, 0 }, OP_CONNECT, (test_setup) _set_connector_pipelining } },
+
+    { NULL }
+  };
+
 /* ************************************************************************* */
 #define STRING_OK(x) (((x) != NULL) && (*x != '\0'))
 
@@ -3285,6 +3611,9 @@ client_connected (GIOChannel *channel,
       srv->cert);
   g_object_unref (gconn);
 
+  if (srv->count_round_trips)
+    test_connector_server_count_round_trips (srv->server);
+
   /* Recursively start extra servers */
   if (srv->extra_server != NULL)
     {
@@ -3385,6 +3714,10 @@ test_server_teardown (test_t *test,
             test_connector_server_get_used_mech (srv->server));
         }
 
+      if (srv->count_round_trips)
+        test->result.round_trips =
+          test_connector_server_get_round_trips (srv->server);
+
       /* Run until server is down */
       test_connector_server_teardown (srv->server,
         test_server_teardown_cb, loop);
@@ -3694,6 +4027,37 @@ run_test (gpointer data)
   error = NULL;
 }
 
+static void
+test_race_dns_cache (void)
+{
+  int i;
+
+  for (i = 0; race_cache_tests[i].desc != NULL; i++)
+    run_test (&race_cache_tests[i]);
+}
+
+static void
+test_pipelining_round_trips (void)
+{
+  test_t *serial = &pipelining_tests[0];
+  test_t *pipelined = &pipelining_tests[1];
+
+  run_test (serial);
+  run_test (pipelined);
+
+  /* one step at a time, the stream open, bind, sm enable and session each
+   * take a round trip once authenticated. Pipelined, the bind iq goes with
+   * the stream open and the sm enable request follows the features at once,
+   * and the optional session is skipped. Whether the server has replied to
+   * the bind iq by the time the sm enable request reaches it is down to
+   * scheduling, so the exact saving may vary by one. */
+  g_test_message ("round trips: %u serial, %u pipelined",
+      serial->result.round_trips, pipelined->result.round_trips);
+  g_assert_cmpuint (pipelined->result.round_trips, >, 0);
+  g_assert_cmpuint (pipelined->result.round_trips, <,
+      serial->result.round_trips);
+}
+
 int
 main (int argc,
     char **argv)
@@ -3738,6 +4102,10 @@ main (int argc,
 
 #endif
 
+  g_test_add_func ("/connector/race/dns-cache", test_race_dns_cache);
+  g_test_add_func ("/connector/pipelining/round-trips",
+      test_pipelining_round_trips);
+
   result = g_test_run ();
   test_deinit ();
   return result;
@@ -0,0 +1,215 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <wocky/wocky.h>
+
+#include "wocky-test-helper.h"
+
+/* A link-local contact found on the loopback interface at a given port, as
+ * if it had been discovered over mDNS */
+typedef struct {
+  WockyLLContact parent;
+  guint16 port;
+} TestContact;
+
+typedef struct {
+  WockyLLContactClass parent_class;
+} TestContactClass;
+
+static GType test_contact_get_type (void);
+
+G_DEFINE_TYPE (TestContact, test_contact, WOCKY_TYPE_LL_CONTACT)
+
+static GList *
+test_contact_get_addresses (WockyLLContact *contact)
+{
+  TestContact *self = (TestContact *) contact;
+  GInetAddress *loopback;
+  GSocketAddress *address;
+
+  loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (loopback, self->port);
+  g_object_unref (loopback);
+
+  return g_list_prepend (NULL, address);
+}
+
+static void
+test_contact_init (TestContact *self)
+{
+}
+
+static void
+test_contact_class_init (TestContactClass *klass)
+{
+  WockyLLContactClass *contact_class = WOCKY_LL_CONTACT_CLASS (klass);
+
+  contact_class->get_addresses = test_contact_get_addresses;
+}
+
+typedef struct {
+  GMainLoop *loop;
+  WockyContactFactory *factory;
+  WockyPorter *porter;
+  TestContact *contact;
+  /* Accepts connections, and never says anything on them */
+  GSocketService *service;
+  GPtrArray *accepted;
+} test_data_t;
+
+static gboolean
+silent_incoming_cb (GSocketService *service,
+    GSocketConnection *connection,
+    GObject *source_object,
+    gpointer user_data)
+{
+  test_data_t *test = user_data;
+
+  g_ptr_array_add (test->accepted, g_object_ref (connection));
+  return TRUE;
+}
+
+static test_data_t *
+setup_test (void)
+{
+  test_data_t *test = g_slice_new0 (test_data_t);
+  GError *error = NULL;
+
+  test->loop = g_main_loop_new (NULL, FALSE);
+  test->factory = wocky_contact_factory_new ();
+  test->porter = wocky_meta_porter_new ("juliet@capulet", test->factory);
+
+  test->accepted = g_ptr_array_new_with_free_func (g_object_unref);
+  test->service = g_socket_service_new ();
+  g_signal_connect (test->service, "incoming",
+      G_CALLBACK (silent_incoming_cb), test);
+
+  test->contact = g_object_new (test_contact_get_type (),
+      "jid", "romeo@montague",
+      NULL);
+  test->contact->port = g_socket_listener_add_any_inet_port (
+      G_SOCKET_LISTENER (test->service), NULL, &error);
+  g_assert_no_error (error);
+
+  g_socket_service_start (test->service);
+
+  return test;
+}
+
+static void
+teardown_test (test_data_t *test)
+{
+  guint i;
+
+  /* The connection attempts which outlived their IQs fail once the other
+   * end goes away, and only then let go of the porter */
+  g_object_add_weak_pointer (G_OBJECT (test->porter),
+      (gpointer *) &test->porter);
+  g_object_unref (test->porter);
+
+  g_socket_service_stop (test->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (test->service));
+
+  for (i = 0; i < test->accepted->len; i++)
+    g_io_stream_close (g_ptr_array_index (test->accepted, i), NULL, NULL);
+
+  while (test->porter != NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_ptr_array_unref (test->accepted);
+  g_object_unref (test->service);
+  g_object_unref (test->contact);
+  g_object_unref (test->factory);
+  g_main_loop_unref (test->loop);
+  g_slice_free (test_data_t, test);
+}
+
+static WockyStanza *
+make_iq (test_data_t *test)
+{
+  WockyStanza *iq;
+
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_GET, NULL, "romeo@montague",
+      '(', "query", ':', WOCKY_NS_DISCO_INFO, ')',
+      NULL);
+  wocky_stanza_set_to_contact (iq, WOCKY_CONTACT (test->contact));
+
+  return iq;
+}
+
+static void
+send_iq_timed_out_cb (GObject *source,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  test_data_t *test = user_data;
+  WockyStanza *reply;
+  GError *error = NULL;
+
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source), res, &error);
+  g_assert (reply == NULL);
+  g_assert_error (error, WOCKY_PORTER_ERROR, WOCKY_PORTER_ERROR_TIMED_OUT);
+  g_error_free (error);
+
+  g_main_loop_quit (test->loop);
+}
+
+/* The contact accepts the connection but never opens its stream, so the
+ * IQs can only end by timing out */
+static void
+test_send_iq_timeout (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *iq;
+  guint timeout;
+
+  /* IQs don't time out by default */
+  g_object_get (test->porter, "iq-timeout", &timeout, NULL);
+  g_assert_cmpuint (timeout, ==, 0);
+
+  /* Porter-wide deadline, used by wocky_porter_send_iq_async() */
+  g_object_set (test->porter, "iq-timeout", 200, NULL);
+
+  iq = make_iq (test);
+  wocky_porter_send_iq_async (test->porter, iq, NULL,
+      send_iq_timed_out_cb, test);
+  g_object_unref (iq);
+
+  g_main_loop_run (test->loop);
+
+  /* Per-IQ deadline overriding the default */
+  g_object_set (test->porter, "iq-timeout", 0, NULL);
+
+  iq = make_iq (test);
+  wocky_porter_send_iq_with_timeout_async (test->porter, iq, 100, NULL,
+      send_iq_timed_out_cb, test);
+  g_object_unref (iq);
+
+  g_main_loop_run (test->loop);
+
+  teardown_test (test);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  int result;
+
+  test_init (argc, argv);
+
+  g_test_add_func ("/meta-porter/send-iq-timeout", test_send_iq_timeout);
+
+  result = g_test_run ();
+  test_deinit ();
+  return result;
+}
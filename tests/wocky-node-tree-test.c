@@ -94,6 +94,120 @@ test_node_add_tree (void)
   g_object_unref (destination);
 }
 
+/* Copies share their descendants with the original until either changes
+ * them, and neither sees the other's changes */
+static void
+test_copy_on_write (void)
+{
+  WockyNodeTree *origin, *copy, *expected;
+  WockyNode *top, *copy_top, *item;
+
+  origin = wocky_node_tree_new ("noms", "foodstocks",
+    '*', &top,
+    '(', "item", '@', "origin", "Italy",
+      '(', "name", '$', "Plum cake", ')',
+    ')',
+    '(', "item", '@', "origin", "Iceland",
+      '(', "name", '$', "Skyr", ')',
+    ')',
+    NULL);
+
+  copy = wocky_node_tree_new_from_node (top);
+  copy_top = wocky_node_tree_get_top_node (copy);
+  test_assert_nodes_equal (top, copy_top);
+
+  item = wocky_node_get_child (copy_top, "item");
+  wocky_node_set_attribute (item, "origin", "France");
+  wocky_node_set_content (wocky_node_get_child (item, "name"), "Clafoutis");
+  wocky_node_add_child (copy_top, "item");
+
+  expected = wocky_node_tree_new ("noms", "foodstocks",
+    '(', "item", '@', "origin", "France",
+      '(', "name", '$', "Clafoutis", ')',
+    ')',
+    '(', "item", '@', "origin", "Iceland",
+      '(', "name", '$', "Skyr", ')',
+    ')',
+    '(', "item", ')',
+    NULL);
+  test_assert_nodes_equal (copy_top, wocky_node_tree_get_top_node (expected));
+  g_object_unref (expected);
+
+  /* the original is untouched, and can be changed in turn */
+  item = wocky_node_get_child (top, "item");
+  g_assert_cmpstr (wocky_node_get_attribute (item, "origin"), ==, "Italy");
+  g_assert_cmpstr (wocky_node_get_content_from_child (item, "name"), ==,
+      "Plum cake");
+  wocky_node_set_attribute (item, "origin", "Spain");
+  g_object_unref (copy);
+
+  expected = wocky_node_tree_new ("noms", "foodstocks",
+    '(', "item", '@', "origin", "Spain",
+      '(', "name", '$', "Plum cake", ')',
+    ')',
+    '(', "item", '@', "origin", "Iceland",
+      '(', "name", '$', "Skyr", ')',
+    ')',
+    NULL);
+  test_assert_nodes_equal (top, wocky_node_tree_get_top_node (expected));
+  g_object_unref (expected);
+
+  g_object_unref (origin);
+}
+
+/* Nodes found before copying a tree stay those of the original, as do those
+ * found in it afterwards; and copies outlive their original */
+static void
+test_copy_keeps_nodes (void)
+{
+  WockyNodeTree *origin, *copy, *copy_of_copy, *expected;
+  WockyNode *top, *item, *name;
+
+  origin = wocky_node_tree_new ("noms", "foodstocks",
+    '*', &top,
+    '(', "item", '@', "origin", "Italy",
+      '*', &item,
+      '(', "name", '*', &name, ')',
+    ')',
+    NULL);
+
+  copy = wocky_node_tree_new_from_node (top);
+  copy_of_copy = wocky_node_tree_new_from_node (
+      wocky_node_tree_get_top_node (copy));
+
+  g_assert (wocky_node_get_child (top, "item") == item);
+  g_assert (wocky_node_get_child (item, "name") == name);
+  g_assert (wocky_node_get_child (wocky_node_tree_get_top_node (copy),
+      "item") != item);
+
+  wocky_node_set_attribute (item, "origin", "Spain");
+  wocky_node_set_content (name, "Turron");
+  wocky_node_add_child (item, "price");
+
+  expected = wocky_node_tree_new ("noms", "foodstocks",
+    '(', "item", '@', "origin", "Spain",
+      '(', "name", '$', "Turron", ')',
+      '(', "price", ')',
+    ')',
+    NULL);
+  test_assert_nodes_equal (top, wocky_node_tree_get_top_node (expected));
+  g_object_unref (expected);
+  g_object_unref (origin);
+
+  expected = wocky_node_tree_new ("noms", "foodstocks",
+    '(', "item", '@', "origin", "Italy",
+      '(', "name", ')',
+    ')',
+    NULL);
+  test_assert_nodes_equal (wocky_node_tree_get_top_node (copy),
+      wocky_node_tree_get_top_node (expected));
+  g_object_unref (copy);
+  test_assert_nodes_equal (wocky_node_tree_get_top_node (copy_of_copy),
+      wocky_node_tree_get_top_node (expected));
+  g_object_unref (copy_of_copy);
+  g_object_unref (expected);
+}
+
 
 int
 main (int argc, char **argv)
@@ -108,6 +222,10 @@ main (int argc, char **argv)
     test_tree_from_node);
   g_test_add_func ("/xmpp-node-tree/node-add-tree",
     test_node_add_tree);
+  g_test_add_func ("/xmpp-node-tree/copy-on-write",
+    test_copy_on_write);
+  g_test_add_func ("/xmpp-node-tree/copy-keeps-nodes",
+    test_copy_keeps_nodes);
 
   result =  g_test_run ();
   test_deinit ();
@@ -188,6 +188,290 @@ test_send (void)
   teardown_test (test);
 }
 
+/* Stanzas queued in a higher priority lane overtake the ones queued before
+ * them in lower priority lanes, but keep their order within a lane */
+static WockyStanza *
+send_in_lane (test_data_t *test,
+    WockyStanza *s,
+    WockyC2SPorterLane lane)
+{
+  wocky_c2s_porter_send_in_lane_async (WOCKY_C2S_PORTER (test->sched_in), s,
+      lane, NULL, send_stanza_cb, test);
+  test->outstanding++;
+  return s;
+}
+
+static void
+test_send_lanes (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *first, *bulk1, *bulk2, *normal, *reply, *interactive;
+
+  test_open_connection (test);
+
+  /* This one is written straight away, the others have to queue */
+  first = send_in_lane (test, wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "romeo@example.net",
+      NULL), WOCKY_C2S_PORTER_LANE_NORMAL);
+  bulk1 = send_in_lane (test, wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "tybalt@example.net",
+      NULL), WOCKY_C2S_PORTER_LANE_BULK);
+  bulk2 = send_in_lane (test, wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "nurse@example.net",
+      NULL), WOCKY_C2S_PORTER_LANE_BULK);
+  normal = send_in_lane (test, wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "peter@example.net",
+      NULL), WOCKY_C2S_PORTER_LANE_NORMAL);
+  /* IQ replies are put in the interactive lane when it's picked for them */
+  reply = send_in_lane (test, wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_RESULT, "juliet@example.com", "romeo@example.net",
+      '@', "id", "1", NULL), WOCKY_C2S_PORTER_LANE_AUTO);
+  interactive = send_in_lane (test, wocky_stanza_build (
+      WOCKY_STANZA_TYPE_MESSAGE, WOCKY_STANZA_SUB_TYPE_CHAT,
+      "juliet@example.com", "samson@example.net", NULL),
+      WOCKY_C2S_PORTER_LANE_INTERACTIVE);
+
+  g_queue_push_tail (test->expected_stanzas, first);
+  g_queue_push_tail (test->expected_stanzas, reply);
+  g_queue_push_tail (test->expected_stanzas, interactive);
+  g_queue_push_tail (test->expected_stanzas, normal);
+  g_queue_push_tail (test->expected_stanzas, bulk1);
+  g_queue_push_tail (test->expected_stanzas, bulk2);
+
+  wocky_xmpp_connection_recv_stanza_async (test->out, NULL,
+      send_stanza_received_cb, test);
+  test->outstanding++;
+
+  test_wait_pending (test);
+
+  test_close_connection (test);
+  teardown_test (test);
+}
+
+/* Without a lane being chosen, stanzas keep the order they were sent in */
+static void
+test_send_default_lane (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *first, *message, *reply;
+
+  test_open_connection (test);
+
+  first = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "romeo@example.net",
+      NULL);
+  message = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "tybalt@example.net",
+      NULL);
+  reply = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+      WOCKY_STANZA_SUB_TYPE_RESULT, "juliet@example.com", "romeo@example.net",
+      '@', "id", "1", NULL);
+
+  wocky_porter_send_async (test->sched_in, first, NULL, send_stanza_cb,
+      test);
+  wocky_porter_send_async (test->sched_in, message, NULL, send_stanza_cb,
+      test);
+  wocky_porter_send_async (test->sched_in, reply, NULL, send_stanza_cb,
+      test);
+  test->outstanding += 3;
+
+  g_queue_push_tail (test->expected_stanzas, first);
+  g_queue_push_tail (test->expected_stanzas, message);
+  g_queue_push_tail (test->expected_stanzas, reply);
+
+  wocky_xmpp_connection_recv_stanza_async (test->out, NULL,
+      send_stanza_received_cb, test);
+  test->outstanding++;
+
+  test_wait_pending (test);
+
+  test_close_connection (test);
+  teardown_test (test);
+}
+
+/* Backpressure: the porter reports congestion once its water marks are
+ * reached, and can hold back new stanzas until it drains */
+static void
+congested_notify_cb (GObject *porter,
+    GParamSpec *pspec,
+    gpointer user_data)
+{
+  GArray *transitions = user_data;
+  gboolean congested;
+
+  g_object_get (porter, "congested", &congested, NULL);
+  g_array_append_val (transitions, congested);
+}
+
+static WockyStanza *
+send_numbered_message (test_data_t *test,
+    guint i)
+{
+  gchar *to = g_strdup_printf ("romeo%u@example.net", i);
+  WockyStanza *s = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", to,
+      '(', "body", '$', "O Romeo, Romeo! wherefore art thou Romeo?", ')',
+      NULL);
+
+  g_free (to);
+
+  wocky_porter_send_async (test->sched_in, s, NULL, send_stanza_cb, test);
+  test->outstanding++;
+  g_queue_push_tail (test->expected_stanzas, s);
+  return s;
+}
+
+static void
+test_send_backpressure (void)
+{
+  test_data_t *test = setup_test ();
+  GArray *transitions = g_array_new (FALSE, FALSE, sizeof (gboolean));
+  gboolean congested;
+  guint i;
+
+  test_open_connection (test);
+
+  g_object_set (test->sched_in,
+      "high-water-stanzas", 4,
+      "low-water-stanzas", 1,
+      NULL);
+  g_signal_connect (test->sched_in, "notify::congested",
+      G_CALLBACK (congested_notify_cb), transitions);
+
+  /* The other side stops reading: the first stanza stays in flight and the
+   * others pile up behind it */
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, TRUE);
+
+  for (i = 0; i < 3; i++)
+    send_numbered_message (test, i);
+
+  g_object_get (test->sched_in, "congested", &congested, NULL);
+  g_assert (!congested);
+
+  send_numbered_message (test, 3);
+
+  g_object_get (test->sched_in, "congested", &congested, NULL);
+  g_assert (congested);
+  g_assert_cmpuint (transitions->len, ==, 1);
+
+  /* Let it drain */
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, FALSE);
+  wocky_xmpp_connection_recv_stanza_async (test->out, NULL,
+      send_stanza_received_cb, test);
+  test->outstanding++;
+  test_wait_pending (test);
+
+  g_object_get (test->sched_in, "congested", &congested, NULL);
+  g_assert (!congested);
+  g_assert_cmpuint (transitions->len, ==, 2);
+  g_assert (g_array_index (transitions, gboolean, 0));
+  g_assert (!g_array_index (transitions, gboolean, 1));
+
+  /* In deferred mode, stanzas sent above the high water mark wait outside
+   * the queue, so it never grows past the mark; they still go out in
+   * order once it drains */
+  g_object_set (test->sched_in, "defer-sends", TRUE, NULL);
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, TRUE);
+
+  for (i = 0; i < 10; i++)
+    send_numbered_message (test, i);
+
+  g_object_get (test->sched_in, "congested", &congested, NULL);
+  g_assert (congested);
+
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, FALSE);
+  wocky_xmpp_connection_recv_stanza_async (test->out, NULL,
+      send_stanza_received_cb, test);
+  test->outstanding++;
+  test_wait_pending (test);
+
+  g_object_get (test->sched_in, "congested", &congested, NULL);
+  g_assert (!congested);
+
+  g_array_unref (transitions);
+  test_close_connection (test);
+  teardown_test (test);
+}
+
+/* Stanzas queued with wocky_porter_send() go out in order with the others,
+ * and their failures are reported through ::send-failed */
+static void
+send_failed_cb (WockyC2SPorter *porter,
+    WockyStanza *stanza,
+    GError *error,
+    test_data_t *test)
+{
+  g_assert (WOCKY_IS_STANZA (stanza));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+}
+
+static void
+test_send_no_reply (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *s;
+  guint i;
+
+  test_open_connection (test);
+
+  /* Hold the first write so the others have to be queued */
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, TRUE);
+
+  for (i = 0; i < 6; i++)
+    {
+      gchar *id = g_strdup_printf ("%u", i);
+
+      s = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+          WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com",
+          "romeo@example.net",
+          '@', "id", id,
+          NULL);
+      g_free (id);
+
+      if (i % 3 == 1)
+        {
+          wocky_porter_send_async (test->sched_in, s, NULL, send_stanza_cb,
+              test);
+          test->outstanding++;
+        }
+      else
+        {
+          wocky_porter_send (test->sched_in, s);
+        }
+
+      g_queue_push_tail (test->expected_stanzas, s);
+    }
+
+  wocky_test_output_stream_set_throttled (test->stream->stream0_output, FALSE);
+  wocky_xmpp_connection_recv_stanza_async (test->out, NULL,
+      send_stanza_received_cb, test);
+  test->outstanding++;
+  test_wait_pending (test);
+
+  /* Now make the connection fail */
+  g_signal_connect (test->sched_in, "send-failed",
+      G_CALLBACK (send_failed_cb), test);
+  wocky_test_output_stream_set_write_error (test->stream->stream0_output);
+
+  for (i = 0; i < 2; i++)
+    {
+      s = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+          WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com",
+          "romeo@example.net", NULL);
+
+      wocky_porter_send (test->sched_in, s);
+      test->outstanding++;
+      g_object_unref (s);
+    }
+
+  test_wait_pending (test);
+
+  teardown_test (test);
+}
+
 /* receive testing */
 static gboolean
 test_receive_stanza_received_cb (WockyPorter *porter,
@@ -1913,6 +2197,295 @@ test_send_iq_abnormal (void)
   teardown_test (test);
 }
 
+/* Test that IQs nobody replies to time out */
+static gboolean
+test_send_iq_timeout_ignore_cb (WockyPorter *porter,
+    WockyStanza *stanza,
+    gpointer user_data)
+{
+  test_data_t *test = (test_data_t *) user_data;
+
+  /* Swallow the IQ without replying */
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+  return TRUE;
+}
+
+static void
+test_send_iq_timeout_cb (GObject *source,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  test_data_t *test = (test_data_t *) user_data;
+  WockyStanza *reply;
+  GError *error = NULL;
+
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source),
+      res, &error);
+  g_assert (reply == NULL);
+  g_assert_error (error, WOCKY_PORTER_ERROR, WOCKY_PORTER_ERROR_TIMED_OUT);
+  g_error_free (error);
+
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+}
+
+static void
+test_send_iq_timeout (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *iq;
+  guint timeout;
+
+  test_open_both_connections (test);
+  wocky_porter_start (test->sched_out);
+  wocky_porter_start (test->sched_in);
+
+  wocky_porter_register_handler_from_anyone (test->sched_out,
+      WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_NONE,
+      WOCKY_PORTER_HANDLER_PRIORITY_NORMAL,
+      test_send_iq_timeout_ignore_cb, test, NULL);
+
+  /* IQs don't time out by default */
+  g_object_get (test->sched_in, "iq-timeout", &timeout, NULL);
+  g_assert_cmpuint (timeout, ==, 0);
+
+  /* Porter-wide deadline */
+  g_object_set (test->sched_in, "iq-timeout", 200, NULL);
+
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+    WOCKY_STANZA_SUB_TYPE_GET, "juliet@example.com", "romeo@example.net",
+    NULL);
+  wocky_porter_send_iq_async (test->sched_in, iq, NULL,
+      test_send_iq_timeout_cb, test);
+  g_object_unref (iq);
+
+  test->outstanding += 2;
+  test_wait_pending (test);
+
+  /* Per-IQ deadline overriding the default */
+  g_object_set (test->sched_in, "iq-timeout", 0, NULL);
+
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+    WOCKY_STANZA_SUB_TYPE_SET, "juliet@example.com", "romeo@example.net",
+    NULL);
+  wocky_porter_send_iq_with_timeout_async (test->sched_in, iq, 100, NULL,
+      test_send_iq_timeout_cb, test);
+  g_object_unref (iq);
+
+  test->outstanding += 2;
+  test_wait_pending (test);
+
+  test_close_both_porters (test);
+  teardown_test (test);
+}
+
+/* Test that a deadline set while the main loop was held up counts from when
+ * it was set, not from when the loop last ran */
+static void
+test_send_iq_timeout_stall_cancelled_cb (GObject *source,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  test_data_t *test = (test_data_t *) user_data;
+  WockyStanza *reply;
+  GError *error = NULL;
+
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source),
+      res, &error);
+  g_assert (reply == NULL);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_error_free (error);
+
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+}
+
+static void
+test_send_iq_timeout_stall (void)
+{
+  test_data_t *test = setup_test ();
+  WockyStanza *iq;
+  gint64 sent;
+
+  test_open_both_connections (test);
+  wocky_porter_start (test->sched_out);
+  wocky_porter_start (test->sched_in);
+
+  wocky_porter_register_handler_from_anyone (test->sched_out,
+      WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_NONE,
+      WOCKY_PORTER_HANDLER_PRIORITY_NORMAL,
+      test_send_iq_timeout_ignore_cb, test, NULL);
+
+  /* An IQ with a distant deadline keeps the porter's timers running */
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+    WOCKY_STANZA_SUB_TYPE_GET, "juliet@example.com", "romeo@example.net",
+    NULL);
+  wocky_porter_send_iq_with_timeout_async (test->sched_in, iq, 60000,
+      test->cancellable, test_send_iq_timeout_stall_cancelled_cb, test);
+  g_object_unref (iq);
+
+  test->outstanding += 1;
+  test_wait_pending (test);
+
+  /* Hold the main loop up for longer than the next deadline */
+  g_usleep (G_USEC_PER_SEC);
+
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+    WOCKY_STANZA_SUB_TYPE_SET, "juliet@example.com", "romeo@example.net",
+    NULL);
+  sent = g_get_monotonic_time ();
+  wocky_porter_send_iq_with_timeout_async (test->sched_in, iq, 500, NULL,
+      test_send_iq_timeout_cb, test);
+  g_object_unref (iq);
+
+  test->outstanding += 2;
+  test_wait_pending (test);
+
+  /* Deadlines are only as precise as the porter's tick */
+  g_assert_cmpint (g_get_monotonic_time () - sent, >=,
+      (500 - 100) * 1000);
+
+  test->outstanding += 1;
+  g_cancellable_cancel (test->cancellable);
+  test_wait_pending (test);
+
+  test_close_both_porters (test);
+  teardown_test (test);
+}
+
+/* Test that IQs sent through porters which don't implement deadlines
+ * themselves still time out */
+typedef struct {
+  GObject parent;
+  GSimpleAsyncResult *pending;
+} TestPlainPorter;
+
+typedef struct {
+  GObjectClass parent_class;
+} TestPlainPorterClass;
+
+static void test_plain_porter_iface_init (gpointer g_iface,
+    gpointer data);
+
+G_DEFINE_TYPE_WITH_CODE (TestPlainPorter, test_plain_porter, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (WOCKY_TYPE_PORTER, test_plain_porter_iface_init))
+
+enum
+{
+  PLAIN_PROP_CONNECTION = 1,
+  PLAIN_PROP_FULL_JID,
+  PLAIN_PROP_BARE_JID,
+  PLAIN_PROP_RESOURCE,
+};
+
+static void
+test_plain_porter_init (TestPlainPorter *self)
+{
+}
+
+static void
+test_plain_porter_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+}
+
+static void
+test_plain_porter_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+}
+
+static void
+test_plain_porter_class_init (TestPlainPorterClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->set_property = test_plain_porter_set_property;
+  object_class->get_property = test_plain_porter_get_property;
+
+  g_object_class_override_property (object_class,
+      PLAIN_PROP_CONNECTION, "connection");
+  g_object_class_override_property (object_class,
+      PLAIN_PROP_FULL_JID, "full-jid");
+  g_object_class_override_property (object_class,
+      PLAIN_PROP_BARE_JID, "bare-jid");
+  g_object_class_override_property (object_class,
+      PLAIN_PROP_RESOURCE, "resource");
+}
+
+/* Never gets a reply until the test gives it one */
+static void
+test_plain_porter_send_iq_async (WockyPorter *porter,
+    WockyStanza *stanza,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  TestPlainPorter *self = (TestPlainPorter *) porter;
+
+  g_assert (self->pending == NULL);
+  self->pending = g_simple_async_result_new (G_OBJECT (porter), callback,
+      user_data, test_plain_porter_send_iq_async);
+}
+
+static WockyStanza *
+test_plain_porter_send_iq_finish (WockyPorter *porter,
+    GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  return g_object_ref (g_simple_async_result_get_op_res_gpointer (simple));
+}
+
+static void
+test_plain_porter_iface_init (gpointer g_iface,
+    gpointer data)
+{
+  WockyPorterInterface *iface = g_iface;
+
+  iface->send_iq_async = test_plain_porter_send_iq_async;
+  iface->send_iq_finish = test_plain_porter_send_iq_finish;
+}
+
+static void
+test_send_iq_timeout_fallback (void)
+{
+  test_data_t *test = setup_test ();
+  TestPlainPorter *porter = g_object_new (test_plain_porter_get_type (),
+      NULL);
+  WockyStanza *iq;
+
+  iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+    WOCKY_STANZA_SUB_TYPE_GET, "juliet@example.com", "romeo@example.net",
+    NULL);
+  wocky_porter_send_iq_with_timeout_async (WOCKY_PORTER (porter), iq, 100,
+      NULL, test_send_iq_timeout_cb, test);
+
+  test->outstanding += 1;
+  test_wait_pending (test);
+
+  /* A reply arriving after the deadline is ignored */
+  g_assert (porter->pending != NULL);
+  g_simple_async_result_set_op_res_gpointer (porter->pending,
+      g_object_ref (iq), g_object_unref);
+  g_simple_async_result_complete (porter->pending);
+  g_object_unref (porter->pending);
+  porter->pending = NULL;
+
+  g_object_unref (iq);
+  g_object_unref (porter);
+  teardown_test (test);
+}
+
 /* Test if the error is correctly propagated when a writing error occurs while
  * sending an IQ */
 static void
@@ -3574,6 +4147,10 @@ main (int argc, char **argv)
 
   g_test_add_func ("/xmpp-porter/initiation", test_instantiation);
   g_test_add_func ("/xmpp-porter/send", test_send);
+  g_test_add_func ("/xmpp-porter/send-lanes", test_send_lanes);
+  g_test_add_func ("/xmpp-porter/send-default-lane", test_send_default_lane);
+  g_test_add_func ("/xmpp-porter/send-backpressure", test_send_backpressure);
+  g_test_add_func ("/xmpp-porter/send-no-reply", test_send_no_reply);
   g_test_add_func ("/xmpp-porter/receive", test_receive);
   g_test_add_func ("/xmpp-porter/filter", test_filter);
   g_test_add_func ("/xmpp-porter/close-flush", test_close_flush);
@@ -3597,6 +4174,11 @@ main (int argc, char **argv)
   g_test_add_func ("/xmpp-porter/send-iq-error", test_send_iq_error);
   g_test_add_func ("/xmpp-porter/send-iq-gerror", test_send_iq_gerror);
   g_test_add_func ("/xmpp-porter/send-iq-denormalised", test_send_iq_abnormal);
+  g_test_add_func ("/xmpp-porter/send-iq-timeout", test_send_iq_timeout);
+  g_test_add_func ("/xmpp-porter/send-iq-timeout/stall",
+      test_send_iq_timeout_stall);
+  g_test_add_func ("/xmpp-porter/send-iq-timeout/fallback",
+      test_send_iq_timeout_fallback);
   g_test_add_func ("/xmpp-porter/error-while-sending-iq",
       test_error_while_sending_iq);
   g_test_add_func ("/xmpp-porter/handler-filter", test_handler_filter);
@@ -45,6 +45,68 @@ test_copy (void)
   g_object_unref (expected);
 }
 
+static void
+test_template (void)
+{
+  WockyStanzaTemplate *template;
+  WockyStanza *stanza, *expected;
+  const gchar *values[] = { "romeo@example.net", "one", "Wherefore?" };
+
+  template = wocky_stanza_template_new (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com",
+      WOCKY_STANZA_TEMPLATE_SLOT,
+      '@', "id", WOCKY_STANZA_TEMPLATE_SLOT,
+        '(', "body",
+          '$', WOCKY_STANZA_TEMPLATE_SLOT,
+        ')',
+        '(', "active",
+          ':', "http://jabber.org/protocol/chatstates",
+          '#', "en",
+        ')',
+      NULL);
+  g_assert (template != NULL);
+  g_assert_cmpuint (wocky_stanza_template_get_n_slots (template), ==, 3);
+
+  expected = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", "romeo@example.net",
+      '@', "id", "one",
+        '(', "body",
+          '$', "Wherefore?",
+        ')',
+        '(', "active",
+          ':', "http://jabber.org/protocol/chatstates",
+          '#', "en",
+        ')',
+      NULL);
+
+  stanza = wocky_stanza_template_instantiate (template,
+      "romeo@example.net", "one", "Wherefore?");
+  test_assert_stanzas_equal (expected, stanza);
+  g_object_unref (stanza);
+
+  stanza = wocky_stanza_template_instantiatev (template, values);
+  test_assert_stanzas_equal (expected, stanza);
+  g_object_unref (stanza);
+  g_object_unref (expected);
+
+  /* empty slots leave out what they stand for */
+  expected = wocky_stanza_build (WOCKY_STANZA_TYPE_MESSAGE,
+      WOCKY_STANZA_SUB_TYPE_CHAT, "juliet@example.com", NULL,
+        '(', "body", ')',
+        '(', "active",
+          ':', "http://jabber.org/protocol/chatstates",
+          '#', "en",
+        ')',
+      NULL);
+
+  stanza = wocky_stanza_template_instantiate (template, NULL, NULL, NULL);
+  test_assert_stanzas_equal (expected, stanza);
+  g_object_unref (stanza);
+  g_object_unref (expected);
+
+  wocky_stanza_template_free (template);
+}
+
 static void
 test_build_iq_result_simple_ack (void)
 {
@@ -825,6 +887,7 @@ main (int argc, char **argv)
 
   test_init (argc, argv);
   g_test_add_func ("/xmpp-stanza/copy", test_copy);
+  g_test_add_func ("/xmpp-stanza/template", test_template);
   g_test_add_func ("/xmpp-stanza/iq-result/build-simple-ack",
       test_build_iq_result_simple_ack);
   g_test_add_func ("/xmpp-stanza/iq-result/build-complex-reply",
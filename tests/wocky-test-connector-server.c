@@ -66,6 +66,453 @@ static void quit (GObject *source, GAsyncResult *result, gpointer data);
 static void server_enc_outstanding (TestConnectorServer *self);
 static gboolean server_dec_outstanding (TestConnectorServer *self);
 
+/* ************************************************************************* */
+/* round trip counting                                                       */
+
+/* Everything the client sends is read as soon as it arrives, and every
+ * chunk which arrives after we last wrote something counts as a new round
+ * trip: the client had to wait for our reply before sending it. Requests
+ * the client pipelines reach us before we reply to what precedes them, so
+ * they share its round trip. */
+typedef struct {
+  GFilterInputStream parent;
+  guint round_trips;
+  /* we wrote something since the client last sent anything */
+  gboolean replied;
+
+  GCancellable *cancellable;
+  guint8 chunk[4096];
+  GByteArray *buffer;
+  gboolean eof;
+  GError *error /* from reading the base stream */;
+
+  /* the read waiting for data, if any */
+  GSimpleAsyncResult *result;
+  guint8 *dest;
+  gsize count;
+  GSource *cancelled;
+} RttInputStream;
+
+typedef struct {
+  GFilterInputStreamClass parent_class;
+} RttInputStreamClass;
+
+static GType rtt_input_stream_get_type (void);
+
+G_DEFINE_TYPE (RttInputStream, rtt_input_stream, G_TYPE_FILTER_INPUT_STREAM);
+
+static void rtt_input_stream_fill (RttInputStream *self);
+
+/* hand what we have (data, error or end of stream) to the pending read */
+static gboolean
+rtt_input_stream_deliver (RttInputStream *self)
+{
+  GSimpleAsyncResult *r = self->result;
+
+  if (r == NULL)
+    return FALSE;
+
+  if (self->buffer->len > 0)
+    {
+      gsize n = MIN (self->count, self->buffer->len);
+
+      memcpy (self->dest, self->buffer->data, n);
+      g_byte_array_remove_range (self->buffer, 0, n);
+      g_simple_async_result_set_op_res_gssize (r, n);
+    }
+  else if (self->error != NULL)
+    {
+      g_simple_async_result_set_from_error (r, self->error);
+    }
+  else if (self->eof)
+    {
+      g_simple_async_result_set_op_res_gssize (r, 0);
+    }
+  else
+    {
+      return FALSE;
+    }
+
+  self->result = NULL;
+
+  if (self->cancelled != NULL)
+    {
+      g_source_destroy (self->cancelled);
+      g_source_unref (self->cancelled);
+      self->cancelled = NULL;
+    }
+
+  g_simple_async_result_complete_in_idle (r);
+  g_object_unref (r);
+  return TRUE;
+}
+
+static void
+rtt_input_stream_read_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  RttInputStream *self = user_data;
+  GError *error = NULL;
+  gssize n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+
+  if (n > 0)
+    {
+      if (self->replied)
+        {
+          self->round_trips++;
+          self->replied = FALSE;
+          DEBUG ("round trip %u", self->round_trips);
+        }
+
+      g_byte_array_append (self->buffer, self->chunk, n);
+      rtt_input_stream_fill (self);
+    }
+  else if (n == 0)
+    {
+      self->eof = TRUE;
+    }
+  else
+    {
+      self->error = error;
+    }
+
+  rtt_input_stream_deliver (self);
+  g_object_unref (self);
+}
+
+static void
+rtt_input_stream_fill (RttInputStream *self)
+{
+  GInputStream *base = g_filter_input_stream_get_base_stream (
+      G_FILTER_INPUT_STREAM (self));
+
+  g_input_stream_read_async (base, self->chunk, sizeof (self->chunk),
+      G_PRIORITY_DEFAULT, self->cancellable, rtt_input_stream_read_cb,
+      g_object_ref (self));
+}
+
+static gboolean
+rtt_input_stream_read_cancelled (GCancellable *cancellable,
+    gpointer user_data)
+{
+  RttInputStream *self = user_data;
+  GSimpleAsyncResult *r = self->result;
+
+  self->result = NULL;
+  g_source_unref (self->cancelled);
+  self->cancelled = NULL;
+
+  g_simple_async_result_set_error (r, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+      "Operation was cancelled");
+  g_simple_async_result_complete (r);
+  g_object_unref (r);
+
+  return FALSE;
+}
+
+static gssize
+rtt_input_stream_read (GInputStream *stream,
+    void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+      "Only asynchronous reads are supported");
+  return -1;
+}
+
+static void
+rtt_input_stream_read_async (GInputStream *stream,
+    void *buffer,
+    gsize count,
+    int io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  RttInputStream *self = (RttInputStream *) stream;
+
+  g_assert (self->result == NULL);
+
+  self->result = g_simple_async_result_new (G_OBJECT (stream), callback,
+      user_data, rtt_input_stream_read_async);
+  self->dest = buffer;
+  self->count = count;
+
+  if (rtt_input_stream_deliver (self) || cancellable == NULL)
+    return;
+
+  self->cancelled = g_cancellable_source_new (cancellable);
+  g_source_set_callback (self->cancelled,
+      (GSourceFunc) rtt_input_stream_read_cancelled, self, NULL);
+  g_source_attach (self->cancelled, NULL);
+}
+
+static gssize
+rtt_input_stream_read_finish (GInputStream *stream,
+    GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return -1;
+
+  return g_simple_async_result_get_op_res_gssize (simple);
+}
+
+static gboolean
+rtt_input_stream_close (GInputStream *stream,
+    GCancellable *cancellable,
+    GError **error)
+{
+  RttInputStream *self = (RttInputStream *) stream;
+
+  g_cancellable_cancel (self->cancellable);
+
+  return G_INPUT_STREAM_CLASS (rtt_input_stream_parent_class)->close_fn (
+      stream, cancellable, error);
+}
+
+static void
+rtt_input_stream_finalize (GObject *object)
+{
+  RttInputStream *self = (RttInputStream *) object;
+
+  g_object_unref (self->cancellable);
+  g_byte_array_unref (self->buffer);
+
+  if (self->error != NULL)
+    g_error_free (self->error);
+
+  G_OBJECT_CLASS (rtt_input_stream_parent_class)->finalize (object);
+}
+
+static void
+rtt_input_stream_init (RttInputStream *self)
+{
+  self->cancellable = g_cancellable_new ();
+  self->buffer = g_byte_array_new ();
+  /* the client's first flight counts too */
+  self->replied = TRUE;
+}
+
+static void
+rtt_input_stream_class_init (RttInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = rtt_input_stream_finalize;
+  stream_class->read_fn = rtt_input_stream_read;
+  stream_class->read_async = rtt_input_stream_read_async;
+  stream_class->read_finish = rtt_input_stream_read_finish;
+  stream_class->close_fn = rtt_input_stream_close;
+}
+
+typedef struct {
+  GFilterOutputStream parent;
+  RttInputStream *input;
+} RttOutputStream;
+
+typedef struct {
+  GFilterOutputStreamClass parent_class;
+} RttOutputStreamClass;
+
+static GType rtt_output_stream_get_type (void);
+
+G_DEFINE_TYPE (RttOutputStream, rtt_output_stream,
+    G_TYPE_FILTER_OUTPUT_STREAM);
+
+static gssize
+rtt_output_stream_write (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error)
+{
+  RttOutputStream *self = (RttOutputStream *) stream;
+
+  self->input->replied = TRUE;
+
+  return g_output_stream_write (
+      g_filter_output_stream_get_base_stream (G_FILTER_OUTPUT_STREAM (self)),
+      buffer, count, cancellable, error);
+}
+
+static void
+rtt_output_stream_write_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *r = user_data;
+  GError *error = NULL;
+  gssize n;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source), result, &error);
+
+  if (n < 0)
+    g_simple_async_result_take_error (r, error);
+  else
+    g_simple_async_result_set_op_res_gssize (r, n);
+
+  g_simple_async_result_complete (r);
+  g_object_unref (r);
+}
+
+static void
+rtt_output_stream_write_async (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    int io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  RttOutputStream *self = (RttOutputStream *) stream;
+  GSimpleAsyncResult *r = g_simple_async_result_new (G_OBJECT (stream),
+      callback, user_data, rtt_output_stream_write_async);
+
+  self->input->replied = TRUE;
+
+  g_output_stream_write_async (
+      g_filter_output_stream_get_base_stream (G_FILTER_OUTPUT_STREAM (self)),
+      buffer, count, io_priority, cancellable, rtt_output_stream_write_cb, r);
+}
+
+static gssize
+rtt_output_stream_write_finish (GOutputStream *stream,
+    GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return -1;
+
+  return g_simple_async_result_get_op_res_gssize (simple);
+}
+
+static void
+rtt_output_stream_finalize (GObject *object)
+{
+  RttOutputStream *self = (RttOutputStream *) object;
+
+  g_object_unref (self->input);
+
+  G_OBJECT_CLASS (rtt_output_stream_parent_class)->finalize (object);
+}
+
+static void
+rtt_output_stream_init (RttOutputStream *self)
+{
+}
+
+static void
+rtt_output_stream_class_init (RttOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = rtt_output_stream_finalize;
+  stream_class->write_fn = rtt_output_stream_write;
+  stream_class->write_async = rtt_output_stream_write_async;
+  stream_class->write_finish = rtt_output_stream_write_finish;
+}
+
+typedef struct {
+  GIOStream parent;
+  GIOStream *base;
+  RttInputStream *input;
+  RttOutputStream *output;
+} RttIOStream;
+
+typedef struct {
+  GIOStreamClass parent_class;
+} RttIOStreamClass;
+
+static GType rtt_io_stream_get_type (void);
+
+G_DEFINE_TYPE (RttIOStream, rtt_io_stream, G_TYPE_IO_STREAM);
+
+static GInputStream *
+rtt_io_stream_get_input_stream (GIOStream *stream)
+{
+  return G_INPUT_STREAM (((RttIOStream *) stream)->input);
+}
+
+static GOutputStream *
+rtt_io_stream_get_output_stream (GIOStream *stream)
+{
+  return G_OUTPUT_STREAM (((RttIOStream *) stream)->output);
+}
+
+static gboolean
+rtt_io_stream_close (GIOStream *stream,
+    GCancellable *cancellable,
+    GError **error)
+{
+  RttIOStream *self = (RttIOStream *) stream;
+
+  g_cancellable_cancel (self->input->cancellable);
+
+  return g_io_stream_close (self->base, cancellable, error);
+}
+
+static void
+rtt_io_stream_finalize (GObject *object)
+{
+  RttIOStream *self = (RttIOStream *) object;
+
+  g_object_unref (self->input);
+  g_object_unref (self->output);
+  g_object_unref (self->base);
+
+  G_OBJECT_CLASS (rtt_io_stream_parent_class)->finalize (object);
+}
+
+static void
+rtt_io_stream_init (RttIOStream *self)
+{
+}
+
+static void
+rtt_io_stream_class_init (RttIOStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GIOStreamClass *stream_class = G_IO_STREAM_CLASS (klass);
+
+  object_class->finalize = rtt_io_stream_finalize;
+  stream_class->get_input_stream = rtt_io_stream_get_input_stream;
+  stream_class->get_output_stream = rtt_io_stream_get_output_stream;
+  stream_class->close_fn = rtt_io_stream_close;
+}
+
+static GIOStream *
+rtt_io_stream_new (GIOStream *base)
+{
+  RttIOStream *self = g_object_new (rtt_io_stream_get_type (), NULL);
+
+  self->base = g_object_ref (base);
+  self->input = g_object_new (rtt_input_stream_get_type (),
+      "base-stream", g_io_stream_get_input_stream (base),
+      "close-base-stream", FALSE,
+      NULL);
+  self->output = g_object_new (rtt_output_stream_get_type (),
+      "base-stream", g_io_stream_get_output_stream (base),
+      "close-base-stream", FALSE,
+      NULL);
+  self->output->input = g_object_ref (self->input);
+
+  rtt_input_stream_fill (self->input);
+
+  return G_IO_STREAM (self);
+}
+
 /* ************************************************************************* */
 /* test connector server object definition */
 typedef enum {
@@ -114,6 +561,10 @@ struct _TestConnectorServerPrivate
 
   gchar *other_host;
   guint other_port;
+
+  /* a bind iq set was refused (BIND_PROBLEM_TOO_EARLY), or succeeded */
+  gboolean bind_refused;
+  gboolean bound;
 };
 
 static void
@@ -197,6 +648,8 @@ static void handle_auth     (TestConnectorServer *self,
     WockyStanza *xml);
 static void handle_starttls (TestConnectorServer *self,
     WockyStanza *xml);
+static void handle_enable   (TestConnectorServer *self,
+    WockyStanza *xml);
 
 static void
 after_auth (GObject *source,
@@ -235,6 +688,7 @@ static stanza_handler handlers[] =
   {
     HANDLER (SASL_AUTH, auth),
     HANDLER (TLS, starttls),
+    HANDLER (STREAM_MANAGEMENT, enable),
     { NULL, NULL, NULL }
   };
 
@@ -710,7 +1164,21 @@ iq_set_bind_XMPP_BIND (TestConnectorServer *self,
   BindProblem bp = BIND_PROBLEM_NONE;
 
   DEBUG("");
-  if ((bp = problems & BIND_PROBLEM_INVALID)  ||
+  if ((problems & BIND_PROBLEM_TOO_EARLY) && !priv->bind_refused)
+    {
+      priv->bind_refused = TRUE;
+      iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
+          WOCKY_STANZA_SUB_TYPE_ERROR,
+          NULL, NULL,
+          '(', "bind", ':', WOCKY_XMPP_NS_BIND,
+          ')',
+          '(', "error", '@', "type", "wait",
+          '(', "unexpected-request", ':', WOCKY_XMPP_NS_STANZAS,
+          ')',
+          ')',
+          NULL);
+    }
+  else if ((bp = problems & BIND_PROBLEM_INVALID)  ||
       (bp = problems & BIND_PROBLEM_DENIED)   ||
       (bp = problems & BIND_PROBLEM_CONFLICT) ||
       (bp = problems & BIND_PROBLEM_REJECTED))
@@ -793,6 +1261,7 @@ iq_set_bind_XMPP_BIND (TestConnectorServer *self,
         }
       else
         {
+          priv->bound = TRUE;
           jid = g_strdup_printf ("user@some.doma.in/%s", uniq);
           iq = wocky_stanza_build (WOCKY_STANZA_TYPE_IQ,
               WOCKY_STANZA_SUB_TYPE_RESULT,
@@ -1030,6 +1499,26 @@ handle_starttls (TestConnectorServer *self,
   g_object_unref (xml);
 }
 
+static void
+handle_enable (TestConnectorServer *self,
+    WockyStanza *xml)
+{
+  TestConnectorServerPrivate *priv = self->priv;
+  WockyStanza *reply;
+
+  DEBUG ("");
+  if ((priv->problem.connector->xmpp & XMPP_PROBLEM_SM) && priv->bound)
+    reply = wocky_stanza_new ("enabled", WOCKY_XMPP_NS_STREAM_MANAGEMENT);
+  else
+    reply = wocky_stanza_new ("failed", WOCKY_XMPP_NS_STREAM_MANAGEMENT);
+
+  server_enc_outstanding (self);
+  wocky_xmpp_connection_send_stanza_async (priv->conn, reply,
+      priv->cancellable, iq_sent, self);
+  g_object_unref (reply);
+  g_object_unref (xml);
+}
+
 static void
 finished (GObject *source,
     GAsyncResult *result,
@@ -1086,6 +1575,21 @@ handshake_cb (GObject *source,
       goto out;
     }
 
+  if (priv->problem.connector->xmpp & XMPP_PROBLEM_DIRECT_TLS)
+    {
+      const gchar *alpn = wocky_tls_session_get_alpn_protocol (
+          priv->tls_sess);
+
+      /* NULL means one of the TLS libraries doesn't support ALPN */
+      if (alpn != NULL && wocky_strdiff (alpn, "xmpp-client"))
+        {
+          DEBUG ("Direct TLS client asked for '%s', not xmpp-client", alpn);
+          g_io_stream_close (priv->stream, NULL, NULL);
+          g_object_unref (tls_conn);
+          goto out;
+        }
+    }
+
   if (priv->conn != NULL)
     g_object_unref (priv->conn);
 
@@ -1261,11 +1765,20 @@ after_auth (GObject *source,
   node = wocky_stanza_get_top_node (feat);
 
   if (!(priv->problem.connector->xmpp & XMPP_PROBLEM_NO_SESSION))
-    wocky_node_add_child_ns (node, "session", WOCKY_XMPP_NS_SESSION);
+    {
+      WockyNode *session = wocky_node_add_child_ns (node, "session",
+          WOCKY_XMPP_NS_SESSION);
+
+      if (priv->problem.connector->xmpp & XMPP_PROBLEM_OPTIONAL_SESSION)
+        wocky_node_add_child (session, "optional");
+    }
 
   if (!(priv->problem.connector->xmpp & XMPP_PROBLEM_CANNOT_BIND))
     wocky_node_add_child_ns (node, "bind", WOCKY_XMPP_NS_BIND);
 
+  if (priv->problem.connector->xmpp & XMPP_PROBLEM_SM)
+    wocky_node_add_child_ns (node, "sm", WOCKY_XMPP_NS_STREAM_MANAGEMENT);
+
   priv->state = SERVER_STATE_FEATURES_SENT;
 
   server_enc_outstanding (tcs);
@@ -1367,6 +1880,9 @@ static void startssl (TestConnectorServer *self)
         wocky_tls_session_server_new (priv->stream, 1024, key, crt);
     }
 
+  if (problem->xmpp & XMPP_PROBLEM_DIRECT_TLS)
+    wocky_tls_session_set_alpn_protocol (priv->tls_sess, "xmpp-client");
+
   DEBUG ("starting server SSL handshake");
   server_enc_outstanding (self);
   wocky_tls_session_handshake_async (priv->tls_sess,
@@ -1673,7 +2189,8 @@ test_connector_server_start (TestConnectorServer *self)
   priv = self->priv;
   priv->state = SERVER_STATE_START;
   DEBUG ("connection: %p", priv->conn);
-  if (priv->problem.connector->xmpp & XMPP_PROBLEM_OLD_SSL)
+  if (priv->problem.connector->xmpp &
+      (XMPP_PROBLEM_OLD_SSL | XMPP_PROBLEM_DIRECT_TLS))
     {
       startssl (self);
     }
@@ -1704,3 +2221,33 @@ test_connector_server_set_other_host (TestConnectorServer *self,
   self->priv->other_port = port;
 
 }
+
+/* Count the round trips needed to get through the client's requests: must
+ * be called before test_connector_server_start () */
+void
+test_connector_server_count_round_trips (TestConnectorServer *self)
+{
+  TestConnectorServerPrivate *priv = self->priv;
+  GIOStream *stream;
+
+  g_return_if_fail (priv->state == SERVER_STATE_START);
+
+  stream = rtt_io_stream_new (priv->stream);
+
+  g_object_unref (priv->conn);
+  g_object_unref (priv->stream);
+  priv->stream = stream;
+  priv->conn = wocky_xmpp_connection_new (stream);
+}
+
+guint
+test_connector_server_get_round_trips (TestConnectorServer *self)
+{
+  TestConnectorServerPrivate *priv = self->priv;
+
+  if (priv->stream == NULL ||
+      !G_TYPE_CHECK_INSTANCE_TYPE (priv->stream, rtt_io_stream_get_type ()))
+    return 0;
+
+  return ((RttIOStream *) priv->stream)->input->round_trips;
+}
@@ -46,6 +46,12 @@ typedef enum
   XMPP_PROBLEM_CANNOT_BIND = CONNPROBLEM (11),
   XMPP_PROBLEM_OLD_AUTH_FEATURE = CONNPROBLEM (12),
   XMPP_PROBLEM_SEE_OTHER_HOST = CONNPROBLEM (13),
+  /* not a problem as such: serve Direct TLS (XEP-0368) rather than STARTTLS */
+  XMPP_PROBLEM_DIRECT_TLS  = CONNPROBLEM (14),
+  /* not problems either: offer stream management, and mark the session
+   * as optional (RFC 6121 appendix E) */
+  XMPP_PROBLEM_SM          = CONNPROBLEM (15),
+  XMPP_PROBLEM_OPTIONAL_SESSION = CONNPROBLEM (16),
 } XmppProblem;
 
 typedef enum
@@ -59,6 +65,8 @@ typedef enum
   BIND_PROBLEM_FAILED      = CONNPROBLEM(5),
   BIND_PROBLEM_NO_JID      = CONNPROBLEM(6),
   BIND_PROBLEM_NONSENSE    = CONNPROBLEM(7),
+  /* refuse the first bind, as a server not expecting it that early might */
+  BIND_PROBLEM_TOO_EARLY   = CONNPROBLEM(8),
 } BindProblem;
 
 typedef enum
@@ -193,6 +201,10 @@ gboolean test_connector_server_teardown_finish (TestConnectorServer *self,
 
 const gchar *test_connector_server_get_used_mech (TestConnectorServer *self);
 
+void test_connector_server_count_round_trips (TestConnectorServer *self);
+
+guint test_connector_server_get_round_trips (TestConnectorServer *self);
+
 G_END_DECLS
 
 #endif /* #ifndef __TEST_CONNECTOR_SERVER_H__*/
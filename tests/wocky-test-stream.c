@@ -59,6 +59,12 @@ typedef struct {
   WockyTestStreamWriteMode mode;
   GError *write_error /* no, this is not a coding style violation */;
   gboolean dispose_has_run;
+  /* While throttled, the asynchronous write in progress (if any) is held
+   * back, as if the other side had stopped reading */
+  gboolean throttled;
+  GSimpleAsyncResult *held_write;
+  const void *held_buffer;
+  gsize held_count;
 } WockyTestOutputStream;
 
 typedef struct {
@@ -506,24 +512,17 @@ wocky_test_output_stream_write (GOutputStream *stream, const void *buffer,
 }
 
 static void
-wocky_test_output_stream_write_async (GOutputStream *stream,
+output_stream_complete_write (GOutputStream *stream,
+    GSimpleAsyncResult *simple,
     const void *buffer,
-    gsize count,
-    int io_priority,
-    GCancellable *cancellable,
-    GAsyncReadyCallback callback,
-    gpointer user_data)
+    gsize count)
 {
-  GSimpleAsyncResult *simple;
   GError *error = NULL;
   gssize result;
 
-  result = wocky_test_output_stream_write (stream, buffer, count, cancellable,
+  result = wocky_test_output_stream_write (stream, buffer, count, NULL,
     &error);
 
-  simple = g_simple_async_result_new (G_OBJECT (stream), callback, user_data,
-    wocky_test_output_stream_write_async);
-
   if (result == -1)
     {
       g_simple_async_result_set_from_error (simple, error);
@@ -538,6 +537,33 @@ wocky_test_output_stream_write_async (GOutputStream *stream,
   g_object_unref (simple);
 }
 
+static void
+wocky_test_output_stream_write_async (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    int io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  WockyTestOutputStream *self = WOCKY_TEST_OUTPUT_STREAM (stream);
+  GSimpleAsyncResult *simple;
+
+  simple = g_simple_async_result_new (G_OBJECT (stream), callback, user_data,
+    wocky_test_output_stream_write_async);
+
+  if (self->throttled)
+    {
+      g_assert (self->held_write == NULL);
+      self->held_write = simple;
+      self->held_buffer = buffer;
+      self->held_count = count;
+      return;
+    }
+
+  output_stream_complete_write (stream, simple, buffer, count);
+}
+
 static gssize
 wocky_test_output_stream_write_finish (GOutputStream *stream,
   GAsyncResult *result,
@@ -564,6 +590,10 @@ wocky_test_output_stream_dispose (GObject *object)
 
   self->dispose_has_run = TRUE;
 
+  if (self->held_write != NULL)
+    g_object_unref (self->held_write);
+  self->held_write = NULL;
+
   g_async_queue_push (self->queue,
     g_array_sized_new (FALSE, FALSE, sizeof (guint8), 0));
   g_async_queue_unref (self->queue);
@@ -635,6 +665,23 @@ wocky_test_output_stream_set_write_error (GOutputStream *stream)
        "write error");
 }
 
+void
+wocky_test_output_stream_set_throttled (GOutputStream *stream,
+    gboolean throttled)
+{
+  WockyTestOutputStream *self = WOCKY_TEST_OUTPUT_STREAM (stream);
+  GSimpleAsyncResult *simple = self->held_write;
+
+  self->throttled = throttled;
+
+  if (throttled || simple == NULL)
+    return;
+
+  self->held_write = NULL;
+  output_stream_complete_write (stream, simple, self->held_buffer,
+      self->held_count);
+}
+
 void
 wocky_test_stream_set_mode (GInputStream *stream,
   WockyTestStreamReadMode mode)
@@ -70,6 +70,9 @@ void wocky_test_output_stream_set_write_error (GOutputStream *stream);
 
 void wocky_test_stream_cork (GInputStream *stream, gboolean cork);
 
+void wocky_test_output_stream_set_throttled (GOutputStream *stream,
+  gboolean throttled);
+
 typedef enum {
   /* one read can have data from two  writes, but never has all the data
    * from one specific write */
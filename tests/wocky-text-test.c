@@ -0,0 +1,268 @@
+/*
+ * wocky-text-test.c - Tests for the vectorised text kernels
+ *
+ * Copyright © 2026 Collabora Ltd. <http://www.collabora.co.uk/>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+/* The kernels aren't public API */
+#define WOCKY_COMPILATION
+#include <wocky/wocky-text.h>
+#undef WOCKY_COMPILATION
+
+/* Long enough for every kernel to go through a few whole blocks, and stop
+ * anywhere in one */
+#define MAX_LEN 300
+#define ROUNDS 2000
+
+static const gchar *pieces[] = { "a", "Z", "0", "+", "/", "=", " ", "\n",
+    "<", ">", "&", "\"", "'", "\r", "\t", "\x01", "é", "€", "𝄞", "\xff",
+    "\xc3", "\xed\xa0\x80", "\0" };
+
+/* Mostly ASCII, with a sprinkling of things each kernel has to stop at */
+static gsize
+fill (GRand *rand,
+    gchar *buf)
+{
+  gsize len = 0;
+  gsize target = g_rand_int_range (rand, 0, MAX_LEN);
+  gint odd = g_rand_int_range (rand, 1, 64);
+
+  while (len < target)
+    {
+      const gchar *piece;
+      gsize n;
+
+      if (g_rand_int_range (rand, 0, odd) == 0)
+        {
+          guint i = g_rand_int_range (rand, 0, G_N_ELEMENTS (pieces));
+
+          piece = pieces[i];
+          n = MAX (strlen (piece), 1);
+        }
+      else
+        {
+          piece = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+              + g_rand_int_range (rand, 0, 52);
+          n = 1;
+        }
+
+      memcpy (buf + len, piece, n);
+      len += n;
+    }
+
+  buf[len] = '\0';
+  return len;
+}
+
+/* strchr() would find the terminator */
+static gboolean
+is_one_of (gchar c,
+    const gchar *set)
+{
+  return c != '\0' && strchr (set, c) != NULL;
+}
+
+typedef void (*CheckFunc) (const gchar *buf, gsize len);
+
+/* Runs @check over the same inputs with each set of kernels the CPU has */
+static void
+check_all_isas (CheckFunc check)
+{
+  WockyTextIsa best = wocky_text_get_isa ();
+  WockyTextIsa isa;
+
+  for (isa = WOCKY_TEXT_ISA_SCALAR; isa <= WOCKY_TEXT_ISA_NEON; isa++)
+    {
+      GRand *rand = g_rand_new_with_seed (isa);
+      gchar buf[MAX_LEN + 8];
+      guint i;
+
+      if (!wocky_text_set_isa (isa))
+        continue;
+
+      for (i = 0; i < ROUNDS; i++)
+        {
+          gsize len = fill (rand, buf);
+
+          check (buf, len);
+        }
+
+      g_rand_free (rand);
+    }
+
+  g_assert (wocky_text_set_isa (best));
+}
+
+static void
+check_utf8 (const gchar *buf,
+    gsize len)
+{
+  const gchar *expected_end, *end;
+  gboolean expected;
+
+  expected = g_utf8_validate (buf, len, &expected_end);
+  g_assert_cmpint (wocky_text_utf8_validate (buf, len, &end), ==, expected);
+  g_assert (end == expected_end);
+
+  expected = g_utf8_validate (buf, -1, &expected_end);
+  g_assert_cmpint (wocky_text_utf8_validate (buf, -1, &end), ==, expected);
+  g_assert (end == expected_end);
+}
+
+static void
+test_utf8_validate (void)
+{
+  check_all_isas (check_utf8);
+}
+
+static void
+check_escape (const gchar *buf,
+    gsize len)
+{
+  GString *escaped = g_string_new (NULL);
+  gsize i;
+
+  for (i = 0; i < len && !is_one_of (buf[i], "<>&\"\r"); i++)
+    ;
+
+  g_assert_cmpuint (
+      wocky_text_escape_scan (buf, len, WOCKY_TEXT_ESCAPE_CONTENT), ==, i);
+
+  for (i = 0; i < len && !is_one_of (buf[i], "<>&\"\r\n\t") &&
+          (guchar) buf[i] < 0x80; i++)
+    ;
+
+  g_assert_cmpuint (
+      wocky_text_escape_scan (buf, len, WOCKY_TEXT_ESCAPE_ATTRIBUTE), ==, i);
+
+  wocky_text_escape_append (escaped, buf, len);
+
+  for (i = 0; i < escaped->len; i++)
+    g_assert (!is_one_of (escaped->str[i], "<>\"\r"));
+
+  g_string_free (escaped, TRUE);
+}
+
+static void
+test_escape (void)
+{
+  GString *escaped = g_string_new ("x");
+
+  wocky_text_escape_append (escaped, "a<b>&\"c\"\r\n\té", 14);
+  g_assert_cmpstr (escaped->str, ==,
+      "xa&lt;b&gt;&amp;&quot;c&quot;&#13;\n\té");
+  g_string_free (escaped, TRUE);
+
+  check_all_isas (check_escape);
+}
+
+static gsize
+expected_markup_span (const gchar *buf,
+    gsize len,
+    gchar quote)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      guchar c = buf[i];
+
+      if (c == '<' || c == '&' || (c == quote && quote != '\0'))
+        break;
+
+      if (c < 0x20 && (quote != '\0' || (c != '\t' && c != '\n')))
+        break;
+    }
+
+  return i;
+}
+
+static void
+check_markup (const gchar *buf,
+    gsize len)
+{
+  g_assert_cmpuint (wocky_text_markup_scan (buf, len, '\0'), ==,
+      expected_markup_span (buf, len, '\0'));
+  g_assert_cmpuint (wocky_text_markup_scan (buf, len, '\''), ==,
+      expected_markup_span (buf, len, '\''));
+  g_assert_cmpuint (wocky_text_markup_scan (buf, len, '"'), ==,
+      expected_markup_span (buf, len, '"'));
+}
+
+static void
+test_markup (void)
+{
+  check_all_isas (check_markup);
+}
+
+static void
+check_base64 (const gchar *buf,
+    gsize len)
+{
+  gchar *expected, *encoded;
+  guchar *decoded, *expected_decoded;
+  gsize decoded_len, expected_len;
+
+  expected = g_base64_encode ((const guchar *) buf, len);
+  encoded = wocky_text_base64_encode ((const guchar *) buf, len);
+  g_assert_cmpstr (encoded, ==, expected);
+
+  decoded = wocky_text_base64_decode (encoded, &decoded_len);
+  g_assert_cmpuint (decoded_len, ==, len);
+  g_assert (memcmp (decoded, buf, len) == 0);
+  g_free (decoded);
+
+  /* the input, as base64 gone wrong: padding and whitespace in the middle,
+   * and characters which have no business being there */
+  expected_decoded = g_base64_decode (buf, &expected_len);
+  decoded = wocky_text_base64_decode (buf, &decoded_len);
+  g_assert_cmpuint (decoded_len, ==, expected_len);
+  g_assert (memcmp (decoded, expected_decoded, decoded_len) == 0);
+  g_free (decoded);
+  g_free (expected_decoded);
+
+  g_free (expected);
+  g_free (encoded);
+}
+
+static void
+test_base64 (void)
+{
+  check_all_isas (check_base64);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/text/utf8-validate", test_utf8_validate);
+  g_test_add_func ("/text/escape", test_escape);
+  g_test_add_func ("/text/markup", test_markup);
+  g_test_add_func ("/text/base64", test_base64);
+
+  return g_test_run ();
+}
@@ -5,6 +5,7 @@
 #include "config.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <wocky/wocky.h>
 #include "wocky-test-stream.h"
@@ -257,7 +258,7 @@ teardown_ssl_test (ssl_test_t *ssl_test)
 }
 
 static void
-test_tls_handshake_rw (void)
+run_tls_handshake_rw (gboolean kernel_offload)
 {
   ssl_test_t ssl_test = { NULL, } ;
   test_data_t *test = setup_test ();
@@ -280,6 +281,8 @@ test_tls_handshake_rw (void)
 
   setup_ssl_test (&ssl_test, test);
 
+  wocky_tls_session_set_kernel_offload (client, kernel_offload);
+
   wocky_tls_session_handshake_async (client, G_PRIORITY_DEFAULT,
       test->cancellable, client_handshake_cb, &ssl_test);
   test->outstanding += 1;
@@ -297,12 +300,184 @@ test_tls_handshake_rw (void)
   g_assert (!memcmp (ssl_test.srv_data->str,
     ssl_test.cli_send, ssl_test.cli_send_len));
 
+  /* the test streams aren't sockets: the kernel can't take over */
+  g_assert (!wocky_tls_session_is_kernel_offloaded (client));
+
   teardown_test (test);
   teardown_ssl_test (&ssl_test);
   g_object_unref (client);
   g_object_unref (server);
 }
 
+static void
+test_tls_handshake_rw (void)
+{
+  run_tls_handshake_rw (FALSE);
+}
+
+/* asking for kernel offload where it can't be done falls back quietly */
+static void
+test_tls_kernel_offload_fallback (void)
+{
+  run_tls_handshake_rw (TRUE);
+}
+
+static void
+verify_cache_secured_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer data)
+{
+  test_data_t *test = data;
+  WockyXmppConnection *connection;
+  GError *error = NULL;
+
+  connection = wocky_tls_connector_secure_finish (
+      WOCKY_TLS_CONNECTOR (source), result, &error);
+  g_assert_no_error (error);
+  g_object_unref (connection);
+
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+}
+
+static void
+verify_cache_server_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer data)
+{
+  test_data_t *test = data;
+  WockyTLSConnection *connection;
+  GError *error = NULL;
+
+  connection = wocky_tls_session_handshake_finish (
+      WOCKY_TLS_SESSION (source), result, &error);
+  g_assert_no_error (error);
+  g_object_unref (connection);
+
+  test->outstanding--;
+  g_main_loop_quit (test->loop);
+}
+
+static void
+verify_cache_connect (WockyTLSHandler *handler)
+{
+  test_data_t *test = setup_test ();
+  WockyTLSConnector *connector = wocky_tls_connector_new (handler);
+  WockyXmppConnection *connection = wocky_xmpp_connection_new (
+      test->stream->stream0);
+  WockyTLSSession *server = wocky_tls_session_server_new (
+      test->stream->stream1, 1024, TLS_SERVER_KEY_FILE, TLS_SERVER_CRT_FILE);
+
+  wocky_tls_connector_secure_async (connector, connection, TRUE,
+      "weasel-juice.org", NULL, test->cancellable, verify_cache_secured_cb,
+      test);
+  test->outstanding += 1;
+
+  wocky_tls_session_handshake_async (server, G_PRIORITY_DEFAULT,
+      test->cancellable, verify_cache_server_cb, test);
+  test->outstanding += 1;
+
+  test_wait_pending (test);
+
+  g_object_unref (server);
+  g_object_unref (connection);
+  g_object_unref (connector);
+  teardown_test (test);
+}
+
+static void
+test_tls_verify_cache (void)
+{
+  WockyTLSHandler *handler = wocky_tls_handler_new (FALSE);
+  guint hits, misses;
+
+  wocky_tls_handler_forget_cas (handler);
+  wocky_tls_handler_add_ca (handler, TLS_CA_CRT_FILE);
+  g_object_set (handler, "verify-cache", TRUE, NULL);
+
+  /* the first connection has to check the certificate... */
+  verify_cache_connect (handler);
+  g_object_get (handler,
+      "verify-cache-hits", &hits,
+      "verify-cache-misses", &misses,
+      NULL);
+  g_assert_cmpuint (hits, ==, 0);
+  g_assert_cmpuint (misses, ==, 1);
+
+  /* ...but the second one to the same server doesn't */
+  verify_cache_connect (handler);
+  g_object_get (handler,
+      "verify-cache-hits", &hits,
+      "verify-cache-misses", &misses,
+      NULL);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 1);
+
+  g_object_unref (handler);
+}
+
+static void
+verify_cache_get_counts (WockyTLSHandler *handler,
+    guint *hits,
+    guint *misses)
+{
+  g_object_get (handler,
+      "verify-cache-hits", hits,
+      "verify-cache-misses", misses,
+      NULL);
+}
+
+static void
+test_tls_verify_cache_ca_changed (void)
+{
+  WockyTLSHandler *handler = wocky_tls_handler_new (FALSE);
+  GError *error = NULL;
+  gchar *dir, *ca, *contents;
+  gsize length;
+  guint hits, misses, tries;
+
+  dir = g_dir_make_tmp ("wocky-tls-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  ca = g_build_filename (dir, "ca.pem", NULL);
+
+  g_file_get_contents (TLS_CA_CRT_FILE, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (ca, contents, length, &error);
+  g_assert_no_error (error);
+
+  wocky_tls_handler_forget_cas (handler);
+  wocky_tls_handler_add_ca (handler, ca);
+  g_object_set (handler, "verify-cache", TRUE, NULL);
+
+  /* reconnecting finds the outcome, even though the session the CA was
+   * parsed for is long gone... */
+  verify_cache_connect (handler);
+  verify_cache_connect (handler);
+  verify_cache_get_counts (handler, &hits, &misses);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 1);
+
+  /* ...until the CA file changes, which the store only hears about once its
+   * file monitor gets round to it */
+  g_file_set_contents (ca, contents, length, &error);
+  g_assert_no_error (error);
+
+  for (tries = 0; tries < 50 && misses == 1; tries++)
+    {
+      g_usleep (G_USEC_PER_SEC / 10);
+      verify_cache_connect (handler);
+      verify_cache_get_counts (handler, &hits, &misses);
+    }
+
+  g_assert_cmpuint (misses, ==, 2);
+
+  g_object_unref (handler);
+  g_unlink (ca);
+  g_rmdir (dir);
+  g_free (contents);
+  g_free (ca);
+  g_free (dir);
+}
 
 int
 main (int argc, char **argv)
@@ -311,6 +486,11 @@ main (int argc, char **argv)
 
   test_init (argc, argv);
   g_test_add_func ("/tls/handshake+rw", test_tls_handshake_rw);
+  g_test_add_func ("/tls/kernel-offload/fallback",
+      test_tls_kernel_offload_fallback);
+  g_test_add_func ("/tls/verify-cache", test_tls_verify_cache);
+  g_test_add_func ("/tls/verify-cache/ca-changed",
+      test_tls_verify_cache_ca_changed);
   result = g_test_run ();
   test_deinit ();
 
@@ -81,7 +81,7 @@ received_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
 #define CHUNK_SIZE 13
 
 static void
-test_recv_simple_message (void)
+recv_simple_message (gboolean pooled)
 {
   WockyXmppConnection *connection;
   WockyTestStream *stream;
@@ -90,15 +90,20 @@ test_recv_simple_message (void)
   gchar message[] = SIMPLE_MESSAGE;
   GMainLoop *loop = NULL;
   test_data_t data = { NULL, FALSE };
+  guint timeout_id;
 
   loop = g_main_loop_new (NULL, FALSE);
 
   len = strlen (message);
 
   stream = g_object_new (WOCKY_TYPE_TEST_STREAM, NULL);
-  connection = wocky_xmpp_connection_new (stream->stream0);
 
-  g_timeout_add (1000, test_timeout_cb, NULL);
+  if (pooled)
+    connection = wocky_xmpp_connection_new_pooled (stream->stream0);
+  else
+    connection = wocky_xmpp_connection_new (stream->stream0);
+
+  timeout_id = g_timeout_add (1000, test_timeout_cb, NULL);
 
   data.loop = loop;
   wocky_xmpp_connection_recv_open_async (connection,
@@ -118,11 +123,27 @@ test_recv_simple_message (void)
 
   g_main_loop_run (loop);
   g_main_loop_unref (loop);
+  g_source_remove (timeout_id);
 
   g_object_unref (stream);
   g_object_unref (connection);
 }
 
+static void
+test_recv_simple_message (void)
+{
+  recv_simple_message (FALSE);
+}
+
+/* the second connection gets the reader and writer the first one gave back,
+ * which must be as good as new */
+static void
+test_recv_pooled (void)
+{
+  recv_simple_message (TRUE);
+  recv_simple_message (TRUE);
+}
+
 /* simple send message testing */
 static void
 send_stanza_received_cb (GObject *source, GAsyncResult *res,
@@ -924,6 +945,7 @@ main (int argc, char **argv)
   g_test_add_func ("/xmpp-connection/recv-simple-message-in-one-chunk",
     test_recv_simple_message_in_one_chunk);
   g_test_add_func ("/xmpp-connection/force-close", test_force_close);
+  g_test_add_func ("/xmpp-connection/recv-pooled", test_recv_pooled);
 
   result = g_test_run ();
   test_deinit ();
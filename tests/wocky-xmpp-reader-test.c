@@ -107,6 +107,45 @@
 "    <body>" NON_CHARACTER_CODEPOINTS "</body>" \
 "  </message>"
 
+#define TRICKY_MESSAGE \
+"<message to='juliet@example.com' from='romeo&amp;co@example.net'\r\n" \
+"    xml:lang='en' id=\"&#x31;&#50;\" note='tab\there\r\nand there'>\r\n" \
+"  <!-- not part of the stanza -->" \
+"  <body>Art thou &lt;not&gt; Romeo, &quot;and&quot; a Montague? &#xe9;\r\n" \
+"and a\rmonkey " MONKEY "</body>" \
+"  <x xmlns='urn:example:x' xmlns:y='urn:example:y' y:z='1'>" \
+"    <![CDATA[<not> & markup]]><y:inner/>" \
+"  </x>" \
+"</message>"
+
+/* Whether the tests make their readers parse with the native tokenizer
+ * rather than libxml2; every test is run both ways */
+static gboolean native = FALSE;
+
+static WockyXmppReader *
+reader_new (void)
+{
+  return g_object_new (WOCKY_TYPE_XMPP_READER,
+      "native-tokenizer", native,
+      NULL);
+}
+
+static WockyXmppReader *
+reader_new_no_stream_ns (const gchar *default_namespace)
+{
+  return g_object_new (WOCKY_TYPE_XMPP_READER,
+      "streaming-mode", FALSE,
+      "default-namespace", default_namespace,
+      "native-tokenizer", native,
+      NULL);
+}
+
+static WockyXmppReader *
+reader_new_no_stream (void)
+{
+  return reader_new_no_stream_ns ("");
+}
+
 
 
 static void
@@ -115,7 +154,7 @@ test_stream_no_stanzas (void)
   WockyXmppReader *reader;
   GError *error = NULL;
 
-  reader = wocky_xmpp_reader_new ();
+  reader = reader_new ();
 
   g_assert (wocky_xmpp_reader_get_state (reader)
     == WOCKY_XMPP_READER_STATE_INITIAL);
@@ -147,7 +186,7 @@ test_stream_open_error (void)
   WockyXmppReader *reader;
   GError *error = NULL;
 
-  reader = wocky_xmpp_reader_new ();
+  reader = reader_new ();
 
   g_assert (wocky_xmpp_reader_get_state (reader)
     == WOCKY_XMPP_READER_STATE_INITIAL);
@@ -171,7 +210,7 @@ test_stream_open_error (void)
 static void
 test_stream_open_unqualified_lang (void)
 {
-  WockyXmppReader *reader = wocky_xmpp_reader_new ();
+  WockyXmppReader *reader = reader_new ();
 
   g_assert (wocky_xmpp_reader_get_state (reader)
     == WOCKY_XMPP_READER_STATE_INITIAL);
@@ -192,7 +231,7 @@ test_parse_error (void)
   WockyXmppReader *reader;
   GError *error = NULL;
 
-  reader = wocky_xmpp_reader_new ();
+  reader = reader_new ();
 
   g_assert (wocky_xmpp_reader_get_state (reader)
     == WOCKY_XMPP_READER_STATE_INITIAL);
@@ -226,6 +265,457 @@ test_parse_error (void)
   g_object_unref (reader);
 }
 
+/* The parser is reset in place rather than created again: nothing from the
+ * broken stream may leak into the next one */
+static void
+test_reset_after_error (void)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  guint i;
+
+  reader = reader_new ();
+
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+  wocky_xmpp_reader_push (reader,
+    (guint8 *) BROKEN_MESSAGE, strlen (BROKEN_MESSAGE));
+  g_assert (wocky_xmpp_reader_get_state (reader)
+    == WOCKY_XMPP_READER_STATE_ERROR);
+
+  for (i = 0; i < 3; i++)
+    {
+      wocky_xmpp_reader_reset (reader);
+      g_assert (wocky_xmpp_reader_get_state (reader)
+        == WOCKY_XMPP_READER_STATE_INITIAL);
+
+      wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+      g_assert (wocky_xmpp_reader_get_state (reader)
+        == WOCKY_XMPP_READER_STATE_OPENED);
+
+      wocky_xmpp_reader_push (reader,
+        (guint8 *) MESSAGE_CHUNK0, strlen (MESSAGE_CHUNK0));
+      wocky_xmpp_reader_push (reader,
+        (guint8 *) MESSAGE_CHUNK1, strlen (MESSAGE_CHUNK1));
+
+      stanza = wocky_xmpp_reader_pop_stanza (reader);
+      g_assert (stanza != NULL);
+      g_assert (wocky_xmpp_reader_get_error (reader) == NULL);
+      g_object_unref (stanza);
+    }
+
+  g_object_unref (reader);
+}
+
+/* Text arriving in many pieces, with a character cut in two between two of
+ * them, ends up in the node as it was sent */
+static void
+test_split_text (void)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  WockyNode *body;
+  GString *expected = g_string_new ("");
+  const gchar *piece = "Art thou not Romeo, and a Montague? \xc3\xa9";
+  const gchar *message =
+      "<message to='juliet@example.com'><body>";
+  guint i;
+
+  reader = reader_new ();
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+  wocky_xmpp_reader_push (reader, (guint8 *) message, strlen (message));
+
+  for (i = 0; i < 1000; i++)
+    {
+      gsize len = strlen (piece);
+
+      /* the \xc3 and \xa9 go in different pushes */
+      wocky_xmpp_reader_push (reader, (guint8 *) piece, len - 1);
+      wocky_xmpp_reader_push (reader, (guint8 *) piece + len - 1, 1);
+      g_string_append (expected, piece);
+    }
+
+  message = "</body></message>";
+  wocky_xmpp_reader_push (reader, (guint8 *) message, strlen (message));
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  body = wocky_node_get_child (wocky_stanza_get_top_node (stanza), "body");
+  g_assert (body != NULL);
+  g_assert_cmpstr (body->content, ==, expected->str);
+
+  g_object_unref (stanza);
+  g_object_unref (reader);
+  g_string_free (expected, TRUE);
+}
+
+typedef struct {
+  GByteArray *data;
+  gboolean ended;
+} SinkData;
+
+static void
+sink_cb (WockyXmppReader *reader,
+    WockyStanza *stanza,
+    WockyNode *node,
+    const guint8 *data,
+    gsize length,
+    gpointer user_data)
+{
+  SinkData *sink = user_data;
+
+  g_assert (!sink->ended);
+  g_assert_cmpstr (node->name, ==, "data");
+  g_assert_cmpstr (wocky_node_get_attribute (
+      wocky_stanza_get_top_node (stanza), "id"), ==, "ibb1");
+
+  if (data == NULL)
+    sink->ended = TRUE;
+  else
+    g_byte_array_append (sink->data, data, length);
+}
+
+/* The text of elements a sink was added for is streamed to it, decoded,
+ * rather than stored in the stanza */
+static void
+test_content_sink (void)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  WockyNode *data;
+  SinkData sink = { g_byte_array_new (), FALSE };
+  GString *payload = g_string_new ("");
+  GString *xml = g_string_new ("<iq type='set' id='ibb1'>"
+      "<data xmlns='http://jabber.org/protocol/ibb' seq='0' sid='s'>");
+  gchar *encoded;
+  gsize i;
+
+  for (i = 0; i < 10000; i++)
+    g_string_append_c (payload, i % 251);
+
+  encoded = g_base64_encode ((guchar *) payload->str, payload->len);
+  g_string_append (xml, encoded);
+  g_string_append (xml, "</data></iq>");
+
+  reader = reader_new ();
+  wocky_xmpp_reader_add_content_sink (reader, WOCKY_XMPP_NS_IBB, "data",
+      TRUE, sink_cb, &sink, NULL);
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+
+  /* in odd-sized pieces, so that base64 quads get cut in two */
+  for (i = 0; i < xml->len; i += 333)
+    wocky_xmpp_reader_push (reader, (guint8 *) xml->str + i,
+        MIN (333, xml->len - i));
+
+  g_assert (sink.ended);
+  g_assert_cmpuint (sink.data->len, ==, payload->len);
+  g_assert (!memcmp (sink.data->data, payload->str, payload->len));
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  data = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza), "data",
+      WOCKY_XMPP_NS_IBB);
+  g_assert (data != NULL);
+  g_assert (data->content == NULL);
+  g_assert_cmpstr (wocky_node_get_attribute (data, "seq"), ==, "0");
+  g_assert_cmpstr (wocky_node_get_attribute_ns (data, "length",
+      WOCKY_XMPP_READER_NS_STREAMED), ==, "10000");
+
+  g_object_unref (stanza);
+  g_object_unref (reader);
+  g_free (encoded);
+  g_string_free (xml, TRUE);
+  g_string_free (payload, TRUE);
+  g_byte_array_unref (sink.data);
+}
+
+static void
+sm_func (WockyXmppReader *reader,
+    WockyStanzaType type,
+    guint h,
+    gpointer user_data)
+{
+  GString *events = user_data;
+
+  g_string_append_printf (events, "%s%u ",
+      type == WOCKY_STANZA_TYPE_SM_R ? "r" : "a", h);
+}
+
+/* Stream management requests and acks are reported without being built into
+ * stanzas, and between them the keepalives change nothing. They are reported
+ * in stream order, once the stanzas before them have been dealt with. */
+static void
+test_sm_fast_path (void)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  GString *events = g_string_new ("");
+  const gchar *chunks[] = {
+      HEADER,
+      "<r xmlns='urn:xmpp:sm:3'/>",
+      MESSAGE_CHUNK0 MESSAGE_CHUNK1 "  \n ",
+      "<r xmlns='urn:xmpp:sm:3'/><a xmlns='urn:xmpp:sm:3' h='42'/>",
+      "\n",
+      /* not worth a fast path, so it is a stanza as it used to be */
+      "<a xmlns='urn:xmpp:sm:3'/>",
+      NULL };
+  guint i;
+
+  reader = reader_new ();
+  wocky_xmpp_reader_set_sm_func (reader, sm_func, events);
+
+  for (i = 0; chunks[i] != NULL; i++)
+    wocky_xmpp_reader_push (reader, (guint8 *) chunks[i],
+        strlen (chunks[i]));
+
+  /* the message hasn't been popped yet */
+  g_assert_cmpstr (events->str, ==, "r0 ");
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  g_assert (wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_MESSAGE));
+  g_assert_cmpuint (wocky_stanza_get_recv_count (stanza), ==, 1);
+  g_object_unref (stanza);
+
+  /* nor dealt with, until whoever popped it comes back for more */
+  g_assert_cmpstr (events->str, ==, "r0 ");
+  wocky_xmpp_reader_emit_sm_events (reader);
+  g_assert_cmpstr (events->str, ==, "r0 r1 a42 ");
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  g_assert (wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_SM_A));
+  g_object_unref (stanza);
+
+  g_assert (wocky_xmpp_reader_pop_stanza (reader) == NULL);
+  g_assert_cmpuint (wocky_xmpp_reader_get_recv_count (reader), ==, 1);
+  g_assert (wocky_xmpp_reader_get_state (reader)
+    == WOCKY_XMPP_READER_STATE_OPENED);
+
+  g_string_free (events, TRUE);
+  g_object_unref (reader);
+}
+
+#define CHATSTATES "http://jabber.org/protocol/chatstates"
+
+#define FILTERED_STANZAS \
+"<message from='romeo@example.net' type='chat'>" \
+"  <composing xmlns='" CHATSTATES "'/></message>" \
+"<message from='romeo@example.net' type='chat' xml:lang='en'>  " \
+"  <body>Art thou &lt;not&gt; Romeo?</body>" \
+"  <active xmlns='" CHATSTATES "'/></message>" \
+"<presence from='romeo@example.net' type='unavailable'>" \
+"  <status>Gone</status></presence>" \
+"<presence from='romeo@example.net' xmlns:x='urn:example:x' x:y='z'/>" \
+"<message from='romeo@example.net' type='chat'>  </message>"
+
+static void
+push_in_pieces (WockyXmppReader *reader,
+    const gchar *xml)
+{
+  gsize len = strlen (xml);
+  gsize i;
+
+  for (i = 0; i < len; i += 7)
+    wocky_xmpp_reader_push (reader, (guint8 *) xml + i, MIN (7, len - i));
+}
+
+/* Filtered stanzas are dropped but counted, while the others come out as
+ * they would have without filters, even though their top-level element was
+ * held back until its first child */
+static void
+test_filter (void)
+{
+  WockyXmppReader *reader = reader_new ();
+  WockyXmppReader *plain = reader_new ();
+  WockyStanza *stanza;
+  WockyStanza *expected;
+  guint id;
+  guint counts[] = { 2, 4, 5 };
+  guint i;
+
+  id = wocky_xmpp_reader_add_filter (reader, WOCKY_STANZA_TYPE_MESSAGE,
+      CHATSTATES, NULL, NULL);
+  wocky_xmpp_reader_add_filter (reader, WOCKY_STANZA_TYPE_PRESENCE, NULL,
+      "type", "unavailable");
+  /* matches nothing */
+  wocky_xmpp_reader_add_filter (reader, WOCKY_STANZA_TYPE_NONE,
+      WOCKY_XMPP_NS_PUBSUB_EVENT, "type", NULL);
+
+  push_in_pieces (reader, HEADER FILTERED_STANZAS);
+  push_in_pieces (plain, HEADER FILTERED_STANZAS);
+
+  /* the first and third stanzas are only in the plain reader's output */
+  for (i = 0; i < 5; i++)
+    {
+      expected = wocky_xmpp_reader_pop_stanza (plain);
+      g_assert (expected != NULL);
+
+      if (i == 0 || i == 2)
+        {
+          g_object_unref (expected);
+          continue;
+        }
+
+      stanza = wocky_xmpp_reader_pop_stanza (reader);
+      g_assert (stanza != NULL);
+      test_assert_stanzas_equal (stanza, expected);
+      g_assert_cmpuint (wocky_stanza_get_recv_count (stanza), ==,
+          counts[i / 2]);
+      g_object_unref (stanza);
+      g_object_unref (expected);
+    }
+
+  g_assert (wocky_xmpp_reader_pop_stanza (reader) == NULL);
+  g_assert_cmpuint (wocky_xmpp_reader_get_recv_count (reader), ==, 5);
+  g_assert_cmpuint (wocky_xmpp_reader_get_filtered_count (reader), ==, 2);
+
+  /* filters can be dropped between stanzas */
+  wocky_xmpp_reader_remove_filter (reader, id);
+  push_in_pieces (reader, FILTERED_STANZAS FOOTER);
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  g_assert (wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza),
+      "composing", CHATSTATES) != NULL);
+  g_assert_cmpuint (wocky_stanza_get_recv_count (stanza), ==, 6);
+  g_object_unref (stanza);
+
+  for (i = 0; i < 3; i++)
+    g_object_unref (wocky_xmpp_reader_pop_stanza (reader));
+
+  g_assert (wocky_xmpp_reader_pop_stanza (reader) == NULL);
+  g_assert_cmpuint (wocky_xmpp_reader_get_recv_count (reader), ==, 10);
+  g_assert_cmpuint (wocky_xmpp_reader_get_filtered_count (reader), ==, 3);
+  g_assert (wocky_xmpp_reader_get_state (reader)
+    == WOCKY_XMPP_READER_STATE_CLOSED);
+
+  g_object_unref (reader);
+  g_object_unref (plain);
+}
+
+/* A lazy reader only builds the children of the top-level element; the rest
+ * is built when it's first looked at, the same as it would have been */
+static void
+test_lazy_subtrees (void)
+{
+  WockyXmppReader *reader = g_object_new (WOCKY_TYPE_XMPP_READER,
+      "native-tokenizer", native,
+      "lazy-subtrees", TRUE,
+      NULL);
+  WockyXmppReader *plain = reader_new ();
+  WockyStanza *stanza;
+  WockyStanza *expected;
+  WockyStanza *copy;
+  WockyNode *vcard;
+  WockyNode *n;
+  const gchar *xml = HEADER VCARD_MESSAGE TRICKY_MESSAGE;
+
+  push_in_pieces (reader, xml);
+  push_in_pieces (plain, xml);
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  vcard = wocky_node_get_child_ns (wocky_stanza_get_top_node (stanza),
+      "vCard", "vcard-temp");
+  g_assert (vcard != NULL);
+  g_assert (vcard->children == NULL);
+
+  /* a copy can be built on its own */
+  copy = wocky_stanza_copy (stanza);
+
+  n = wocky_node_get_child (vcard, "N");
+  g_assert (n != NULL);
+  g_assert_cmpstr (wocky_node_get_content_from_child (n, "GIVEN"), ==,
+      "Peter");
+
+  expected = wocky_xmpp_reader_pop_stanza (plain);
+  test_assert_stanzas_equal (stanza, expected);
+  test_assert_stanzas_equal (copy, expected);
+  g_object_unref (stanza);
+  g_object_unref (copy);
+  g_object_unref (expected);
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  expected = wocky_xmpp_reader_pop_stanza (plain);
+  g_assert (stanza != NULL);
+  test_assert_stanzas_equal (stanza, expected);
+  g_object_unref (stanza);
+  g_object_unref (expected);
+
+  g_assert (wocky_xmpp_reader_pop_stanza (reader) == NULL);
+
+  g_object_unref (reader);
+  g_object_unref (plain);
+}
+
+static void
+assert_over_limit (const gchar *limit,
+    guint value,
+    const gchar *xml)
+{
+  WockyXmppReader *reader = reader_new ();
+  GError *error = NULL;
+
+  g_object_set (reader, limit, value, NULL);
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+  wocky_xmpp_reader_push (reader, (guint8 *) xml, strlen (xml));
+
+  g_assert (wocky_xmpp_reader_pop_stanza (reader) == NULL);
+  g_assert (wocky_xmpp_reader_get_state (reader)
+    == WOCKY_XMPP_READER_STATE_ERROR);
+
+  error = wocky_xmpp_reader_get_error (reader);
+  g_assert_error (error, WOCKY_XMPP_READER_ERROR,
+      WOCKY_XMPP_READER_ERROR_LIMIT_EXCEEDED);
+  g_error_free (error);
+
+  g_object_unref (reader);
+}
+
+/* Stanzas going over a limit stop the reader as soon as they do, and the
+ * reader keeps track of the most it has seen of each */
+static void
+test_limits (void)
+{
+  WockyXmppReader *reader = reader_new ();
+  WockyStanza *stanza;
+  gsize size;
+  guint depth, attributes, children;
+
+  g_object_set (reader,
+      "max-stanza-size", 4096,
+      "max-depth", 4,
+      "max-attributes", 3,
+      "max-children", 9,
+      NULL);
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+  push_in_pieces (reader, VCARD_MESSAGE);
+
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+  g_object_unref (stanza);
+
+  wocky_xmpp_reader_get_peaks (reader, &size, &depth, &attributes,
+      &children);
+  g_assert_cmpuint (size, >, 0);
+  g_assert_cmpuint (size, <=, 4096);
+  g_assert_cmpuint (depth, ==, 4);
+  g_assert_cmpuint (attributes, ==, 3);
+  g_assert_cmpuint (children, ==, 9);
+  g_object_unref (reader);
+
+  assert_over_limit ("max-stanza-size", 64,
+      "<message><body>Art thou not Romeo, and a Montague? Neither, fair "
+      "saint, if either thee dislike.</body></message>");
+  /* a start tag which never ends counts too */
+  assert_over_limit ("max-stanza-size", 64,
+      "<message to='juliet@example.com' from='romeo@example.net' "
+      "id='01234567890123456789012345678901234567890123456789");
+  assert_over_limit ("max-depth", 3, VCARD_MESSAGE);
+  assert_over_limit ("max-attributes", 2, VCARD_MESSAGE);
+  assert_over_limit ("max-children", 8, VCARD_MESSAGE);
+}
+
 static void
 test_no_stream_parse_message (WockyXmppReader *reader)
 {
@@ -262,7 +752,7 @@ test_no_stream_hunks (void)
 {
   WockyXmppReader *reader;
 
-  reader = wocky_xmpp_reader_new_no_stream ();
+  reader = reader_new_no_stream ();
   test_no_stream_parse_message (reader);
 
   g_object_unref (reader);
@@ -273,7 +763,7 @@ test_no_stream_reset (void)
 {
   WockyXmppReader *reader;
 
-  reader = wocky_xmpp_reader_new_no_stream ();
+  reader = reader_new_no_stream ();
 
   /* whole message, reset, whole message, reset */
   test_no_stream_parse_message (reader);
@@ -303,7 +793,7 @@ test_vcard_namespace (void)
   WockyXmppReader *reader;
   WockyStanza *stanza;
 
-  reader = wocky_xmpp_reader_new_no_stream ();
+  reader = reader_new_no_stream ();
 
   wocky_xmpp_reader_push (reader,
     (guint8 *) VCARD_MESSAGE, strlen (VCARD_MESSAGE));
@@ -322,7 +812,7 @@ test_invalid_namespace (void)
   WockyXmppReader *reader;
   WockyStanza *stanza;
 
-  reader = wocky_xmpp_reader_new_no_stream ();
+  reader = reader_new_no_stream ();
 
   wocky_xmpp_reader_push (reader,
     (guint8 *) INVALID_NAMESPACE_MESSAGE, strlen (INVALID_NAMESPACE_MESSAGE));
@@ -346,7 +836,7 @@ test_body_with_alternative (
     const gchar *expected_body_text,
     const gchar *alt_body_text)
 {
-  WockyXmppReader *reader = wocky_xmpp_reader_new_no_stream ();
+  WockyXmppReader *reader = reader_new_no_stream ();
   WockyStanza *stanza;
   WockyNode *body;
 
@@ -455,7 +945,7 @@ test_no_stream_default_namespace (
 static void
 test_no_stream_default_default_namespace (void)
 {
-  WockyXmppReader *reader = wocky_xmpp_reader_new_no_stream ();
+  WockyXmppReader *reader = reader_new_no_stream ();
 
   /* WockyXmppReader defaults to the empty namespace. */
   test_no_stream_default_namespace (reader, "");
@@ -467,7 +957,7 @@ static void
 test_no_stream_specified_default_namespace (void)
 {
 #define WEIRD "wocky:weird:namespace"
-  WockyXmppReader *reader = wocky_xmpp_reader_new_no_stream_ns (WEIRD);
+  WockyXmppReader *reader = reader_new_no_stream_ns (WEIRD);
 
   test_no_stream_default_namespace (reader, WEIRD);
 
@@ -475,31 +965,186 @@ test_no_stream_specified_default_namespace (void)
 #undef WEIRD
 }
 
+static WockyStanza *
+parse_stanza (gboolean native_tokenizer,
+    const gchar *xml,
+    gsize chunk)
+{
+  WockyXmppReader *reader;
+  WockyStanza *stanza;
+  gsize len = strlen (xml);
+  gsize i;
+
+  reader = g_object_new (WOCKY_TYPE_XMPP_READER,
+      "native-tokenizer", native_tokenizer,
+      NULL);
+  wocky_xmpp_reader_push (reader, (guint8 *) HEADER, strlen (HEADER));
+
+  for (i = 0; i < len; i += chunk)
+    wocky_xmpp_reader_push (reader, (guint8 *) xml + i, MIN (chunk, len - i));
+
+  g_assert (wocky_xmpp_reader_get_error (reader) == NULL);
+  stanza = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (stanza != NULL);
+
+  g_object_unref (reader);
+  return stanza;
+}
+
+/* Whatever the native tokenizer is given, and however it is cut up, it
+ * builds the same stanza libxml2 does */
+static void
+test_native_matches_libxml2 (void)
+{
+  const gchar *messages[] = {
+      TRICKY_MESSAGE,
+      MESSAGE_CHUNK0 MESSAGE_CHUNK1,
+      VCARD_MESSAGE,
+      INVALID_NAMESPACE_MESSAGE,
+      MESSAGE_WITH_NON_CHARACTER_CODEPOINTS,
+      NULL };
+  gsize chunks[] = { 1, 2, 7, 4096 };
+  WockyStanza *stanza;
+  WockyNode *top;
+  guint i, j;
+
+  for (i = 0; messages[i] != NULL; i++)
+    {
+      WockyStanza *expected = parse_stanza (FALSE, messages[i], 4096);
+
+      for (j = 0; j < G_N_ELEMENTS (chunks); j++)
+        {
+          stanza = parse_stanza (TRUE, messages[i], chunks[j]);
+          test_assert_stanzas_equal (expected, stanza);
+          g_object_unref (stanza);
+        }
+
+      g_object_unref (expected);
+    }
+
+  /* and what it built is right, not just the same */
+  stanza = parse_stanza (TRUE, TRICKY_MESSAGE, 4096);
+  top = wocky_stanza_get_top_node (stanza);
+  g_assert_cmpstr (wocky_node_get_attribute (top, "from"), ==,
+      "romeo&co@example.net");
+  g_assert_cmpstr (wocky_node_get_attribute (top, "id"), ==, "12");
+  g_assert_cmpstr (wocky_node_get_attribute (top, "note"), ==,
+      "tab here and there");
+  g_assert_cmpstr (wocky_node_get_language (top), ==, "en");
+  g_assert_cmpstr (wocky_node_get_child (top, "body")->content, ==,
+      "Art thou <not> Romeo, \"and\" a Montague? \xc3\xa9\nand a\nmonkey "
+      MONKEY);
+  g_assert (wocky_node_get_child_ns (
+      wocky_node_get_child_ns (top, "x", "urn:example:x"),
+      "inner", "urn:example:y") != NULL);
+  g_object_unref (stanza);
+}
+
+/* What XMPP leaves out of XML is an error, not something to be skipped */
+static void
+test_native_rejects (void)
+{
+  const gchar *documents[] = {
+      "<!DOCTYPE stream:stream [<!ENTITY x 'y'>]>" HEADER,
+      "<?xml version='1.0' encoding='ISO-8859-1'?>"
+      "<stream:stream xmlns='jabber:client'"
+      "  xmlns:stream='http://etherx.jabber.org/streams'>",
+      HEADER "<?php echo 'hi'; ?>",
+      HEADER "<message><body>&x;</body></message>",
+      HEADER "<message><body>\x01</body></message>",
+      HEADER "<message to='a' to='b'/>",
+      HEADER "<message><body>\xc3\x28</body></message>",
+      NULL };
+  guint i;
+
+  for (i = 0; documents[i] != NULL; i++)
+    {
+      WockyXmppReader *reader;
+      GError *error = NULL;
+
+      reader = g_object_new (WOCKY_TYPE_XMPP_READER,
+          "native-tokenizer", TRUE,
+          NULL);
+      wocky_xmpp_reader_push (reader, (guint8 *) documents[i],
+          strlen (documents[i]));
+
+      g_assert (wocky_xmpp_reader_get_state (reader)
+        == WOCKY_XMPP_READER_STATE_ERROR);
+      error = wocky_xmpp_reader_get_error (reader);
+      g_assert_error (error, WOCKY_XMPP_READER_ERROR,
+          WOCKY_XMPP_READER_ERROR_PARSE_ERROR);
+
+      g_error_free (error);
+      g_object_unref (reader);
+    }
+}
+
+typedef struct
+{
+  const gchar *path;
+  GTestFunc func;
+} ReaderTest;
+
+static const ReaderTest reader_tests[] = {
+  { "stream-no-stanzas", test_stream_no_stanzas },
+  { "stream-open-error", test_stream_open_error },
+  { "stream-open-unqualified-lang", test_stream_open_unqualified_lang },
+  { "parse-error", test_parse_error },
+  { "reset-after-error", test_reset_after_error },
+  { "sm-fast-path", test_sm_fast_path },
+  { "filter", test_filter },
+  { "lazy-subtrees", test_lazy_subtrees },
+  { "limits", test_limits },
+  { "split-text", test_split_text },
+  { "content-sink", test_content_sink },
+  { "no-stream-hunks", test_no_stream_hunks },
+  { "no-stream-resetting", test_no_stream_reset },
+  { "vcard-namespace", test_vcard_namespace },
+  { "invalid-namespace", test_invalid_namespace },
+  { "whitespace-padding", test_whitespace_padding },
+  { "whitespace-only", test_whitespace_only },
+  { "utf-non-character-codepoints", test_non_character_codepoints },
+  { "no-stream-default-default-namespace",
+    test_no_stream_default_default_namespace },
+  { "no-stream-specified-default-namespace",
+    test_no_stream_specified_default_namespace },
+};
+
+static void
+run_native (gconstpointer data)
+{
+  const ReaderTest *test = data;
+
+  native = TRUE;
+  test->func ();
+  native = FALSE;
+}
+
 int
 main (int argc,
     char **argv)
 {
   int result;
+  guint i;
 
   test_init (argc, argv);
 
-  g_test_add_func ("/xmpp-reader/stream-no-stanzas", test_stream_no_stanzas);
-  g_test_add_func ("/xmpp-reader/stream-open-error", test_stream_open_error);
-  g_test_add_func ("/xmpp-reader/stream-open-unqualified-lang",
-      test_stream_open_unqualified_lang);
-  g_test_add_func ("/xmpp-reader/parse-error", test_parse_error);
-  g_test_add_func ("/xmpp-reader/no-stream-hunks", test_no_stream_hunks);
-  g_test_add_func ("/xmpp-reader/no-stream-resetting", test_no_stream_reset);
-  g_test_add_func ("/xmpp-reader/vcard-namespace", test_vcard_namespace);
-  g_test_add_func ("/xmpp-reader/invalid-namespace", test_invalid_namespace);
-  g_test_add_func ("/xmpp-reader/whitespace-padding", test_whitespace_padding);
-  g_test_add_func ("/xmpp-reader/whitespace-only", test_whitespace_only);
-  g_test_add_func ("/xmpp-reader/utf-non-character-codepoints",
-    test_non_character_codepoints);
-  g_test_add_func ("/xmpp-reader/no-stream-default-default-namespace",
-      test_no_stream_default_default_namespace);
-  g_test_add_func ("/xmpp-reader/no-stream-specified-default-namespace",
-      test_no_stream_specified_default_namespace);
+  for (i = 0; i < G_N_ELEMENTS (reader_tests); i++)
+    {
+      gchar *path = g_strdup_printf ("/xmpp-reader/%s",
+          reader_tests[i].path);
+
+      g_test_add_func (path, reader_tests[i].func);
+      g_free (path);
+
+      path = g_strdup_printf ("/xmpp-reader/native/%s", reader_tests[i].path);
+      g_test_add_data_func (path, &reader_tests[i], run_native);
+      g_free (path);
+    }
+
+  g_test_add_func ("/xmpp-reader/native/matches-libxml2",
+      test_native_matches_libxml2);
+  g_test_add_func ("/xmpp-reader/native/rejects", test_native_rejects);
 
   result = g_test_run ();
   test_deinit ();
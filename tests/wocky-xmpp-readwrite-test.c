@@ -202,6 +202,98 @@ test_readwrite_nostream (void)
   g_object_unref (writer);
 }
 
+static void
+test_readwrite_cached (void)
+{
+  WockyXmppReader *reader;
+  WockyXmppWriter *writer;
+  WockyXmppWriter *nostream_writer;
+  WockyStanza *received, *sent, *copy;
+  WockyNode *head;
+  const guint8 *data;
+  gsize length;
+  gchar *first;
+  gsize first_length;
+
+  writer = wocky_xmpp_writer_new ();
+  nostream_writer = wocky_xmpp_writer_new_no_stream ();
+  reader = wocky_xmpp_reader_new ();
+
+  wocky_xmpp_writer_stream_open (writer, TO, FROM, XMPP_VERSION, LANG, NULL,
+      &data, &length);
+  wocky_xmpp_reader_push (reader, data, length);
+
+  /* Only stanzas about to be written more than once keep what was made of
+   * them */
+  sent = create_stanza ();
+  wocky_stanza_hold_serialization (sent);
+
+  wocky_xmpp_writer_write_stanza (writer, sent, &data, &length);
+  first = g_strndup ((const gchar *) data, length);
+  first_length = length;
+
+  /* Written again as it was */
+  wocky_xmpp_writer_write_stanza (writer, sent, &data, &length);
+  g_assert_cmpuint (length, ==, first_length);
+  g_assert (memcmp (data, first, length) == 0);
+
+  /* A writer in another state doesn't get what the first one wrote */
+  wocky_xmpp_writer_write_stanza (nostream_writer, sent, &data, &length);
+  g_assert (g_str_has_prefix ((const gchar *) data, "<?xml"));
+
+  wocky_xmpp_writer_write_stanza (writer, sent, &data, &length);
+  g_assert_cmpuint (length, ==, first_length);
+  g_assert (memcmp (data, first, length) == 0);
+
+  /* A copy is written as the original */
+  copy = wocky_stanza_copy (sent);
+  wocky_stanza_hold_serialization (copy);
+  wocky_xmpp_writer_write_stanza (writer, copy, &data, &length);
+  g_assert_cmpuint (length, ==, first_length);
+  g_assert (memcmp (data, first, length) == 0);
+
+  /* Changing a node deep down is seen */
+  head = wocky_node_get_child (
+      wocky_node_get_child (wocky_stanza_get_top_node (sent), "html"),
+      "head");
+  wocky_node_set_attribute_ns (head, "rev", "0xdecafbad", DUMMY_NS);
+
+  wocky_xmpp_writer_write_stanza (writer, sent, &data, &length);
+  g_assert (length != first_length || memcmp (data, first, length) != 0);
+  wocky_xmpp_reader_push (reader, data, length);
+
+  received = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (received != NULL);
+  test_assert_stanzas_equal (sent, received);
+  g_object_unref (received);
+
+  /* while the copy stays as it was */
+  wocky_xmpp_writer_write_stanza (writer, copy, &data, &length);
+  g_assert_cmpuint (length, ==, first_length);
+  g_assert (memcmp (data, first, length) == 0);
+
+  /* What was written stays valid after the stanza is gone */
+  wocky_stanza_release_serialization (copy);
+  g_object_unref (copy);
+  wocky_xmpp_reader_push (reader, data, length);
+
+  received = wocky_xmpp_reader_pop_stanza (reader);
+  g_assert (received != NULL);
+  head = wocky_node_get_child (
+      wocky_node_get_child (wocky_stanza_get_top_node (received), "html"),
+      "head");
+  g_assert_cmpstr (wocky_node_get_attribute_ns (head, "rev", DUMMY_NS), ==,
+      "0xbad1dea");
+  g_object_unref (received);
+
+  g_free (first);
+  wocky_stanza_release_serialization (sent);
+  g_object_unref (sent);
+  g_object_unref (reader);
+  g_object_unref (nostream_writer);
+  g_object_unref (writer);
+}
+
 int
 main (int argc,
     char **argv)
@@ -213,6 +305,8 @@ main (int argc,
   g_test_add_func ("/xmpp-readwrite/readwrite", test_readwrite);
   g_test_add_func ("/xmpp-readwrite/readwrite-nostream",
     test_readwrite_nostream);
+  g_test_add_func ("/xmpp-readwrite/readwrite-cached",
+    test_readwrite_cached);
 
   result = g_test_run ();
   test_deinit ();
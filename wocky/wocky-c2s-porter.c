@@ -48,7 +48,10 @@
 #include "wocky-utils.h"
 #include "wocky-namespaces.h"
 #include "wocky-contact-factory.h"
+#include "wocky-node-private.h"
 #include "wocky-sm.h"
+#include "wocky-signals-marshal.h"
+#include "wocky-timer-wheel.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_PORTER
 #include "wocky-debug-internal.h"
@@ -66,8 +69,54 @@ enum
   PROP_FULL_JID,
   PROP_BARE_JID,
   PROP_RESOURCE,
+  PROP_IQ_TIMEOUT,
+  PROP_HIGH_WATER_BYTES,
+  PROP_LOW_WATER_BYTES,
+  PROP_HIGH_WATER_STANZAS,
+  PROP_LOW_WATER_STANZAS,
+  PROP_CONGESTED,
+  PROP_DEFER_SENDS,
 };
 
+/* signals */
+enum
+{
+  SEND_FAILED,
+  LAST_SIGNAL,
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+#define N_LANES WOCKY_C2S_PORTER_LANE_AUTO
+
+/* How many stanzas each lane may send in a round before giving way to the
+ * lanes below it. The control lane is not scheduled: it always goes first. */
+static const guint lane_weights[N_LANES] = { 0, 4, 2, 1 };
+
+/* A stanza waiting to be sent */
+typedef struct
+{
+  /* owned */
+  WockyStanza *stanza;
+  /* The pending send operation, or NULL if nobody is waiting for the
+   * stanza to be sent (see wocky_c2s_porter_send()) */
+  struct _sending_queue_elem *elem;
+  /* Estimated size of stanza, for the water marks */
+  guint size;
+  WockyC2SPorterLane lane;
+} sending_entry;
+
+/* A growable circular buffer of sending_entry, much cheaper than a GQueue
+ * when a lot of stanzas are sent in a row */
+typedef struct
+{
+  sending_entry *entries;
+  /* A power of 2, or 0 if entries has not been allocated yet */
+  guint capacity;
+  guint head;
+  guint length;
+} sending_ring;
+
 /* private structure */
 struct _WockyC2SPorterPrivate
 {
@@ -79,8 +128,27 @@ struct _WockyC2SPorterPrivate
   gchar *resource;
   gchar *domain;
 
-  /* Queue of (sending_queue_elem *) */
-  GQueue *sending_queue;
+  /* One ring of stanzas to send per WockyC2SPorterLane */
+  sending_ring sending_lanes[N_LANES];
+  /* Remaining weighted round-robin credits of each lane */
+  guint lane_credits[N_LANES];
+  /* The stanza being written to the connection, if any (that is, if
+   * sending.stanza is not NULL) */
+  sending_entry sending;
+
+  /* Stanzas (and their estimated size) in sending_lanes and sending */
+  guint queued_stanzas;
+  gsize queued_bytes;
+  /* Water marks on the above; a high water mark of 0 disables it */
+  guint high_water_bytes;
+  guint low_water_bytes;
+  guint high_water_stanzas;
+  guint low_water_stanzas;
+  gboolean congested;
+  /* If set, stanzas sent while above the high water mark wait in
+   * deferred_queue, outside the lanes, until the porter drains */
+  gboolean defer_sends;
+  sending_ring deferred_queue;
   GCancellable *receive_cancellable;
   gboolean sending_whitespace_ping;
 
@@ -100,6 +168,9 @@ struct _WockyC2SPorterPrivate
   /* (const gchar *) => owned (StanzaIqHandler *)
    * This key is the ID of the IQ */
   GHashTable *iq_reply_handlers;
+  /* Deadlines of the IQs in iq_reply_handlers */
+  WockyTimerWheel *iq_timers;
+  guint iq_timeout;
 
   gboolean power_saving_mode;
   /* Queue of (owned WockyStanza *) */
@@ -112,10 +183,12 @@ struct _WockyC2SPorterPrivate
   WockySM *sm;
 };
 
-typedef struct
+/* The state of a send operation which has to be completed */
+typedef struct _sending_queue_elem
 {
   WockyC2SPorter *self;
-  WockyStanza *stanza;
+  WockyC2SPorterLane lane;
+  gboolean deferred;
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
   gulong cancelled_sig_id;
@@ -127,7 +200,7 @@ static void wocky_c2s_porter_send_async (WockyPorter *porter,
 
 static sending_queue_elem *
 sending_queue_elem_new (WockyC2SPorter *self,
-  WockyStanza *stanza,
+  WockyC2SPorterLane lane,
   GCancellable *cancellable,
   GAsyncReadyCallback callback,
   gpointer user_data)
@@ -135,7 +208,7 @@ sending_queue_elem_new (WockyC2SPorter *self,
   sending_queue_elem *elem = g_slice_new0 (sending_queue_elem);
 
   elem->self = self;
-  elem->stanza = g_object_ref (stanza);
+  elem->lane = lane;
   if (cancellable != NULL)
     elem->cancellable = g_object_ref (cancellable);
 
@@ -148,7 +221,6 @@ sending_queue_elem_new (WockyC2SPorter *self,
 static void
 sending_queue_elem_free (sending_queue_elem *elem)
 {
-  g_object_unref (elem->stanza);
   if (elem->cancellable != NULL)
     {
       g_object_unref (elem->cancellable);
@@ -162,6 +234,131 @@ sending_queue_elem_free (sending_queue_elem *elem)
   g_slice_free (sending_queue_elem, elem);
 }
 
+static void
+sending_entry_init (WockyC2SPorter *self,
+    sending_entry *entry,
+    WockyStanza *stanza,
+    WockyC2SPorterLane lane,
+    sending_queue_elem *elem)
+{
+  entry->stanza = g_object_ref (stanza);
+  entry->elem = elem;
+  entry->size = 0;
+  entry->lane = lane;
+
+  /* Estimating the size walks the whole stanza: only worth it if there is
+   * a mark to compare it with */
+  if (self->priv->high_water_bytes > 0)
+    {
+      gsize size = _wocky_node_estimate_size (
+          wocky_stanza_get_top_node (stanza));
+
+      entry->size = MIN (size, G_MAXUINT);
+    }
+}
+
+static void
+sending_entry_clear (sending_entry *entry)
+{
+  if (entry->elem != NULL)
+    sending_queue_elem_free (entry->elem);
+
+  g_object_unref (entry->stanza);
+  memset (entry, 0, sizeof (sending_entry));
+}
+
+static gboolean
+sending_ring_is_empty (sending_ring *ring)
+{
+  return ring->length == 0;
+}
+
+static void
+sending_ring_push_tail (sending_ring *ring,
+    const sending_entry *entry)
+{
+  if (ring->length == ring->capacity)
+    {
+      guint old_capacity = ring->capacity;
+
+      ring->capacity = MAX (old_capacity * 2, 16);
+      ring->entries = g_renew (sending_entry, ring->entries, ring->capacity);
+
+      /* Unwrap the entries which were at the start of the old buffer */
+      if (ring->head + ring->length > old_capacity)
+        {
+          guint wrapped = ring->head + ring->length - old_capacity;
+
+          memcpy (ring->entries + old_capacity, ring->entries,
+              wrapped * sizeof (sending_entry));
+        }
+    }
+
+  ring->entries[(ring->head + ring->length) & (ring->capacity - 1)] = *entry;
+  ring->length++;
+}
+
+static gboolean
+sending_ring_pop_head (sending_ring *ring,
+    sending_entry *entry)
+{
+  if (ring->length == 0)
+    return FALSE;
+
+  *entry = ring->entries[ring->head];
+  ring->head = (ring->head + 1) & (ring->capacity - 1);
+  ring->length--;
+
+  return TRUE;
+}
+
+/* Remove the entry of @elem from @ring; this is O(n), but only happens when
+ * a send operation is cancelled */
+static gboolean
+sending_ring_steal_elem (sending_ring *ring,
+    sending_queue_elem *elem,
+    sending_entry *entry)
+{
+  guint mask = ring->capacity - 1;
+  guint i;
+
+  for (i = 0; i < ring->length; i++)
+    {
+      if (ring->entries[(ring->head + i) & mask].elem != elem)
+        continue;
+
+      *entry = ring->entries[(ring->head + i) & mask];
+
+      for (; i + 1 < ring->length; i++)
+        ring->entries[(ring->head + i) & mask] =
+            ring->entries[(ring->head + i + 1) & mask];
+
+      ring->length--;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Only used in finalize: stanzas nobody waits for may still be queued, but
+ * pending operations keep the porter alive */
+static void
+sending_ring_clear (sending_ring *ring)
+{
+  sending_entry entry;
+
+  while (sending_ring_pop_head (ring, &entry))
+    {
+      g_assert (entry.elem == NULL);
+      sending_entry_clear (&entry);
+    }
+
+  g_free (ring->entries);
+  ring->entries = NULL;
+  ring->capacity = 0;
+  ring->head = 0;
+}
+
 typedef enum {
     MATCH_ANYONE,
     MATCH_SERVER,
@@ -245,6 +442,7 @@ typedef struct
   gchar *recipient;
   gchar *id;
   gboolean sent;
+  WockyTimer *timer;
 } StanzaIqHandler;
 
 static StanzaIqHandler *
@@ -295,6 +493,17 @@ stanza_iq_handler_remove_cancellable (StanzaIqHandler *handler)
     }
 }
 
+static void
+stanza_iq_handler_remove_timer (StanzaIqHandler *handler)
+{
+  if (handler->timer != NULL)
+    {
+      wocky_timer_wheel_remove (handler->self->priv->iq_timers,
+          handler->timer);
+      handler->timer = NULL;
+    }
+}
+
 static void
 stanza_iq_handler_free (StanzaIqHandler *handler)
 {
@@ -302,6 +511,7 @@ stanza_iq_handler_free (StanzaIqHandler *handler)
     g_object_unref (handler->result);
 
   stanza_iq_handler_remove_cancellable (handler);
+  stanza_iq_handler_remove_timer (handler);
 
   g_free (handler->id);
   g_free (handler->recipient);
@@ -342,8 +552,6 @@ wocky_c2s_porter_init (WockyC2SPorter *self)
       WockyC2SPorterPrivate);
   priv = self->priv;
 
-  priv->sending_queue = g_queue_new ();
-
   priv->handlers_by_id = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) stanza_handler_free);
   /* these are guints, reserve 0 for "not a valid handler" */
@@ -354,12 +562,14 @@ wocky_c2s_porter_init (WockyC2SPorter *self)
 
   priv->iq_reply_handlers = g_hash_table_new_full (g_str_hash, g_str_equal,
       NULL, (GDestroyNotify) stanza_iq_handler_free);
+  priv->iq_timers = wocky_timer_wheel_new (WOCKY_TIMER_WHEEL_DEFAULT_TICK);
 
   priv->sm = NULL;
 }
 
 static void wocky_c2s_porter_dispose (GObject *object);
 static void wocky_c2s_porter_finalize (GObject *object);
+static void water_marks_changed (WockyC2SPorter *self);
 
 static void
 wocky_c2s_porter_set_property (GObject *object,
@@ -393,6 +603,35 @@ wocky_c2s_porter_set_property (GObject *object,
         g_free (node);
         break;
 
+      case PROP_IQ_TIMEOUT:
+        priv->iq_timeout = g_value_get_uint (value);
+        break;
+
+      case PROP_HIGH_WATER_BYTES:
+        priv->high_water_bytes = g_value_get_uint (value);
+        water_marks_changed (connection);
+        break;
+
+      case PROP_LOW_WATER_BYTES:
+        priv->low_water_bytes = g_value_get_uint (value);
+        water_marks_changed (connection);
+        break;
+
+      case PROP_HIGH_WATER_STANZAS:
+        priv->high_water_stanzas = g_value_get_uint (value);
+        water_marks_changed (connection);
+        break;
+
+      case PROP_LOW_WATER_STANZAS:
+        priv->low_water_stanzas = g_value_get_uint (value);
+        water_marks_changed (connection);
+        break;
+
+      case PROP_DEFER_SENDS:
+        priv->defer_sends = g_value_get_boolean (value);
+        water_marks_changed (connection);
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -427,6 +666,34 @@ wocky_c2s_porter_get_property (GObject *object,
         g_value_set_string (value, priv->resource);
         break;
 
+      case PROP_IQ_TIMEOUT:
+        g_value_set_uint (value, priv->iq_timeout);
+        break;
+
+      case PROP_HIGH_WATER_BYTES:
+        g_value_set_uint (value, priv->high_water_bytes);
+        break;
+
+      case PROP_LOW_WATER_BYTES:
+        g_value_set_uint (value, priv->low_water_bytes);
+        break;
+
+      case PROP_HIGH_WATER_STANZAS:
+        g_value_set_uint (value, priv->high_water_stanzas);
+        break;
+
+      case PROP_LOW_WATER_STANZAS:
+        g_value_set_uint (value, priv->low_water_stanzas);
+        break;
+
+      case PROP_CONGESTED:
+        g_value_set_boolean (value, priv->congested);
+        break;
+
+      case PROP_DEFER_SENDS:
+        g_value_set_boolean (value, priv->defer_sends);
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -490,6 +757,7 @@ wocky_c2s_porter_class_init (
     WockyC2SPorterClass *wocky_c2s_porter_class)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (wocky_c2s_porter_class);
+  GParamSpec *spec;
 
   g_type_class_add_private (wocky_c2s_porter_class,
       sizeof (WockyC2SPorterPrivate));
@@ -508,6 +776,120 @@ wocky_c2s_porter_class_init (
       PROP_BARE_JID, "bare-jid");
   g_object_class_override_property (object_class,
       PROP_RESOURCE, "resource");
+
+  /**
+   * WockyC2SPorter:iq-timeout:
+   *
+   * The default deadline, in milliseconds, applied to IQs sent with
+   * wocky_porter_send_iq_async(). If no reply has been received once it
+   * has elapsed, the operation fails with %WOCKY_PORTER_ERROR_TIMED_OUT and
+   * a reply arriving later is treated as unsolicited. 0 (the default) means
+   * IQs never time out.
+   */
+  spec = g_param_spec_uint ("iq-timeout", "IQ timeout",
+      "Default IQ reply deadline in milliseconds, or 0 for none",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_IQ_TIMEOUT, spec);
+
+  /**
+   * WockyC2SPorter:high-water-bytes:
+   *
+   * Once the stanzas waiting to be sent add up to this many bytes (as
+   * estimated before serialization), the porter becomes
+   * #WockyC2SPorter:congested. 0, the default, means no limit. Sizes are
+   * only estimated while a limit is set, so stanzas queued before it was
+   * set don't count towards it.
+   */
+  spec = g_param_spec_uint ("high-water-bytes", "High water mark (bytes)",
+      "Queued bytes above which the porter is congested, or 0",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HIGH_WATER_BYTES, spec);
+
+  /**
+   * WockyC2SPorter:low-water-bytes:
+   *
+   * A #WockyC2SPorter:congested porter stops being congested once the
+   * stanzas waiting to be sent add up to no more than this many bytes, and
+   * no more than #WockyC2SPorter:low-water-stanzas stanzas are waiting.
+   */
+  spec = g_param_spec_uint ("low-water-bytes", "Low water mark (bytes)",
+      "Queued bytes below which the porter is no longer congested",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LOW_WATER_BYTES, spec);
+
+  /**
+   * WockyC2SPorter:high-water-stanzas:
+   *
+   * Once this many stanzas are waiting to be sent, the porter becomes
+   * #WockyC2SPorter:congested. 0, the default, means no limit.
+   */
+  spec = g_param_spec_uint ("high-water-stanzas", "High water mark (stanzas)",
+      "Queued stanzas above which the porter is congested, or 0",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_HIGH_WATER_STANZAS,
+      spec);
+
+  /**
+   * WockyC2SPorter:low-water-stanzas:
+   *
+   * A #WockyC2SPorter:congested porter stops being congested once no more
+   * than this many stanzas are waiting to be sent, and no more than
+   * #WockyC2SPorter:low-water-bytes bytes.
+   */
+  spec = g_param_spec_uint ("low-water-stanzas", "Low water mark (stanzas)",
+      "Queued stanzas below which the porter is no longer congested",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LOW_WATER_STANZAS,
+      spec);
+
+  /**
+   * WockyC2SPorter:congested:
+   *
+   * %TRUE if one of the high water marks has been reached and the porter
+   * has not drained down to its low water marks yet. Producers should
+   * connect to #GObject::notify for this property and stop sending until it
+   * goes back to %FALSE.
+   */
+  spec = g_param_spec_boolean ("congested", "Congested",
+      "Whether too much data is waiting to be sent",
+      FALSE,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_CONGESTED, spec);
+
+  /**
+   * WockyC2SPorter:defer-sends:
+   *
+   * If %TRUE, stanzas sent while a high water mark is reached are not
+   * queued for sending (and their send operation doesn't complete) until
+   * the porter is back below its high water marks. Stream management
+   * stanzas are never deferred.
+   */
+  spec = g_param_spec_boolean ("defer-sends", "Defer sends",
+      "Hold back new stanzas while above the high water mark",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DEFER_SENDS, spec);
+
+  /**
+   * WockyC2SPorter::send-failed:
+   * @porter: the object on which the signal is emitted
+   * @stanza: the #WockyStanza which could not be sent
+   * @error: the reason of the failure
+   *
+   * Emitted when a stanza queued with wocky_c2s_porter_send() (or
+   * wocky_porter_send()) could not be sent. Failures of
+   * wocky_porter_send_async() are reported to its callback instead.
+   */
+  signals[SEND_FAILED] = g_signal_new ("send-failed",
+      G_OBJECT_CLASS_TYPE (wocky_c2s_porter_class),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+      _wocky_signals_marshal_VOID__OBJECT_BOXED,
+      G_TYPE_NONE, 2, WOCKY_TYPE_STANZA, G_TYPE_ERROR);
 }
 
 void
@@ -524,6 +906,7 @@ wocky_c2s_porter_dispose (GObject *object)
 
   if (priv->connection != NULL)
     {
+      wocky_xmpp_connection_set_sm_func (priv->connection, NULL, NULL);
       g_object_unref (priv->connection);
       priv->connection = NULL;
     }
@@ -576,18 +959,23 @@ wocky_c2s_porter_finalize (GObject *object)
   WockyC2SPorter *self = WOCKY_C2S_PORTER (object);
   WockyC2SPorterPrivate *priv =
       self->priv;
+  guint i;
 
   DEBUG ("finalize porter %p", self);
 
   /* sending_queue_elem keeps a ref on the Porter (through the
    * GSimpleAsyncResult) so it shouldn't be destroyed while there are
    * elements in the queue. */
-  g_assert_cmpuint (g_queue_get_length (priv->sending_queue), ==, 0);
-  g_queue_free (priv->sending_queue);
+  g_assert (priv->sending.stanza == NULL);
+  sending_ring_clear (&priv->deferred_queue);
+  for (i = 0; i < N_LANES; i++)
+    sending_ring_clear (&priv->sending_lanes[i]);
 
   g_hash_table_unref (priv->handlers_by_id);
   g_list_free (priv->handlers);
   g_hash_table_unref (priv->iq_reply_handlers);
+  /* Must outlive iq_reply_handlers, which disarm their timers when freed */
+  wocky_timer_wheel_free (priv->iq_timers);
 
   g_queue_free (priv->unimportant_queue);
 
@@ -622,18 +1010,195 @@ wocky_c2s_porter_new (WockyXmppConnection *connection,
     NULL);
 }
 
+/* The lane of stanzas sent without choosing one: the normal lane, so that
+ * they go out in the order they were sent in. Stream management's own
+ * requests and acks aren't stanzas, and don't need to wait behind them. */
+static WockyC2SPorterLane
+default_lane (WockyStanza *stanza)
+{
+  WockyStanzaType type;
+
+  wocky_stanza_get_type_info (stanza, &type, NULL);
+
+  if (type == WOCKY_STANZA_TYPE_SM_R || type == WOCKY_STANZA_TYPE_SM_A)
+    return WOCKY_C2S_PORTER_LANE_CONTROL;
+
+  return WOCKY_C2S_PORTER_LANE_NORMAL;
+}
+
+static WockyC2SPorterLane
+pick_lane (WockyStanza *stanza)
+{
+  WockyStanzaType type;
+  WockyStanzaSubType sub_type;
+
+  wocky_stanza_get_type_info (stanza, &type, &sub_type);
+
+  if (type == WOCKY_STANZA_TYPE_SM_R || type == WOCKY_STANZA_TYPE_SM_A)
+    return WOCKY_C2S_PORTER_LANE_CONTROL;
+
+  if (type == WOCKY_STANZA_TYPE_IQ &&
+      (sub_type == WOCKY_STANZA_SUB_TYPE_RESULT ||
+       sub_type == WOCKY_STANZA_SUB_TYPE_ERROR))
+    return WOCKY_C2S_PORTER_LANE_INTERACTIVE;
+
+  return WOCKY_C2S_PORTER_LANE_NORMAL;
+}
+
+/* Weighted round-robin between the lanes, preserving the order within each
+ * lane */
+static gboolean
+pop_next_entry (WockyC2SPorter *self,
+    sending_entry *entry)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+  guint round, i;
+
+  if (sending_ring_pop_head (
+          &priv->sending_lanes[WOCKY_C2S_PORTER_LANE_CONTROL], entry))
+    return TRUE;
+
+  for (round = 0; round < 2; round++)
+    {
+      for (i = WOCKY_C2S_PORTER_LANE_INTERACTIVE; i < N_LANES; i++)
+        {
+          if (priv->lane_credits[i] > 0 &&
+              sending_ring_pop_head (&priv->sending_lanes[i], entry))
+            {
+              priv->lane_credits[i]--;
+              return TRUE;
+            }
+        }
+
+      /* Every lane with something to send has used its share; start a new
+       * round */
+      for (i = 0; i < N_LANES; i++)
+        priv->lane_credits[i] = lane_weights[i];
+    }
+
+  return FALSE;
+}
+
+static gboolean
+above_high_water (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  return (priv->high_water_stanzas > 0 &&
+          priv->queued_stanzas >= priv->high_water_stanzas) ||
+      (priv->high_water_bytes > 0 &&
+          priv->queued_bytes >= priv->high_water_bytes);
+}
+
+static gboolean
+below_low_water (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  /* Only the marks of the limits which are enabled matter */
+  return (priv->high_water_stanzas == 0 ||
+          priv->queued_stanzas <= priv->low_water_stanzas) &&
+      (priv->high_water_bytes == 0 ||
+          priv->queued_bytes <= priv->low_water_bytes);
+}
+
+static void
+update_congestion (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+  gboolean congested = priv->congested;
+
+  if (!congested && above_high_water (self))
+    congested = TRUE;
+  else if (congested && !above_high_water (self) && below_low_water (self))
+    congested = FALSE;
+
+  if (congested == priv->congested)
+    return;
+
+  DEBUG ("porter is %s (%u stanzas, %" G_GSIZE_FORMAT " bytes queued)",
+      congested ? "congested" : "writable again", priv->queued_stanzas,
+      priv->queued_bytes);
+
+  priv->congested = congested;
+  g_object_notify (G_OBJECT (self), "congested");
+}
+
+static void
+account_entry (WockyC2SPorter *self,
+    const sending_entry *entry,
+    gboolean queued)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  if (queued)
+    {
+      priv->queued_stanzas++;
+      priv->queued_bytes += entry->size;
+    }
+  else
+    {
+      g_assert (priv->queued_stanzas > 0);
+      g_assert (priv->queued_bytes >= entry->size);
+
+      priv->queued_stanzas--;
+      priv->queued_bytes -= entry->size;
+    }
+}
+
+/* Report the failure of a send operation to whoever is waiting for it, or
+ * through WockyC2SPorter::send-failed if nobody is. Consumes @entry. */
+static void
+fail_entry (WockyC2SPorter *self,
+    sending_entry *entry,
+    const GError *error)
+{
+  if (entry->elem != NULL)
+    {
+      g_simple_async_result_set_from_error (entry->elem->result, error);
+      g_simple_async_result_complete (entry->elem->result);
+    }
+  else
+    {
+      g_signal_emit (self, signals[SEND_FAILED], 0, entry->stanza, error);
+    }
+
+  sending_entry_clear (entry);
+}
+
+static gboolean
+sending_queue_is_empty (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+  guint i;
+
+  for (i = 0; i < N_LANES; i++)
+    {
+      if (!sending_ring_is_empty (&priv->sending_lanes[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 send_head_stanza (WockyC2SPorter *self)
 {
   WockyC2SPorterPrivate *priv = self->priv;
   sending_queue_elem *elem;
+  WockyStanza *stanza;
+  gboolean counted;
+
+  g_assert (priv->sending.stanza == NULL);
 
-  elem = g_queue_peek_head (priv->sending_queue);
-  if (elem == NULL)
+  if (!pop_next_entry (self, &priv->sending))
     /* Nothing to send */
     return;
 
-  if (elem->cancelled_sig_id != 0)
+  elem = priv->sending.elem;
+  stanza = priv->sending.stanza;
+
+  if (elem != NULL && elem->cancelled_sig_id != 0)
     {
       /* We are going to start sending the stanza. Lower layers are now
        * responsible of handling the cancellable. */
@@ -641,10 +1206,27 @@ send_head_stanza (WockyC2SPorter *self)
       elem->cancelled_sig_id = 0;
     }
 
+  counted = priv->sm != NULL &&
+      !wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_SM_R) &&
+      !wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_SM_A);
+
+  /* A counted stanza is written again on the next connection if this one is
+   * lost before the server acknowledges it; the hold is released by
+   * wocky_sm_ack() */
+  if (counted)
+    wocky_stanza_hold_serialization (stanza);
+
   wocky_xmpp_connection_send_stanza_async (priv->connection,
-      elem->stanza, elem->cancellable, send_stanza_cb, g_object_ref (self));
+      stanza, elem != NULL ? elem->cancellable : NULL, send_stanza_cb,
+      g_object_ref (self));
+
+  g_signal_emit_by_name (self, "sending", stanza);
 
-  g_signal_emit_by_name (self, "sending", elem->stanza);
+  /* Stanzas are counted in the order they hit the wire, which is not the
+   * order they were queued in. The <r/> this queues goes out next, through
+   * the control lane. */
+  if (counted)
+    wocky_sm_request_for_stanza (priv->sm, stanza);
 }
 
 static void
@@ -652,16 +1234,32 @@ terminate_sending_operations (WockyC2SPorter *self,
     GError *error)
 {
   WockyC2SPorterPrivate *priv = self->priv;
-  sending_queue_elem *elem;
+  sending_entry entry;
+  guint i;
 
   g_return_if_fail (error != NULL);
 
-  while ((elem = g_queue_pop_head (priv->sending_queue)))
+  if (priv->sending.stanza != NULL)
     {
-      g_simple_async_result_set_from_error (elem->result, error);
-      g_simple_async_result_complete (elem->result);
-      sending_queue_elem_free (elem);
+      entry = priv->sending;
+      memset (&priv->sending, 0, sizeof (sending_entry));
+      account_entry (self, &entry, FALSE);
+      fail_entry (self, &entry, error);
+    }
+
+  for (i = 0; i < N_LANES; i++)
+    {
+      while (sending_ring_pop_head (&priv->sending_lanes[i], &entry))
+        {
+          account_entry (self, &entry, FALSE);
+          fail_entry (self, &entry, error);
+        }
     }
+
+  while (sending_ring_pop_head (&priv->deferred_queue, &entry))
+    fail_entry (self, &entry, error);
+
+  update_congestion (self);
 }
 
 static gboolean
@@ -669,10 +1267,43 @@ sending_in_progress (WockyC2SPorter *self)
 {
   WockyC2SPorterPrivate *priv = self->priv;
 
-  return g_queue_get_length (priv->sending_queue) > 0 ||
+  return priv->sending.stanza != NULL ||
+    !sending_queue_is_empty (self) ||
+    !sending_ring_is_empty (&priv->deferred_queue) ||
     priv->sending_whitespace_ping;
 }
 
+/* Move deferred stanzas to their lane while there is room; the caller is
+ * responsible for kicking the sending of the queue */
+static void
+admit_deferred (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+  sending_entry entry;
+
+  while ((!priv->defer_sends || !above_high_water (self)) &&
+      sending_ring_pop_head (&priv->deferred_queue, &entry))
+    {
+      if (entry.elem != NULL)
+        entry.elem->deferred = FALSE;
+
+      sending_ring_push_tail (&priv->sending_lanes[entry.lane], &entry);
+      account_entry (self, &entry, TRUE);
+    }
+}
+
+static void
+water_marks_changed (WockyC2SPorter *self)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  admit_deferred (self);
+  update_congestion (self);
+
+  if (priv->sending.stanza == NULL && !priv->sending_whitespace_ping)
+    send_head_stanza (self);
+}
+
 static void
 close_if_waiting (WockyC2SPorter *self)
 {
@@ -705,23 +1336,27 @@ send_stanza_cb (GObject *source,
     }
   else
     {
-      sending_queue_elem *elem = g_queue_pop_head (priv->sending_queue);
+      sending_entry entry = priv->sending;
 
-      if (elem == NULL)
+      if (entry.stanza == NULL)
         /* The elem could have been removed from the queue if its sending
          * operation has already been completed (for example by forcing to
          * close the connection). */
         return;
 
-      g_simple_async_result_complete (elem->result);
+      memset (&priv->sending, 0, sizeof (sending_entry));
+      account_entry (self, &entry, FALSE);
+      admit_deferred (self);
+      update_congestion (self);
 
-      sending_queue_elem_free (elem);
+      if (entry.elem != NULL)
+        g_simple_async_result_complete (entry.elem->result);
 
-      if (g_queue_get_length (priv->sending_queue) > 0)
-        {
-          /* Send next stanza */
-          send_head_stanza (self);
-        }
+      sending_entry_clear (&entry);
+
+      /* Send next stanza, unless the callback already did */
+      if (priv->sending.stanza == NULL)
+        send_head_stanza (self);
     }
 
   close_if_waiting (self);
@@ -734,14 +1369,61 @@ send_cancelled_cb (GCancellable *cancellable,
     gpointer user_data)
 {
   sending_queue_elem *elem = (sending_queue_elem *) user_data;
-  WockyC2SPorterPrivate *priv = elem->self->priv;
+  WockyC2SPorter *self = elem->self;
+  WockyC2SPorterPrivate *priv = self->priv;
   GError error = { G_IO_ERROR, G_IO_ERROR_CANCELLED, "Sending was cancelled" };
+  sending_entry entry;
 
   g_simple_async_result_set_from_error (elem->result, &error);
   g_simple_async_result_complete_in_idle (elem->result);
 
-  g_queue_remove (priv->sending_queue, elem);
-  sending_queue_elem_free (elem);
+  if (elem->deferred)
+    {
+      if (!sending_ring_steal_elem (&priv->deferred_queue, elem, &entry))
+        g_assert_not_reached ();
+    }
+  else
+    {
+      if (!sending_ring_steal_elem (&priv->sending_lanes[elem->lane], elem,
+              &entry))
+        g_assert_not_reached ();
+
+      account_entry (self, &entry, FALSE);
+      admit_deferred (self);
+      update_congestion (self);
+    }
+
+  /* Frees elem as well */
+  sending_entry_clear (&entry);
+}
+
+/* Queue @entry, or defer it; returns %TRUE if the caller should start
+ * sending it right away */
+static gboolean
+queue_entry (WockyC2SPorter *self,
+    sending_entry *entry)
+{
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  /* Stanzas can't overtake the ones deferred before them, except for
+   * stream-level ones which must not wait */
+  if (priv->defer_sends && entry->lane != WOCKY_C2S_PORTER_LANE_CONTROL &&
+      (above_high_water (self) ||
+       !sending_ring_is_empty (&priv->deferred_queue)))
+    {
+      DEBUG ("above the high water mark; deferring stanza");
+      if (entry->elem != NULL)
+        entry->elem->deferred = TRUE;
+
+      sending_ring_push_tail (&priv->deferred_queue, entry);
+      return FALSE;
+    }
+
+  sending_ring_push_tail (&priv->sending_lanes[entry->lane], entry);
+  account_entry (self, entry, TRUE);
+  update_congestion (self);
+
+  return priv->sending.stanza == NULL && !priv->sending_whitespace_ping;
 }
 
 static void
@@ -751,9 +1433,45 @@ wocky_c2s_porter_send_async (WockyPorter *porter,
     GAsyncReadyCallback callback,
     gpointer user_data)
 {
-  WockyC2SPorter *self = WOCKY_C2S_PORTER (porter);
-  WockyC2SPorterPrivate *priv = self->priv;
+  wocky_c2s_porter_send_in_lane_async (WOCKY_C2S_PORTER (porter), stanza,
+      default_lane (stanza), cancellable, callback, user_data);
+}
+
+/**
+ * wocky_c2s_porter_send_in_lane_async:
+ * @self: a #WockyC2SPorter
+ * @stanza: the #WockyStanza to send
+ * @lane: the #WockyC2SPorterLane to queue @stanza in
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @callback: callback to call when the request is satisfied
+ * @user_data: the data to pass to callback function
+ *
+ * Like wocky_porter_send_async(), but lets the caller choose the lane
+ * @stanza is queued in. Lanes are served by a weighted round-robin so that,
+ * for instance, a reply to an IQ doesn't wait behind a long burst of bulk
+ * messages, while the bulk lane still makes progress. Stanzas of the same lane
+ * are sent in the order they were queued in. wocky_porter_send_async() puts
+ * every stanza in the normal lane, so that they keep the order they were sent
+ * in.
+ *
+ * Call wocky_porter_send_finish() to get the result of the operation.
+ */
+void
+wocky_c2s_porter_send_in_lane_async (WockyC2SPorter *self,
+    WockyStanza *stanza,
+    WockyC2SPorterLane lane,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  WockyC2SPorterPrivate *priv;
   sending_queue_elem *elem;
+  sending_entry entry;
+
+  g_return_if_fail (WOCKY_IS_C2S_PORTER (self));
+  g_return_if_fail (lane <= WOCKY_C2S_PORTER_LANE_AUTO);
+
+  priv = self->priv;
 
   if (priv->close_result != NULL || priv->force_close_result != NULL)
     {
@@ -764,29 +1482,65 @@ wocky_c2s_porter_send_async (WockyPorter *porter,
       return;
     }
 
-  elem = sending_queue_elem_new (self, stanza, cancellable, callback,
+  if (lane == WOCKY_C2S_PORTER_LANE_AUTO)
+    lane = pick_lane (stanza);
+
+  elem = sending_queue_elem_new (self, lane, cancellable, callback,
       user_data);
-  g_queue_push_tail (priv->sending_queue, elem);
+  sending_entry_init (self, &entry, stanza, lane, elem);
 
-  if (g_queue_get_length (priv->sending_queue) == 1 &&
-      !priv->sending_whitespace_ping)
-    {
-      send_head_stanza (self);
-    }
+  if (queue_entry (self, &entry))
+    send_head_stanza (self);
   else if (cancellable != NULL)
-    {
-      elem->cancelled_sig_id = g_cancellable_connect (cancellable,
-          G_CALLBACK (send_cancelled_cb), elem, NULL);
-    }
+    elem->cancelled_sig_id = g_cancellable_connect (cancellable,
+        G_CALLBACK (send_cancelled_cb), elem, NULL);
+}
 
-  if (priv->sm)
+/**
+ * wocky_c2s_porter_send:
+ * @self: a #WockyC2SPorter
+ * @stanza: the #WockyStanza to send
+ *
+ * Queues @stanza to be sent, like wocky_porter_send_async() with a %NULL
+ * callback, but much more cheaply: only a reference to @stanza is kept until
+ * it has been written. As there is no operation to complete, failures are
+ * reported through the #WockyC2SPorter::send-failed signal.
+ *
+ * This is what wocky_porter_send() uses, and is meant for high rate traffic
+ * such as presence broadcasts, chat states or receipts.
+ */
+void
+wocky_c2s_porter_send (WockyC2SPorter *self,
+    WockyStanza *stanza)
+{
+  WockyC2SPorterPrivate *priv;
+  sending_entry entry;
+
+  g_return_if_fail (WOCKY_IS_C2S_PORTER (self));
+  g_return_if_fail (WOCKY_IS_STANZA (stanza));
+
+  priv = self->priv;
+
+  if (priv->close_result != NULL || priv->force_close_result != NULL)
     {
-      if ((!wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_SM_R))
-          && (!wocky_stanza_has_type (stanza, WOCKY_STANZA_TYPE_SM_A)))
-        {
-          wocky_sm_request_for_stanza (priv->sm, stanza);
-        }
+      GError error = { WOCKY_PORTER_ERROR, WOCKY_PORTER_ERROR_CLOSING,
+          "Porter is closing" };
+
+      g_signal_emit (self, signals[SEND_FAILED], 0, stanza, &error);
+      return;
     }
+
+  sending_entry_init (self, &entry, stanza, default_lane (stanza), NULL);
+
+  if (queue_entry (self, &entry))
+    send_head_stanza (self);
+}
+
+static void
+wocky_c2s_porter_send_no_reply (WockyPorter *porter,
+    WockyStanza *stanza)
+{
+  wocky_c2s_porter_send (WOCKY_C2S_PORTER (porter), stanza);
 }
 
 static gboolean
@@ -950,6 +1704,7 @@ handle_iq_reply (WockyPorter *porter,
 
       /* Don't want to get cancelled during completion */
       stanza_iq_handler_remove_cancellable (handler);
+      stanza_iq_handler_remove_timer (handler);
 
       g_simple_async_result_set_op_res_gpointer (r, reply, NULL);
       g_simple_async_result_complete (r);
@@ -1188,6 +1943,7 @@ abort_pending_iqs (WockyC2SPorter *self,
 
       /* Don't want to get cancelled during completion */
       stanza_iq_handler_remove_cancellable (handler);
+      stanza_iq_handler_remove_timer (handler);
 
       g_simple_async_result_set_from_error (handler->result, error);
       g_simple_async_result_complete_in_idle (handler->result);
@@ -1405,6 +2161,26 @@ receive_stanza (WockyC2SPorter *self)
       priv->receive_cancellable, stanza_received_cb, self);
 }
 
+/* Stream management requests and acks, picked out of the stream by the
+ * reader without going through the handlers */
+static void
+sm_cb (WockyXmppReader *reader,
+    WockyStanzaType type,
+    guint h,
+    gpointer user_data)
+{
+  WockyC2SPorter *self = WOCKY_C2S_PORTER (user_data);
+  WockyC2SPorterPrivate *priv = self->priv;
+
+  if (priv->sm == NULL)
+    return;
+
+  if (type == WOCKY_STANZA_TYPE_SM_R)
+    wocky_sm_send_a (WOCKY_PORTER (self), h);
+  else
+    wocky_sm_ack (priv->sm, h);
+}
+
 static void
 wocky_c2s_porter_start (WockyPorter *porter)
 {
@@ -1421,6 +2197,7 @@ wocky_c2s_porter_start (WockyPorter *porter)
   if (wocky_xmpp_connection_get_sm_enabled (priv->connection))
     {
       priv->sm = wocky_sm_new (WOCKY_C2S_PORTER (self));
+      wocky_xmpp_connection_set_sm_func (priv->connection, sm_cb, self);
       DEBUG ("c2s_porter: Stream Management enabled");
     }
   else
@@ -1897,6 +2674,8 @@ send_iq_cancelled_cb (GCancellable *cancellable,
    * finished */
   g_assert (handler->result != NULL);
 
+  stanza_iq_handler_remove_timer (handler);
+
   g_simple_async_result_set_from_error (handler->result, &error);
   g_simple_async_result_complete_in_idle (handler->result);
   g_object_unref (handler->result);
@@ -1905,6 +2684,33 @@ send_iq_cancelled_cb (GCancellable *cancellable,
   stanza_iq_handler_maybe_remove (handler);
 }
 
+static void
+iq_timed_out_cb (gpointer user_data)
+{
+  StanzaIqHandler *handler = (StanzaIqHandler *) user_data;
+
+  /* The wheel has already dropped the timer */
+  handler->timer = NULL;
+
+  g_assert (handler->result != NULL);
+
+  DEBUG ("No reply received to IQ '%s'; giving up", handler->id);
+
+  /* Don't want to get cancelled during completion */
+  stanza_iq_handler_remove_cancellable (handler);
+
+  g_simple_async_result_set_error (handler->result, WOCKY_PORTER_ERROR,
+      WOCKY_PORTER_ERROR_TIMED_OUT, "No reply to IQ '%s' was received",
+      handler->id);
+  g_simple_async_result_complete_in_idle (handler->result);
+  g_object_unref (handler->result);
+  handler->result = NULL;
+
+  /* If the IQ is still in the sending queue, iq_sent_cb() reclaims the
+   * handler once it has gone out */
+  stanza_iq_handler_maybe_remove (handler);
+}
+
 static void
 iq_sent_cb (GObject *source,
     GAsyncResult *res,
@@ -1927,6 +2733,7 @@ iq_sent_cb (GObject *source,
 
       /* Don't want to get cancelled during completion */
       stanza_iq_handler_remove_cancellable (handler);
+      stanza_iq_handler_remove_timer (handler);
 
       g_simple_async_result_set_from_error (r, error);
       g_simple_async_result_complete (r);
@@ -1938,9 +2745,14 @@ finished:
   stanza_iq_handler_maybe_remove (handler);
 }
 
+static void wocky_c2s_porter_send_iq_async (WockyPorter *porter,
+    WockyStanza *stanza, GCancellable *cancellable,
+    GAsyncReadyCallback callback, gpointer user_data);
+
 static void
-wocky_c2s_porter_send_iq_async (WockyPorter *porter,
+wocky_c2s_porter_send_iq_with_timeout_async (WockyPorter *porter,
     WockyStanza *stanza,
+    guint timeout_ms,
     GCancellable *cancellable,
     GAsyncReadyCallback callback,
     gpointer user_data)
@@ -2003,6 +2815,10 @@ wocky_c2s_porter_send_iq_async (WockyPorter *porter,
           G_CALLBACK (send_iq_cancelled_cb), handler, NULL);
     }
 
+  if (timeout_ms > 0)
+    handler->timer = wocky_timer_wheel_add (priv->iq_timers, timeout_ms,
+        iq_timed_out_cb, handler);
+
   g_hash_table_insert (priv->iq_reply_handlers, id, handler);
 
   wocky_c2s_porter_send_async (WOCKY_PORTER (self), stanza, cancellable,
@@ -2016,6 +2832,19 @@ wrong_stanza:
       "Stanza is not an IQ query");
 }
 
+static void
+wocky_c2s_porter_send_iq_async (WockyPorter *porter,
+    WockyStanza *stanza,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  WockyC2SPorter *self = WOCKY_C2S_PORTER (porter);
+
+  wocky_c2s_porter_send_iq_with_timeout_async (porter, stanza,
+      self->priv->iq_timeout, cancellable, callback, user_data);
+}
+
 static WockyStanza *
 wocky_c2s_porter_send_iq_finish (WockyPorter *self,
     GAsyncResult *result,
@@ -2186,7 +3015,7 @@ send_whitespace_ping_cb (GObject *source,
 
       /* Somebody could have tried sending a stanza while we were sending
        * the ping */
-      if (g_queue_get_length (priv->sending_queue) > 0)
+      if (priv->sending.stanza == NULL)
         send_head_stanza (self);
     }
 
@@ -2312,6 +3141,7 @@ wocky_porter_iface_init (gpointer g_iface,
 
   iface->send_async = wocky_c2s_porter_send_async;
   iface->send_finish = wocky_c2s_porter_send_finish;
+  iface->send = wocky_c2s_porter_send_no_reply;
 
   iface->register_handler_from_by_stanza =
     wocky_c2s_porter_register_handler_from_by_stanza;
@@ -2325,11 +3155,24 @@ wocky_porter_iface_init (gpointer g_iface,
 
   iface->send_iq_async = wocky_c2s_porter_send_iq_async;
   iface->send_iq_finish = wocky_c2s_porter_send_iq_finish;
+  iface->send_iq_with_timeout_async =
+    wocky_c2s_porter_send_iq_with_timeout_async;
 
   iface->force_close_async = wocky_c2s_porter_force_close_async;
   iface->force_close_finish = wocky_c2s_porter_force_close_finish;
 }
 
+/**
+ * wocky_c2s_porter_pop_unacked_stanzas:
+ * @porter: a #WockyC2SPorter
+ *
+ * Removes the oldest stanza sent while stream management was enabled which
+ * the server has not acknowledged yet, typically to send it again once the
+ * stream has been resumed.
+ *
+ * Returns: (transfer full): the stanza, or %NULL if there is none or stream
+ *  management is not enabled
+ */
 WockyStanza *
 wocky_c2s_porter_pop_unacked_stanzas (WockyC2SPorter *porter)
 {
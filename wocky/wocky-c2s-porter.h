@@ -59,6 +59,30 @@ struct _WockyC2SPorter {
     WockyC2SPorterPrivate *priv;
 };
 
+/**
+ * WockyC2SPorterLane:
+ * @WOCKY_C2S_PORTER_LANE_CONTROL: stream-level traffic such as stream
+ *  management requests and acknowledgements; always sent first
+ * @WOCKY_C2S_PORTER_LANE_INTERACTIVE: latency-sensitive stanzas, such as
+ *  replies to IQs
+ * @WOCKY_C2S_PORTER_LANE_NORMAL: everything else
+ * @WOCKY_C2S_PORTER_LANE_BULK: stanzas which can wait, such as large
+ *  batches of messages or pubsub publishes
+ * @WOCKY_C2S_PORTER_LANE_AUTO: pick the lane from the stanza: stream
+ *  management stanzas use the control lane, IQ results and errors the
+ *  interactive lane, and all other stanzas the normal lane
+ *
+ * The sending lanes of a #WockyC2SPorter. Stanzas are sent in order within a
+ * lane; stanzas in different lanes may overtake each other.
+ */
+typedef enum {
+  WOCKY_C2S_PORTER_LANE_CONTROL,
+  WOCKY_C2S_PORTER_LANE_INTERACTIVE,
+  WOCKY_C2S_PORTER_LANE_NORMAL,
+  WOCKY_C2S_PORTER_LANE_BULK,
+  WOCKY_C2S_PORTER_LANE_AUTO,
+} WockyC2SPorterLane;
+
 GType wocky_c2s_porter_get_type (void);
 
 /* TYPE MACROS */
@@ -81,6 +105,16 @@ GType wocky_c2s_porter_get_type (void);
 WockyPorter * wocky_c2s_porter_new (WockyXmppConnection *connection,
     const gchar *full_jid);
 
+void wocky_c2s_porter_send_in_lane_async (WockyC2SPorter *self,
+    WockyStanza *stanza,
+    WockyC2SPorterLane lane,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+void wocky_c2s_porter_send (WockyC2SPorter *self,
+    WockyStanza *stanza);
+
 void wocky_c2s_porter_send_whitespace_ping_async (
     WockyC2SPorter *self,
     GCancellable *cancellable,
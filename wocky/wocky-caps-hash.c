@@ -35,9 +35,11 @@
 #include <stdlib.h>
 
 #include "wocky-disco-identity.h"
+#include "wocky-text.h"
 #include "wocky-utils.h"
 #include "wocky-data-form.h"
 #include "wocky-namespaces.h"
+#include "wocky-node-private.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_PRESENCE
 #include "wocky-debug-internal.h"
@@ -283,7 +285,7 @@ wocky_caps_hash_compute_from_lists (
   sha1 = g_new0 (guint8, sha1_buffer_size);
   g_checksum_get_digest (checksum, sha1, &sha1_buffer_size);
 
-  encoded = g_base64_encode (sha1, sha1_buffer_size);
+  encoded = wocky_text_base64_encode (sha1, sha1_buffer_size);
   g_free (sha1);
 
 cleanup:
@@ -324,6 +326,8 @@ wocky_caps_hash_compute_from_node (WockyNode *node)
   WockyNodeIter iter;
   WockyNode *x_node = NULL;
 
+  _wocky_node_ensure_children (node);
+
   for (c = node->children; c != NULL; c = c->next)
     {
       WockyNode *child = c->data;
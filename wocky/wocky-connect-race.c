@@ -0,0 +1,745 @@
+/*
+ * wocky-connect-race.c - Source for racing TCP connection attempts
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Connects to a service the "happy eyeballs" way (RFC 8305), rather than
+ * trying each address in turn like g_socket_client_connect_to_service ()
+ * does, where a single blackholed SRV target or broken IPv6 route costs a
+ * whole TCP timeout.
+ *
+ * The SRV targets (followed by the host itself, as a fallback) are all
+ * resolved in parallel. Their addresses are sorted by the priority of their
+ * target, alternating between IPv6 and IPv4 within a target. Connection
+ * attempts are started in that order, a new one every
+ * WOCKY_CONNECT_RACE_ATTEMPT_DELAY milliseconds or as soon as the previous one
+ * failed, without waiting for every lookup to complete. The first attempt to
+ * succeed wins and the others are cancelled.
+ *
+ * If a Direct TLS service (XEP-0368) is given as well, its SRV targets are
+ * merged with the plain ones by priority (Direct TLS first on a tie), and the
+ * caller is told which kind of target won.
+ *
+ * Resolved records go through the shared WockyDnsCache.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-connect-race.h"
+
+#include "wocky-dns-cache.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_CONNECTOR
+#include "wocky-debug-internal.h"
+
+typedef struct
+{
+  GInetSocketAddress *address;
+  /* Index of the target the address belongs to, in order of preference */
+  guint target;
+  /* Order within the target */
+  guint rank;
+  /* Whether the target expects TLS straight away */
+  gboolean direct_tls;
+} Candidate;
+
+typedef struct
+{
+  guint ref_count;
+
+  /* NULL once the race is over */
+  GSimpleAsyncResult *result;
+
+  GSocketClient *client;
+  GResolver *resolver;
+  gchar *host;
+  gchar *service;
+  gchar *tls_service;
+  guint16 default_port;
+
+  /* Cancelled when the race is over, or when caller_cancellable is */
+  GCancellable *cancellable;
+  GCancellable *caller_cancellable;
+  gulong caller_cancelled_id;
+
+  /* Owned GSrvTarget lists, kept until both SRV lookups are done */
+  GList *srv_targets;
+  GList *tls_srv_targets;
+  guint pending_srv_lookups;
+
+  guint n_targets;
+  /* SRV and address lookups in progress */
+  guint pending_lookups;
+  /* Sorted list of owned (Candidate *) not tried yet */
+  GList *candidates;
+  /* Connection attempts in progress */
+  guint n_attempts;
+  /* Timer before the next attempt can be started, if any */
+  guint delay_id;
+
+  /* The errors to report if all attempts fail: the first connection error
+   * for the most preferred target, or else the first resolver error */
+  GError *connect_error /* for connect_error_target */;
+  guint connect_error_target;
+  GError *resolve_error /* from any target */;
+} Race;
+
+typedef struct
+{
+  Race *race;
+  gchar *host;
+  guint target;
+  guint16 port;
+  gboolean direct_tls;
+} HostLookup;
+
+typedef struct
+{
+  Race *race;
+  gboolean direct_tls;
+} SrvLookup;
+
+typedef struct
+{
+  GSocketConnection *connection;
+  gboolean direct_tls;
+} Winner;
+
+typedef struct
+{
+  Race *race;
+  Candidate *candidate;
+} Attempt;
+
+static void race_maybe_start_attempt (Race *race);
+static void race_check_failed (Race *race);
+
+static void
+srv_target_list_free (GList *targets)
+{
+  g_list_foreach (targets, (GFunc) g_srv_target_free, NULL);
+  g_list_free (targets);
+}
+
+static void
+winner_free (Winner *winner)
+{
+  g_object_unref (winner->connection);
+  g_slice_free (Winner, winner);
+}
+
+static void
+candidate_free (Candidate *candidate)
+{
+  g_object_unref (candidate->address);
+  g_slice_free (Candidate, candidate);
+}
+
+static gint
+candidate_compare (gconstpointer a,
+    gconstpointer b)
+{
+  const Candidate *ca = a;
+  const Candidate *cb = b;
+
+  if (ca->target != cb->target)
+    return ca->target < cb->target ? -1 : 1;
+
+  if (ca->rank != cb->rank)
+    return ca->rank < cb->rank ? -1 : 1;
+
+  return 0;
+}
+
+static Race *
+race_ref (Race *race)
+{
+  race->ref_count++;
+  return race;
+}
+
+static void
+race_unref (Race *race)
+{
+  if (--race->ref_count > 0)
+    return;
+
+  g_assert (race->result == NULL);
+  g_assert (race->delay_id == 0);
+  g_assert (race->candidates == NULL);
+
+  if (race->caller_cancellable != NULL)
+    {
+      /* FIXME: we should use g_cancellable_disconnect but it raises a dead
+       * lock (#587300) */
+      if (race->caller_cancelled_id != 0)
+        g_signal_handler_disconnect (race->caller_cancellable,
+            race->caller_cancelled_id);
+
+      g_object_unref (race->caller_cancellable);
+    }
+
+  g_object_unref (race->cancellable);
+  g_object_unref (race->client);
+  g_object_unref (race->resolver);
+  g_free (race->host);
+  g_free (race->service);
+  g_free (race->tls_service);
+  srv_target_list_free (race->srv_targets);
+  srv_target_list_free (race->tls_srv_targets);
+  g_clear_error (&race->connect_error);
+  g_clear_error (&race->resolve_error);
+
+  g_slice_free (Race, race);
+}
+
+static void
+race_complete (Race *race,
+    GSocketConnection *connection,
+    gboolean direct_tls,
+    GError *error)
+{
+  GSimpleAsyncResult *result = race->result;
+
+  if (result == NULL)
+    return;
+
+  race->result = NULL;
+
+  if (connection != NULL)
+    {
+      Winner *winner = g_slice_new0 (Winner);
+
+      winner->connection = g_object_ref (connection);
+      winner->direct_tls = direct_tls;
+      g_simple_async_result_set_op_res_gpointer (result, winner,
+          (GDestroyNotify) winner_free);
+    }
+  else
+    g_simple_async_result_set_from_error (result, error);
+
+  g_simple_async_result_complete_in_idle (result);
+  g_object_unref (result);
+
+  /* Stop the losers */
+  if (race->delay_id != 0)
+    {
+      g_source_remove (race->delay_id);
+      race->delay_id = 0;
+    }
+
+  g_list_foreach (race->candidates, (GFunc) candidate_free, NULL);
+  g_list_free (race->candidates);
+  race->candidates = NULL;
+
+  g_cancellable_cancel (race->cancellable);
+
+  /* The in-progress race owned a reference */
+  race_unref (race);
+}
+
+static void
+race_add_addresses (Race *race,
+    guint target,
+    guint16 port,
+    gboolean direct_tls,
+    GList *addresses)
+{
+  guint n_v6 = 0, n_v4 = 0;
+  GList *l;
+
+  for (l = addresses; l != NULL; l = l->next)
+    {
+      GInetAddress *address = l->data;
+      Candidate *candidate = g_slice_new0 (Candidate);
+
+      candidate->address = G_INET_SOCKET_ADDRESS (
+          g_inet_socket_address_new (address, port));
+      candidate->target = target;
+      candidate->direct_tls = direct_tls;
+
+      /* Interleave the address families, IPv6 first */
+      if (g_inet_address_get_family (address) == G_SOCKET_FAMILY_IPV6)
+        candidate->rank = 2 * n_v6++;
+      else
+        candidate->rank = 2 * n_v4++ + 1;
+
+      race->candidates = g_list_insert_sorted (race->candidates, candidate,
+          candidate_compare);
+    }
+}
+
+static void
+host_lookup_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  HostLookup *lookup = user_data;
+  Race *race = lookup->race;
+  GError *error = NULL;
+  GList *addresses;
+
+  addresses = g_resolver_lookup_by_name_finish (G_RESOLVER (source), result,
+      &error);
+  race->pending_lookups--;
+
+  if (addresses != NULL)
+    {
+      wocky_dns_cache_add_host (lookup->host, addresses);
+
+      if (race->result != NULL)
+        race_add_addresses (race, lookup->target, lookup->port,
+            lookup->direct_tls, addresses);
+
+      g_resolver_free_addresses (addresses);
+    }
+  else
+    {
+      DEBUG ("lookup of target %u failed: %s", lookup->target,
+          error->message);
+
+      if (race->resolve_error == NULL)
+        race->resolve_error = error;
+      else
+        g_error_free (error);
+    }
+
+  race_maybe_start_attempt (race);
+  race_check_failed (race);
+
+  race_unref (race);
+  g_free (lookup->host);
+  g_slice_free (HostLookup, lookup);
+}
+
+static void
+race_resolve_target (Race *race,
+    const gchar *host,
+    guint16 port,
+    gboolean direct_tls)
+{
+  guint target = race->n_targets++;
+  GInetAddress *literal;
+  GList *addresses;
+  HostLookup *lookup;
+
+  DEBUG ("target %u is %s:%u%s", target, host, port,
+      direct_tls ? " (Direct TLS)" : "");
+
+  literal = g_inet_address_new_from_string (host);
+  if (literal != NULL)
+    {
+      GList one = { literal, NULL, NULL };
+
+      race_add_addresses (race, target, port, direct_tls, &one);
+      g_object_unref (literal);
+      return;
+    }
+
+  addresses = wocky_dns_cache_lookup_host (host);
+  if (addresses != NULL)
+    {
+      race_add_addresses (race, target, port, direct_tls, addresses);
+      g_resolver_free_addresses (addresses);
+      return;
+    }
+
+  lookup = g_slice_new0 (HostLookup);
+  lookup->race = race_ref (race);
+  lookup->host = g_strdup (host);
+  lookup->target = target;
+  lookup->port = port;
+  lookup->direct_tls = direct_tls;
+
+  race->pending_lookups++;
+  g_resolver_lookup_by_name_async (race->resolver, host, race->cancellable,
+      host_lookup_cb, lookup);
+}
+
+/* Called once both SRV lookups are done */
+static void
+race_got_targets (Race *race)
+{
+  gboolean host_is_target = FALSE;
+  GList *plain = race->srv_targets;
+  GList *tls = race->tls_srv_targets;
+
+  while (plain != NULL || tls != NULL)
+    {
+      GSrvTarget *target;
+      gboolean direct_tls;
+      const gchar *hostname;
+      guint16 port;
+
+      /* Both lists are sorted already: merge them, preferring Direct TLS
+       * targets when the priorities are the same */
+      direct_tls = (plain == NULL || (tls != NULL &&
+          g_srv_target_get_priority (tls->data) <=
+          g_srv_target_get_priority (plain->data)));
+
+      if (direct_tls)
+        {
+          target = tls->data;
+          tls = tls->next;
+        }
+      else
+        {
+          target = plain->data;
+          plain = plain->next;
+        }
+
+      hostname = g_srv_target_get_hostname (target);
+      port = g_srv_target_get_port (target);
+      race_resolve_target (race, hostname, port, direct_tls);
+
+      if (!direct_tls && port == race->default_port &&
+          !g_ascii_strcasecmp (hostname, race->host))
+        host_is_target = TRUE;
+    }
+
+  /* As a last resort, try the host itself: some services (like
+   * chat.facebook.com) have broken SRV records */
+  if (!host_is_target)
+    race_resolve_target (race, race->host, race->default_port, FALSE);
+}
+
+static void
+race_set_srv_targets (Race *race,
+    gboolean direct_tls,
+    GList *targets)
+{
+  if (direct_tls)
+    race->tls_srv_targets = targets;
+  else
+    race->srv_targets = targets;
+}
+
+static void
+srv_lookup_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  SrvLookup *lookup = user_data;
+  Race *race = lookup->race;
+  GError *error = NULL;
+  GList *targets;
+
+  targets = g_resolver_lookup_service_finish (G_RESOLVER (source), result,
+      &error);
+  race->pending_lookups--;
+  race->pending_srv_lookups--;
+
+  if (targets != NULL)
+    {
+      wocky_dns_cache_add_service (
+          lookup->direct_tls ? race->tls_service : race->service,
+          race->host, targets);
+      race_set_srv_targets (race, lookup->direct_tls, targets);
+    }
+  else
+    {
+      /* Not having SRV records is perfectly fine */
+      DEBUG ("%sSRV lookup failed: %s", lookup->direct_tls ? "Direct TLS " : "",
+          error->message);
+      g_error_free (error);
+    }
+
+  if (race->result != NULL && race->pending_srv_lookups == 0)
+    race_got_targets (race);
+
+  race_maybe_start_attempt (race);
+  race_check_failed (race);
+
+  race_unref (race);
+  g_slice_free (SrvLookup, lookup);
+}
+
+static void
+race_lookup_service (Race *race,
+    gboolean direct_tls)
+{
+  const gchar *service = direct_tls ? race->tls_service : race->service;
+  GList *targets;
+  SrvLookup *lookup;
+
+  targets = wocky_dns_cache_lookup_service (service, race->host);
+  if (targets != NULL)
+    {
+      race_set_srv_targets (race, direct_tls, targets);
+      return;
+    }
+
+  lookup = g_slice_new0 (SrvLookup);
+  lookup->race = race_ref (race);
+  lookup->direct_tls = direct_tls;
+
+  race->pending_lookups++;
+  race->pending_srv_lookups++;
+  g_resolver_lookup_service_async (race->resolver, service, "tcp",
+      race->host, race->cancellable, srv_lookup_cb, lookup);
+}
+
+static gboolean
+attempt_delay_cb (gpointer user_data)
+{
+  Race *race = user_data;
+
+  race->delay_id = 0;
+  race_maybe_start_attempt (race);
+
+  return FALSE;
+}
+
+static void
+attempt_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  Attempt *attempt = user_data;
+  Race *race = attempt->race;
+  GError *error = NULL;
+  GSocketConnection *connection;
+  gchar *address = g_inet_address_to_string (
+      g_inet_socket_address_get_address (attempt->candidate->address));
+
+  connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source),
+      result, &error);
+  race->n_attempts--;
+
+  if (connection != NULL)
+    {
+      if (race->result != NULL)
+        {
+          DEBUG ("connected to %s:%u (target %u)", address,
+              g_inet_socket_address_get_port (attempt->candidate->address),
+              attempt->candidate->target);
+          race_complete (race, connection, attempt->candidate->direct_tls,
+              NULL);
+        }
+
+      /* If we lost the race, this closes the connection */
+      g_object_unref (connection);
+    }
+  else
+    {
+      if (race->result != NULL)
+        DEBUG ("connecting to %s:%u failed: %s", address,
+            g_inet_socket_address_get_port (attempt->candidate->address),
+            error->message);
+
+      if (race->connect_error == NULL ||
+          attempt->candidate->target < race->connect_error_target)
+        {
+          g_clear_error (&race->connect_error);
+          race->connect_error = error;
+          race->connect_error_target = attempt->candidate->target;
+        }
+      else
+        {
+          g_error_free (error);
+        }
+
+      /* Don't wait for the delay to expire before trying the next one */
+      if (race->delay_id != 0)
+        {
+          g_source_remove (race->delay_id);
+          race->delay_id = 0;
+        }
+
+      race_maybe_start_attempt (race);
+      race_check_failed (race);
+    }
+
+  g_free (address);
+  candidate_free (attempt->candidate);
+  race_unref (race);
+  g_slice_free (Attempt, attempt);
+}
+
+static void
+race_maybe_start_attempt (Race *race)
+{
+  Attempt *attempt;
+
+  if (race->result == NULL || race->candidates == NULL ||
+      race->delay_id != 0)
+    return;
+
+  attempt = g_slice_new0 (Attempt);
+  attempt->race = race_ref (race);
+  attempt->candidate = race->candidates->data;
+  race->candidates = g_list_delete_link (race->candidates, race->candidates);
+
+  race->n_attempts++;
+  g_socket_client_connect_async (race->client,
+      G_SOCKET_CONNECTABLE (attempt->candidate->address), race->cancellable,
+      attempt_cb, attempt);
+
+  race->delay_id = g_timeout_add (WOCKY_CONNECT_RACE_ATTEMPT_DELAY,
+      attempt_delay_cb, race);
+}
+
+static void
+race_check_failed (Race *race)
+{
+  GError *error = NULL;
+
+  if (race->result == NULL || race->n_attempts > 0 ||
+      race->pending_lookups > 0 || race->pending_srv_lookups > 0 ||
+      race->candidates != NULL)
+    return;
+
+  if (race->caller_cancellable != NULL &&
+      g_cancellable_is_cancelled (race->caller_cancellable))
+    error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+        "Connection cancelled");
+  else if (race->connect_error != NULL)
+    error = g_error_copy (race->connect_error);
+  else if (race->resolve_error != NULL)
+    error = g_error_copy (race->resolve_error);
+  else
+    error = g_error_new (G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND,
+        "No address found for %s", race->host);
+
+  DEBUG ("all attempts failed: %s", error->message);
+  race_complete (race, NULL, FALSE, error);
+  g_error_free (error);
+}
+
+static void
+caller_cancelled_cb (GCancellable *cancellable,
+    gpointer user_data)
+{
+  Race *race = user_data;
+
+  g_cancellable_cancel (race->cancellable);
+}
+
+/*
+ * wocky_connect_race_async:
+ * @client: the #GSocketClient to connect with
+ * @host: the domain to look the SRV records of @service up for, or the host
+ *  to connect to if @service is %NULL
+ * @service: the SRV service to use (such as "xmpp-client"), or %NULL
+ * @tls_service: the Direct TLS SRV service to use as well (such as
+ *  "xmpps-client"), or %NULL
+ * @default_port: the port to use when connecting to @host itself
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @callback: callback to call when the request is satisfied
+ * @user_data: the data to pass to callback function
+ *
+ * Connects to one of the SRV targets of @service on @host, or to @host on
+ * @default_port, whichever answers first. See the top of this file.
+ */
+void
+wocky_connect_race_async (GSocketClient *client,
+    const gchar *host,
+    const gchar *service,
+    const gchar *tls_service,
+    guint16 default_port,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  Race *race;
+
+  g_return_if_fail (G_IS_SOCKET_CLIENT (client));
+  g_return_if_fail (host != NULL);
+  g_return_if_fail (service != NULL || tls_service == NULL);
+
+  race = g_slice_new0 (Race);
+  race->ref_count = 1;
+  race->result = g_simple_async_result_new (G_OBJECT (client), callback,
+      user_data, wocky_connect_race_async);
+  race->client = g_object_ref (client);
+  race->resolver = g_resolver_get_default ();
+  race->host = g_strdup (host);
+  race->service = g_strdup (service);
+  race->tls_service = g_strdup (tls_service);
+  race->default_port = default_port;
+  race->cancellable = g_cancellable_new ();
+
+  if (cancellable != NULL)
+    {
+      race->caller_cancellable = g_object_ref (cancellable);
+      race->caller_cancelled_id = g_cancellable_connect (cancellable,
+          G_CALLBACK (caller_cancelled_cb), race, NULL);
+    }
+
+  /* Hold a reference while we're starting, as the lookups may complete
+   * synchronously */
+  race_ref (race);
+
+  if (service == NULL)
+    {
+      race_resolve_target (race, host, default_port, FALSE);
+    }
+  else
+    {
+      /* Don't let a lookup completing synchronously use the targets before
+       * the other one is done */
+      race->pending_srv_lookups++;
+
+      race_lookup_service (race, FALSE);
+
+      if (tls_service != NULL)
+        race_lookup_service (race, TRUE);
+
+      if (--race->pending_srv_lookups == 0)
+        race_got_targets (race);
+    }
+
+  race_maybe_start_attempt (race);
+  race_check_failed (race);
+  race_unref (race);
+}
+
+/*
+ * wocky_connect_race_finish:
+ * @client: the #GSocketClient passed to wocky_connect_race_async ()
+ * @result: the result passed to the callback
+ * @direct_tls: if not %NULL, set to whether the winning target was one of
+ *  the Direct TLS service's, which expects a TLS handshake straight away
+ * @error: location for an error, or %NULL
+ *
+ * Returns: a new reference to the winning connection, or %NULL on error
+ */
+GSocketConnection *
+wocky_connect_race_finish (GSocketClient *client,
+    GAsyncResult *result,
+    gboolean *direct_tls,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  Winner *winner;
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+      G_OBJECT (client), wocky_connect_race_async), NULL);
+
+  winner = g_simple_async_result_get_op_res_gpointer (simple);
+
+  if (direct_tls != NULL)
+    *direct_tls = winner->direct_tls;
+
+  return g_object_ref (winner->connection);
+}
@@ -0,0 +1,52 @@
+/*
+ * wocky-connect-race.h - Header for racing TCP connection attempts
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_CONNECT_RACE_H
+#define WOCKY_CONNECT_RACE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* How long an attempt has to succeed or fail before the next one is started
+ * alongside it, in milliseconds (the "Connection Attempt Delay" of RFC 8305) */
+#define WOCKY_CONNECT_RACE_ATTEMPT_DELAY 250
+
+void wocky_connect_race_async (
+    GSocketClient *client,
+    const gchar *host,
+    const gchar *service,
+    const gchar *tls_service,
+    guint16 default_port,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+GSocketConnection *wocky_connect_race_finish (
+    GSocketClient *client,
+    GAsyncResult *result,
+    gboolean *direct_tls,
+    GError **error);
+
+G_END_DECLS
+
+#endif /* WOCKY_CONNECT_RACE_H */
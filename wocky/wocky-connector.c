@@ -42,11 +42,11 @@
  *
  * <informalexample>
  *  <programlisting>
- * tcp_srv_connected
- * │
- * ├→ tcp_host_connected
- * │  ↓
- * └→ maybe_old_ssl
+ * tcp_srv_connected      tcp_race_connected
+ * │                      │
+ * ├→ tcp_host_connected  │
+ * │  ↓                   │
+ * └→ maybe_old_ssl ←─────┘
  *    ↓
  *    xmpp_init ←─────────────────┬────────────┐
  *    ↓                           │            │
@@ -86,6 +86,12 @@
  *    establish_session_recv_cb ─────┘
  *  </programlisting>
  * </informalexample>
+ *
+ * With #WockyConnector:pipelining set, the authenticated stream is handled
+ * differently: xmpp_init_sent_cb calls iq_bind_resource straight away,
+ * iq_bind_resource_sent_cb waits for the stream open, xmpp_features_cb calls
+ * sm_enable (or waits for the bind reply), and the replies are read in the
+ * order the requests were sent.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -107,12 +113,15 @@
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_CONNECTOR
 #include "wocky-debug-internal.h"
 
+#include "wocky-connect-race.h"
+#include "wocky-dns-cache.h"
 #include "wocky-http-proxy.h"
 #include "wocky-sasl-auth.h"
 #include "wocky-tls-handler.h"
 #include "wocky-tls-connector.h"
 #include "wocky-jabber-auth.h"
 #include "wocky-namespaces.h"
+#include "wocky-node-private.h"
 #include "wocky-xmpp-connection.h"
 #include "wocky-xmpp-error.h"
 #include "wocky-signals-marshal.h"
@@ -136,6 +145,9 @@ static void tcp_srv_connected (GObject *source,
 static void tcp_host_connected (GObject *source,
     GAsyncResult *result,
     gpointer connector);
+static void tcp_race_connected (GObject *source,
+    GAsyncResult *result,
+    gpointer connector);
 
 static void maybe_old_ssl (WockyConnector *self);
 
@@ -236,6 +248,9 @@ enum
   PROP_EMAIL,
   PROP_AUTH_REGISTRY,
   PROP_TLS_HANDLER,
+  PROP_CONNECTION_RACING,
+  PROP_DIRECT_TLS,
+  PROP_PIPELINING,
 };
 
 /* this tracks which XEP 0077 operation (register account, cancel account)  *
@@ -281,6 +296,9 @@ struct _WockyConnectorPrivate
   gboolean legacy_ssl;
   gchar *session_id;
   gchar *ca; /* file or dir containing x509 CA files */
+  gboolean connection_racing;
+  gboolean direct_tls;
+  gboolean pipelining;
 
   /* XMPP connection data */
   WockyStanza *features;
@@ -291,6 +309,15 @@ struct _WockyConnectorPrivate
   gboolean authed;
   gboolean encrypted;
   gboolean connected;
+  /* we reached a Direct TLS SRV target: handshake before the stream opens */
+  gboolean direct_tls_target;
+  /* pipelined requests whose replies haven't been read yet: the bind iq
+   * goes out with the post-authentication stream open, and the sm enable
+   * before the bind reply comes back */
+  gboolean bind_pipelined;
+  gboolean sm_pipelined;
+  /* a pipelined request failed: do the rest one step at a time */
+  gboolean pipelining_failed;
   /* register/cancel account, or normal login */
   WockyConnectorXEP77Op reg_op;
   GSimpleAsyncResult *result;
@@ -506,6 +533,15 @@ wocky_connector_set_property (GObject *object,
       case PROP_TLS_HANDLER:
         priv->tls_handler = g_value_dup_object (value);
         break;
+      case PROP_CONNECTION_RACING:
+        priv->connection_racing = g_value_get_boolean (value);
+        break;
+      case PROP_DIRECT_TLS:
+        priv->direct_tls = g_value_get_boolean (value);
+        break;
+      case PROP_PIPELINING:
+        priv->pipelining = g_value_get_boolean (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -571,6 +607,15 @@ wocky_connector_get_property (GObject *object,
       case PROP_TLS_HANDLER:
         g_value_set_object (value, priv->tls_handler);
         break;
+      case PROP_CONNECTION_RACING:
+        g_value_set_boolean (value, priv->connection_racing);
+        break;
+      case PROP_DIRECT_TLS:
+        g_value_set_boolean (value, priv->direct_tls);
+        break;
+      case PROP_PIPELINING:
+        g_value_set_boolean (value, priv->pipelining);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -775,6 +820,63 @@ wocky_connector_class_init (WockyConnectorClass *klass)
       (G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (oclass, PROP_TLS_HANDLER, spec);
 
+  /**
+   * WockyConnector:connection-racing:
+   *
+   * Whether to race connection attempts to the server's addresses rather
+   * than trying them one after the other. All the SRV targets are resolved
+   * in parallel, and a new attempt is started every 250ms (or as soon as
+   * the previous one failed), alternating between IPv6 and IPv4, until one
+   * succeeds. This avoids waiting for a whole TCP timeout when a SRV target
+   * or an address family is unreachable.
+   *
+   * The records resolved this way are cached by all the connectors of the
+   * process; see wocky_connector_clear_dns_cache().
+   *
+   * Proxies are not used to resolve the server's name when this is enabled.
+   */
+  spec = g_param_spec_boolean ("connection-racing", "Connection racing",
+      "Race connection attempts to the server's addresses", FALSE,
+      (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_CONNECTION_RACING, spec);
+
+  /**
+   * WockyConnector:direct-tls:
+   *
+   * Whether to look for Direct TLS (XEP-0368) SRV records
+   * (_xmpps-client._tcp) as well as the usual ones, and race connection
+   * attempts to both kinds of targets as if
+   * #WockyConnector:connection-racing was set. If a Direct TLS target wins,
+   * the TLS handshake starts at once, using ALPN and SNI, rather than after
+   * opening the stream and negotiating STARTTLS, which saves two round
+   * trips.
+   *
+   * This has no effect if #WockyConnector:xmpp-server or
+   * #WockyConnector:xmpp-port is set, as no SRV lookup is done then.
+   */
+  spec = g_param_spec_boolean ("direct-tls", "Direct TLS",
+      "Connect to Direct TLS SRV targets too", FALSE,
+      (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_DIRECT_TLS, spec);
+
+  /**
+   * WockyConnector:pipelining:
+   *
+   * Whether to send the requests which follow authentication without
+   * waiting for the replies they don't depend on: the resource binding iq
+   * goes out together with the new stream header, and the stream
+   * management enable request before the bind reply has been read. The
+   * session iq is also skipped if the server marks it as optional.
+   *
+   * This cuts the number of round trips needed to get a usable session
+   * from four to two. If a pipelined request fails, the connector falls
+   * back to sending it again after the replies it was waiting for.
+   */
+  spec = g_param_spec_boolean ("pipelining", "Pipelining",
+      "Pipeline the stream negotiation requests after authentication", FALSE,
+      (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_PIPELINING, spec);
+
   /**
    * WockyConnector::connection-established:
    * @connection: the #GSocketConnection
@@ -1001,6 +1103,63 @@ tcp_host_connected (GObject *source,
     }
 }
 
+static void
+tcp_race_connected (GObject *source,
+    GAsyncResult *result,
+    gpointer connector)
+{
+  GError *error = NULL;
+  WockyConnector *self = WOCKY_CONNECTOR (connector);
+  WockyConnectorPrivate *priv = self->priv;
+
+  priv->sock = wocky_connect_race_finish (G_SOCKET_CLIENT (source), result,
+      &priv->direct_tls_target, &error);
+
+  if (priv->sock == NULL)
+    {
+      DEBUG ("connection race failed: %s", error->message);
+      abort_connect_error (connector, &error, "couldn't connect to server");
+      g_error_free (error);
+    }
+  else
+    {
+      DEBUG ("connection race won");
+
+      g_signal_emit (self, signals[CONNECTION_ESTABLISHED], 0, priv->sock);
+
+      priv->connected = TRUE;
+      priv->state = WCON_TCP_CONNECTED;
+      maybe_old_ssl (self);
+    }
+}
+
+static void
+race_connect_async (WockyConnector *self,
+    const gchar *host_and_port,
+    const gchar *service,
+    const gchar *tls_service,
+    guint default_port)
+{
+  WockyConnectorPrivate *priv = self->priv;
+  GSocketConnectable *address;
+  GError *error = NULL;
+
+  address = g_network_address_parse (host_and_port, default_port, &error);
+
+  if (address == NULL)
+    {
+      abort_connect_error (self, &error, "couldn't parse server address");
+      g_error_free (error);
+      return;
+    }
+
+  wocky_connect_race_async (priv->client,
+      g_network_address_get_hostname (G_NETWORK_ADDRESS (address)), service,
+      tls_service, g_network_address_get_port (G_NETWORK_ADDRESS (address)),
+      priv->cancellable, tcp_race_connected, self);
+  g_object_unref (address);
+}
+
 /* ************************************************************************* */
 /* legacy jabber support                                                     */
 static void
@@ -1085,13 +1244,16 @@ maybe_old_ssl (WockyConnector *self)
 
   priv->conn = wocky_xmpp_connection_new (G_IO_STREAM (priv->sock));
 
-  if (priv->legacy_ssl && !priv->encrypted)
+  if ((priv->legacy_ssl || priv->direct_tls_target) && !priv->encrypted)
     {
       WockyTLSConnector *tls_connector;
 
       DEBUG ("Creating SSL connector");
       tls_connector = wocky_tls_connector_new (priv->tls_handler);
 
+      if (priv->direct_tls_target)
+        wocky_tls_connector_set_alpn_protocol (tls_connector, "xmpp-client");
+
       DEBUG ("Beginning SSL handshake");
       wocky_tls_connector_secure_async (tls_connector,
           priv->conn, TRUE, get_peername (self), NULL,
@@ -1134,6 +1296,17 @@ xmpp_init_sent_cb (GObject *source,
       return;
     }
 
+  /* binding is mandatory (RFC 6120 §7), so there's no need to wait for
+   * the features of the authenticated stream before asking for it */
+  if (priv->pipelining && !priv->pipelining_failed &&
+      priv->state == WCON_XMPP_AUTHED)
+    {
+      DEBUG ("pipelining bind iq set after stream open");
+      priv->bind_pipelined = TRUE;
+      iq_bind_resource (self);
+      return;
+    }
+
   DEBUG ("waiting for stream open from server");
   wocky_xmpp_connection_recv_open_async (priv->conn, priv->cancellable,
       xmpp_init_recv_cb, data);
@@ -1228,6 +1401,7 @@ stream_error_abort (WockyConnector *self,
           self->priv->authed = FALSE;
           self->priv->encrypted = FALSE;
           self->priv->connected = FALSE;
+          self->priv->direct_tls_target = FALSE;
 
           connect_to_host_async (self, other_host, 5222);
 
@@ -1347,7 +1521,16 @@ xmpp_features_cb (GObject *source,
     }
 
   /* we MUST bind here http://www.ietf.org/rfc/rfc3920.txt */
-  if (can_bind)
+  if (can_bind && priv->bind_pipelined)
+    {
+      /* the bind iq is already on its way */
+      if (can_sm)
+        sm_enable (self);
+      else
+        wocky_xmpp_connection_recv_stanza_async (priv->conn,
+            priv->cancellable, iq_bind_resource_recv_cb, self);
+    }
+  else if (can_bind)
     iq_bind_resource (self);
   else
     abort_connect_code (data, WOCKY_CONNECTOR_ERROR_BIND_UNAVAILABLE,
@@ -1776,6 +1959,8 @@ xep77_signup_send (WockyConnector *self,
   reg = wocky_node_add_child_ns (wocky_stanza_get_top_node (riq),
       "query", WOCKY_XEP77_NS_REGISTER);
 
+  _wocky_node_ensure_children (req);
+
   for (arg = req->children; arg != NULL; arg = g_slist_next (arg))
     {
       gchar *value = NULL;
@@ -1928,6 +2113,9 @@ static void sm_enable (WockyConnector *self)
   WockyConnectorPrivate *priv = self->priv;
   WockyStanza *enable = wocky_stanza_new ("enable", WOCKY_XMPP_NS_STREAM_MANAGEMENT);
 
+  /* the reply to a pipelined bind iq comes first */
+  priv->sm_pipelined = priv->bind_pipelined;
+
   DEBUG ("sending sm enable stanza");
   wocky_xmpp_connection_send_stanza_async (priv->conn, enable, priv->cancellable,
       sm_enable_sent_cb, self);
@@ -1952,8 +2140,12 @@ sm_enable_sent_cb (GObject *source,
     return;
   }
 
-  wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
-      sm_enable_recv_cb, data);
+  if (priv->sm_pipelined)
+    wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
+        iq_bind_resource_recv_cb, data);
+  else
+    wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
+        sm_enable_recv_cb, data);
 }
 static void
 sm_enable_recv_cb (GObject *source,
@@ -1964,8 +2156,9 @@ sm_enable_recv_cb (GObject *source,
   WockyConnector *self = WOCKY_CONNECTOR (data);
   WockyConnectorPrivate *priv = self->priv;
   WockyStanza *reply = NULL;
+  gboolean pipelined = priv->sm_pipelined;
 
-
+  priv->sm_pipelined = FALSE;
   reply = wocky_xmpp_connection_recv_stanza_finish (priv->conn, result, &error);
 
   if (reply == NULL)
@@ -1975,6 +2168,16 @@ sm_enable_recv_cb (GObject *source,
       return;
   }
 
+  if (pipelined && wocky_strdiff (
+          wocky_stanza_get_top_node (reply)->name, "enabled"))
+    {
+      DEBUG ("pipelined sm enable failed; trying again");
+      priv->pipelining_failed = TRUE;
+      sm_enable (self);
+      g_object_unref (reply);
+      return;
+    }
+
   wocky_xmpp_connection_set_stanza_recv_count (priv->conn, 0);
   wocky_xmpp_connection_set_sm_enabled (priv->conn, TRUE);
 
@@ -2030,8 +2233,59 @@ iq_bind_resource_sent_cb (GObject *source,
     }
 
   DEBUG ("bind iq set stanza sent");
-  wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
-      iq_bind_resource_recv_cb, data);
+
+  /* pipelined: the stream open and features come before the reply */
+  if (priv->bind_pipelined)
+    wocky_xmpp_connection_recv_open_async (priv->conn, priv->cancellable,
+        xmpp_init_recv_cb, data);
+  else
+    wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
+        iq_bind_resource_recv_cb, data);
+}
+
+static void
+pipelined_sm_discarded_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer data)
+{
+  GError *error = NULL;
+  WockyConnector *self = WOCKY_CONNECTOR (data);
+  WockyConnectorPrivate *priv = self->priv;
+  WockyStanza *reply;
+
+  reply = wocky_xmpp_connection_recv_stanza_finish (priv->conn, result, &error);
+
+  if (reply == NULL)
+    {
+      abort_connect_error (self, &error, "Failed to receive sm enable result");
+      g_error_free (error);
+      return;
+    }
+
+  g_object_unref (reply);
+  iq_bind_resource (self);
+}
+
+/* A pipelined bind iq set failed: the server may not have expected it so
+ * early. Forget about the sm enable request sent behind it (the server will
+ * have refused it, not having bound a resource) and bind again. */
+static void
+pipelining_fallback (WockyConnector *self)
+{
+  WockyConnectorPrivate *priv = self->priv;
+
+  priv->pipelining_failed = TRUE;
+
+  if (priv->sm_pipelined)
+    {
+      priv->sm_pipelined = FALSE;
+      wocky_xmpp_connection_recv_stanza_async (priv->conn, priv->cancellable,
+          pipelined_sm_discarded_cb, self);
+    }
+  else
+    {
+      iq_bind_resource (self);
+    }
 }
 
 static void
@@ -2045,7 +2299,9 @@ iq_bind_resource_recv_cb (GObject *source,
   WockyStanza *reply = NULL;
   WockyStanzaType type = WOCKY_STANZA_TYPE_NONE;
   WockyStanzaSubType sub = WOCKY_STANZA_SUB_TYPE_NONE;
+  gboolean pipelined = priv->bind_pipelined;
 
+  priv->bind_pipelined = FALSE;
   reply = wocky_xmpp_connection_recv_stanza_finish (priv->conn, result, &error);
   DEBUG ("bind iq response stanza received");
   if (reply == NULL)
@@ -2073,6 +2329,13 @@ iq_bind_resource_recv_cb (GObject *source,
       WockyConnectorError code;
 
       case WOCKY_STANZA_SUB_TYPE_ERROR:
+        if (pipelined)
+          {
+            DEBUG ("pipelined bind iq set failed; trying again");
+            pipelining_fallback (self);
+            break;
+          }
+
         wocky_stanza_extract_errors (reply, NULL, &error, NULL, NULL);
 
         switch (error->code)
@@ -2112,7 +2375,10 @@ iq_bind_resource_recv_cb (GObject *source,
 
         node = wocky_stanza_get_top_node (priv->features);
 
-        if (wocky_node_get_child_ns (node, "sm", WOCKY_XMPP_NS_STREAM_MANAGEMENT) != NULL)
+        if (priv->sm_pipelined)
+          wocky_xmpp_connection_recv_stanza_async (priv->conn,
+              priv->cancellable, sm_enable_recv_cb, self);
+        else if (wocky_node_get_child_ns (node, "sm", WOCKY_XMPP_NS_STREAM_MANAGEMENT) != NULL)
           sm_enable (self);
         else
           establish_session (self);
@@ -2139,10 +2405,21 @@ establish_session (WockyConnector *self)
   WockyNode *feat = (priv->features != NULL) ?
     wocky_stanza_get_top_node (priv->features) : NULL;
 
+  WockyNode *session_feat = (feat != NULL) ?
+    wocky_node_get_child_ns (feat, "session", WOCKY_XMPP_NS_SESSION) : NULL;
+
+  /* servers implementing RFC 6121 keep advertising the session for the  *
+   * sake of old clients, but say it is optional: save the round trip    */
+  if (priv->pipelining && (session_feat != NULL) &&
+      (wocky_node_get_child (session_feat, "optional") != NULL))
+    {
+      DEBUG ("session establishment is optional; skipping it");
+      session_feat = NULL;
+    }
+
   /* _if_ session setup is advertised, a session _must_ be established to *
    * allow presence/messaging etc to work. If not, it is not important    */
-  if ((feat != NULL) &&
-      wocky_node_get_child_ns (feat, "session", WOCKY_XMPP_NS_SESSION))
+  if (session_feat != NULL)
     {
       WockyXmppConnection *conn = priv->conn;
       gchar *id = wocky_xmpp_connection_new_id (conn);
@@ -2477,7 +2754,16 @@ connector_connect_async (WockyConnector *self,
       const gchar *srv = (priv->xmpp_host == NULL) ? host : priv->xmpp_host;
 
       DEBUG ("host: %s; port: %d", priv->xmpp_host, priv->xmpp_port);
-      connect_to_host_async (self, srv, port);
+
+      if (priv->connection_racing)
+        race_connect_async (self, srv, NULL, NULL, port);
+      else
+        connect_to_host_async (self, srv, port);
+    }
+  else if (priv->connection_racing || priv->direct_tls)
+    {
+      race_connect_async (self, host, "xmpp-client",
+          priv->direct_tls ? "xmpps-client" : NULL, 5222);
     }
   else
     {
@@ -2591,3 +2877,18 @@ wocky_connector_new (const gchar *jid,
       "tls-handler", tls_handler,
       NULL);
 }
+
+/**
+ * wocky_connector_clear_dns_cache:
+ *
+ * Forgets the SRV and address records cached by connectors using
+ * #WockyConnector:connection-racing, so that the next connection attempt
+ * resolves the server's name again. This is done automatically when the
+ * system's resolver configuration changes, but may be useful when the
+ * network changes in a way which doesn't affect it.
+ */
+void
+wocky_connector_clear_dns_cache (void)
+{
+  wocky_dns_cache_clear ();
+}
@@ -198,6 +198,8 @@ gboolean wocky_connector_unregister_finish (WockyConnector *self,
 void wocky_connector_set_auth_registry (WockyConnector *self,
     WockyAuthRegistry *registry);
 
+void wocky_connector_clear_dns_cache (void);
+
 G_END_DECLS
 
 #endif /* #ifndef __WOCKY_CONNECTOR_H__*/
@@ -37,6 +37,7 @@
 #include <string.h>
 
 #include "wocky-namespaces.h"
+#include "wocky-node-private.h"
 #include "wocky-utils.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_DATA_FORM
@@ -953,6 +954,8 @@ parse_unique_result (WockyDataForm *self,
 {
   GSList *l, *item = NULL;
 
+  _wocky_node_ensure_children (x);
+
   for (l = x->children; l != NULL; l = g_slist_next (l))
     {
       WockyNode *node = l->data;
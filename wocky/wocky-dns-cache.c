@@ -0,0 +1,260 @@
+/*
+ * wocky-dns-cache.c - Source for the process-wide DNS cache
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * SRV and address records resolved by the connection racing code of
+ * WockyConnector, shared by every connector of the process so that
+ * reconnecting (or connecting several accounts on the same server) doesn't
+ * hit the resolver again.
+ *
+ * The cache belongs to the default GResolver: it is emptied when another
+ * resolver is made the default, or when the default one reloads its
+ * configuration (which GLib does when /etc/resolv.conf changes).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-dns-cache.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_CONNECTOR
+#include "wocky-debug-internal.h"
+
+typedef struct
+{
+  /* Owned GSrvTarget or GInetAddress */
+  GList *records;
+  /* Monotonic time, in microseconds */
+  gint64 expires;
+} CacheEntry;
+
+G_LOCK_DEFINE_STATIC (cache);
+
+/* Only accessed with the lock held */
+static GResolver *cache_resolver = NULL;
+static gulong reload_id = 0;
+/* owned gchar * => owned CacheEntry */
+static GHashTable *services = NULL;
+static GHashTable *hosts = NULL;
+
+static void
+srv_target_list_free (GList *targets)
+{
+  g_list_foreach (targets, (GFunc) g_srv_target_free, NULL);
+  g_list_free (targets);
+}
+
+static GList *
+srv_target_list_copy (GList *targets)
+{
+  GList *copy = NULL;
+  GList *l;
+
+  for (l = targets; l != NULL; l = l->next)
+    copy = g_list_prepend (copy, g_srv_target_copy (l->data));
+
+  return g_list_reverse (copy);
+}
+
+static void
+service_entry_free (CacheEntry *entry)
+{
+  srv_target_list_free (entry->records);
+  g_slice_free (CacheEntry, entry);
+}
+
+static void
+host_entry_free (CacheEntry *entry)
+{
+  g_resolver_free_addresses (entry->records);
+  g_slice_free (CacheEntry, entry);
+}
+
+static void
+clear_locked (void)
+{
+  if (services != NULL)
+    g_hash_table_remove_all (services);
+
+  if (hosts != NULL)
+    g_hash_table_remove_all (hosts);
+}
+
+static void
+resolver_reload_cb (GResolver *resolver,
+    gpointer user_data)
+{
+  DEBUG ("resolver configuration changed; forgetting cached records");
+
+  G_LOCK (cache);
+  clear_locked ();
+  G_UNLOCK (cache);
+}
+
+/* Must be called with the lock held */
+static void
+ensure_cache (void)
+{
+  GResolver *resolver = g_resolver_get_default ();
+
+  if (services == NULL)
+    {
+      services = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+          (GDestroyNotify) service_entry_free);
+      hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+          (GDestroyNotify) host_entry_free);
+    }
+
+  if (resolver != cache_resolver)
+    {
+      /* Records from another resolver can't be trusted */
+      clear_locked ();
+
+      if (cache_resolver != NULL)
+        {
+          g_signal_handler_disconnect (cache_resolver, reload_id);
+          g_object_unref (cache_resolver);
+        }
+
+      cache_resolver = g_object_ref (resolver);
+      reload_id = g_signal_connect (cache_resolver, "reload",
+          G_CALLBACK (resolver_reload_cb), NULL);
+    }
+
+  g_object_unref (resolver);
+}
+
+/* Must be called with the lock held */
+static CacheEntry *
+lookup_locked (GHashTable *table,
+    const gchar *key)
+{
+  CacheEntry *entry = g_hash_table_lookup (table, key);
+
+  if (entry == NULL)
+    return NULL;
+
+  if (entry->expires <= g_get_monotonic_time ())
+    {
+      g_hash_table_remove (table, key);
+      return NULL;
+    }
+
+  return entry;
+}
+
+static gchar *
+service_key (const gchar *service,
+    const gchar *domain)
+{
+  return g_strdup_printf ("_%s._tcp.%s", service, domain);
+}
+
+GList *
+wocky_dns_cache_lookup_service (const gchar *service,
+    const gchar *domain)
+{
+  gchar *key = service_key (service, domain);
+  CacheEntry *entry;
+  GList *records = NULL;
+
+  G_LOCK (cache);
+  ensure_cache ();
+
+  entry = lookup_locked (services, key);
+  if (entry != NULL)
+    records = srv_target_list_copy (entry->records);
+
+  G_UNLOCK (cache);
+
+  DEBUG ("%s: %s", key, records != NULL ? "hit" : "miss");
+  g_free (key);
+  return records;
+}
+
+GList *
+wocky_dns_cache_lookup_host (const gchar *hostname)
+{
+  CacheEntry *entry;
+  GList *records = NULL;
+
+  G_LOCK (cache);
+  ensure_cache ();
+
+  entry = lookup_locked (hosts, hostname);
+  if (entry != NULL)
+    {
+      records = g_list_copy (entry->records);
+      g_list_foreach (records, (GFunc) g_object_ref, NULL);
+    }
+
+  G_UNLOCK (cache);
+
+  DEBUG ("%s: %s", hostname, records != NULL ? "hit" : "miss");
+  return records;
+}
+
+void
+wocky_dns_cache_add_service (const gchar *service,
+    const gchar *domain,
+    GList *records)
+{
+  CacheEntry *entry;
+
+  g_return_if_fail (records != NULL);
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->records = srv_target_list_copy (records);
+  entry->expires = g_get_monotonic_time () +
+      WOCKY_DNS_CACHE_TTL * G_USEC_PER_SEC;
+
+  G_LOCK (cache);
+  ensure_cache ();
+  g_hash_table_replace (services, service_key (service, domain), entry);
+  G_UNLOCK (cache);
+}
+
+void
+wocky_dns_cache_add_host (const gchar *hostname,
+    GList *records)
+{
+  CacheEntry *entry;
+
+  g_return_if_fail (records != NULL);
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->records = g_list_copy (records);
+  g_list_foreach (entry->records, (GFunc) g_object_ref, NULL);
+  entry->expires = g_get_monotonic_time () +
+      WOCKY_DNS_CACHE_TTL * G_USEC_PER_SEC;
+
+  G_LOCK (cache);
+  ensure_cache ();
+  g_hash_table_replace (hosts, g_strdup (hostname), entry);
+  G_UNLOCK (cache);
+}
+
+void
+wocky_dns_cache_clear (void)
+{
+  G_LOCK (cache);
+  clear_locked ();
+  G_UNLOCK (cache);
+}
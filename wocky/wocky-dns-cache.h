@@ -0,0 +1,57 @@
+/*
+ * wocky-dns-cache.h - Header for the process-wide DNS cache
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_DNS_CACHE_H
+#define WOCKY_DNS_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* How long records are kept, in seconds. GResolver doesn't tell us the TTL
+ * of the records it returns, so this is a conservative guess. */
+#define WOCKY_DNS_CACHE_TTL 300
+
+/* Both return a deep copy of the cached records, or NULL if there are none
+ * (or they expired) */
+GList *wocky_dns_cache_lookup_service (
+    const gchar *service,
+    const gchar *domain);
+
+GList *wocky_dns_cache_lookup_host (
+    const gchar *hostname);
+
+/* Both copy @records, which may not be empty */
+void wocky_dns_cache_add_service (
+    const gchar *service,
+    const gchar *domain,
+    GList *records);
+
+void wocky_dns_cache_add_host (
+    const gchar *hostname,
+    GList *records);
+
+void wocky_dns_cache_clear (void);
+
+G_END_DECLS
+
+#endif /* WOCKY_DNS_CACHE_H */
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "wocky-text.h"
+
 
 struct _WockyHttpProxy
 {
@@ -95,7 +97,8 @@ create_request (GProxyAddress *proxy_address, gboolean *has_cred)
         *has_cred = TRUE;
 
       cred = g_strdup_printf ("%s:%s", username, password);
-      base64_cred = g_base64_encode ((guchar *) cred, strlen (cred));
+      base64_cred = wocky_text_base64_encode ((guchar *) cred,
+          strlen (cred));
       g_free (cred);
       g_string_append_printf (request,
           "Proxy-Authorization: %s\r\n",
@@ -961,38 +961,39 @@ produce_payload_type (WockyJingleContent *content,
   WockyNode *pt_node;
   gchar buf[16];
 
-  pt_node = wocky_node_add_child (desc_node, "payload-type");
+  if (dialect == WOCKY_JINGLE_DIALECT_GTALK3 &&
+      type == WOCKY_JINGLE_MEDIA_TYPE_AUDIO)
+    {
+      /* Gtalk 03 has either an audio or a video session, in case of a
+       * video session the audio codecs need to set their namespace to
+       * WOCKY_XMPP_NS_GOOGLE_SESSION_PHONE. In the case of an audio session it
+       * doesn't matter, so just always set the namespace on audio
+       * payloads.
+       */
+      pt_node = wocky_node_add_child_ns (desc_node, "payload-type",
+          WOCKY_XMPP_NS_GOOGLE_SESSION_PHONE);
+    }
+  else
+    {
+      pt_node = wocky_node_add_child (desc_node, "payload-type");
+    }
 
   /* id: required */
   sprintf (buf, "%d", p->id);
   wocky_node_set_attribute (pt_node, "id", buf);
 
-  if (dialect == WOCKY_JINGLE_DIALECT_GTALK3)
+  if (dialect == WOCKY_JINGLE_DIALECT_GTALK3 &&
+      type != WOCKY_JINGLE_MEDIA_TYPE_AUDIO)
     {
-      if (type == WOCKY_JINGLE_MEDIA_TYPE_AUDIO)
-        {
-          /* Gtalk 03 has either an audio or a video session, in case of a
-           * video session the audio codecs need to set their namespace to
-           * WOCKY_XMPP_NS_GOOGLE_SESSION_PHONE. In the case of an audio session it
-           * doesn't matter, so just always set the namespace on audio
-           * payloads.
-           */
-          pt_node->ns = g_quark_from_static_string (
-              WOCKY_XMPP_NS_GOOGLE_SESSION_PHONE);
-        }
-      else
-        {
-          /* If width, height and framerate aren't set the google server ignore
-           * our initiate.. These are a recv parameters, to it doesn't matter
-           * for what we're sending, just for what we're getting.. 320x240
-           * seems a sane enough default */
-          wocky_node_set_attributes (pt_node,
-            "width", "320",
-            "height", "240",
-            "framerate", "30",
-            NULL);
-        }
-
+      /* If width, height and framerate aren't set the google server ignore
+       * our initiate.. These are a recv parameters, to it doesn't matter
+       * for what we're sending, just for what we're getting.. 320x240
+       * seems a sane enough default */
+      wocky_node_set_attributes (pt_node,
+        "width", "320",
+        "height", "240",
+        "framerate", "30",
+        NULL);
     }
 
   /* name: optional */
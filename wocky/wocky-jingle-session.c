@@ -37,7 +37,6 @@
  */
 #include "wocky-jingle-media-rtp.h"
 #include "wocky-namespaces.h"
-#include "wocky-node-private.h"
 #include "wocky-resource-contact.h"
 #include "wocky-utils.h"
 
@@ -2620,10 +2619,11 @@ wocky_jingle_session_acknowledge_iq (WockyJingleSession *self,
 
           if (reply != NULL)
             {
-              WockyNode *reply_node = wocky_stanza_get_top_node (reply);
+              WockyNodeTree *echo = wocky_node_tree_new_from_node (used_node);
 
-              reply_node->children = g_slist_append (reply_node->children,
-                  _wocky_node_copy (used_node));
+              wocky_node_add_node_tree (wocky_stanza_get_top_node (reply),
+                  echo);
+              g_object_unref (echo);
               wocky_porter_send (self->priv->porter, reply);
               g_object_unref (reply);
               return;
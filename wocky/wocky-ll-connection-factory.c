@@ -146,7 +146,7 @@ connect_to_host_cb (GObject *source_object,
       return;
     }
 
-  connection = wocky_xmpp_connection_new (G_IO_STREAM (conn));
+  connection = wocky_xmpp_connection_new_pooled (G_IO_STREAM (conn));
 
   DEBUG ("made connection");
 
@@ -31,6 +31,14 @@
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_CONNECTOR
 #include "wocky-debug-internal.h"
 
+/* Limits on the stanzas of link-local connections we didn't set up
+ * ourselves: generous for what link-local XMPP carries, while keeping what
+ * any peer on the network can make us allocate within bounds */
+#define LL_MAX_STANZA_SIZE (1024 * 1024)
+#define LL_MAX_DEPTH 64
+#define LL_MAX_ATTRIBUTES 128
+#define LL_MAX_CHILDREN 4096
+
 static void initable_iface_init (gpointer, gpointer);
 
 G_DEFINE_TYPE_WITH_CODE (WockyLLConnector, wocky_ll_connector, G_TYPE_OBJECT,
@@ -182,8 +190,15 @@ wocky_ll_connector_constructed (GObject *object)
   if (G_OBJECT_CLASS (wocky_ll_connector_parent_class)->constructed)
     G_OBJECT_CLASS (wocky_ll_connector_parent_class)->constructed (object);
 
+  /* Anyone on the local network can connect to us: whatever they send
+   * mustn't be able to take up more than so much memory */
   if (priv->connection == NULL)
-    priv->connection = wocky_xmpp_connection_new (priv->stream);
+    {
+      priv->connection = wocky_xmpp_connection_new_pooled (priv->stream);
+      wocky_xmpp_connection_set_limits (priv->connection,
+          LL_MAX_STANZA_SIZE, LL_MAX_DEPTH, LL_MAX_ATTRIBUTES,
+          LL_MAX_CHILDREN);
+    }
 }
 static void
 wocky_ll_connector_class_init (
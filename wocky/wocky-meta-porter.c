@@ -45,6 +45,7 @@ typedef uint16_t u_int16_t;
 #include "wocky-ll-contact.h"
 #include "wocky-ll-connector.h"
 #include "wocky-loopback-stream.h"
+#include "wocky-timer-wheel.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_PORTER
 #include "wocky-debug-internal.h"
@@ -63,6 +64,7 @@ enum
   PROP_CONTACT_FACTORY,
   PROP_CONNECTION,
   PROP_RESOURCE,
+  PROP_IQ_TIMEOUT,
 };
 
 #define PORTER_JID_QUARK \
@@ -86,6 +88,11 @@ struct _WockyMetaPorterPrivate
   guint16 port;
 
   guint next_handler_id;
+
+  /* Deadlines of the pending IQs, which may still be waiting for a
+   * connection to the contact to be made */
+  WockyTimerWheel *iq_timers;
+  guint iq_timeout;
 };
 
 typedef struct
@@ -441,6 +448,8 @@ wocky_meta_porter_init (WockyMetaPorter *self)
       WOCKY_TYPE_META_PORTER, WockyMetaPorterPrivate);
 
   self->priv = priv;
+
+  priv->iq_timers = wocky_timer_wheel_new (WOCKY_TIMER_WHEEL_DEFAULT_TICK);
 }
 
 /* FIXME: these two functions are a hack until we get the
@@ -706,7 +715,7 @@ create_loopback_porter (WockyMetaPorter *self)
     return;
 
   stream = wocky_loopback_stream_new ();
-  connection = wocky_xmpp_connection_new (stream);
+  connection = wocky_xmpp_connection_new_pooled (stream);
 
   /* really simple connector */
   wocky_xmpp_connection_send_open_async (connection, NULL, NULL, NULL,
@@ -752,6 +761,9 @@ wocky_meta_porter_finalize (GObject *object)
   g_free (priv->jid);
   priv->jid = NULL;
 
+  wocky_timer_wheel_free (priv->iq_timers);
+  priv->iq_timers = NULL;
+
   if (G_OBJECT_CLASS (wocky_meta_porter_parent_class)->finalize)
     G_OBJECT_CLASS (wocky_meta_porter_parent_class)->finalize (object);
 }
@@ -800,6 +812,9 @@ wocky_meta_porter_get_property (GObject *object,
         /* nothing; just here to implement WockyPorter */
         g_value_set_string (value, NULL);
         break;
+      case PROP_IQ_TIMEOUT:
+        g_value_set_uint (value, priv->iq_timeout);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -829,6 +844,9 @@ wocky_meta_porter_set_property (GObject *object,
       case PROP_RESOURCE:
         /* nothing; just here to implement WockyPorter */
         break;
+      case PROP_IQ_TIMEOUT:
+        priv->iq_timeout = g_value_get_uint (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -872,6 +890,22 @@ wocky_meta_porter_class_init (
       PROP_JID, "bare-jid");
   g_object_class_override_property (object_class,
       PROP_RESOURCE, "resource");
+
+  /**
+   * WockyMetaPorter:iq-timeout:
+   *
+   * The default deadline, in milliseconds, applied to IQs sent with
+   * wocky_porter_send_iq_async(), including the time taken to connect to
+   * the contact. If no reply has been received once it has elapsed, the
+   * operation fails with %WOCKY_PORTER_ERROR_TIMED_OUT. 0 (the default)
+   * means IQs never time out.
+   */
+  param_spec = g_param_spec_uint ("iq-timeout", "IQ timeout",
+      "Default IQ reply deadline in milliseconds, or 0 for none",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_IQ_TIMEOUT,
+      param_spec);
 }
 
 /**
@@ -1508,8 +1542,52 @@ typedef struct
   WockyMetaPorter *self; /* already reffed by simple */
   GSimpleAsyncResult *simple;
   WockyContact *contact;
+  WockyStanza *stanza;
+
+  /* Monotonic time after which the IQ times out, or 0 */
+  gint64 deadline;
+  WockyTimer *timer;
+  gboolean timed_out;
 } SendIQData;
 
+static void wocky_meta_porter_send_iq_async (WockyPorter *porter,
+    WockyStanza *stanza, GCancellable *cancellable,
+    GAsyncReadyCallback callback, gpointer user_data);
+
+static void
+send_iq_data_done (SendIQData *data)
+{
+  if (data->timer != NULL)
+    wocky_timer_wheel_remove (data->self->priv->iq_timers, data->timer);
+
+  wocky_meta_porter_unhold (data->self, data->contact);
+
+  /* unref simple here as we depend on it holding potentially the last
+   * ref on self */
+  g_object_unref (data->simple);
+  g_object_unref (data->contact);
+  g_object_unref (data->stanza);
+  g_slice_free (SendIQData, data);
+}
+
+static void
+meta_porter_send_iq_timed_out_cb (gpointer user_data)
+{
+  SendIQData *data = user_data;
+
+  /* The wheel has already dropped the timer */
+  data->timer = NULL;
+  data->timed_out = TRUE;
+
+  DEBUG ("No reply received to IQ in time; giving up");
+
+  /* The connection attempt or the IQ on the underlying porter is still in
+   * flight; its result will be ignored and data freed once it finishes. */
+  g_simple_async_result_set_error (data->simple, WOCKY_PORTER_ERROR,
+      WOCKY_PORTER_ERROR_TIMED_OUT, "No reply to IQ was received");
+  g_simple_async_result_complete_in_idle (data->simple);
+}
+
 static void
 meta_porter_send_iq_cb (GObject *source_object,
     GAsyncResult *result,
@@ -1523,6 +1601,18 @@ meta_porter_send_iq_cb (GObject *source_object,
   stanza = wocky_porter_send_iq_finish (WOCKY_PORTER (source_object),
       result, &error);
 
+  if (data->timed_out)
+    {
+      DEBUG ("IQ operation finished after having timed out; ignoring");
+
+      if (stanza != NULL)
+        g_object_unref (stanza);
+
+      g_clear_error (&error);
+      send_iq_data_done (data);
+      return;
+    }
+
   if (stanza == NULL)
     {
       g_simple_async_result_set_from_error (simple, error);
@@ -1534,15 +1624,15 @@ meta_porter_send_iq_cb (GObject *source_object,
       g_simple_async_result_set_op_res_gpointer (simple, stanza, g_object_unref);
     }
 
-  g_simple_async_result_complete (simple);
+  if (data->timer != NULL)
+    {
+      wocky_timer_wheel_remove (data->self->priv->iq_timers, data->timer);
+      data->timer = NULL;
+    }
 
-  wocky_meta_porter_unhold (data->self, data->contact);
+  g_simple_async_result_complete (simple);
 
-  /* unref simple here as we depend on it holding potentially the last
-   * ref on self */
-  g_object_unref (data->simple);
-  g_object_unref (data->contact);
-  g_slice_free (SendIQData, data);
+  send_iq_data_done (data);
 }
 
 static void
@@ -1553,54 +1643,66 @@ meta_porter_send_iq_got_porter_cb (WockyMetaPorter *self,
     GSimpleAsyncResult *simple,
     gpointer user_data)
 {
-  WockyStanza *stanza = user_data;
-  WockyContact *contact;
-
-  contact = wocky_stanza_get_to_contact (stanza);
+  SendIQData *data = user_data;
+  guint timeout_ms = 0;
 
-  if (error != NULL)
+  if (data->timed_out)
     {
+      /* Don't bother sending an IQ nobody is waiting for any more */
+      send_iq_data_done (data);
+    }
+  else if (error != NULL)
+    {
+      if (data->timer != NULL)
+        {
+          wocky_timer_wheel_remove (self->priv->iq_timers, data->timer);
+          data->timer = NULL;
+        }
+
       g_simple_async_result_set_from_error (simple, error);
       g_simple_async_result_complete (simple);
 
-      wocky_meta_porter_unhold (self, contact);
-
-      /* unref simple here as we depend on it potentially holding the
-       * last ref to self */
-      g_object_unref (simple);
+      send_iq_data_done (data);
     }
   else
     {
-      SendIQData *data = g_slice_new0 (SendIQData);
-      data->self = self;
-      data->simple = simple;
-      data->contact = g_object_ref (contact);
+      /* Let the underlying porter enforce what is left of the deadline too,
+       * so its reply handler doesn't outlive ours */
+      if (data->deadline > 0)
+        {
+          gint64 remaining = data->deadline - g_get_monotonic_time ();
 
-      wocky_porter_send_iq_async (porter, stanza, cancellable,
-          meta_porter_send_iq_cb, data);
-    }
+          timeout_ms = MAX (remaining / 1000, 1);
+        }
 
-  g_object_unref (stanza);
+      wocky_porter_send_iq_with_timeout_async (porter, data->stanza,
+          timeout_ms, cancellable, meta_porter_send_iq_cb, data);
+    }
 }
 
 static void
-wocky_meta_porter_send_iq_async (WockyPorter *porter,
+wocky_meta_porter_send_iq_with_timeout_async (WockyPorter *porter,
     WockyStanza *stanza,
+    guint timeout_ms,
     GCancellable *cancellable,
     GAsyncReadyCallback callback,
     gpointer user_data)
 {
   WockyMetaPorter *self = WOCKY_META_PORTER (porter);
   WockyMetaPorterPrivate *priv = self->priv;
-  GSimpleAsyncResult *simple;
+  SendIQData *data;
   WockyContact *to;
 
   to = wocky_stanza_get_to_contact (stanza);
 
   g_return_if_fail (WOCKY_IS_LL_CONTACT (to));
 
-  simple = g_simple_async_result_new (G_OBJECT (self), callback, user_data,
-      wocky_meta_porter_send_iq_async);
+  data = g_slice_new0 (SendIQData);
+  data->self = self;
+  data->simple = g_simple_async_result_new (G_OBJECT (self), callback,
+      user_data, wocky_meta_porter_send_iq_async);
+  data->contact = g_object_ref (to);
+  data->stanza = g_object_ref (stanza);
 
   wocky_meta_porter_hold (self, to);
 
@@ -1612,8 +1714,28 @@ wocky_meta_porter_send_iq_async (WockyPorter *porter,
           "from", priv->jid);
     }
 
+  if (timeout_ms > 0)
+    {
+      data->deadline = g_get_monotonic_time () + (gint64) timeout_ms * 1000;
+      data->timer = wocky_timer_wheel_add (priv->iq_timers, timeout_ms,
+          meta_porter_send_iq_timed_out_cb, data);
+    }
+
   open_porter_if_necessary (self, WOCKY_LL_CONTACT (to), cancellable,
-      meta_porter_send_iq_got_porter_cb, simple, g_object_ref (stanza));
+      meta_porter_send_iq_got_porter_cb, data->simple, data);
+}
+
+static void
+wocky_meta_porter_send_iq_async (WockyPorter *porter,
+    WockyStanza *stanza,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  WockyMetaPorter *self = WOCKY_META_PORTER (porter);
+
+  wocky_meta_porter_send_iq_with_timeout_async (porter, stanza,
+      self->priv->iq_timeout, cancellable, callback, user_data);
 }
 
 static WockyStanza *
@@ -1855,6 +1977,8 @@ wocky_porter_iface_init (gpointer g_iface,
 
   iface->send_iq_async = wocky_meta_porter_send_iq_async;
   iface->send_iq_finish = wocky_meta_porter_send_iq_finish;
+  iface->send_iq_with_timeout_async =
+    wocky_meta_porter_send_iq_with_timeout_async;
 
   iface->force_close_async = wocky_meta_porter_force_close_async;
   iface->force_close_finish = wocky_meta_porter_force_close_finish;
@@ -31,6 +31,103 @@ G_BEGIN_DECLS
 
 WockyNode *_wocky_node_copy (WockyNode *node);
 
+gsize _wocky_node_estimate_size (WockyNode *node);
+
+/* Text content of a node being parsed, which can arrive in any number of
+ * pieces: appending is amortised O(1), and only the new bytes are checked
+ * for valid UTF-8, characters cut in two between pieces included */
+typedef struct
+{
+  GString *str;
+  /* the first valid bytes of str; anything after them is the beginning of
+   * a character whose end hasn't arrived yet */
+  gsize valid;
+} WockyNodeText;
+
+void _wocky_node_text_init (WockyNodeText *text);
+
+void _wocky_node_text_append (WockyNodeText *text,
+    const gchar *content,
+    gsize size);
+
+/* Appends the text gathered so far to @node's content, and empties @text */
+void _wocky_node_text_finish (WockyNodeText *text,
+    WockyNode *node);
+
+/* Empties @text, dropping what it held */
+void _wocky_node_text_reset (WockyNodeText *text);
+
+void _wocky_node_text_clear (WockyNodeText *text);
+
+/* The descendants of a node being parsed can be recorded, in the order the
+ * parser reports them, rather than built: the node then gets the record,
+ * and its children are only built once something asks for them.
+ * @attributes are as in wocky_xmpp_reader's SAX callbacks. */
+void _wocky_node_record_start (GByteArray *record,
+    const gchar *name,
+    const gchar *ns,
+    gint n_attributes,
+    const gchar **attributes);
+
+void _wocky_node_record_text (GByteArray *record,
+    const gchar *text,
+    gsize len);
+
+void _wocky_node_record_end (GByteArray *record);
+
+/* Hands @record, of @node's children, to @node, which has none yet */
+void _wocky_node_set_record (WockyNode *node,
+    GByteArray *record);
+
+/* Builds @node's children if they were only recorded so far; to be called
+ * before reading node->children directly */
+void _wocky_node_ensure_children (WockyNode *node);
+
+/* Copies of a node borrow its children until either wants to change them,
+ * or the copy hands one out: this gives @node children which are its alone,
+ * copying those it borrows one level deep, and has the copies borrowing
+ * @node's children or those of its ancestors take their own. To be called
+ * before changing node->children directly. */
+void _wocky_node_own_children (WockyNode *node);
+
+/* Something derived from a tree, such as its serialization, can be kept for
+ * as long as the tree doesn't change: this marks @node and its descendants
+ * as clean. Changing a node through the API marks it and its ancestors as
+ * dirty again; changes made to the struct fields directly aren't noticed. */
+void _wocky_node_set_clean (WockyNode *node);
+
+gboolean _wocky_node_is_dirty (WockyNode *node);
+
+/* A build spec compiled once into a flat description of the tree, so that
+ * building it again only copies strings. Wherever the spec has @slot for an
+ * attribute value or text, the value is given when building instead; slots
+ * are numbered in the order they're added. */
+typedef struct _WockyNodeTemplate WockyNodeTemplate;
+
+WockyNodeTemplate *_wocky_node_template_new (const gchar *name,
+    GQuark ns,
+    const gchar *slot);
+
+/* Sets an attribute of the top-level element, as wocky_node_set_attribute()
+ * would */
+void _wocky_node_template_set_attribute (WockyNodeTemplate *template,
+    const gchar *key,
+    const gchar *value);
+
+/* Adds a wocky_node_add_build() spec under the top-level element; returns
+ * FALSE if it uses '*', which means nothing in a template */
+gboolean _wocky_node_template_add_build_va (WockyNodeTemplate *template,
+    va_list ap);
+
+guint _wocky_node_template_get_n_slots (WockyNodeTemplate *template);
+
+/* Builds a new tree with @values, one for each slot: a NULL value leaves
+ * out the attribute, or the text, that the slot stands for */
+WockyNode *_wocky_node_template_build (WockyNodeTemplate *template,
+    const gchar * const *values);
+
+void _wocky_node_template_free (WockyNodeTemplate *template);
+
 G_END_DECLS
 
 #endif /* #ifndef __WOCKY_NODE__PRIVATE_H__*/
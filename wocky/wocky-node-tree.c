@@ -198,6 +198,10 @@ wocky_node_tree_new_va (const gchar *name,
  *
  * Build a new WockyNodeTree that contains a copy of the given node.
  *
+ * The copy shares the descendants of @node with it until either of them
+ * changes them, so it's cheap to make. Nodes below @node found before making
+ * the copy still belong to @node, and changing them doesn't change the copy.
+ *
  * Returns: a new node-tree object
  */
 WockyNodeTree *
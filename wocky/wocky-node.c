@@ -30,6 +30,7 @@
 #include "wocky-node-tree.h"
 #include "wocky-utils.h"
 #include "wocky-namespaces.h"
+#include "wocky-text.h"
 
 /**
  * SECTION: wocky-node
@@ -54,6 +55,27 @@ typedef struct {
   GQuark ns;
 } Tuple;
 
+/* Nodes are only ever allocated by this file, as one of these; the fields
+ * after @node are kept out of the public struct */
+typedef struct {
+  WockyNode node;
+  /* children still to be built, see _wocky_node_ensure_children() */
+  GByteArray *record;
+  /* the node whose children this one is one of, if any */
+  WockyNode *parent;
+  /* set if @node.children are those of this other node, only borrowed by
+   * @node, which is a copy of it; see take_children() */
+  WockyNode *lender;
+  /* the copies of @node which borrow its children */
+  GSList *borrowers;
+  /* set until something derived from the node is kept, and again once the
+   * node or one of its descendants changes; a node which isn't dirty only has
+   * descendants which aren't either. See _wocky_node_set_clean() */
+  gboolean dirty;
+} WockyNodePrivate;
+
+#define PRIV(node) ((WockyNodePrivate *) (node))
+
 typedef struct {
   const gchar *ns_urn;
   gchar *prefix;
@@ -84,7 +106,7 @@ strndup_make_valid (const gchar *str, gssize len)
 
   result = g_string_sized_new (len);
 
-  while (!g_utf8_validate (remainder, left, &endp))
+  while (!wocky_text_utf8_validate (remainder, left, &endp))
     {
       g_string_append_len (result, remainder, endp - remainder);
       /* append U+FFFD REPLACEMENT CHARACTER */
@@ -113,7 +135,7 @@ strndup_validated (const gchar *str, gssize len)
     return NULL;
 
   /* Fast path, string happily validates, simple copy */
-  if (G_LIKELY (g_utf8_validate (str, len, NULL)))
+  if (G_LIKELY (wocky_text_utf8_validate (str, len, NULL)))
     {
       if (len < 0)
         return g_strdup (str);
@@ -141,7 +163,7 @@ concat_validated (const gchar *s1, const gchar *s2, gssize s2_size)
   if (s2_size < 0)
     s2_size = strlen (s2);
 
-  if (G_UNLIKELY (!g_utf8_validate (s2, s2_size, NULL)))
+  if (G_UNLIKELY (!wocky_text_utf8_validate (s2, s2_size, NULL)))
     {
       /* Make a validated copy we will free later on. Making a copy to just
        * concat and then free isn't the most efficient way, but at this point
@@ -167,7 +189,8 @@ new_node (const char *name, GQuark ns)
   g_return_val_if_fail (name != NULL, NULL);
   g_return_val_if_fail (ns != 0, NULL);
 
-  result = g_slice_new0 (WockyNode);
+  result = (WockyNode *) g_slice_new0 (WockyNodePrivate);
+  PRIV (result)->dirty = TRUE;
 
   result->name = strndup_validated (name, -1);
   result->ns = ns;
@@ -193,6 +216,36 @@ wocky_node_new (const char *name, const gchar *ns)
   return new_node (name, g_quark_from_string (ns));
 }
 
+/* To be called by whatever changes @node: it and its ancestors are dirty */
+static inline void
+changed (WockyNode *node)
+{
+  WockyNode *n;
+
+  for (n = node; n != NULL && !PRIV (n)->dirty; n = PRIV (n)->parent)
+    PRIV (n)->dirty = TRUE;
+}
+
+static void take_children (WockyNode *node);
+static void hand_out_children (WockyNode *node);
+
+/* To be called before @node changes: the copies borrowing the children of
+ * its ancestors would see the change too, so they take their own first,
+ * from the top down as those they take lend theirs in turn */
+static void
+unshare (WockyNode *node)
+{
+  WockyNode *parent = PRIV (node)->parent;
+
+  if (parent == NULL)
+    return;
+
+  unshare (parent);
+
+  while (PRIV (parent)->borrowers != NULL)
+    take_children (PRIV (parent)->borrowers->data);
+}
+
 static void
 attribute_free (Attribute *a)
 {
@@ -202,6 +255,28 @@ attribute_free (Attribute *a)
   g_slice_free (Attribute, a);
 }
 
+/* @node, which lends its children, is going away: the first of its
+ * borrowers takes them over, and lends them to the others */
+static void
+hand_over_children (WockyNode *node)
+{
+  GSList *borrowers = PRIV (node)->borrowers;
+  WockyNode *heir = borrowers->data;
+  GSList *l;
+
+  PRIV (heir)->lender = NULL;
+  PRIV (heir)->borrowers = g_slist_delete_link (borrowers, borrowers);
+
+  for (l = PRIV (heir)->borrowers; l != NULL; l = l->next)
+    PRIV (l->data)->lender = heir;
+
+  for (l = node->children; l != NULL; l = l->next)
+    PRIV (l->data)->parent = heir;
+
+  PRIV (node)->borrowers = NULL;
+  node->children = NULL;
+}
+
 /**
  * wocky_node_free:
  * @node: a #WockyNode.
@@ -223,11 +298,25 @@ wocky_node_free (WockyNode *node)
   g_free (node->content);
   g_free (node->language);
 
-  for (l = node->children; l != NULL ; l = l->next)
+  if (PRIV (node)->lender != NULL)
     {
-      wocky_node_free ((WockyNode *) l->data);
+      WockyNodePrivate *lender = PRIV (PRIV (node)->lender);
+
+      lender->borrowers = g_slist_remove (lender->borrowers, node);
     }
-  g_slist_free (node->children);
+  else
+    {
+      if (PRIV (node)->borrowers != NULL)
+        hand_over_children (node);
+
+      for (l = node->children; l != NULL ; l = l->next)
+        wocky_node_free ((WockyNode *) l->data);
+
+      g_slist_free (node->children);
+    }
+
+  if (PRIV (node)->record != NULL)
+    g_byte_array_unref (PRIV (node)->record);
 
   for (l = node->attributes; l != NULL ; l = l->next)
     {
@@ -236,7 +325,7 @@ wocky_node_free (WockyNode *node)
     }
   g_slist_free (node->attributes);
 
-  g_slice_free (WockyNode, node);
+  g_slice_free (WockyNodePrivate, PRIV (node));
 }
 
 /**
@@ -278,6 +367,8 @@ wocky_node_each_child (WockyNode *node,
 {
   GSList *l;
 
+  hand_out_children (node);
+
   for (l = node->children; l != NULL ; l = l->next)
     {
       WockyNode *n = (WockyNode *) l->data;
@@ -606,10 +697,13 @@ void
 wocky_node_set_attribute_n_ns (WockyNode *node, const gchar *key,
     const gchar *value, gsize value_size, const gchar *ns)
 {
-  Attribute *a = g_slice_new0 (Attribute);
+  Attribute *a;
   GSList *link;
   Tuple search;
 
+  unshare (node);
+  changed (node);
+  a = g_slice_new0 (Attribute);
   a->key = strndup_validated (key, -1);
   a->value = strndup_validated (value, value_size);
   a->prefix = g_strdup (wocky_node_attribute_ns_get_prefix_from_urn (ns));
@@ -685,6 +779,7 @@ wocky_node_get_child_ns (WockyNode *node, const gchar *name,
   t.key = name;
   t.ns = (ns != NULL ?  g_quark_from_string (ns) : 0);
 
+  hand_out_children (node);
   link = g_slist_find_custom (node->children, &t, node_compare_child);
 
   return (link == NULL) ? NULL : (WockyNode *) (link->data);
@@ -718,6 +813,8 @@ wocky_node_get_first_child (WockyNode *node)
 {
   g_return_val_if_fail (node != NULL, NULL);
 
+  hand_out_children (node);
+
   if (node->children == NULL)
     return NULL;
 
@@ -897,10 +994,14 @@ WockyNode *
 wocky_node_add_child_with_content_ns_q (WockyNode *node,
     const gchar *name, const gchar *content, GQuark ns)
 {
-  WockyNode *result = new_node (name, ns != 0 ? ns : node->ns);
+  WockyNode *result;
 
+  changed (node);
+  result = new_node (name, ns != 0 ? ns : node->ns);
   wocky_node_set_content (result, content);
 
+  _wocky_node_own_children (node);
+  PRIV (result)->parent = node;
   node->children = g_slist_append (node->children, result);
   return result;
 }
@@ -1007,6 +1108,8 @@ void
 wocky_node_set_language_n (WockyNode *node, const gchar *lang,
     gsize lang_size)
 {
+  unshare (node);
+  changed (node);
   g_free (node->language);
   node->language = strndup_validated (lang, lang_size);
 }
@@ -1038,6 +1141,8 @@ wocky_node_set_language (WockyNode *node, const gchar *lang)
 void
 wocky_node_set_content (WockyNode *node, const gchar *content)
 {
+  unshare (node);
+  changed (node);
   g_free (node->content);
   node->content = strndup_validated (content, -1);
 }
@@ -1054,6 +1159,9 @@ wocky_node_append_content (WockyNode *node,
     const gchar *content)
 {
   gchar *t = node->content;
+
+  unshare (node);
+  changed (node);
   node->content = concat_validated (t, content, -1);
   g_free (t);
 }
@@ -1072,10 +1180,422 @@ wocky_node_append_content_n (WockyNode *node, const gchar *content,
     gsize size)
 {
   gchar *t = node->content;
+
+  unshare (node);
+  changed (node);
   node->content = concat_validated (t, content, size);
   g_free (t);
 }
 
+/* What a text builder starts with, and keeps once its content has been
+ * handed over; anything bigger is given away along with the content */
+#define TEXT_INITIAL_SIZE 256
+#define TEXT_KEPT_SIZE 4096
+
+void
+_wocky_node_text_init (WockyNodeText *text)
+{
+  text->str = g_string_sized_new (TEXT_INITIAL_SIZE);
+  text->valid = 0;
+}
+
+void
+_wocky_node_text_append (WockyNodeText *text,
+    const gchar *content,
+    gsize size)
+{
+  GString *str = text->str;
+
+  g_string_append_len (str, content, size);
+
+  while (text->valid < str->len)
+    {
+      const gchar *start = str->str + text->valid;
+      const gchar *end;
+      const gchar *next;
+      gsize left = str->len - text->valid;
+
+      if (G_LIKELY (wocky_text_utf8_validate (start, left, &end)))
+        {
+          text->valid = str->len;
+          break;
+        }
+
+      text->valid = end - str->str;
+      left = str->len - text->valid;
+
+      /* The rest of the character is in the next piece */
+      if (g_utf8_get_char_validated (end, left) == (gunichar) -2)
+        break;
+
+      /* Replace what doesn't validate by U+FFFD REPLACEMENT CHARACTER, as
+       * strndup_make_valid() does */
+      next = g_utf8_find_next_char (end, end + left);
+      g_string_erase (str, text->valid, next == NULL ? left : next - end);
+      g_string_insert_len (str, text->valid, "\357\277\275", 3);
+      text->valid += 3;
+    }
+}
+
+void
+_wocky_node_text_finish (WockyNodeText *text,
+    WockyNode *node)
+{
+  GString *str = text->str;
+
+  /* a character which never got its end */
+  if (G_UNLIKELY (text->valid < str->len))
+    {
+      g_string_truncate (str, text->valid);
+      g_string_append (str, "\357\277\275");
+    }
+
+  if (str->len == 0)
+    {
+      /* nothing to add */
+    }
+  else if (node->content != NULL)
+    {
+      /* text on both sides of a child element, which XMPP hardly uses */
+      wocky_node_append_content_n (node, str->str, str->len);
+    }
+  else if (str->allocated_len > TEXT_KEPT_SIZE)
+    {
+      /* big enough that handing the buffer over beats copying it */
+      gsize len = str->len;
+
+      node->content = g_realloc (g_string_free (str, FALSE), len + 1);
+      text->str = g_string_sized_new (TEXT_INITIAL_SIZE);
+    }
+  else
+    {
+      node->content = g_strndup (str->str, str->len);
+    }
+
+  _wocky_node_text_reset (text);
+}
+
+void
+_wocky_node_text_reset (WockyNodeText *text)
+{
+  g_string_truncate (text->str, 0);
+  text->valid = 0;
+}
+
+void
+_wocky_node_text_clear (WockyNodeText *text)
+{
+  if (text->str != NULL)
+    g_string_free (text->str, TRUE);
+
+  text->str = NULL;
+  text->valid = 0;
+}
+
+/* A record is a sequence of events, each starting with one of these tags.
+ * Strings are stored as their length and their bytes followed by a NUL,
+ * or as RECORD_NULL for NULL. */
+#define RECORD_START 'S'
+#define RECORD_TEXT 'T'
+#define RECORD_END 'E'
+#define RECORD_NULL G_MAXUINT32
+
+static void
+record_string (GByteArray *record,
+    const gchar *str,
+    gsize len)
+{
+  guint32 l = (str != NULL) ? len : RECORD_NULL;
+
+  g_byte_array_append (record, (const guint8 *) &l, sizeof (l));
+
+  if (str != NULL)
+    {
+      g_byte_array_append (record, (const guint8 *) str, len);
+      g_byte_array_append (record, (const guint8 *) "", 1);
+    }
+}
+
+static void
+record_cstring (GByteArray *record,
+    const gchar *str)
+{
+  record_string (record, str, str != NULL ? strlen (str) : 0);
+}
+
+static void
+record_tag (GByteArray *record,
+    guint8 tag)
+{
+  g_byte_array_append (record, &tag, 1);
+}
+
+static const gchar *
+read_string (const guint8 **p,
+    gsize *len)
+{
+  const gchar *str;
+  guint32 l;
+
+  memcpy (&l, *p, sizeof (l));
+  *p += sizeof (l);
+
+  if (l == RECORD_NULL)
+    return NULL;
+
+  str = (const gchar *) *p;
+  *p += l + 1;
+
+  if (len != NULL)
+    *len = l;
+
+  return str;
+}
+
+void
+_wocky_node_record_start (GByteArray *record,
+    const gchar *name,
+    const gchar *ns,
+    gint n_attributes,
+    const gchar **attributes)
+{
+  guint32 n = n_attributes;
+  gint i;
+
+  record_tag (record, RECORD_START);
+  record_cstring (record, name);
+  record_cstring (record, ns);
+  g_byte_array_append (record, (const guint8 *) &n, sizeof (n));
+
+  for (i = 0; i < n_attributes * 5; i += 5)
+    {
+      record_cstring (record, attributes[i]);
+      record_cstring (record, attributes[i + 1]);
+      record_cstring (record, attributes[i + 2]);
+      record_string (record, attributes[i + 3],
+          attributes[i + 4] - attributes[i + 3]);
+    }
+}
+
+void
+_wocky_node_record_text (GByteArray *record,
+    const gchar *text,
+    gsize len)
+{
+  record_tag (record, RECORD_TEXT);
+  record_string (record, text, len);
+}
+
+void
+_wocky_node_record_end (GByteArray *record)
+{
+  record_tag (record, RECORD_END);
+}
+
+void
+_wocky_node_set_record (WockyNode *node,
+    GByteArray *record)
+{
+  g_assert (node->children == NULL);
+  g_assert (PRIV (node)->record == NULL);
+
+  PRIV (node)->record = record;
+}
+
+/* Marks @node and its descendants as clean, down to those which are already */
+static void
+set_clean (WockyNode *node)
+{
+  GSList *l;
+
+  if (!PRIV (node)->dirty)
+    return;
+
+  PRIV (node)->dirty = FALSE;
+
+  /* children still to be built are marked once built */
+  for (l = node->children; l != NULL; l = l->next)
+    set_clean (l->data);
+}
+
+/* Builds the children of @node from its record, as the reader would have
+ * built them while parsing */
+static void
+build_children (WockyNode *node)
+{
+  GByteArray *record = PRIV (node)->record;
+  const guint8 *p = record->data;
+  const guint8 *end = p + record->len;
+  GSList *parents = NULL;
+  WockyNode *current = node;
+  WockyNode *text_node = NULL;
+  WockyNodeText text;
+  WockyNode *parent = PRIV (node)->parent;
+  gboolean dirty = PRIV (node)->dirty;
+
+  /* building children which were there all along changes nothing the
+   * copies borrowing from @node's ancestors could see, nor anything kept */
+  PRIV (node)->parent = NULL;
+  PRIV (node)->dirty = TRUE;
+  PRIV (node)->record = NULL;
+  _wocky_node_text_init (&text);
+
+  while (p < end)
+    {
+      guint8 tag = *p++;
+      const gchar *str;
+      gsize len;
+
+      if (tag == RECORD_TEXT)
+        {
+          str = read_string (&p, &len);
+          text_node = current;
+          _wocky_node_text_append (&text, str, len);
+          continue;
+        }
+
+      if (text_node != NULL)
+        {
+          _wocky_node_text_finish (&text, text_node);
+          text_node = NULL;
+        }
+
+      if (tag == RECORD_START)
+        {
+          const gchar *name = read_string (&p, NULL);
+          const gchar *ns = read_string (&p, NULL);
+          guint32 n, i;
+
+          memcpy (&n, p, sizeof (n));
+          p += sizeof (n);
+
+          parents = g_slist_prepend (parents, current);
+          current = wocky_node_add_child_ns (current, name, ns);
+
+          for (i = 0; i < n; i++)
+            {
+              const gchar *attr_name = read_string (&p, NULL);
+              const gchar *attr_prefix = read_string (&p, NULL);
+              const gchar *attr_uri = read_string (&p, NULL);
+              const gchar *attr_value = read_string (&p, &len);
+
+              if (!wocky_strdiff (attr_prefix, "xml") &&
+                  !wocky_strdiff (attr_name, "lang"))
+                {
+                  wocky_node_set_language_n (current, attr_value, len);
+                }
+              else
+                {
+                  if (attr_prefix != NULL)
+                    wocky_node_attribute_ns_set_prefix (
+                        g_quark_from_string (attr_uri), attr_prefix);
+
+                  wocky_node_set_attribute_n_ns (current, attr_name,
+                      attr_value, len, attr_uri);
+                }
+            }
+        }
+      else
+        {
+          g_assert (tag == RECORD_END);
+          g_assert (parents != NULL);
+
+          current = parents->data;
+          parents = g_slist_delete_link (parents, parents);
+        }
+    }
+
+  g_assert (parents == NULL);
+  g_assert (text_node == NULL);
+
+  _wocky_node_text_clear (&text);
+  g_byte_array_unref (record);
+
+  PRIV (node)->parent = parent;
+
+  if (!dirty)
+    set_clean (node);
+}
+
+void
+_wocky_node_ensure_children (WockyNode *node)
+{
+  if (G_UNLIKELY (PRIV (node)->record != NULL))
+    build_children (node);
+}
+
+/* Lets @copy, which has no children yet, borrow those of @node */
+static void
+borrow_children (WockyNode *copy,
+    WockyNode *node)
+{
+  WockyNode *lender = PRIV (node)->lender != NULL ? PRIV (node)->lender : node;
+
+  copy->children = lender->children;
+  PRIV (copy)->lender = lender;
+  PRIV (lender)->borrowers = g_slist_prepend (PRIV (lender)->borrowers, copy);
+}
+
+/* Gives @node, if it only borrows its children, copies of them of its own,
+ * which borrow the children of theirs in turn */
+static void
+take_children (WockyNode *node)
+{
+  WockyNode *lender = PRIV (node)->lender;
+  GSList *l;
+
+  if (G_LIKELY (lender == NULL))
+    return;
+
+  PRIV (lender)->borrowers = g_slist_remove (PRIV (lender)->borrowers, node);
+  PRIV (node)->lender = NULL;
+  node->children = NULL;
+
+  for (l = lender->children; l != NULL; l = l->next)
+    {
+      WockyNode *copy = _wocky_node_copy (l->data);
+
+      /* the copy is no more changed than what it's copied from */
+      PRIV (copy)->dirty = PRIV (l->data)->dirty;
+      PRIV (copy)->parent = node;
+      node->children = g_slist_prepend (node->children, copy);
+    }
+
+  node->children = g_slist_reverse (node->children);
+}
+
+/* To be called before handing out @node's children: those of a copy are
+ * copied for it first, so that changing them can't change the original,
+ * whose own are always handed out as they are */
+static void
+hand_out_children (WockyNode *node)
+{
+  _wocky_node_ensure_children (node);
+  take_children (node);
+}
+
+void
+_wocky_node_own_children (WockyNode *node)
+{
+  hand_out_children (node);
+  unshare (node);
+
+  while (PRIV (node)->borrowers != NULL)
+    take_children (PRIV (node)->borrowers->data);
+}
+
+void
+_wocky_node_set_clean (WockyNode *node)
+{
+  set_clean (node);
+}
+
+gboolean
+_wocky_node_is_dirty (WockyNode *node)
+{
+  return PRIV (node)->dirty;
+}
+
 static gboolean
 attribute_to_string (const gchar *key, const gchar *value,
     const gchar *prefix, const gchar *ns,
@@ -1117,6 +1637,8 @@ node_to_string (WockyNode *node,
   wocky_node_each_attribute (node, attribute_to_string, str);
   g_string_append_c (str, '\n');
 
+  _wocky_node_ensure_children (node);
+
   nprefix = g_strdup_printf ("%s    ", prefix);
   if (node->content != NULL && *node->content != '\0')
     g_string_append_printf (str, "%s\"%s\"\n", nprefix, node->content);
@@ -1197,6 +1719,9 @@ wocky_node_equal (WockyNode *node0,
     }
 
   /* Recursively compare children, order matters */
+  _wocky_node_ensure_children (node0);
+  _wocky_node_ensure_children (node1);
+
   for (l0 = node0->children, l1 = node1->children ;
       l0 != NULL && l1 != NULL;
       l0 = g_slist_next (l0), l1 = g_slist_next (l1))
@@ -1263,6 +1788,8 @@ wocky_node_is_superset (WockyNode *node,
     }
 
   /* Recursively check children; order doesn't matter */
+  _wocky_node_ensure_children (subset);
+
   for (l = subset->children; l != NULL; l = g_slist_next (l))
     {
       WockyNode *pattern_child = (WockyNode *) l->data;
@@ -1309,6 +1836,8 @@ wocky_node_iter_init (WockyNodeIter *iter,
   g_return_if_fail (iter != NULL);
   g_return_if_fail (node != NULL);
 
+  hand_out_children (node);
+
   iter->node = node;
   iter->pending = node->children;
   iter->current = NULL;
@@ -1370,6 +1899,8 @@ wocky_node_iter_remove (WockyNodeIter *iter)
   g_return_if_fail (iter->current != NULL);
 
   g_assert (iter->current->data != NULL);
+  _wocky_node_own_children (iter->node);
+  changed (iter->node);
   wocky_node_free (iter->current->data);
 
   iter->node->children = g_slist_delete_link (iter->node->children,
@@ -1522,6 +2053,345 @@ wocky_node_add_build_va (WockyNode *node, va_list ap)
   g_slist_free (stack);
 }
 
+typedef struct {
+  gchar *key;
+  gchar *value;
+  /* the slot giving the value, or -1 if it's @value */
+  gint slot;
+} TemplateAttribute;
+
+typedef struct {
+  gchar *name;
+  GQuark ns;
+  gchar *language;
+  gchar *content;
+  gint content_slot;
+  GArray *attributes;
+  /* the index of the element after this one's descendants */
+  guint end;
+} TemplateElement;
+
+struct _WockyNodeTemplate {
+  const gchar *slot;
+  guint n_slots;
+  /* TemplateElement, in document order */
+  GArray *elements;
+};
+
+static guint
+template_add_element (WockyNodeTemplate *template,
+    const gchar *name,
+    GQuark ns)
+{
+  TemplateElement e = { NULL, };
+
+  e.name = strndup_validated (name, -1);
+  e.ns = ns;
+  e.content_slot = -1;
+  e.attributes = g_array_new (FALSE, FALSE, sizeof (TemplateAttribute));
+  e.end = template->elements->len + 1;
+  g_array_append_val (template->elements, e);
+
+  return template->elements->len - 1;
+}
+
+static TemplateElement *
+template_get_element (WockyNodeTemplate *template,
+    guint i)
+{
+  return &g_array_index (template->elements, TemplateElement, i);
+}
+
+/* Returns the slot @value stands for, taking the next one, or -1 if @value
+ * is a value of its own */
+static gint
+template_take_slot (WockyNodeTemplate *template,
+    const gchar *value)
+{
+  if (value != template->slot)
+    return -1;
+
+  return template->n_slots++;
+}
+
+static void
+template_set_attribute (WockyNodeTemplate *template,
+    guint i,
+    const gchar *key,
+    const gchar *value)
+{
+  GArray *attributes = template_get_element (template, i)->attributes;
+  TemplateAttribute a;
+  guint k;
+
+  /* like wocky_node_set_attribute(), setting it again moves it last */
+  for (k = 0; k < attributes->len; k++)
+    {
+      TemplateAttribute *old = &g_array_index (attributes,
+          TemplateAttribute, k);
+
+      if (!strcmp (old->key, key))
+        {
+          g_free (old->key);
+          g_free (old->value);
+          g_array_remove_index (attributes, k);
+          break;
+        }
+    }
+
+  a.key = strndup_validated (key, -1);
+  a.slot = template_take_slot (template, value);
+  a.value = a.slot < 0 ? strndup_validated (value, -1) : NULL;
+  g_array_append_val (attributes, a);
+}
+
+WockyNodeTemplate *
+_wocky_node_template_new (const gchar *name,
+    GQuark ns,
+    const gchar *slot)
+{
+  WockyNodeTemplate *template;
+
+  g_return_val_if_fail (name != NULL, NULL);
+  g_return_val_if_fail (ns != 0, NULL);
+  g_return_val_if_fail (slot != NULL, NULL);
+
+  template = g_slice_new0 (WockyNodeTemplate);
+  template->slot = slot;
+  template->elements = g_array_new (FALSE, FALSE, sizeof (TemplateElement));
+  template_add_element (template, name, ns);
+
+  return template;
+}
+
+void
+_wocky_node_template_set_attribute (WockyNodeTemplate *template,
+    const gchar *key,
+    const gchar *value)
+{
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (value != NULL);
+
+  template_set_attribute (template, 0, key, value);
+}
+
+gboolean
+_wocky_node_template_add_build_va (WockyNodeTemplate *template,
+    va_list ap)
+{
+  GArray *stack = g_array_new (FALSE, FALSE, sizeof (guint));
+  WockyNodeBuildTag arg;
+  guint top = 0;
+  gboolean ret = TRUE;
+
+  g_array_append_val (stack, top);
+
+  while ((arg = va_arg (ap, WockyNodeBuildTag)) != 0)
+    {
+      TemplateElement *e;
+
+      g_assert (stack->len > 0);
+      top = g_array_index (stack, guint, stack->len - 1);
+      e = template_get_element (template, top);
+
+      switch (arg)
+        {
+        case WOCKY_NODE_ATTRIBUTE:
+          {
+            gchar *key = va_arg (ap, gchar *);
+            gchar *value = va_arg (ap, gchar *);
+
+            g_assert (key != NULL);
+            g_assert (value != NULL);
+            template_set_attribute (template, top, key, value);
+          }
+          break;
+
+        case WOCKY_NODE_START:
+          {
+            gchar *name = va_arg (ap, gchar *);
+            guint child;
+
+            g_assert (name != NULL);
+            child = template_add_element (template, name, e->ns);
+            g_array_append_val (stack, child);
+          }
+          break;
+
+        case WOCKY_NODE_TEXT:
+          {
+            gchar *txt = va_arg (ap, gchar *);
+
+            g_free (e->content);
+            e->content_slot = template_take_slot (template, txt);
+            e->content = e->content_slot < 0 ?
+                strndup_validated (txt, -1) : NULL;
+          }
+          break;
+
+        case WOCKY_NODE_XMLNS:
+          {
+            gchar *ns = va_arg (ap, gchar *);
+
+            g_assert (ns != NULL);
+            g_assert (ns != template->slot);
+            e->ns = g_quark_from_string (ns);
+          }
+          break;
+
+        case WOCKY_NODE_LANGUAGE:
+          {
+            gchar *lang = va_arg (ap, gchar *);
+
+            g_assert (lang != NULL);
+            g_assert (lang != template->slot);
+            g_free (e->language);
+            e->language = strndup_validated (lang, -1);
+          }
+          break;
+
+        case WOCKY_NODE_END:
+          {
+            g_warn_if_fail (stack->len > 1);
+
+            if (stack->len > 1)
+              {
+                e->end = template->elements->len;
+                g_array_set_size (stack, stack->len - 1);
+              }
+          }
+          break;
+
+        case WOCKY_NODE_ASSIGN_TO:
+          {
+            /* there's no node to assign until the template is built */
+            (void) va_arg (ap, WockyNode **);
+            g_critical ("'%c' can't be used in a template", arg);
+            ret = FALSE;
+          }
+          break;
+
+        default:
+          g_critical ("unknown build tag %c", arg);
+          g_assert_not_reached ();
+        }
+    }
+
+  if (G_UNLIKELY (stack->len > 1))
+    g_warning ("improperly nested build spec! %u left unclosed",
+        stack->len - 1);
+
+  /* whatever is still open, the top-level element included, ends here */
+  while (stack->len > 0)
+    {
+      top = g_array_index (stack, guint, stack->len - 1);
+      template_get_element (template, top)->end = template->elements->len;
+      g_array_set_size (stack, stack->len - 1);
+    }
+
+  g_array_unref (stack);
+  return ret;
+}
+
+guint
+_wocky_node_template_get_n_slots (WockyNodeTemplate *template)
+{
+  return template->n_slots;
+}
+
+static WockyNode *
+template_build_element (WockyNodeTemplate *template,
+    guint i,
+    const gchar * const *values)
+{
+  TemplateElement *e = template_get_element (template, i);
+  WockyNode *node = (WockyNode *) g_slice_new0 (WockyNodePrivate);
+  GSList *l;
+  guint k;
+
+  PRIV (node)->dirty = TRUE;
+
+  /* what came from the spec was validated when compiling it, so only the
+   * values going into the slots need checking */
+  node->name = g_strdup (e->name);
+  node->ns = e->ns;
+  node->language = g_strdup (e->language);
+
+  if (e->content_slot < 0)
+    node->content = g_strdup (e->content);
+  else
+    node->content = strndup_validated (values[e->content_slot], -1);
+
+  for (k = e->attributes->len; k > 0; k--)
+    {
+      TemplateAttribute *ta = &g_array_index (e->attributes,
+          TemplateAttribute, k - 1);
+      Attribute *a;
+
+      if (ta->slot >= 0 && values[ta->slot] == NULL)
+        continue;
+
+      a = g_slice_new0 (Attribute);
+      a->key = g_strdup (ta->key);
+      a->value = ta->slot < 0 ?
+          g_strdup (ta->value) : strndup_validated (values[ta->slot], -1);
+      node->attributes = g_slist_prepend (node->attributes, a);
+    }
+
+  for (k = i + 1; k < e->end; k = template_get_element (template, k)->end)
+    node->children = g_slist_prepend (node->children,
+        template_build_element (template, k, values));
+
+  node->children = g_slist_reverse (node->children);
+
+  for (l = node->children; l != NULL; l = l->next)
+    PRIV (l->data)->parent = node;
+
+  return node;
+}
+
+WockyNode *
+_wocky_node_template_build (WockyNodeTemplate *template,
+    const gchar * const *values)
+{
+  g_return_val_if_fail (template != NULL, NULL);
+  g_return_val_if_fail (values != NULL || template->n_slots == 0, NULL);
+
+  return template_build_element (template, 0, values);
+}
+
+void
+_wocky_node_template_free (WockyNodeTemplate *template)
+{
+  guint i, k;
+
+  if (template == NULL)
+    return;
+
+  for (i = 0; i < template->elements->len; i++)
+    {
+      TemplateElement *e = template_get_element (template, i);
+
+      g_free (e->name);
+      g_free (e->language);
+      g_free (e->content);
+
+      for (k = 0; k < e->attributes->len; k++)
+        {
+          TemplateAttribute *a = &g_array_index (e->attributes,
+              TemplateAttribute, k);
+
+          g_free (a->key);
+          g_free (a->value);
+        }
+
+      g_array_unref (e->attributes);
+    }
+
+  g_array_unref (template->elements);
+  g_slice_free (WockyNodeTemplate, template);
+}
+
 WockyNode *
 _wocky_node_copy (WockyNode *node)
 {
@@ -1544,19 +2414,59 @@ _wocky_node_copy (WockyNode *node)
       result->attributes = g_slist_append (result->attributes, b);
     }
 
-  for (l = node->children ; l != NULL; l = g_slist_next (l))
-    result->children = g_slist_append (result->children,
-      _wocky_node_copy ((WockyNode *) l->data));
+  /* what hasn't been built yet can as well be built for the copy later */
+  if (PRIV (node)->record != NULL)
+    PRIV (result)->record = g_byte_array_ref (PRIV (node)->record);
+
+  /* and what has been can be borrowed until either node changes it */
+  if (node->children != NULL)
+    borrow_children (result, node);
 
   return result;
 }
 
+/* Rough size of @node once serialized, without the cost of serializing it:
+ * names, attributes and text plus the markup around them, ignoring escaping
+ * and namespace declarations. */
+gsize
+_wocky_node_estimate_size (WockyNode *node)
+{
+  gsize size;
+  gsize name_len = strlen (node->name);
+  GSList *l;
+
+  /* <name></name> */
+  size = 2 * name_len + 5;
+
+  if (node->content != NULL)
+    size += strlen (node->content);
+
+  for (l = node->attributes ; l != NULL; l = g_slist_next (l))
+    {
+      Attribute *a = l->data;
+
+      /* ' key="value"' */
+      size += strlen (a->key) + strlen (a->value) + 4;
+    }
+
+  /* near enough to what the children will take once built */
+  if (PRIV (node)->record != NULL)
+    size += PRIV (node)->record->len;
+
+  for (l = node->children ; l != NULL; l = g_slist_next (l))
+    size += _wocky_node_estimate_size ((WockyNode *) l->data);
+
+  return size;
+}
+
 /**
  * wocky_node_add_node_tree:
  * @node: A node
  * @tree: The node tree to add
  *
- * Copies the nodes from @tree, and appends them to @node's children.
+ * Copies the nodes from @tree, and appends them to @node's children. As with
+ * wocky_node_tree_new_from_node(), the copy shares its descendants with @tree
+ * until either changes them.
  *
  * Returns: the root of the copy of @tree added to @node.
  */
@@ -1568,7 +2478,10 @@ wocky_node_add_node_tree (WockyNode *node, WockyNodeTree *tree)
   g_return_val_if_fail (node != NULL, NULL);
   g_return_val_if_fail (tree != NULL, NULL);
 
+  changed (node);
   copy = _wocky_node_copy (wocky_node_tree_get_top_node (tree));
+  _wocky_node_own_children (node);
+  PRIV (copy)->parent = node;
   node->children = g_slist_append (node->children, copy);
 
   return copy;
@@ -1594,7 +2507,10 @@ wocky_node_prepend_node_tree (
   g_return_val_if_fail (node != NULL, NULL);
   g_return_val_if_fail (tree != NULL, NULL);
 
+  changed (node);
   copy = _wocky_node_copy (wocky_node_tree_get_top_node (tree));
+  _wocky_node_own_children (node);
+  PRIV (copy)->parent = node;
   node->children = g_slist_prepend (node->children, copy);
 
   return copy;
@@ -38,6 +38,9 @@
 #endif
 
 #include "wocky-tls.h"
+#include "wocky-tls-trust-store.h"
+#include "wocky-tls-ktls.h"
+#include "wocky-tls-worker.h"
 
 /* Apparently an implicit requirement of OpenSSL's headers... */
 #ifdef G_OS_WIN32
@@ -66,6 +69,7 @@
 
 #include <openssl/ssl.h>
 #include <openssl/x509_vfy.h>
+#include <openssl/evp.h>
 
 #include <ctype.h>
 #include <string.h>
@@ -127,9 +131,312 @@ typedef enum
   WOCKY_TLS_OP_WRITE
 } WockyTLSOperation;
 
+/* ALPN appeared in OpenSSL 1.0.2 */
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+#define HAVE_TLS_ALPN 1
+#endif
+
+/* what it takes to work out the keys of an established session (the key
+ * log callback, HKDF and the TLS PRF) appeared in OpenSSL 1.1.1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_TLS_KEY_EXPORT 1
+#include <openssl/kdf.h>
+#endif
+
 /* from openssl docs: not clear if this is exported as a constant by openssl */
 #define MAX_SSLV3_BLOCK_SIZE 0x4000
 
+/* Initial size of the cipherbyte buffers between OpenSSL and the base
+ * stream: the read one never needs to grow past it, as OpenSSL consumes
+ * records as soon as they are complete */
+#define RING_SIZE (4 * MAX_SSLV3_BLOCK_SIZE)
+
+/* How many clearbytes may be held back while a write to the base stream is
+ * in flight, so that they can go out together as full-size records */
+#define COALESCE_MAX (4 * MAX_SSLV3_BLOCK_SIZE)
+
+/* ************************************************************************* */
+/* cipherbyte ring buffers, which OpenSSL reads from and writes into         *
+ * directly through a custom BIO, and which the base stream reads into and   *
+ * writes from directly: this avoids copying every record in and out of a    *
+ * memory BIO                                                                */
+
+typedef struct
+{
+  gchar *data;
+  gsize size;    /* a power of 2 */
+  gsize head;    /* offset of the first byte held (unwrapped)   */
+  gsize tail;    /* offset past the last byte held (unwrapped)  */
+  /* set while the base stream is writing out of the buffer: if it has to
+   * grow meanwhile, the old one is kept until the write is over */
+  gboolean pinned;
+  GSList *retired;
+} WockyTLSRing;
+
+static void
+ring_init (WockyTLSRing *ring, gsize size)
+{
+  ring->data = g_malloc (size);
+  ring->size = size;
+  ring->head = ring->tail = 0;
+  ring->pinned = FALSE;
+  ring->retired = NULL;
+}
+
+static void
+ring_unpin (WockyTLSRing *ring)
+{
+  g_slist_foreach (ring->retired, (GFunc) g_free, NULL);
+  g_slist_free (ring->retired);
+  ring->retired = NULL;
+  ring->pinned = FALSE;
+}
+
+static void
+ring_free (WockyTLSRing *ring)
+{
+  ring_unpin (ring);
+  g_free (ring->data);
+  ring->data = NULL;
+}
+
+static inline gsize
+ring_used (const WockyTLSRing *ring)
+{
+  return ring->tail - ring->head;
+}
+
+/* the bytes at the head which can be handed out without wrapping */
+static gchar *
+ring_peek (WockyTLSRing *ring, gsize *len)
+{
+  gsize start = ring->head & (ring->size - 1);
+
+  *len = MIN (ring_used (ring), ring->size - start);
+  return ring->data + start;
+}
+
+static void
+ring_consume (WockyTLSRing *ring, gsize len)
+{
+  g_assert (len <= ring_used (ring));
+  ring->head += len;
+
+  /* start again from the beginning of the buffer whenever it's empty, to
+   * make the free space contiguous */
+  if (ring->head == ring->tail)
+    ring->head = ring->tail = 0;
+}
+
+/* grows (or unwraps) the ring so that at least @want bytes can be added at
+ * its tail without wrapping, and returns where they go */
+static gchar *
+ring_reserve (WockyTLSRing *ring, gsize want, gsize *len)
+{
+  gsize start = ring->tail & (ring->size - 1);
+  gsize contiguous = MIN (ring->size - ring_used (ring), ring->size - start);
+
+  if (contiguous < want)
+    {
+      gsize used = ring_used (ring);
+      gsize size = ring->size;
+      gchar *data;
+      gsize n;
+      gchar *from;
+
+      while (size - used < want)
+        size *= 2;
+
+      data = g_malloc (size);
+
+      /* linearise what we have at the start of the new buffer */
+      from = ring_peek (ring, &n);
+      memcpy (data, from, n);
+      memcpy (data + n, ring->data, used - n);
+
+      if (ring->pinned)
+        ring->retired = g_slist_prepend (ring->retired, ring->data);
+      else
+        g_free (ring->data);
+
+      ring->data = data;
+      ring->size = size;
+      ring->head = 0;
+      ring->tail = used;
+
+      start = used;
+      contiguous = size - used;
+    }
+
+  *len = contiguous;
+  return ring->data + start;
+}
+
+static inline void
+ring_produce (WockyTLSRing *ring, gsize len)
+{
+  ring->tail += len;
+}
+
+static gsize
+ring_pull (WockyTLSRing *ring, gchar *buffer, gsize count)
+{
+  gsize done = 0;
+
+  while (done < count && ring_used (ring) > 0)
+    {
+      gsize len;
+      gchar *from = ring_peek (ring, &len);
+
+      len = MIN (len, count - done);
+      memcpy (buffer + done, from, len);
+      ring_consume (ring, len);
+      done += len;
+    }
+
+  return done;
+}
+
+static void
+ring_push (WockyTLSRing *ring, const gchar *buffer, gsize count)
+{
+  gsize len;
+  gchar *to = ring_reserve (ring, count, &len);
+
+  memcpy (to, buffer, count);
+  ring_produce (ring, count);
+}
+
+/* the BIO OpenSSL sees: reads drain a ring, writes fill one */
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define BIO_get_data(b) ((b)->ptr)
+#define BIO_set_data(b, d) ((b)->ptr = (d))
+#define BIO_set_init(b, i) ((b)->init = (i))
+#endif
+
+static int
+ring_bio_write (BIO *bio, const char *buffer, int count)
+{
+  BIO_clear_retry_flags (bio);
+
+  if (count <= 0)
+    return 0;
+
+  ring_push (BIO_get_data (bio), buffer, count);
+  return count;
+}
+
+static int
+ring_bio_read (BIO *bio, char *buffer, int count)
+{
+  int done;
+
+  BIO_clear_retry_flags (bio);
+
+  if (count <= 0)
+    return 0;
+
+  done = ring_pull (BIO_get_data (bio), buffer, count);
+
+  if (done == 0)
+    {
+      BIO_set_retry_read (bio);
+      return -1;
+    }
+
+  return done;
+}
+
+static long
+ring_bio_ctrl (BIO *bio, int cmd, long num, void *ptr)
+{
+  WockyTLSRing *ring = BIO_get_data (bio);
+
+  switch (cmd)
+    {
+    case BIO_CTRL_PENDING:
+      return ring_used (ring);
+    case BIO_CTRL_RESET:
+      ring->head = ring->tail = 0;
+      return 1;
+    case BIO_CTRL_FLUSH:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+static int
+ring_bio_create (BIO *bio)
+{
+  BIO_set_init (bio, 0);
+  BIO_set_data (bio, NULL);
+  return 1;
+}
+
+static int
+ring_bio_destroy (BIO *bio)
+{
+  /* the ring belongs to the session */
+  BIO_set_data (bio, NULL);
+  return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BIO_METHOD ring_bio_method_struct = {
+  BIO_TYPE_SOURCE_SINK,
+  "wocky ring buffer",
+  ring_bio_write,
+  ring_bio_read,
+  NULL,
+  NULL,
+  ring_bio_ctrl,
+  ring_bio_create,
+  ring_bio_destroy,
+  NULL,
+};
+#endif
+
+static BIO_METHOD *
+ring_bio_method (void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  return &ring_bio_method_struct;
+#else
+  static gsize method = 0;
+
+  if (g_once_init_enter (&method))
+    {
+      BIO_METHOD *m = BIO_meth_new (
+          BIO_get_new_index () | BIO_TYPE_SOURCE_SINK, "wocky ring buffer");
+
+      BIO_meth_set_write (m, ring_bio_write);
+      BIO_meth_set_read (m, ring_bio_read);
+      BIO_meth_set_ctrl (m, ring_bio_ctrl);
+      BIO_meth_set_create (m, ring_bio_create);
+      BIO_meth_set_destroy (m, ring_bio_destroy);
+      g_once_init_leave (&method, (gsize) m);
+    }
+
+  return (BIO_METHOD *) method;
+#endif
+}
+
+static BIO *
+ring_bio_new (WockyTLSRing *ring)
+{
+  BIO *bio = BIO_new (ring_bio_method ());
+
+  if (bio != NULL)
+    {
+      BIO_set_data (bio, ring);
+      BIO_set_init (bio, 1);
+    }
+
+  return bio;
+}
+
 typedef struct
 {
   gboolean active;
@@ -144,7 +451,6 @@ typedef struct
   gboolean sync_complete;
   gchar *buffer;
   gsize count;
-  gchar rbuf[MAX_SSLV3_BLOCK_SIZE];
 } WockyTLSJob;
 
 typedef struct
@@ -168,12 +474,22 @@ struct _WockyTLSSession
   GError *error;
   gboolean async;
 
+  /* whether SSL_connect () or SSL_accept () runs on the worker pool */
+  gboolean worker_pool;
+
   /* tls server support */
   gboolean server;
   guint dh_bits;
   gchar *key_file;
   gchar *cert_file;
 
+  /* application protocol we offer (or, as a server, accept), in both plain
+   * and wire format, and the one which was negotiated */
+  gchar *alpn_protocol;
+  guchar *alpn_wire;
+  guint alpn_wire_len;
+  gchar *alpn_selected;
+
   /* frontend jobs */
   struct
   {
@@ -182,12 +498,54 @@ struct _WockyTLSSession
     WockyTLSJob write;
   } job;
 
+  /* cipherbytes received but not decrypted yet, and encrypted but not
+   * written to the base stream yet */
+  WockyTLSRing rring;
+  WockyTLSRing wring;
+
+  /* whether an async write of application data to the base stream is in
+   * flight; while it is, writes are held back in clear to be coalesced */
+  gboolean flushing;
+  GByteArray *clear;
+  /* an error writing held back data, for the next write to report */
+  GError *write_error;
+  gint flush_priority;
+  /* a close waiting for held back data to be written */
+  GSimpleAsyncResult *close_result;
+  gint close_priority;
+  GCancellable *close_cancellable;
+
   /* openssl structures */
   BIO *rbio;
   BIO *wbio;
   SSL_METHOD *method;
   SSL_CTX *ctx;
   SSL *ssl;
+
+  /* shared CAs and CRLs in ctx, if set */
+  WockyTLSTrust *trust;
+
+  /* whether to hand the records to the kernel after the handshake, and in
+   * which directions it took them: those go straight to ktls_socket */
+  gboolean kernel_offload;
+  GSocket *ktls_socket;
+  gboolean ktls_tx;
+  gboolean ktls_rx;
+#ifdef HAVE_TLS_KEY_EXPORT
+  /* the TLS 1.3 application traffic secrets, from the key log */
+  guint8 client_secret[EVP_MAX_MD_SIZE];
+  guint8 server_secret[EVP_MAX_MD_SIZE];
+  gsize secret_len;
+#endif
+};
+
+struct _WockyTLSTrust
+{
+  volatile gint ref_count;
+  guint generation;
+  /* OpenSSL locks it internally, so it can be shared by any number of
+   * SSL_CTXs */
+  X509_STORE *store;
 };
 
 typedef struct
@@ -238,10 +596,13 @@ G_DEFINE_TYPE (WockyTLSOutputStream, wocky_tls_output_stream, G_TYPE_OUTPUT_STRE
  * returned by the last openssl operation which MAY NOT have come from the   *
  * openssl error stack (cf SSL_get_error) and which MAY be SSL_ERROR_NONE:   *
  * it's not supposed to be SSL_ERROR_NONE if a problem occurred, but this is *
- * not actually guaranteed anywhere so we have to check for it here:         */
-static const gchar *error_to_string (long error)
+ * not actually guaranteed anywhere so we have to check for it here:         *
+ * The stack belongs to the calling thread, and the string is written to     *
+ * @buffer, so worker threads can use this too.                              */
+static const gchar *error_to_string_r (long error,
+                                       gchar *buffer,
+                                       gsize len)
 {
-  static gchar ssl_error[256];
   int e;
   int x;
   /* SSL_ERROR_NONE from ERR_get_error means we have emptied the stack, *
@@ -252,14 +613,22 @@ static const gchar *error_to_string (long error)
   /* we found an error in the stack, or were passed one in errnum: */
   if (e != SSL_ERROR_NONE)
     {
-      ERR_error_string_n ((gulong) e, ssl_error, sizeof (ssl_error));
-      return ssl_error;
+      ERR_error_string_n ((gulong) e, buffer, len);
+      return buffer;
     }
 
   /* No useful/informative/relevant error found */
   return NULL;
 }
 
+/* only for the main context: see error_to_string_r */
+static const gchar *error_to_string (long error)
+{
+  static gchar ssl_error[256];
+
+  return error_to_string_r (error, ssl_error, sizeof (ssl_error));
+}
+
 static GSimpleAsyncResult *
 wocky_tls_job_make_result (WockyTLSJob *job,
                            gssize   result)
@@ -341,81 +710,176 @@ wocky_tls_session_read_ready (GObject      *object,
  * receive SSL_ERROR_WANT_WRITE: reads, on the other hand, obviously
  * depend on how much data we have buffered, so SSL_ERROR_WANT_READ can
  * clearly happen */
+/* writes as much of the pending cipherbytes as is contiguous straight out
+ * of the write ring: the session is kept alive until the write is over */
+static void
+ring_write_async (WockyTLSSession *session,
+                  gint io_priority,
+                  GCancellable *cancellable)
+{
+  GOutputStream *output = g_io_stream_get_output_stream (session->stream);
+  gsize len;
+  gchar *wbuf = ring_peek (&session->wring, &len);
+
+  session->wring.pinned = TRUE;
+  g_output_stream_write_async (output, wbuf, len, io_priority, cancellable,
+                               wocky_tls_session_write_ready,
+                               g_object_ref (session));
+}
+
+/* reads straight into the free space of the read ring, asking for as much
+ * as is free rather than a single record */
+static void
+ring_read_async (WockyTLSSession *session,
+                 gint io_priority,
+                 GCancellable *cancellable)
+{
+  GInputStream *input = g_io_stream_get_input_stream (session->stream);
+  gsize len;
+  gchar *rbuf = ring_reserve (&session->rring, MAX_SSLV3_BLOCK_SIZE, &len);
+
+  g_input_stream_read_async (input, rbuf, len, io_priority, cancellable,
+                             wocky_tls_session_read_ready, session);
+}
+
 static void
 handshake_write (WockyTLSSession *session)
 {
-  gchar *wbuf;
   WockyTLSJob *handshake = &(session->job.handshake.job);
-  GCancellable *cancel = handshake->cancellable;
-  gint prio = handshake->io_priority;
-  GOutputStream *output = g_io_stream_get_output_stream (session->stream);
-  long wsize = BIO_get_mem_data (session->wbio, &wbuf);
 
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
 
-  g_output_stream_write_async (output, wbuf, wsize, prio, cancel,
-                               wocky_tls_session_write_ready, session);
+  ring_write_async (session, handshake->io_priority, handshake->cancellable);
 }
 
 static void
 handshake_read (WockyTLSSession *session)
 {
-  GInputStream *input = g_io_stream_get_input_stream (session->stream);
   WockyTLSJob *handshake = (WockyTLSJob *) &session->job.handshake.job;
 
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
 
-  g_input_stream_read_async (input,
-                             &(handshake->rbuf),
-                             MAX_SSLV3_BLOCK_SIZE,
-                             handshake->io_priority,
-                             handshake->cancellable,
-                             wocky_tls_session_read_ready,
-                             session);
+  ring_read_async (session, handshake->io_priority, handshake->cancellable);
+}
+
+/* what SSL_connect () or SSL_accept () made of the data so far */
+typedef struct
+{
+  gint result;
+  gulong errnum;
+  gchar errbuf[256];
+  const gchar *errstr;
+} WockyTLSHandshakeStep;
+
+static int ssl_handshake_continue (WockyTLSSession *session,
+                                   WockyTLSHandshakeStep *step);
+
+/* The key exchange and signatures happen within SSL_connect () or
+ * SSL_accept (), which only ever read and write the rings: all the I/O of
+ * the handshake is done by handshake_read () and handshake_write () */
+static void
+ssl_handshake_step (WockyTLSSession *session,
+                    WockyTLSHandshakeStep *step)
+{
+  const gchar *method;
+
+  if (session->server)
+    {
+      method = "SSL_accept";
+      step->result = SSL_accept (session->ssl);
+    }
+  else
+    {
+      method = "SSL_connect";
+      step->result = SSL_connect (session->ssl);
+    }
+  /* both look at the error stack of this thread */
+  step->errnum = SSL_get_error (session->ssl, step->result);
+  step->errstr = error_to_string_r (step->errnum, step->errbuf,
+                                    sizeof (step->errbuf));
+  DEBUG ("%s - result: %d; error: %ld", method, step->result, step->errnum);
+  DEBUG ("%s         : %s", method, step->errstr);
+}
+
+static void
+handshake_step_in_thread (GSimpleAsyncResult *result,
+                          gpointer            data,
+                          GCancellable       *cancellable)
+{
+  WockyTLSHandshakeStep *step = g_slice_new0 (WockyTLSHandshakeStep);
+
+  ssl_handshake_step (WOCKY_TLS_SESSION (data), step);
+  g_simple_async_result_set_op_res_gpointer (result, step, NULL);
+}
+
+static void
+handshake_step_done (GObject      *source,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  WockyTLSHandshakeStep *step = g_simple_async_result_get_op_res_gpointer (
+      G_SIMPLE_ASYNC_RESULT (res));
+
+  ssl_handshake_continue (WOCKY_TLS_SESSION (source), step);
+  g_slice_free (WockyTLSHandshakeStep, step);
+}
+
+void
+wocky_tls_session_set_worker_pool (WockyTLSSession *session,
+                                   gboolean worker_pool)
+{
+  g_return_if_fail (!session->job.handshake.job.active);
+
+  session->worker_pool = worker_pool;
 }
 
+/* With a worker pool, the step runs there and the rest of the handshake
+ * carries on in the main context once it's done */
 static int
 ssl_handshake (WockyTLSSession *session)
 {
-  gint result = 1;
-  gulong errnum = SSL_ERROR_NONE;
-  gboolean want_read = FALSE;
-  gboolean want_write = FALSE;
-  const gchar *errstr = NULL;
-  gboolean done = session->job.handshake.done;
-  gboolean fatal = FALSE;
+  WockyTLSHandshakeStep step = { 1, SSL_ERROR_NONE, "", NULL };
 
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
 
-  if (!done)
+  if (!session->job.handshake.done)
     {
-      const gchar *method;
-
-      if (session->server)
-        {
-          method = "SSL_accept";
-          result = SSL_accept (session->ssl);
-        }
-      else
+      if (session->worker_pool)
         {
-          method = "SSL_connect";
-          result = SSL_connect (session->ssl);
+          GSimpleAsyncResult *result = g_simple_async_result_new (
+              G_OBJECT (session), handshake_step_done, NULL, ssl_handshake);
+
+          wocky_tls_worker_run (result, handshake_step_in_thread,
+              g_object_ref (session), g_object_unref, NULL);
+          g_object_unref (result);
+          return session->job.handshake.state;
         }
-      errnum = SSL_get_error (session->ssl, result);
-      done = (result == 1);
-      errstr = error_to_string (errnum);
-      fatal = (errnum != SSL_ERROR_WANT_READ &&
-               errnum != SSL_ERROR_WANT_WRITE &&
-               errnum != SSL_ERROR_NONE);
-      DEBUG ("%s - result: %d; error: %ld", method, result, errnum);
-      DEBUG ("%s         : %s", method, errstr);
+
+      ssl_handshake_step (session, &step);
     }
 
+  return ssl_handshake_continue (session, &step);
+}
+
+static int
+ssl_handshake_continue (WockyTLSSession *session,
+                        WockyTLSHandshakeStep *step)
+{
+  gint result = step->result;
+  gulong errnum = step->errnum;
+  gboolean want_read = FALSE;
+  gboolean want_write = FALSE;
+  const gchar *errstr = step->errstr;
+  gboolean done = session->job.handshake.done || (result == 1);
+  gboolean fatal = (errnum != SSL_ERROR_WANT_READ &&
+                    errnum != SSL_ERROR_WANT_WRITE &&
+                    errnum != SSL_ERROR_NONE);
+
   /* buffered write data means we need to write */
-  want_write = BIO_pending (session->wbio) > 0;
+  want_write = ring_used (&session->wring) > 0;
 
   /* check to see if there's data waiting to go out:                *
    * since writes to a BIO should always succeed, it is possible to *
@@ -479,35 +943,55 @@ ssl_handshake (WockyTLSSession *session)
 static void
 ssl_fill (WockyTLSSession *session)
 {
-  GInputStream *input = g_io_stream_get_input_stream (session->stream);
-  gchar *rbuf = session->job.read.rbuf;
-  gint prio = session->job.read.io_priority;
-  GCancellable *cancel = session->job.read.cancellable;
-
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
 
-  g_input_stream_read_async (input, rbuf, MAX_SSLV3_BLOCK_SIZE, prio, cancel,
-                             wocky_tls_session_read_ready, session);
+  ring_read_async (session, session->job.read.io_priority,
+                   session->job.read.cancellable);
 }
 
+/* application data writes have already been reported as complete by the time
+ * they reach the base stream, so they can't be cancelled any more */
 static void
 ssl_flush (WockyTLSSession *session)
 {
-  long wsize;
-  gchar *wbuf;
-  gint prio = session->job.read.io_priority;
-  GOutputStream *output = g_io_stream_get_output_stream (session->stream);
-  GCancellable *cancel = session->job.read.cancellable;
-
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
 
-  wsize = BIO_get_mem_data (session->wbio, &wbuf);
+  if (ring_used (&session->wring) == 0)
+    return;
 
-  if (wsize > 0)
-    g_output_stream_write_async (output, wbuf, wsize, prio, cancel,
-                                 wocky_tls_session_write_ready, session);
+  session->flushing = TRUE;
+  ring_write_async (session, session->flush_priority, NULL);
+}
+
+/* encrypts @count clearbytes into the write ring */
+static gboolean
+ssl_encrypt (WockyTLSSession *session,
+             const gchar *buffer,
+             gsize count,
+             GError **error)
+{
+  int code;
+  int err;
+
+  if (count == 0)
+    return TRUE;
+
+  code = SSL_write (session->ssl, buffer, count);
+
+  if (code > 0)
+    return TRUE;
+
+  err = SSL_get_error (session->ssl, code);
+
+  if (err == SSL_ERROR_WANT_READ)
+    g_warning ("write caused read: unsupported TLS re-negotiation?");
+
+  DEBUG ("SSL write failed, setting error %d", err);
+  g_set_error (error, WOCKY_TLS_ERROR, err,
+               "OpenSSL write: protocol error %d", err);
+  return FALSE;
 }
 
 /* FALSE indicates we should go round again and try to get more data */
@@ -678,30 +1162,52 @@ wocky_tls_session_handshake (WockyTLSSession   *session,
             }
         }
 
-      want_write = BIO_pending (session->wbio) > 0;
+      want_write = ring_used (&session->wring) > 0;
       want_read = (errnum == SSL_ERROR_WANT_READ);
 
       if (want_write)
         {
-          gchar *wbuf;
           GOutputStream *out = g_io_stream_get_output_stream (session->stream);
-          long wsize = BIO_get_mem_data (session->wbio, &wbuf);
-          gssize sent = 0;
-          DEBUG ("sending %ld cipherbytes", wsize);
-          if (wsize > 0)
-            sent = g_output_stream_write (out, wbuf, wsize, NULL, error);
+          gsize wsize;
+          gchar *wbuf = ring_peek (&session->wring, &wsize);
+          gssize sent;
+
+          DEBUG ("sending %" G_GSIZE_FORMAT " cipherbytes", wsize);
+          sent = g_output_stream_write (out, wbuf, wsize, cancellable, error);
           DEBUG ("sent %" G_GSSIZE_FORMAT " cipherbytes", sent);
-          (void) BIO_reset (session->wbio);
+
+          if (sent < 0)
+            return NULL;
+
+          ring_consume (&session->wring, sent);
+
+          /* anything left over goes out on the next time round */
+          if (ring_used (&session->wring) > 0)
+            continue;
         }
 
       if (want_read)
         {
-          char rbuf[MAX_SSLV3_BLOCK_SIZE];
           GInputStream *in = g_io_stream_get_input_stream (session->stream);
+          gsize rsize;
+          gchar *rbuf = ring_reserve (&session->rring, MAX_SSLV3_BLOCK_SIZE,
+              &rsize);
           gssize bytes =
-            g_input_stream_read (in, &rbuf, sizeof(rbuf), NULL, error);
+            g_input_stream_read (in, rbuf, rsize, cancellable, error);
+
           DEBUG ("read %" G_GSSIZE_FORMAT " cipherbytes", bytes);
-          BIO_write (session->rbio, &rbuf, bytes);
+
+          if (bytes < 0)
+            return NULL;
+
+          if (bytes == 0)
+            {
+              g_set_error (error, WOCKY_TLS_ERROR, SSL_ERROR_SYSCALL,
+                  "Handshake: connection closed by peer");
+              return NULL;
+            }
+
+          ring_produce (&session->rring, bytes);
         }
 
       switch (errnum)
@@ -723,7 +1229,11 @@ wocky_tls_session_handshake (WockyTLSSession   *session,
     }
 
   if (done)
-    return g_object_new (WOCKY_TYPE_TLS_CONNECTION, "session", session, NULL);
+    {
+      ktls_offload (session);
+      return g_object_new (WOCKY_TYPE_TLS_CONNECTION, "session", session,
+          NULL);
+    }
 
   return NULL;
 }
@@ -731,9 +1241,9 @@ wocky_tls_session_handshake (WockyTLSSession   *session,
 /* ************************************************************************* */
 /* adding CA certificates & CRL lists for peer certificate verification      */
 
-void
-wocky_tls_session_add_ca (WockyTLSSession *session,
-                          const gchar *path)
+static void
+add_ca (X509_STORE *store,
+        const gchar *path)
 {
   gboolean ok = FALSE;
 
@@ -743,68 +1253,562 @@ wocky_tls_session_add_ca (WockyTLSSession *session,
       return;
     }
 
-  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      DEBUG ("Loading CA directory");
+      ok = X509_STORE_load_locations (store, NULL, path);
+    }
+
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    {
+      DEBUG ("Loading CA file");
+      ok = X509_STORE_load_locations (store, path, NULL);
+    }
+
+  if (!ok)
+    {
+      gulong e, f;
+      for (f = e = ERR_get_error (); e != 0; e = ERR_get_error ())
+        f = e;
+      DEBUG ("CA '%s' failed: %s", path, ERR_error_string (f, NULL));
+    }
+  else
+    DEBUG ("CA '%s' loaded", path);
+}
+
+static void
+add_crl (X509_STORE *store,
+         const gchar *path)
+{
+  gboolean ok = FALSE;
+
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    {
+      DEBUG ("CRL file or path '%s' not accessible", path);
+      return;
+    }
+
+  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      X509_LOOKUP_METHOD *method = X509_LOOKUP_hash_dir ();
+      X509_LOOKUP *lookup = X509_STORE_add_lookup (store, method);
+      DEBUG ("Loading CRL directory");
+      ok = X509_LOOKUP_add_dir (lookup, path, X509_FILETYPE_PEM) == 1;
+    }
+
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    {
+      X509_LOOKUP_METHOD *method = X509_LOOKUP_file ();
+      X509_LOOKUP *lookup = X509_STORE_add_lookup (store, method);
+      DEBUG ("Loading CRL file");
+      ok = X509_LOOKUP_load_file (lookup, path, X509_FILETYPE_PEM) == 1;
+    }
+
+  if (!ok)
+    {
+      gulong e, f;
+      for (f = e = ERR_get_error (); e != 0; e = ERR_get_error ())
+        f = e;
+      DEBUG ("'%s' failed: %s\n", path, ERR_error_string (f, NULL));
+    }
+  else
+    DEBUG ("'%s' loaded\n", path);
+}
+
+void
+wocky_tls_session_add_ca (WockyTLSSession *session,
+                          const gchar *path)
+{
+  add_ca (SSL_CTX_get_cert_store (session->ctx), path);
+}
+
+void
+wocky_tls_session_add_crl (WockyTLSSession *session,
+                           const gchar *path)
+{
+  add_crl (SSL_CTX_get_cert_store (session->ctx), path);
+}
+
+/* ************************************************************************* */
+/* CA certificates & CRLs shared between sessions: see wocky-tls-trust-store */
+
+WockyTLSTrust *
+wocky_tls_trust_new (GSList *cas,
+                     GSList *crl)
+{
+  WockyTLSTrust *trust = g_slice_new0 (WockyTLSTrust);
+  GSList *l;
+
+  trust->ref_count = 1;
+  trust->store = X509_STORE_new ();
+
+  /* the same as a fresh SSL_CTX gets in wocky_tls_session_init */
+  if (!X509_STORE_set_default_paths (trust->store))
+    g_warning ("X509_STORE_set_default_paths() failed");
+
+  X509_STORE_set_flags (trust->store,
+                        X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL);
+
+  for (l = cas; l != NULL; l = l->next)
+    add_ca (trust->store, l->data);
+
+  for (l = crl; l != NULL; l = l->next)
+    add_crl (trust->store, l->data);
+
+  return trust;
+}
+
+WockyTLSTrust *
+wocky_tls_trust_ref (WockyTLSTrust *trust)
+{
+  g_atomic_int_inc (&trust->ref_count);
+  return trust;
+}
+
+void
+wocky_tls_trust_unref (WockyTLSTrust *trust)
+{
+  if (!g_atomic_int_dec_and_test (&trust->ref_count))
+    return;
+
+  X509_STORE_free (trust->store);
+  g_slice_free (WockyTLSTrust, trust);
+}
+
+void
+wocky_tls_session_set_trust (WockyTLSSession *session,
+                             WockyTLSTrust *trust)
+{
+  g_return_if_fail (!session->server);
+  g_return_if_fail (session->trust == NULL);
+
+  session->trust = wocky_tls_trust_ref (trust);
+
+  /* the SSL_CTX takes a reference, and frees the store it had */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add (&trust->store->references, 1, CRYPTO_LOCK_X509_STORE);
+#else
+  X509_STORE_up_ref (trust->store);
+#endif
+  SSL_CTX_set_cert_store (session->ctx, trust->store);
+}
+
+void
+wocky_tls_trust_set_generation (WockyTLSTrust *trust,
+                                guint generation)
+{
+  trust->generation = generation;
+}
+
+guint
+wocky_tls_trust_get_generation (WockyTLSTrust *trust)
+{
+  return trust->generation;
+}
+
+WockyTLSTrust *
+wocky_tls_session_get_trust (WockyTLSSession *session)
+{
+  return session->trust;
+}
+
+gint64
+wocky_tls_session_get_peers_expiry (WockyTLSSession *session)
+{
+  STACK_OF(X509) *cert_chain = SSL_get_peer_cert_chain (session->ssl);
+  gint64 now = g_get_real_time ();
+  gint64 earliest = 0;
+  gint i;
+
+  if (cert_chain == NULL)
+    return 0;
+
+  for (i = 0; i < sk_X509_num (cert_chain); i++)
+    {
+      X509 *cert = sk_X509_value (cert_chain, i);
+      int days, secs;
+      gint64 expiry;
+
+      if (!ASN1_TIME_diff (&days, &secs, NULL, X509_get_notAfter (cert)))
+        return 0;
+
+      expiry = now + ((gint64) days * 86400 + secs) * G_USEC_PER_SEC;
+
+      if (earliest == 0 || expiry < earliest)
+        earliest = expiry;
+    }
+
+  return earliest;
+}
+
+/* ************************************************************************* */
+/* TLS extensions: these must be set before the handshake                    */
+
+void
+wocky_tls_session_set_server_name (WockyTLSSession *session,
+                                   const gchar *hostname)
+{
+  g_return_if_fail (!session->server);
+  g_return_if_fail (hostname != NULL);
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  SSL_set_tlsext_host_name (session->ssl, hostname);
+#else
+  DEBUG ("SNI not supported by this version of OpenSSL");
+#endif
+}
+
+#ifdef HAVE_TLS_ALPN
+static int
+alpn_select_cb (SSL *ssl,
+                const unsigned char **out,
+                unsigned char *outlen,
+                const unsigned char *in,
+                unsigned int inlen,
+                void *arg)
+{
+  WockyTLSSession *session = arg;
+  unsigned char *selected;
+
+  if (SSL_select_next_proto (&selected, outlen, session->alpn_wire,
+          session->alpn_wire_len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+void
+wocky_tls_session_set_alpn_protocol (WockyTLSSession *session,
+                                     const gchar *protocol)
+{
+  gsize len;
+
+  g_return_if_fail (protocol != NULL && *protocol != '\0');
+
+  len = strlen (protocol);
+  g_return_if_fail (len < 256);
+
+  g_free (session->alpn_protocol);
+  session->alpn_protocol = g_strdup (protocol);
+
+  /* a list of length-prefixed names */
+  g_free (session->alpn_wire);
+  session->alpn_wire_len = len + 1;
+  session->alpn_wire = g_malloc (session->alpn_wire_len);
+  session->alpn_wire[0] = len;
+  memcpy (session->alpn_wire + 1, protocol, len);
+
+#ifdef HAVE_TLS_ALPN
+  if (session->server)
+    SSL_CTX_set_alpn_select_cb (session->ctx, alpn_select_cb, session);
+  else if (SSL_set_alpn_protos (session->ssl, session->alpn_wire,
+               session->alpn_wire_len) != 0)
+    DEBUG ("could not set ALPN protocol %s", protocol);
+#else
+  DEBUG ("ALPN not supported by this version of OpenSSL; not offering %s",
+         protocol);
+#endif
+}
+
+const gchar *
+wocky_tls_session_get_alpn_protocol (WockyTLSSession *session)
+{
+#ifdef HAVE_TLS_ALPN
+  if (session->alpn_selected == NULL)
+    {
+      const unsigned char *data = NULL;
+      unsigned int len = 0;
+
+      SSL_get0_alpn_selected (session->ssl, &data, &len);
+
+      if (data != NULL && len > 0)
+        session->alpn_selected = g_strndup ((const gchar *) data, len);
+    }
+#endif
+
+  return session->alpn_selected;
+}
+
+/* ************************************************************************* */
+/* kernel TLS offload                                                        */
+
+#ifdef HAVE_TLS_KEY_EXPORT
+/* OpenSSL only lets the TLS 1.3 traffic secrets out through the key log */
+static void
+keylog_cb (const SSL *ssl,
+           const char *line)
+{
+  WockyTLSSession *session = SSL_get_app_data (ssl);
+  gchar **parts = g_strsplit (line, " ", 3);
+  guint8 *secret = NULL;
+
+  if (g_strv_length (parts) == 3)
     {
-      DEBUG ("Loading CA directory");
-      ok = SSL_CTX_load_verify_locations (session->ctx, NULL, path);
+      if (!strcmp (parts[0], "CLIENT_TRAFFIC_SECRET_0"))
+        secret = session->client_secret;
+      else if (!strcmp (parts[0], "SERVER_TRAFFIC_SECRET_0"))
+        secret = session->server_secret;
     }
 
-  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+  if (secret != NULL)
     {
-      DEBUG ("Loading CA file");
-      ok = SSL_CTX_load_verify_locations (session->ctx, path, NULL);
+      const gchar *hex = parts[2];
+      gsize i;
+
+      for (i = 0; i < EVP_MAX_MD_SIZE &&
+             g_ascii_isxdigit (hex[2 * i]) &&
+             g_ascii_isxdigit (hex[2 * i + 1]); i++)
+        secret[i] = (g_ascii_xdigit_value (hex[2 * i]) << 4) |
+          g_ascii_xdigit_value (hex[2 * i + 1]);
+
+      session->secret_len = i;
     }
 
-  if (!ok)
+  g_strfreev (parts);
+}
+
+/* HKDF-Expand-Label from RFC 8446, with no context */
+static gboolean
+hkdf_expand_label (const EVP_MD *md,
+                   const guint8 *secret,
+                   gsize secret_len,
+                   const gchar *label,
+                   guint8 *out,
+                   gsize out_len)
+{
+  guint8 info[4 + 255];
+  gsize label_len = strlen (label);
+  gsize info_len = 0;
+  size_t len = out_len;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_HKDF, NULL);
+  gboolean ok;
+
+  info[info_len++] = out_len >> 8;
+  info[info_len++] = out_len & 0xff;
+  info[info_len++] = strlen ("tls13 ") + label_len;
+  memcpy (info + info_len, "tls13 ", strlen ("tls13 "));
+  info_len += strlen ("tls13 ");
+  memcpy (info + info_len, label, label_len);
+  info_len += label_len;
+  info[info_len++] = 0;
+
+  ok = (pctx != NULL &&
+        EVP_PKEY_derive_init (pctx) > 0 &&
+        EVP_PKEY_CTX_hkdf_mode (pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+        EVP_PKEY_CTX_set_hkdf_md (pctx, md) > 0 &&
+        EVP_PKEY_CTX_set1_hkdf_key (pctx, secret, secret_len) > 0 &&
+        EVP_PKEY_CTX_add1_hkdf_info (pctx, info, info_len) > 0 &&
+        EVP_PKEY_derive (pctx, out, &len) > 0);
+
+  EVP_PKEY_CTX_free (pctx);
+  return ok;
+}
+
+/* the TLS 1.2 key block: client key, server key, client IV, server IV */
+static gboolean
+tls12_key_block (WockyTLSSession *session,
+                 const EVP_MD *md,
+                 guint8 *out,
+                 gsize out_len)
+{
+  guint8 master[SSL_MAX_MASTER_KEY_LENGTH];
+  guint8 client_random[SSL3_RANDOM_SIZE];
+  guint8 server_random[SSL3_RANDOM_SIZE];
+  size_t master_len;
+  size_t len = out_len;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_TLS1_PRF, NULL);
+  gboolean ok;
+
+  master_len = SSL_SESSION_get_master_key (SSL_get_session (session->ssl),
+                                           master, sizeof (master));
+  SSL_get_client_random (session->ssl, client_random, SSL3_RANDOM_SIZE);
+  SSL_get_server_random (session->ssl, server_random, SSL3_RANDOM_SIZE);
+
+  ok = (pctx != NULL &&
+        master_len > 0 &&
+        EVP_PKEY_derive_init (pctx) > 0 &&
+        EVP_PKEY_CTX_set_tls1_prf_md (pctx, md) > 0 &&
+        EVP_PKEY_CTX_set1_tls1_prf_secret (pctx, master, master_len) > 0 &&
+        EVP_PKEY_CTX_add1_tls1_prf_seed (pctx, "key expansion",
+                                         strlen ("key expansion")) > 0 &&
+        EVP_PKEY_CTX_add1_tls1_prf_seed (pctx, server_random,
+                                         SSL3_RANDOM_SIZE) > 0 &&
+        EVP_PKEY_CTX_add1_tls1_prf_seed (pctx, client_random,
+                                         SSL3_RANDOM_SIZE) > 0 &&
+        EVP_PKEY_derive (pctx, out, &len) > 0);
+
+  EVP_PKEY_CTX_free (pctx);
+  OPENSSL_cleanse (master, sizeof (master));
+  return ok;
+}
+#endif
+
+/* Only client sessions are offloaded: a server may already have sent
+ * session tickets, and OpenSSL won't say how many records that took. */
+void
+wocky_tls_session_set_kernel_offload (WockyTLSSession *session,
+                                      gboolean enabled)
+{
+  session->kernel_offload = enabled && !session->server;
+
+#ifdef HAVE_TLS_KEY_EXPORT
+  if (session->kernel_offload)
     {
-      gulong e, f;
-      for (f = e = ERR_get_error (); e != 0; e = ERR_get_error ())
-        f = e;
-      DEBUG ("CA '%s' failed: %s", path, ERR_error_string (f, NULL));
+      SSL_set_app_data (session->ssl, session);
+      SSL_CTX_set_keylog_callback (session->ctx, keylog_cb);
     }
-  else
-    DEBUG ("CA '%s' loaded", path);
+#endif
 }
 
-void
-wocky_tls_session_add_crl (WockyTLSSession *session,
-                           const gchar *path)
+gboolean
+wocky_tls_session_is_kernel_offloaded (WockyTLSSession *session)
 {
-  gboolean ok = FALSE;
+  return session->ktls_tx || session->ktls_rx;
+}
 
-  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+/* called once the handshake succeeded, before any application data */
+static void
+ktls_offload (WockyTLSSession *session)
+{
+#ifdef HAVE_TLS_KEY_EXPORT
+  const SSL_CIPHER *c = SSL_get_current_cipher (session->ssl);
+  const EVP_MD *md;
+  GSocket *socket;
+  WockyTLSKtlsCipher cipher;
+  gsize key_len;
+  gsize iv_len;
+  gboolean tls13;
+  /* indexed by 0 for the client, 1 for the server */
+  guint8 keys[2][32];
+  guint8 ivs[2][WOCKY_TLS_KTLS_IV_SIZE];
+  guint8 seq[2][WOCKY_TLS_KTLS_SEQ_SIZE];
+  gint i;
+
+  if (!session->kernel_offload)
+    return;
+
+  socket = wocky_tls_ktls_get_socket (session->stream);
+
+  if (socket == NULL)
     {
-      DEBUG ("CRL file or path '%s' not accessible", path);
+      DEBUG ("not a TCP connection: not offloading");
       return;
     }
 
-  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+  switch (SSL_CIPHER_get_cipher_nid (c))
     {
-      X509_STORE *store = SSL_CTX_get_cert_store (session->ctx);
-      X509_LOOKUP_METHOD *method = X509_LOOKUP_hash_dir ();
-      X509_LOOKUP *lookup = X509_STORE_add_lookup (store, method);
-      DEBUG ("Loading CRL directory");
-      ok = X509_LOOKUP_add_dir (lookup, path, X509_FILETYPE_PEM) == 1;
+      case NID_aes_128_gcm:
+        cipher = WOCKY_TLS_KTLS_AES_128_GCM;
+        key_len = 16;
+        iv_len = 4;
+        break;
+      case NID_aes_256_gcm:
+        cipher = WOCKY_TLS_KTLS_AES_256_GCM;
+        key_len = 32;
+        iv_len = 4;
+        break;
+      case NID_chacha20_poly1305:
+        cipher = WOCKY_TLS_KTLS_CHACHA20_POLY1305;
+        key_len = 32;
+        iv_len = WOCKY_TLS_KTLS_IV_SIZE;
+        break;
+      default:
+        DEBUG ("%s can't be offloaded", SSL_CIPHER_get_name (c));
+        return;
     }
 
-  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+  switch (SSL_version (session->ssl))
     {
-      X509_STORE *store = SSL_CTX_get_cert_store (session->ctx);
-      X509_LOOKUP_METHOD *method = X509_LOOKUP_file ();
-      X509_LOOKUP *lookup = X509_STORE_add_lookup (store, method);
-      DEBUG ("Loading CRL file");
-      ok = X509_LOOKUP_load_file (lookup, path, X509_FILETYPE_PEM) == 1;
+      case TLS1_2_VERSION:
+        tls13 = FALSE;
+        break;
+      case TLS1_3_VERSION:
+        tls13 = TRUE;
+        break;
+      default:
+        DEBUG ("only TLS 1.2 and 1.3 can be offloaded");
+        return;
     }
 
-  if (!ok)
+  md = SSL_CIPHER_get_handshake_digest (c);
+  memset (seq, 0, sizeof (seq));
+
+  if (tls13)
     {
-      gulong e, f;
-      for (f = e = ERR_get_error (); e != 0; e = ERR_get_error ())
-        f = e;
-      DEBUG ("'%s' failed: %s\n", path, ERR_error_string (f, NULL));
+      const guint8 *secrets[2] = { session->client_secret,
+                                   session->server_secret };
+
+      if (session->secret_len == 0)
+        {
+          DEBUG ("the traffic secrets are unknown: not offloading");
+          return;
+        }
+
+      for (i = 0; i < 2; i++)
+        {
+          if (!hkdf_expand_label (md, secrets[i], session->secret_len, "key",
+                  keys[i], key_len) ||
+              !hkdf_expand_label (md, secrets[i], session->secret_len, "iv",
+                  ivs[i], WOCKY_TLS_KTLS_IV_SIZE))
+            {
+              DEBUG ("could not derive the traffic keys");
+              return;
+            }
+        }
+
+      OPENSSL_cleanse (session->client_secret, EVP_MAX_MD_SIZE);
+      OPENSSL_cleanse (session->server_secret, EVP_MAX_MD_SIZE);
     }
   else
-    DEBUG ("'%s' loaded\n", path);
+    {
+      guint8 block[2 * 32 + 2 * WOCKY_TLS_KTLS_IV_SIZE];
+
+      if (!tls12_key_block (session, md, block, 2 * key_len + 2 * iv_len))
+        {
+          DEBUG ("could not derive the key block");
+          return;
+        }
+
+      for (i = 0; i < 2; i++)
+        {
+          memcpy (keys[i], block + i * key_len, key_len);
+          memcpy (ivs[i], block + 2 * key_len + i * iv_len, iv_len);
+
+          /* each side's Finished was the first record under these keys */
+          seq[i][WOCKY_TLS_KTLS_SEQ_SIZE - 1] = 1;
+
+          /* AES-GCM: the explicit part of the nonce just has to be unique,
+           * so the sequence number will do */
+          if (iv_len < WOCKY_TLS_KTLS_IV_SIZE)
+            memcpy (ivs[i] + iv_len, seq[i], WOCKY_TLS_KTLS_SEQ_SIZE);
+        }
+
+      OPENSSL_cleanse (block, sizeof (block));
+    }
+
+  /* the handshake is only over once everything has been written out */
+  session->ktls_tx = wocky_tls_ktls_start (socket, TRUE, tls13, cipher,
+      keys[0], ivs[0], seq[0]);
+
+  /* records already pulled in would be lost to the kernel */
+  if (ring_used (&session->rring) == 0 && !SSL_has_pending (session->ssl))
+    session->ktls_rx = wocky_tls_ktls_start (socket, FALSE, tls13, cipher,
+        keys[1], ivs[1], seq[1]);
+
+  OPENSSL_cleanse (keys, sizeof (keys));
+  OPENSSL_cleanse (ivs, sizeof (ivs));
+
+  DEBUG ("kernel offload: sending %s, receiving %s",
+      session->ktls_tx ? "yes" : "no", session->ktls_rx ? "yes" : "no");
+
+  if (session->ktls_tx || session->ktls_rx)
+    session->ktls_socket = g_object_ref (socket);
+#else
+  if (session->kernel_offload)
+    DEBUG ("OpenSSL is too old for kernel offload");
+#endif
 }
 
 /* ************************************************************************* */
@@ -845,6 +1849,7 @@ wocky_tls_session_handshake_finish (WockyTLSSession   *session,
     return NULL;
 
   DEBUG ("connection OK");
+  ktls_offload (session);
   return g_object_new (WOCKY_TYPE_TLS_CONNECTION, "session", session, NULL);
 }
 
@@ -1237,12 +2242,44 @@ wocky_tls_input_stream_read (GInputStream  *stream,
                              GCancellable  *cancellable,
                              GError       **error)
 {
-  /* WockyTLSSession *session = WOCKY_TLS_INPUT_STREAM (stream)->session; */
+  WockyTLSSession *session = WOCKY_TLS_INPUT_STREAM (stream)->session;
+  GInputStream *input = g_io_stream_get_input_stream (session->stream);
+
+  if (session->ktls_rx)
+    return wocky_tls_ktls_read (session->ktls_socket, buffer, count,
+                                cancellable, error);
+
+  while (TRUE)
+    {
+      int ret = SSL_read (session->ssl, buffer, count);
+      int err;
+      gsize rsize;
+      gchar *rbuf;
+      gssize bytes;
+
+      if (ret > 0)
+        return ret;
+
+      err = SSL_get_error (session->ssl, ret);
+
+      if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+
+      if (err != SSL_ERROR_WANT_READ)
+        {
+          g_set_error (error, WOCKY_TLS_ERROR, err,
+                       "OpenSSL read: protocol error %d", err);
+          return -1;
+        }
+
+      rbuf = ring_reserve (&session->rring, MAX_SSLV3_BLOCK_SIZE, &rsize);
+      bytes = g_input_stream_read (input, rbuf, rsize, cancellable, error);
 
-  DEBUG ("sync read - not implmented");
-  g_assert_not_reached ();
+      if (bytes <= 0)
+        return bytes;
 
-  return 0;
+      ring_produce (&session->rring, bytes);
+    }
 }
 
 static void
@@ -1262,6 +2299,15 @@ wocky_tls_input_stream_read_async (GInputStream        *stream,
 
   g_assert (session->job.read.active == FALSE);
 
+  if (session->ktls_rx)
+    {
+      wocky_tls_ktls_read_async (session->ktls_socket, G_OBJECT (stream),
+                                 wocky_tls_input_stream_read_async, buffer,
+                                 count, io_priority, cancellable, callback,
+                                 user_data);
+      return;
+    }
+
   /* It is possible for a complete SSL record to be present in the read BIO *
    * already as a result of a previous read, since SSL_read may extract     *
    * just the first complete record, or some or all of them:                *
@@ -1328,15 +2374,79 @@ wocky_tls_output_stream_write (GOutputStream  *stream,
                                GCancellable   *cancellable,
                                GError        **error)
 {
-  /* WockyTLSSession *session = WOCKY_TLS_OUTPUT_STREAM (stream)->session; */
+  WockyTLSSession *session = WOCKY_TLS_OUTPUT_STREAM (stream)->session;
+  GOutputStream *output = g_io_stream_get_output_stream (session->stream);
+
+  if (session->ktls_tx)
+    return g_output_stream_write (output, buffer, count, cancellable, error);
+
+  if (session->flushing)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_PENDING,
+                   "An asynchronous write is still in progress");
+      return -1;
+    }
+
+  if (session->write_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (session->write_error));
+      return -1;
+    }
+
+  if (!ssl_encrypt (session, buffer, count, error))
+    return -1;
+
+  while (ring_used (&session->wring) > 0)
+    {
+      gsize wsize;
+      gchar *wbuf = ring_peek (&session->wring, &wsize);
+      gssize sent;
+
+      sent = g_output_stream_write (output, wbuf, wsize, cancellable, error);
+
+      if (sent < 0)
+        return -1;
 
-  DEBUG ("sync write - not implemented");
+      ring_consume (&session->wring, sent);
+    }
+
+  return count;
+}
+
+static void wocky_tls_output_stream_write_async (GOutputStream *stream,
+    const void *buffer,
+    gsize count,
+    gint io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
 
-  g_assert_not_reached ();
+static void
+write_complete_in_idle (GOutputStream *stream,
+                        GAsyncReadyCallback callback,
+                        gpointer user_data,
+                        gssize count,
+                        const GError *error)
+{
+  GSimpleAsyncResult *r = g_simple_async_result_new (G_OBJECT (stream),
+      callback, user_data, wocky_tls_output_stream_write_async);
+
+  if (error != NULL)
+    g_simple_async_result_set_from_error (r, error);
+  else
+    g_simple_async_result_set_op_res_gssize (r, count);
 
-  return 0;
+  g_simple_async_result_complete_in_idle (r);
+  g_object_unref (r);
 }
 
+/* Writes are reported as complete as soon as their clearbytes have been
+ * taken, so that the next one can follow without waiting for the network.
+ * While the base stream is busy, the clearbytes are held back, to be
+ * encrypted together as full-size records once it is free again; writes
+ * only have to wait when too many are held back. An error writing to the
+ * base stream is reported by the next write, or by closing the
+ * connection. */
 static void
 wocky_tls_output_stream_write_async (GOutputStream       *stream,
                                      const void          *buffer,
@@ -1346,43 +2456,54 @@ wocky_tls_output_stream_write_async (GOutputStream       *stream,
                                      GAsyncReadyCallback  callback,
                                      gpointer             user_data)
 {
-  int code;
   WockyTLSSession *session = WOCKY_TLS_OUTPUT_STREAM (stream)->session;
+  GError *error = NULL;
 
   DEBUG ("%" G_GSIZE_FORMAT " clearbytes to send", count);
-  wocky_tls_job_start (&session->job.write, stream,
-                       io_priority, cancellable, callback, user_data,
-                       wocky_tls_output_stream_write_async);
 
-  session->job.write.count = count;
+  g_assert (session->job.write.active == FALSE);
 
-  code = SSL_write (session->ssl, buffer, count);
-  if (code < 0)
+  if (session->ktls_tx)
+    {
+      wocky_tls_ktls_write_async (session->stream, G_OBJECT (stream),
+                                  wocky_tls_output_stream_write_async, buffer,
+                                  count, io_priority, cancellable, callback,
+                                  user_data);
+      return;
+    }
+
+  if (session->write_error != NULL)
+    {
+      write_complete_in_idle (stream, callback, user_data, -1,
+          session->write_error);
+    }
+  else if (!session->flushing)
     {
-      int error = SSL_get_error (session->ssl, code);
-      switch (error)
+      if (ssl_encrypt (session, buffer, count, &error))
         {
-        case SSL_ERROR_WANT_WRITE:
-          DEBUG ("Incomplete SSL write to BIO (theoretically impossible)");
+          session->flush_priority = io_priority;
           ssl_flush (session);
-          return;
-        case SSL_ERROR_WANT_READ:
-          g_warning ("write caused read: unsupported TLS re-negotiation?");
-          /* deliberately falling through to the default case, having logged a
-           * more specific warning.
-           */
-        default:
-          DEBUG ("SSL write failed, setting error %d", error);
-          /* if we haven't already generated an error, set one here: */
-          if(session->job.write.error == NULL)
-            session->job.write.error =
-              g_error_new (WOCKY_TLS_ERROR, error,
-                           "OpenSSL write: protocol error %d", error);
-          wocky_tls_session_try_operation (session, WOCKY_TLS_OP_WRITE);
-          return;
         }
+
+      write_complete_in_idle (stream, callback, user_data, count, error);
+      g_clear_error (&error);
+    }
+  else if (session->clear->len < COALESCE_MAX)
+    {
+      DEBUG ("holding back %" G_GSIZE_FORMAT " clearbytes", count);
+      g_byte_array_append (session->clear, buffer, count);
+      write_complete_in_idle (stream, callback, user_data, count, NULL);
+    }
+  else
+    {
+      DEBUG ("waiting for %u held back clearbytes to be sent",
+          session->clear->len);
+      wocky_tls_job_start (&session->job.write, stream,
+                           io_priority, cancellable, callback, user_data,
+                           wocky_tls_output_stream_write_async);
+      session->job.write.buffer = (gchar *) buffer;
+      session->job.write.count = count;
     }
-  ssl_flush (session);
 }
 
 static gssize
@@ -1547,8 +2668,8 @@ wocky_tls_session_read_ready (GObject      *object,
   GInputStream *input = G_INPUT_STREAM (object);
   GError **error = &(session->job.read.error);
   gssize rsize = 0;
-  gchar *buf = session->job.handshake.job.active ?
-    session->job.handshake.job.rbuf : session->job.read.rbuf;
+  gchar *buf = session->rring.data +
+    (session->rring.tail & (session->rring.size - 1));
 
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     DEBUG ("");
@@ -1561,7 +2682,7 @@ wocky_tls_session_read_ready (GObject      *object,
       int y;
       DEBUG ("received %" G_GSSIZE_FORMAT " cipherbytes, filling SSL BIO",
           rsize);
-      BIO_write (session->rbio, buf, rsize);
+      ring_produce (&session->rring, rsize);
       if (tls_debug_level > DEBUG_ASYNC_DETAIL_LEVEL + 1)
         for (x = 0; x < rsize; x += 16)
           {
@@ -1606,65 +2727,214 @@ wocky_tls_session_read_ready (GObject      *object,
 }
 
 static void
-wocky_tls_session_write_ready (GObject      *object,
-                               GAsyncResult *result,
-                               gpointer      user_data)
+close_base_cb (GObject *source,
+               GAsyncResult *res,
+               gpointer user_data)
 {
-  WockyTLSSession *session = WOCKY_TLS_SESSION (user_data);
-  gint buffered = BIO_pending (session->wbio);
-  gssize written;
+  GSimpleAsyncResult *result = user_data;
+  GError *error = NULL;
 
-  if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
-    DEBUG ("");
+  if (!g_io_stream_close_finish (G_IO_STREAM (source), res, &error))
+    g_simple_async_result_take_error (result, error);
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+}
+
+static void
+close_base (WockyTLSSession *session,
+            GSimpleAsyncResult *result,
+            gint io_priority,
+            GCancellable *cancellable)
+{
+  g_io_stream_close_async (session->stream, io_priority, cancellable,
+      close_base_cb, result);
+}
+
+static void
+close_pending (WockyTLSSession *session)
+{
+  GSimpleAsyncResult *result = session->close_result;
+  GCancellable *cancellable = session->close_cancellable;
+
+  session->close_result = NULL;
+  session->close_cancellable = NULL;
 
-  written = g_output_stream_write_finish (G_OUTPUT_STREAM (object), result,
-                                          &(session->job.write.error));
+  if (session->write_error != NULL)
+    g_simple_async_result_set_from_error (result, session->write_error);
 
-  if (written == buffered)
+  close_base (session, result, session->close_priority, cancellable);
+
+  if (cancellable != NULL)
+    g_object_unref (cancellable);
+}
+
+/* the base stream has taken all the cipherbytes there were (or failed):
+ * send whatever was held back in the meantime */
+static void
+ssl_flush_done (WockyTLSSession *session,
+                GError *error)
+{
+  WockyTLSJob *waiting = &session->job.write;
+  gsize done;
+
+  session->flushing = FALSE;
+
+  if (error != NULL)
     {
-      DEBUG ("%d bytes written, clearing write BIO", buffered);
-      (void) BIO_reset (session->wbio);
-      wocky_tls_session_try_operation (session, WOCKY_TLS_OP_WRITE);
+      DEBUG ("writing held back data failed: %s", error->message);
+
+      if (session->write_error == NULL)
+        session->write_error = error;
+      else
+        g_error_free (error);
+
+      g_byte_array_set_size (session->clear, 0);
     }
   else
     {
-      gchar *buffer;
-      long bsize = BIO_get_mem_data (session->wbio, &buffer);
-      long psize = bsize - written;
-
-      /* scrub the data we did manage to write from our buffer */
-      if (written > 0)
+      for (done = 0; done < session->clear->len; done += MAX_SSLV3_BLOCK_SIZE)
         {
-          gchar *pending = g_memdup (buffer + written, psize);
+          gsize len = MIN (MAX_SSLV3_BLOCK_SIZE, session->clear->len - done);
 
-          (void) BIO_reset (session->wbio);
-          (void) BIO_write (session->wbio, pending, psize);
-          g_free (pending);
+          if (!ssl_encrypt (session, (gchar *) session->clear->data + done,
+                  len, &session->write_error))
+            break;
         }
 
-      if (session->job.write.error != NULL)
-        {
-          if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
-            DEBUG ("Incomplete async write [%" G_GSSIZE_FORMAT "/%d bytes]: "
-                "%s:%u %s",
-                written, buffered,
-                g_quark_to_string (session->job.write.error->domain),
-                session->job.write.error->code,
-                session->job.write.error->message);
-
-          /* if we have a  non-fatal error, erase it try again */
-          if (g_error_matches (session->job.write.error,
-                               G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
-            g_clear_error (&(session->job.write.error));
-        }
+      g_byte_array_set_size (session->clear, 0);
 
-      /* no error here means retry the operation; otherwise bail out */
-      if (session->job.write.error == NULL)
+      if (waiting->active && session->write_error == NULL)
+        ssl_encrypt (session, waiting->buffer, waiting->count,
+            &session->write_error);
+
+      if (session->write_error == NULL)
         ssl_flush (session);
+    }
+
+  /* the flush is already under way again, if there was anything to send:
+   * further writes from the callback will be held back */
+  if (waiting->active)
+    {
+      if (session->write_error != NULL)
+        waiting->error = g_error_copy (session->write_error);
+
+      wocky_tls_session_try_operation (session, WOCKY_TLS_OP_WRITE);
+    }
+
+  if (!session->flushing && session->close_result != NULL)
+    close_pending (session);
+}
+
+static void
+write_ready (WockyTLSSession *session,
+             GOutputStream *output,
+             GAsyncResult *result)
+{
+  WockyTLSJob *handshake = &session->job.handshake.job;
+  GError *error = NULL;
+  gssize written;
+
+  if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
+    DEBUG ("");
+
+  written = g_output_stream_write_finish (output, result, &error);
+  ring_unpin (&session->wring);
+
+  if (written > 0)
+    {
+      DEBUG ("%" G_GSSIZE_FORMAT " cipherbytes written", written);
+      ring_consume (&session->wring, written);
+    }
+
+  if (error != NULL)
+    {
+      if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
+        DEBUG ("Incomplete async write [%" G_GSSIZE_FORMAT "/%"
+            G_GSIZE_FORMAT " bytes]: %s:%u %s",
+            written, ring_used (&session->wring) + MAX (written, 0),
+            g_quark_to_string (error->domain), error->code, error->message);
+
+      /* if we have a  non-fatal error, erase it try again */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        g_clear_error (&error);
+    }
+
+  if (handshake->active)
+    {
+      if (error != NULL)
+        {
+          g_clear_error (&handshake->error);
+          handshake->error = error;
+          session->job.handshake.state = SSL_ERROR_SSL;
+          wocky_tls_session_try_operation (session, WOCKY_TLS_OP_HANDSHAKE);
+        }
+      else if (ring_used (&session->wring) > 0)
+        ring_write_async (session, handshake->io_priority,
+            handshake->cancellable);
       else
         wocky_tls_session_try_operation (session, WOCKY_TLS_OP_WRITE);
     }
+  else if (error == NULL && ring_used (&session->wring) > 0)
+    {
+      ring_write_async (session, session->flush_priority, NULL);
+    }
+  else
+    {
+      ssl_flush_done (session, error);
+    }
+}
+
+static void
+wocky_tls_session_write_ready (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  WockyTLSSession *session = WOCKY_TLS_SESSION (user_data);
+
+  write_ready (session, G_OUTPUT_STREAM (object), result);
+
+  /* taken by ring_write_async */
+  g_object_unref (session);
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Before 1.1.0, OpenSSL is only thread-safe if it is given locks; sessions
+ * are handshaken on the TLS worker pool (see wocky-tls-worker.c) */
+static GMutex *crypto_locks = NULL;
+
+static void
+crypto_locking_cb (int mode,
+    int n,
+    const char *file,
+    int line)
+{
+  if (mode & CRYPTO_LOCK)
+    g_mutex_lock (&crypto_locks[n]);
+  else
+    g_mutex_unlock (&crypto_locks[n]);
+}
+
+static unsigned long
+crypto_thread_id_cb (void)
+{
+  return (unsigned long) g_thread_self ();
+}
+
+static void
+crypto_init_locks (void)
+{
+  gint i;
+
+  crypto_locks = g_new0 (GMutex, CRYPTO_num_locks ());
+
+  for (i = 0; i < CRYPTO_num_locks (); i++)
+    g_mutex_init (&crypto_locks[i]);
+
+  CRYPTO_set_id_callback (crypto_thread_id_cb);
+  CRYPTO_set_locking_callback (crypto_locking_cb);
 }
+#endif
 
 static void
 wocky_tls_session_init (WockyTLSSession *session)
@@ -1682,6 +2952,9 @@ wocky_tls_session_init (WockyTLSSession *session)
       malloc_init_succeeded = CRYPTO_malloc_init ();
       g_warn_if_fail (malloc_init_succeeded);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+      crypto_init_locks ();
+#endif
       SSL_library_init ();
       SSL_load_error_strings ();
       OpenSSL_add_all_algorithms();
@@ -1847,14 +3120,17 @@ wocky_tls_session_constructed (GObject *object)
     }
 
   session->ssl = SSL_new (session->ctx);
-  session->rbio = BIO_new (BIO_s_mem ());
-  session->wbio = BIO_new (BIO_s_mem ());
+  ring_init (&session->rring, RING_SIZE);
+  ring_init (&session->wring, RING_SIZE);
+  session->clear = g_byte_array_new ();
+  session->rbio = ring_bio_new (&session->rring);
+  session->wbio = ring_bio_new (&session->wring);
 
   if (session->rbio == NULL)
-    g_error ("Could not allocate memory BIO for SSL reads");
+    g_error ("Could not allocate BIO for SSL reads");
 
   if (session->wbio == NULL)
-    g_error ("Could not allocate memory BIO for SSL writes");
+    g_error ("Could not allocate BIO for SSL writes");
 
   if (tls_debug_level >= DEBUG_ASYNC_DETAIL_LEVEL)
     {
@@ -1870,7 +3146,6 @@ wocky_tls_session_constructed (GObject *object)
       BIO_set_callback (session->wbio, BIO_debug_callback);
     }
 
-  BIO_set_mem_eof_return (session->rbio, -1);
   SSL_set_bio (session->ssl, session->rbio, session->wbio);
 
   DEBUG ("done");
@@ -1881,15 +3156,29 @@ wocky_tls_session_finalize (GObject *object)
 {
   WockyTLSSession *session = WOCKY_TLS_SESSION (object);
 
-  /* the BIOs are freed by this call */
+  /* the BIOs are freed by this call, but not their rings */
   SSL_free (session->ssl);
+  ring_free (&session->rring);
+  ring_free (&session->wring);
+  g_byte_array_unref (session->clear);
+  g_clear_error (&session->write_error);
   /* free (session->method); handled by SSL_CTX_free */
   session->method = NULL;
   SSL_CTX_free (session->ctx);
   session->ctx = NULL;
 
+  if (session->trust != NULL)
+    wocky_tls_trust_unref (session->trust);
+
+  if (session->ktls_socket != NULL)
+    g_object_unref (session->ktls_socket);
+
   g_object_unref (session->stream);
 
+  g_free (session->alpn_protocol);
+  g_free (session->alpn_wire);
+  g_free (session->alpn_selected);
+
   G_OBJECT_CLASS (wocky_tls_session_parent_class)->finalize (object);
 }
 
@@ -1974,9 +3263,47 @@ wocky_tls_connection_close (GIOStream *stream, GCancellable *cancellable,
 {
   WockyTLSConnection *connection = WOCKY_TLS_CONNECTION (stream);
 
+  if (connection->session->flushing)
+    DEBUG ("closing with a write still in progress");
+
   return g_io_stream_close (connection->session->stream, cancellable, error);
 }
 
+/* waits for held back data to be written before closing the base stream */
+static void
+wocky_tls_connection_close_async (GIOStream *stream,
+                                  int io_priority,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  WockyTLSSession *session = WOCKY_TLS_CONNECTION (stream)->session;
+  GSimpleAsyncResult *result = g_simple_async_result_new (G_OBJECT (stream),
+      callback, user_data, wocky_tls_connection_close_async);
+
+  if (!session->flushing)
+    {
+      close_base (session, result, io_priority, cancellable);
+      return;
+    }
+
+  DEBUG ("waiting for held back data to be written before closing");
+  g_assert (session->close_result == NULL);
+  session->close_result = result;
+  session->close_priority = io_priority;
+
+  if (cancellable != NULL)
+    session->close_cancellable = g_object_ref (cancellable);
+}
+
+static gboolean
+wocky_tls_connection_close_finish (GIOStream *stream,
+                                   GAsyncResult *result,
+                                   GError **error)
+{
+  wocky_implement_finish_void (stream, wocky_tls_connection_close_async);
+}
+
 static GInputStream *
 wocky_tls_connection_get_input_stream (GIOStream *io_stream)
 {
@@ -2058,6 +3385,8 @@ wocky_tls_connection_class_init (WockyTLSConnectionClass *class)
   stream_class->get_input_stream = wocky_tls_connection_get_input_stream;
   stream_class->get_output_stream = wocky_tls_connection_get_output_stream;
   stream_class->close_fn = wocky_tls_connection_close;
+  stream_class->close_async = wocky_tls_connection_close_async;
+  stream_class->close_finish = wocky_tls_connection_close_finish;
 }
 
 WockyTLSSession *
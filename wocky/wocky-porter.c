@@ -24,6 +24,7 @@
 #include "wocky-porter.h"
 
 #include "wocky-signals-marshal.h"
+#include "wocky-utils.h"
 #include "wocky-xmpp-connection.h"
 
 G_DEFINE_INTERFACE (WockyPorter, wocky_porter, G_TYPE_OBJECT)
@@ -307,12 +308,24 @@ wocky_porter_send_finish (WockyPorter *self,
  * Send a #WockyStanza.  This is a convenient function to not have to
  * call wocky_porter_send_async() with lot of %NULL arguments if you
  * don't care to know when the stanza has been actually sent.
+ *
+ * Implementations may take a cheaper path than wocky_porter_send_async()
+ * here, as there is no operation to complete; see wocky_c2s_porter_send().
  */
 void
 wocky_porter_send (WockyPorter *porter,
     WockyStanza *stanza)
 {
-  wocky_porter_send_async (porter, stanza, NULL, NULL, NULL);
+  WockyPorterInterface *iface;
+
+  g_return_if_fail (WOCKY_IS_PORTER (porter));
+
+  iface = WOCKY_PORTER_GET_INTERFACE (porter);
+
+  if (iface->send != NULL)
+    iface->send (porter, stanza);
+  else
+    wocky_porter_send_async (porter, stanza, NULL, NULL, NULL);
 }
 
 
@@ -800,6 +813,12 @@ wocky_porter_close_finish (WockyPorter *self,
  * %WOCKY_STANZA_SUB_TYPE_SET.
  * When the reply to this IQ has been received callback will be called.
  * You can then call #wocky_porter_send_iq_finish to get the reply stanza.
+ *
+ * Some implementations, such as #WockyC2SPorter and #WockyMetaPorter, have
+ * an <literal>iq-timeout</literal> property: if it is non-zero and no reply
+ * is received in time, the operation fails with
+ * %WOCKY_PORTER_ERROR_TIMED_OUT. Use wocky_porter_send_iq_with_timeout_async()
+ * to set a deadline with any porter.
  */
 void
 wocky_porter_send_iq_async (WockyPorter *self,
@@ -819,6 +838,135 @@ wocky_porter_send_iq_async (WockyPorter *self,
   iface->send_iq_async (self, stanza, cancellable, callback, user_data);
 }
 
+typedef struct
+{
+  GSimpleAsyncResult *simple;
+  guint timeout_id;
+  gboolean timed_out;
+} SendIQTimeoutData;
+
+static void
+send_iq_timeout_data_free (SendIQTimeoutData *data)
+{
+  g_object_unref (data->simple);
+  g_slice_free (SendIQTimeoutData, data);
+}
+
+static gboolean
+send_iq_timed_out_cb (gpointer user_data)
+{
+  SendIQTimeoutData *data = user_data;
+
+  data->timeout_id = 0;
+  data->timed_out = TRUE;
+
+  /* The IQ is still in flight on the porter; its result will be ignored and
+   * data freed once it finishes. */
+  g_simple_async_result_set_error (data->simple, WOCKY_PORTER_ERROR,
+      WOCKY_PORTER_ERROR_TIMED_OUT, "No reply to IQ was received");
+  g_simple_async_result_complete (data->simple);
+
+  return FALSE;
+}
+
+static void
+send_iq_timeout_sent_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  SendIQTimeoutData *data = user_data;
+  GError *error = NULL;
+  WockyStanza *reply;
+
+  reply = wocky_porter_send_iq_finish (WOCKY_PORTER (source), result,
+      &error);
+
+  if (data->timed_out)
+    {
+      if (reply != NULL)
+        g_object_unref (reply);
+
+      g_clear_error (&error);
+      send_iq_timeout_data_free (data);
+      return;
+    }
+
+  g_source_remove (data->timeout_id);
+
+  if (reply == NULL)
+    {
+      g_simple_async_result_set_from_error (data->simple, error);
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_simple_async_result_set_op_res_gpointer (data->simple, reply,
+          g_object_unref);
+    }
+
+  g_simple_async_result_complete (data->simple);
+  send_iq_timeout_data_free (data);
+}
+
+/**
+ * wocky_porter_send_iq_with_timeout_async:
+ * @porter: a #WockyPorter
+ * @stanza: the #WockyStanza to send
+ * @timeout_ms: the deadline for the reply in milliseconds, or 0 for none
+ * @cancellable: optional #GCancellable object, %NULL to ignore
+ * @callback: callback to call when the request is satisfied
+ * @user_data: the data to pass to callback function
+ *
+ * Like wocky_porter_send_iq_async(), but overrides the porter's default
+ * deadline, if it has one, for this IQ. If no reply has been received after
+ * @timeout_ms, the operation fails with %WOCKY_PORTER_ERROR_TIMED_OUT and a
+ * reply arriving later is treated as unsolicited; with porters which don't
+ * implement deadlines themselves, it is received but ignored.
+ * Call wocky_porter_send_iq_finish() to get the reply stanza.
+ */
+void
+wocky_porter_send_iq_with_timeout_async (WockyPorter *self,
+    WockyStanza *stanza,
+    guint timeout_ms,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  WockyPorterInterface *iface;
+
+  g_return_if_fail (WOCKY_IS_PORTER (self));
+
+  iface = WOCKY_PORTER_GET_INTERFACE (self);
+
+  /* Porters predating deadlines get one enforced around their IQs */
+  if (iface->send_iq_with_timeout_async == NULL)
+    {
+      SendIQTimeoutData *data;
+
+      g_assert (iface->send_iq_async != NULL);
+
+      if (timeout_ms == 0)
+        {
+          iface->send_iq_async (self, stanza, cancellable, callback,
+              user_data);
+          return;
+        }
+
+      data = g_slice_new0 (SendIQTimeoutData);
+      data->simple = g_simple_async_result_new (G_OBJECT (self), callback,
+          user_data, wocky_porter_send_iq_with_timeout_async);
+      data->timeout_id = g_timeout_add (timeout_ms, send_iq_timed_out_cb,
+          data);
+
+      iface->send_iq_async (self, stanza, cancellable,
+          send_iq_timeout_sent_cb, data);
+      return;
+    }
+
+  iface->send_iq_with_timeout_async (self, stanza, timeout_ms, cancellable,
+      callback, user_data);
+}
+
 /**
  * wocky_porter_send_iq_finish:
  * @porter: a #WockyPorter
@@ -838,6 +986,11 @@ wocky_porter_send_iq_finish (WockyPorter *self,
 
   g_return_val_if_fail (WOCKY_IS_PORTER (self), FALSE);
 
+  if (g_simple_async_result_is_valid (result, G_OBJECT (self),
+          wocky_porter_send_iq_with_timeout_async))
+    wocky_implement_finish_return_copy_pointer (self,
+        wocky_porter_send_iq_with_timeout_async, g_object_ref);
+
   iface = WOCKY_PORTER_GET_INTERFACE (self);
 
   g_assert (iface->send_iq_finish != NULL);
@@ -39,6 +39,8 @@ G_BEGIN_DECLS
  * @WOCKY_PORTER_ERROR_NOT_IQ : The #WockyStanza is not an IQ
  * @WOCKY_PORTER_ERROR_FORCIBLY_CLOSED : The #WockyPorter has been forced to
  * close
+ * @WOCKY_PORTER_ERROR_TIMED_OUT : No reply to an IQ was received before its
+ * deadline
  *
  * The #WockyPorter specific errors.
  */
@@ -48,6 +50,7 @@ typedef enum {
   WOCKY_PORTER_ERROR_CLOSED,
   WOCKY_PORTER_ERROR_NOT_IQ,
   WOCKY_PORTER_ERROR_FORCIBLY_CLOSED,
+  WOCKY_PORTER_ERROR_TIMED_OUT,
 } WockyPorterError;
 
 GQuark wocky_porter_error_quark (void);
@@ -142,6 +145,13 @@ typedef gboolean (* WockyPorterHandlerFunc) (
  *   operation; see wocky_porter_force_close_async() for more details.
  * @force_close_finish: Finish an asynchronous porter force close
  *   operation; see wocky_porter_force_close_finish() for more details.
+ * @send_iq_with_timeout_async: Start an asynchronous IQ stanza send
+ *   operation with an explicit deadline; see
+ *   wocky_porter_send_iq_with_timeout_async() for more details. The
+ *   operation is finished with @send_iq_finish.
+ * @send: Queue a stanza without waiting for it to be sent; see
+ *   wocky_porter_send() for more details. If %NULL, @send_async is used
+ *   with no callback.
  *
  * The vtable for a porter implementation.
  */
@@ -214,6 +224,16 @@ struct _WockyPorterInterface
   gboolean (*force_close_finish) (WockyPorter *porter,
       GAsyncResult *result,
       GError **error);
+
+  void (*send_iq_with_timeout_async) (WockyPorter *porter,
+      WockyStanza *stanza,
+      guint timeout_ms,
+      GCancellable *cancellable,
+      GAsyncReadyCallback callback,
+      gpointer user_data);
+
+  void (*send) (WockyPorter *porter,
+      WockyStanza *stanza);
 };
 
 void wocky_porter_start (WockyPorter *porter);
@@ -308,6 +328,13 @@ void wocky_porter_send_iq_async (WockyPorter *porter,
     GAsyncReadyCallback callback,
     gpointer user_data);
 
+void wocky_porter_send_iq_with_timeout_async (WockyPorter *porter,
+    WockyStanza *stanza,
+    guint timeout_ms,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
 WockyStanza * wocky_porter_send_iq_finish (
     WockyPorter *porter,
     GAsyncResult *result,
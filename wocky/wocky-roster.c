@@ -39,6 +39,7 @@
 #include "wocky-bare-contact.h"
 #include "wocky-c2s-porter.h"
 #include "wocky-namespaces.h"
+#include "wocky-node-private.h"
 #include "wocky-stanza.h"
 #include "wocky-utils.h"
 #include "wocky-signals-marshal.h"
@@ -396,6 +397,8 @@ roster_update (WockyRoster *self,
     }
 
   /* Iterate through item nodes. */
+  _wocky_node_ensure_children (query_node);
+
   for (j = query_node->children; j; j = j->next)
     {
       const gchar *jid;
@@ -1373,7 +1376,8 @@ wocky_roster_contact_remove_group_async (WockyRoster *self,
   WockyStanza *iq;
   WockyNode *item;
   GSimpleAsyncResult *result;
-  GSList *l;
+  WockyNodeIter iter;
+  WockyNode *group_node;
   PendingOperation *pending;
   const gchar *jid;
 
@@ -1415,18 +1419,12 @@ wocky_roster_contact_remove_group_async (WockyRoster *self,
   iq = build_iq_for_contact (contact, &item);
 
   /* remove the group */
-  /* FIXME: should we add a wocky_node_remove_child () ? */
-  for (l = item->children; l != NULL; l = g_slist_next (l))
+  wocky_node_iter_init (&iter, item, "group", NULL);
+  while (wocky_node_iter_next (&iter, &group_node))
     {
-      WockyNode *group_node = (WockyNode *) l->data;
-
-      if (wocky_strdiff (group_node->name, "group"))
-        continue;
-
       if (!wocky_strdiff (group_node->content, group))
         {
-          wocky_node_free (group_node);
-          item->children = g_slist_delete_link (item->children, l);
+          wocky_node_iter_remove (&iter);
           break;
         }
     }
@@ -31,6 +31,7 @@
 #include "wocky-sasl-auth.h"
 #include "wocky-signals-marshal.h"
 #include "wocky-namespaces.h"
+#include "wocky-text.h"
 #include "wocky-utils.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_AUTH
@@ -390,7 +391,7 @@ wocky_sasl_auth_decode_challenge (const gchar *challenge)
   if (challenge == NULL)
     return g_string_new_len ("", 0);
 
-  challenge_str = (gchar *) g_base64_decode (challenge, &len);
+  challenge_str = (gchar *) wocky_text_base64_decode (challenge, &len);
 
   challenge_data = g_string_new_len (challenge_str, len);
 
@@ -403,7 +404,7 @@ static gchar *
 wocky_sasl_auth_encode_response (const GString *response_data)
 {
   if (response_data != NULL && response_data->len > 0)
-    return g_base64_encode ((guchar *) response_data->str,
+    return wocky_text_base64_encode ((guchar *) response_data->str,
         response_data->len);
 
   return NULL;
@@ -24,6 +24,7 @@
 #include "wocky-sasl-scram.h"
 #include "wocky-sasl-auth.h"
 #include "wocky-sasl-utils.h"
+#include "wocky-text.h"
 #include "wocky-utils.h"
 
 #include <string.h>
@@ -385,7 +386,7 @@ scram_make_client_proof (WockySaslScram *self)
   /* xor signature and key, overwriting key */
   scram_xor_array (client_key, client_signature);
 
-  proof = g_base64_encode (client_key->data, client_key->len);
+  proof = wocky_text_base64_encode (client_key->data, client_key->len);
 
   g_byte_array_unref (client_key);
   g_byte_array_unref (client_signature);
@@ -505,7 +506,8 @@ scram_check_server_verification (WockySaslScram *self,
     server_key->len, (guint8 *) priv->auth_message,
     strlen (priv->auth_message));
 
-  v = g_base64_encode (server_signature->data, server_signature->len);
+  v = wocky_text_base64_encode (server_signature->data,
+      server_signature->len);
 
   ret = !wocky_strdiff (v, verification);
 
@@ -25,6 +25,7 @@
 
 #include <string.h>
 #include "wocky-sasl-utils.h"
+#include "wocky-text.h"
 
 /* Generate a good random nonce encoded with base64 such that it falls in the
  * allowable alphabet of various crypto mechanism. */
@@ -40,7 +41,7 @@ sasl_generate_base64_nonce (void)
   for (i = 0; i < NR; i++)
     n[i] = g_random_int ();
 
-  return g_base64_encode ((guchar *) n, sizeof (n));
+  return wocky_text_base64_encode ((guchar *) n, sizeof (n));
 }
 
 GByteArray *
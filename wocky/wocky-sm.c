@@ -164,10 +164,29 @@ wocky_sm_dispose (GObject *object)
   g_object_unref (priv->porter);
   priv->porter = NULL;
 
+  /* Nobody is going to send these again */
+  while (!g_queue_is_empty (priv->stanzas))
+    {
+      WockyStanza *stanza = g_queue_pop_head (priv->stanzas);
+
+      wocky_stanza_release_serialization (stanza);
+      g_object_unref (stanza);
+    }
+
   if (G_OBJECT_CLASS (wocky_sm_parent_class)->dispose)
     G_OBJECT_CLASS (wocky_sm_parent_class)->dispose (object);
 }
 
+static void
+wocky_sm_finalize (GObject *object)
+{
+  WockySM *self = WOCKY_SM (object);
+
+  g_queue_free (self->priv->stanzas);
+
+  G_OBJECT_CLASS (wocky_sm_parent_class)->finalize (object);
+}
+
 static void
 wocky_sm_class_init (WockySMClass *wocky_sm_class)
 {
@@ -181,6 +200,7 @@ wocky_sm_class_init (WockySMClass *wocky_sm_class)
   object_class->set_property = wocky_sm_set_property;
   object_class->get_property = wocky_sm_get_property;
   object_class->dispose = wocky_sm_dispose;
+  object_class->finalize = wocky_sm_finalize;
 
   spec = g_param_spec_object ("porter", "Wocky C2S porter",
       "the wocky porter to set up sm acks on",
@@ -200,6 +220,24 @@ wocky_sm_new (WockyC2SPorter *porter)
       NULL);
 }
 
+static WockyStanzaTemplate *
+get_a_template (void)
+{
+  static gsize template = 0;
+
+  if (g_once_init_enter (&template))
+    {
+      WockyStanzaTemplate *t = wocky_stanza_template_new (
+          WOCKY_STANZA_TYPE_SM_A, WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL,
+          '@', "h", WOCKY_STANZA_TEMPLATE_SLOT,
+          NULL);
+
+      g_once_init_leave (&template, (gsize) t);
+    }
+
+  return (WockyStanzaTemplate *) template;
+}
+
 /** wocky_sm_send_a
  * @porter: WockyPorter object
  * @recv_count: Number of received stanzas to write in the ack
@@ -208,16 +246,14 @@ wocky_sm_new (WockyC2SPorter *porter)
  */
 void wocky_sm_send_a (WockyPorter* porter, uint recv_count)
 {
-  WockyStanza *stanza_a = wocky_stanza_new ("a", WOCKY_XMPP_NS_STREAM_MANAGEMENT);
+  WockyStanza *stanza_a;
+  char buffer[12];
+
+  sprintf (buffer, "%u", recv_count);
+  stanza_a = wocky_stanza_template_instantiate (get_a_template (), buffer);
 
   if (stanza_a != NULL)
   {
-    WockyNode* node = wocky_stanza_get_top_node (stanza_a);
-    char buffer[12];
-
-    sprintf (buffer, "%d", recv_count);
-    wocky_node_set_attribute (node, "h", buffer);
-
     DEBUG("Sending sm-ack h=%d", recv_count);
 
     wocky_porter_send (porter, stanza_a);
@@ -272,7 +308,6 @@ static gboolean
 sm_a_cb (WockyPorter *porter, WockyStanza *stanza_a, gpointer data)
 {
   WockySM *self = WOCKY_SM(data);
-  WockySMPrivate *priv = self->priv;
 
   WockyNode* node = wocky_stanza_get_top_node (stanza_a);
 
@@ -281,17 +316,7 @@ sm_a_cb (WockyPorter *porter, WockyStanza *stanza_a, gpointer data)
       const gchar *val_h = wocky_node_get_attribute (node, "h");
       if (val_h != NULL)
         {
-          WockyStanza *stanza = g_queue_pop_head (priv->stanzas);
-
-          if (stanza != NULL)
-            {
-              DEBUG("Got sm-ack h=%s, shouldbe=%d", val_h, wocky_stanza_get_recv_count(stanza));
-              g_object_unref (stanza);
-            }
-          else
-            {
-              DEBUG("Got sm-ack h=%s, QUEUE IS EMPTY", val_h);
-            }
+          wocky_sm_ack (self, g_ascii_strtoull (val_h, NULL, 10));
         }
       else
         {
@@ -306,6 +331,32 @@ sm_a_cb (WockyPorter *porter, WockyStanza *stanza_a, gpointer data)
   return TRUE;
 }
 
+/**
+ * wocky_sm_ack:
+ * @self: a #WockySM
+ * @h: the h attribute of the ack
+ *
+ * Handles an &lt;a/&gt; received from the server, whether it came as a
+ * stanza or straight from the connection's reader.
+ */
+void
+wocky_sm_ack (WockySM *self, guint h)
+{
+  WockySMPrivate *priv = self->priv;
+  WockyStanza *stanza = g_queue_pop_head (priv->stanzas);
+
+  if (stanza != NULL)
+    {
+      DEBUG("Got sm-ack h=%u, shouldbe=%d", h, wocky_stanza_get_recv_count(stanza));
+      wocky_stanza_release_serialization (stanza);
+      g_object_unref (stanza);
+    }
+  else
+    {
+      DEBUG("Got sm-ack h=%u, QUEUE IS EMPTY", h);
+    }
+}
+
 void wocky_sm_request_for_stanza (WockySM *self, WockyStanza *stanza)
 {
   WockySMPrivate *priv = self->priv;
@@ -326,10 +377,15 @@ gboolean wocky_sm_is_unacked_stanza (WockySM *self)
   return (g_queue_get_length (self->priv->stanzas) > 0);
 }
 
+/* Whoever sends the stanza again holds its serialization again */
 WockyStanza *
 wocky_sm_pop_unacked_stanza (WockySM *self)
 {
   WockySMPrivate *priv = self->priv;
+  WockyStanza *stanza = g_queue_pop_head (priv->stanzas);
+
+  if (stanza != NULL)
+    wocky_stanza_release_serialization (stanza);
 
-  return WOCKY_STANZA(g_queue_pop_head (priv->stanzas));
+  return stanza;
 }
@@ -76,6 +76,7 @@ WockySM * wocky_sm_new (WockyC2SPorter *porter);
 void wocky_sm_send_a (WockyPorter* porter, uint recv_count);
 void wocky_sm_send_r (WockyPorter* porter, uint sent_count);
 void wocky_sm_request_for_stanza (WockySM *self, WockyStanza *stanza);
+void wocky_sm_ack (WockySM *self, guint h);
 gboolean wocky_sm_is_unacked_stanza (WockySM *self);
 WockyStanza * wocky_sm_pop_unacked_stanza (WockySM *self);
 
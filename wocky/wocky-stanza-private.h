@@ -0,0 +1,58 @@
+/*
+ * wocky-stanza-private.h - Private header for WockyStanza
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef __WOCKY__STANZA_PRIVATE_H__
+#define __WOCKY__STANZA_PRIVATE_H__
+
+#include <glib.h>
+#include <wocky-stanza.h>
+
+G_BEGIN_DECLS
+
+/* Whether the stanza is held by wocky_stanza_hold_serialization(): only then
+ * is what a writer makes of it worth keeping */
+gboolean _wocky_stanza_get_serialization_held (WockyStanza *stanza);
+
+/* A stanza sent over and over, to many contacts or again after a
+ * reconnection, only needs serializing once. What a writer makes of a stanza
+ * depends on its mode and on the namespaces it has open, given here as
+ * @streaming, @current_ns and @stream_ns.
+ *
+ * Returns the serialization kept by _wocky_stanza_set_serialized() for a
+ * writer in that state, if the stanza hasn't changed since, or NULL. The
+ * stanza owns the bytes. */
+GBytes *_wocky_stanza_get_serialized (WockyStanza *stanza,
+    gboolean streaming,
+    GQuark current_ns,
+    GQuark stream_ns);
+
+/* Keeps @bytes as what a writer in the given state makes of @stanza as it is
+ * now, in place of anything kept before; the stanza must be held */
+void _wocky_stanza_set_serialized (WockyStanza *stanza,
+    gboolean streaming,
+    GQuark current_ns,
+    GQuark stream_ns,
+    GBytes *bytes);
+
+G_END_DECLS
+
+#endif /* #ifndef __WOCKY__STANZA_PRIVATE_H__*/
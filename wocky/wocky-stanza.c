@@ -32,6 +32,7 @@
 #include "wocky-debug-internal.h"
 
 #include "wocky-node-private.h"
+#include "wocky-stanza-private.h"
 
 G_DEFINE_TYPE(WockyStanza, wocky_stanza, WOCKY_TYPE_NODE_TREE)
 
@@ -43,6 +44,14 @@ struct _WockyStanzaPrivate
 
   guint recv_count;
   gboolean dispose_has_run;
+
+  /* see wocky_stanza_hold_serialization() */
+  guint serialization_holds;
+  /* the stanza as last serialized, see _wocky_stanza_get_serialized() */
+  GBytes *serialized;
+  gboolean serialized_streaming;
+  GQuark serialized_ns;
+  GQuark serialized_stream_ns;
 };
 
 typedef struct
@@ -202,6 +211,9 @@ wocky_stanza_finalize (GObject *object)
       self->priv->to_contact = NULL;
     }
 
+  if (self->priv->serialized != NULL)
+    g_bytes_unref (self->priv->serialized);
+
   G_OBJECT_CLASS (wocky_stanza_parent_class)->finalize (object);
 }
 
@@ -230,6 +242,106 @@ wocky_stanza_copy (WockyStanza *old)
       NULL);
 }
 
+/**
+ * wocky_stanza_hold_serialization:
+ * @self: a stanza
+ *
+ * Tells @self it is about to be written more than once, for instance to many
+ * contacts, or again on a new connection by stream management. Until the
+ * hold is released, what a #WockyXmppWriter makes of @self is kept, and given
+ * again as it is by writers in the same state for as long as @self isn't
+ * changed through the #WockyNode API.
+ *
+ * Each call must be balanced by one to wocky_stanza_release_serialization().
+ */
+void
+wocky_stanza_hold_serialization (WockyStanza *self)
+{
+  g_return_if_fail (WOCKY_IS_STANZA (self));
+
+  self->priv->serialization_holds++;
+}
+
+/**
+ * wocky_stanza_release_serialization:
+ * @self: a stanza
+ *
+ * Releases a hold taken with wocky_stanza_hold_serialization(). Once the last
+ * one is released, @self lets go of what it kept.
+ */
+void
+wocky_stanza_release_serialization (WockyStanza *self)
+{
+  WockyStanzaPrivate *priv;
+
+  g_return_if_fail (WOCKY_IS_STANZA (self));
+
+  priv = self->priv;
+  g_return_if_fail (priv->serialization_holds > 0);
+
+  if (--priv->serialization_holds > 0 || priv->serialized == NULL)
+    return;
+
+  g_bytes_unref (priv->serialized);
+  priv->serialized = NULL;
+}
+
+gboolean
+_wocky_stanza_get_serialization_held (WockyStanza *stanza)
+{
+  return stanza->priv->serialization_holds > 0;
+}
+
+GBytes *
+_wocky_stanza_get_serialized (WockyStanza *stanza,
+    gboolean streaming,
+    GQuark current_ns,
+    GQuark stream_ns)
+{
+  WockyStanzaPrivate *priv = stanza->priv;
+
+  if (priv->serialized == NULL)
+    return NULL;
+
+  if (_wocky_node_is_dirty (wocky_stanza_get_top_node (stanza)))
+    {
+      g_bytes_unref (priv->serialized);
+      priv->serialized = NULL;
+      return NULL;
+    }
+
+  if (priv->serialized_streaming != streaming ||
+      priv->serialized_ns != current_ns ||
+      priv->serialized_stream_ns != stream_ns)
+    return NULL;
+
+  return priv->serialized;
+}
+
+void
+_wocky_stanza_set_serialized (WockyStanza *stanza,
+    gboolean streaming,
+    GQuark current_ns,
+    GQuark stream_ns,
+    GBytes *bytes)
+{
+  WockyStanzaPrivate *priv = stanza->priv;
+
+  g_return_if_fail (priv->serialization_holds > 0);
+
+  /* taken first, in case @bytes is what the stanza holds already */
+  g_bytes_ref (bytes);
+
+  if (priv->serialized != NULL)
+    g_bytes_unref (priv->serialized);
+
+  priv->serialized = bytes;
+  _wocky_node_set_clean (wocky_stanza_get_top_node (stanza));
+  priv->serialized_streaming = streaming;
+  priv->serialized_ns = current_ns;
+  priv->serialized_stream_ns = stream_ns;
+}
+
 static const gchar *
 get_type_name (WockyStanzaType type)
 {
@@ -383,6 +495,198 @@ wocky_stanza_build (WockyStanzaType type,
   return stanza;
 }
 
+const gchar wocky_stanza_template_slot[] = "(slot)";
+
+/**
+ * WockyStanzaTemplate:
+ *
+ * A stanza build spec compiled once, to build stanzas of the same shape over
+ * and over without interpreting the spec each time. Create one with
+ * wocky_stanza_template_new(), and build stanzas from it with
+ * wocky_stanza_template_instantiate().
+ */
+struct _WockyStanzaTemplate
+{
+  WockyNodeTemplate *top;
+};
+
+/**
+ * wocky_stanza_template_new:
+ * @type: The type of stanza to build
+ * @sub_type: The stanza's subtype; valid values depend on @type
+ * @from: The sender's JID, %WOCKY_STANZA_TEMPLATE_SLOT, or %NULL to leave it
+ *  unspecified.
+ * @to: The target's JID, %WOCKY_STANZA_TEMPLATE_SLOT, or %NULL to leave it
+ *  unspecified.
+ * @...: the description of the stanza to build, as for
+ *  wocky_stanza_build(), terminated with %NULL
+ *
+ * Compiles a stanza description into a template. Any attribute value or text
+ * given as %WOCKY_STANZA_TEMPLATE_SLOT, as well as @from and @to, are slots
+ * whose values are only given when instantiating the template; they're
+ * numbered in the order they appear, @from and @to first. For example:
+ *
+ * |[
+ * WockyStanzaTemplate *template = wocky_stanza_template_new (
+ *    WOCKY_STANZA_TYPE_MESSAGE, WOCKY_STANZA_SUB_TYPE_CHAT,
+ *    NULL, WOCKY_STANZA_TEMPLATE_SLOT,
+ *    '(', "body",
+ *      '$', WOCKY_STANZA_TEMPLATE_SLOT,
+ *    ')',
+ *   NULL);
+ *
+ * stanza = wocky_stanza_template_instantiate (template,
+ *    "juliet@<!-- -->example.com", "Wherefore art thou, Romeo?");
+ * ]|
+ *
+ * Templates can't use %WOCKY_NODE_ASSIGN_TO. Instantiating one never
+ * changes it, so it can be kept for as long as stanzas of its shape are
+ * built.
+ *
+ * Returns: a new template, to be freed with wocky_stanza_template_free(), or
+ *  %NULL if the description isn't one a template can have
+ */
+WockyStanzaTemplate *
+wocky_stanza_template_new (WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    const gchar *from,
+    const gchar *to,
+    ...)
+{
+  WockyStanzaTemplate *template;
+  va_list ap;
+
+  va_start (ap, to);
+  template = wocky_stanza_template_new_va (type, sub_type, from, to, ap);
+  va_end (ap);
+
+  return template;
+}
+
+WockyStanzaTemplate *
+wocky_stanza_template_new_va (WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    const gchar *from,
+    const gchar *to,
+    va_list ap)
+{
+  WockyStanzaTemplate *template;
+  const gchar *sub_type_name;
+
+  g_return_val_if_fail (type > WOCKY_STANZA_TYPE_NONE &&
+      type < WOCKY_STANZA_TYPE_UNKNOWN, NULL);
+
+  if (!check_sub_type (type, sub_type))
+    return NULL;
+
+  template = g_slice_new0 (WockyStanzaTemplate);
+  template->top = _wocky_node_template_new (get_type_name (type),
+      g_quark_from_static_string (get_type_ns (type)),
+      WOCKY_STANZA_TEMPLATE_SLOT);
+
+  sub_type_name = get_sub_type_name (sub_type);
+  if (sub_type_name != NULL)
+    _wocky_node_template_set_attribute (template->top, "type",
+        sub_type_name);
+
+  if (from != NULL)
+    _wocky_node_template_set_attribute (template->top, "from", from);
+
+  if (to != NULL)
+    _wocky_node_template_set_attribute (template->top, "to", to);
+
+  if (!_wocky_node_template_add_build_va (template->top, ap))
+    {
+      wocky_stanza_template_free (template);
+      return NULL;
+    }
+
+  return template;
+}
+
+/**
+ * wocky_stanza_template_get_n_slots:
+ * @self: a #WockyStanzaTemplate
+ *
+ * Returns: the number of values wocky_stanza_template_instantiate() takes
+ */
+guint
+wocky_stanza_template_get_n_slots (WockyStanzaTemplate *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return _wocky_node_template_get_n_slots (self->top);
+}
+
+/**
+ * wocky_stanza_template_instantiate:
+ * @self: a #WockyStanzaTemplate
+ * @...: one value for each of the template's slots, in order; %NULL leaves
+ *  out the attribute or text that slot stands for
+ *
+ * Builds a stanza from @self, as wocky_stanza_build() would from the
+ * description @self was compiled from with the values put in its slots.
+ *
+ * Returns: a new stanza object
+ */
+WockyStanza *
+wocky_stanza_template_instantiate (WockyStanzaTemplate *self,
+    ...)
+{
+  const gchar **values;
+  guint n_slots, i;
+  va_list ap;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  n_slots = _wocky_node_template_get_n_slots (self->top);
+  values = g_newa (const gchar *, n_slots + 1);
+
+  va_start (ap, self);
+  for (i = 0; i < n_slots; i++)
+    values[i] = va_arg (ap, const gchar *);
+  va_end (ap);
+
+  return wocky_stanza_template_instantiatev (self, values);
+}
+
+/**
+ * wocky_stanza_template_instantiatev:
+ * @self: a #WockyStanzaTemplate
+ * @values: (array): one value for each of the template's slots, in order;
+ *  a %NULL value leaves out the attribute or text that slot stands for
+ *
+ * Like wocky_stanza_template_instantiate(), but with the values in an array.
+ *
+ * Returns: a new stanza object
+ */
+WockyStanza *
+wocky_stanza_template_instantiatev (WockyStanzaTemplate *self,
+    const gchar * const *values)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  return g_object_new (WOCKY_TYPE_STANZA,
+      "top-node", _wocky_node_template_build (self->top, values),
+      NULL);
+}
+
+/**
+ * wocky_stanza_template_free:
+ * @self: a #WockyStanzaTemplate
+ *
+ * Frees @self. Stanzas built from it are not affected.
+ */
+void
+wocky_stanza_template_free (WockyStanzaTemplate *self)
+{
+  if (self == NULL)
+    return;
+
+  _wocky_node_template_free (self->top);
+  g_slice_free (WockyStanzaTemplate, self);
+}
+
 WockyStanza *
 wocky_stanza_build_to_contact (WockyStanzaType type,
     WockyStanzaSubType sub_type,
@@ -516,6 +820,40 @@ wocky_stanza_has_type (WockyStanza *stanza,
   return expected_type == actual_type;
 }
 
+static gboolean
+spec_is_empty (va_list ap)
+{
+  va_list copy;
+  gboolean empty;
+
+  G_VA_COPY (copy, ap);
+  empty = (va_arg (copy, WockyNodeBuildTag) == 0);
+  va_end (copy);
+
+  return empty;
+}
+
+/* Most IQ results have no body: they're built from this rather than
+ * interpreting an empty spec */
+static WockyStanzaTemplate *
+get_iq_result_template (void)
+{
+  static gsize template = 0;
+
+  if (g_once_init_enter (&template))
+    {
+      WockyStanzaTemplate *t = wocky_stanza_template_new (
+          WOCKY_STANZA_TYPE_IQ, WOCKY_STANZA_SUB_TYPE_RESULT,
+          WOCKY_STANZA_TEMPLATE_SLOT, WOCKY_STANZA_TEMPLATE_SLOT,
+          '@', "id", WOCKY_STANZA_TEMPLATE_SLOT,
+          NULL);
+
+      g_once_init_leave (&template, (gsize) t);
+    }
+
+  return (WockyStanzaTemplate *) template;
+}
+
 static WockyStanza *
 create_iq_reply (WockyStanza *iq,
     WockyStanzaSubType sub_type_reply,
@@ -543,10 +881,18 @@ create_iq_reply (WockyStanza *iq,
   if (id == NULL)
     return NULL;
 
-  reply = wocky_stanza_build_va (WOCKY_STANZA_TYPE_IQ,
-      sub_type_reply, to, from, ap);
+  if (sub_type_reply == WOCKY_STANZA_SUB_TYPE_RESULT && spec_is_empty (ap))
+    {
+      reply = wocky_stanza_template_instantiate (get_iq_result_template (),
+          to, from, id);
+    }
+  else
+    {
+      reply = wocky_stanza_build_va (WOCKY_STANZA_TYPE_IQ,
+          sub_type_reply, to, from, ap);
 
-  wocky_node_set_attribute (wocky_stanza_get_top_node (reply), "id", id);
+      wocky_node_set_attribute (wocky_stanza_get_top_node (reply), "id", id);
+    }
 
   contact = wocky_stanza_get_from_contact (iq);
   if (contact != NULL)
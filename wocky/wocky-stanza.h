@@ -199,6 +199,36 @@ WockyStanza *wocky_stanza_build_iq_error_va (
     WockyStanza *iq,
     va_list ap);
 
+/**
+ * WOCKY_STANZA_TEMPLATE_SLOT:
+ *
+ * Stands in for an attribute value or text in the spec given to
+ * wocky_stanza_template_new(), to be filled in each time the template is
+ * instantiated.
+ */
+#define WOCKY_STANZA_TEMPLATE_SLOT (wocky_stanza_template_slot)
+extern const gchar wocky_stanza_template_slot[];
+
+typedef struct _WockyStanzaTemplate WockyStanzaTemplate;
+
+WockyStanzaTemplate *wocky_stanza_template_new (WockyStanzaType type,
+    WockyStanzaSubType sub_type, const gchar *from, const gchar *to,
+    ...) G_GNUC_NULL_TERMINATED;
+WockyStanzaTemplate *wocky_stanza_template_new_va (WockyStanzaType type,
+    WockyStanzaSubType sub_type,
+    const gchar *from,
+    const gchar *to,
+    va_list ap);
+
+guint wocky_stanza_template_get_n_slots (WockyStanzaTemplate *self);
+
+WockyStanza *wocky_stanza_template_instantiate (WockyStanzaTemplate *self,
+    ...);
+WockyStanza *wocky_stanza_template_instantiatev (WockyStanzaTemplate *self,
+    const gchar * const *values);
+
+void wocky_stanza_template_free (WockyStanzaTemplate *self);
+
 gboolean wocky_stanza_extract_errors (WockyStanza *stanza,
     WockyXmppErrorType *type,
     GError **core,
@@ -218,6 +248,9 @@ void wocky_stanza_set_from_contact (WockyStanza *self,
 void wocky_stanza_set_recv_count (WockyStanza *self,
     guint count);
 
+void wocky_stanza_hold_serialization (WockyStanza *self);
+void wocky_stanza_release_serialization (WockyStanza *self);
+
 G_END_DECLS
 
 #endif /* #ifndef __WOCKY_STANZA_H__*/
@@ -0,0 +1,990 @@
+/*
+ * wocky-text.c - Source for vectorised text kernels
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Every byte of every stanza goes through UTF-8 validation on its way into
+ * a WockyNode and through escaping on its way out, and SASL, caps hashes and
+ * file transfers push a fair amount of base64 around; GLib and libxml2 do
+ * all of these a byte at a time.
+ *
+ * The kernels here only take care of the common case (runs of plain ASCII,
+ * and whole blocks of base64 without padding or whitespace), a vector at a
+ * time, and hand whatever they stop at to the GLib functions they replace,
+ * so that the results are exactly the same, errors included. Which
+ * instruction set to use is decided once, at run time, so that a build for
+ * generic x86-64 still gets AVX2 where the CPU has it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-text.h"
+
+#include <string.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#define TARGET(isa) __attribute__ ((target (isa)))
+#elif defined (__GNUC__) && defined (__aarch64__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+typedef struct
+{
+  WockyTextIsa isa;
+  /* how many of the first @len bytes are ASCII, but not NUL */
+  gsize (*ascii_span) (const guchar *s, gsize len);
+  /* how many of the first @len bytes need no escaping */
+  gsize (*plain_span) (const guchar *s, gsize len, WockyTextEscape mode);
+  /* how many of the first @len bytes are character data, as
+   * wocky_text_markup_scan() has it */
+  gsize (*data_span) (const guchar *s, gsize len, guchar quote);
+  /* encode as much of @in as they can a whole block at a time, returning
+   * how much they took (a multiple of 3), and writing 4/3 as much */
+  gsize (*base64_encode) (const guchar *in, gsize len, gchar *out);
+  /* likewise for decoding, stopping at the first block which isn't made
+   * of base64 digits only; the result is a multiple of 4 */
+  gsize (*base64_decode) (const gchar *in, gsize len, guchar *out);
+} Kernels;
+
+/* Escaping is needed for bit 0 in content, bit 1 in attribute values, where
+ * everything from 0x80 up needs it as well */
+#define ESCAPE_CONTENT (1 << 0)
+#define ESCAPE_ATTRIBUTE (1 << 1)
+
+static const guint8 escape_table[128] = {
+  ['\t'] = ESCAPE_ATTRIBUTE,
+  ['\n'] = ESCAPE_ATTRIBUTE,
+  ['\r'] = ESCAPE_CONTENT | ESCAPE_ATTRIBUTE,
+  ['"'] = ESCAPE_CONTENT | ESCAPE_ATTRIBUTE,
+  ['&'] = ESCAPE_CONTENT | ESCAPE_ATTRIBUTE,
+  ['<'] = ESCAPE_CONTENT | ESCAPE_ATTRIBUTE,
+  ['>'] = ESCAPE_CONTENT | ESCAPE_ATTRIBUTE,
+};
+
+/* Scalar kernels, a machine word at a time where that helps */
+
+#define ONES ((guint64) 0x0101010101010101ULL)
+#define HIGHS ((guint64) 0x8080808080808080ULL)
+
+static gsize
+scalar_ascii_span (const guchar *s,
+    gsize len)
+{
+  gsize i = 0;
+
+  for (; i + 8 <= len; i += 8)
+    {
+      guint64 w;
+
+      memcpy (&w, s + i, 8);
+
+      /* any byte with its top bit set, or equal to zero */
+      if (((w | ((w - ONES) & ~w)) & HIGHS) != 0)
+        break;
+    }
+
+  for (; i < len; i++)
+    {
+      if (s[i] == 0 || s[i] >= 0x80)
+        break;
+    }
+
+  return i;
+}
+
+static gsize
+scalar_plain_span (const guchar *s,
+    gsize len,
+    WockyTextEscape mode)
+{
+  gsize i;
+
+  if (mode == WOCKY_TEXT_ESCAPE_CONTENT)
+    {
+      for (i = 0; i < len; i++)
+        {
+          if (s[i] < 0x80 && (escape_table[s[i]] & ESCAPE_CONTENT))
+            break;
+        }
+    }
+  else
+    {
+      for (i = 0; i < len; i++)
+        {
+          if (s[i] >= 0x80 || (escape_table[s[i]] & ESCAPE_ATTRIBUTE))
+            break;
+        }
+    }
+
+  return i;
+}
+
+static gsize
+scalar_data_span (const guchar *s,
+    gsize len,
+    guchar quote)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      guchar c = s[i];
+
+      if (c == '<' || c == '&' || (c == quote && quote != '\0'))
+        break;
+
+      if (c < 0x20 && (quote != '\0' || (c != '\t' && c != '\n')))
+        break;
+    }
+
+  return i;
+}
+
+static gsize
+scalar_base64_encode (const guchar *in,
+    gsize len,
+    gchar *out)
+{
+  return 0;
+}
+
+static gsize
+scalar_base64_decode (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  return 0;
+}
+
+static const Kernels scalar_kernels = {
+  WOCKY_TEXT_ISA_SCALAR,
+  scalar_ascii_span,
+  scalar_plain_span,
+  scalar_data_span,
+  scalar_base64_encode,
+  scalar_base64_decode,
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* The bytes of @v which need escaping in @mode, as a bit mask */
+TARGET ("sse2") static inline guint
+sse2_escape_mask (__m128i v,
+    WockyTextEscape mode)
+{
+  __m128i m;
+
+  m = _mm_or_si128 (
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('<')),
+          _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('>'))),
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('&')),
+          _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')),
+              _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r')))));
+
+  /* the top bit of every byte from 0x80 up is already set */
+  if (mode == WOCKY_TEXT_ESCAPE_ATTRIBUTE)
+    m = _mm_or_si128 (m, _mm_or_si128 (v,
+            _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')),
+                _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')))));
+
+  return _mm_movemask_epi8 (m);
+}
+
+TARGET ("avx2") static inline guint
+avx2_escape_mask (__m256i v,
+    WockyTextEscape mode)
+{
+  __m256i m;
+
+  m = _mm256_or_si256 (
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('<')),
+          _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('>'))),
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('&')),
+          _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('"')),
+              _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r')))));
+
+  if (mode == WOCKY_TEXT_ESCAPE_ATTRIBUTE)
+    m = _mm256_or_si256 (m, _mm256_or_si256 (v,
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n')),
+                _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')))));
+
+  return _mm256_movemask_epi8 (m);
+}
+
+/* Likewise for the bytes which end a run of character data */
+TARGET ("sse2") static inline guint
+sse2_data_mask (__m128i v,
+    guchar quote)
+{
+  __m128i ctl, m;
+
+  /* unsigned v <= 0x1f */
+  ctl = _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (0x1f)), v);
+
+  if (quote == '\0')
+    ctl = _mm_andnot_si128 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')),
+            _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n'))), ctl);
+
+  /* a NUL @quote only finds what ctl already has */
+  m = _mm_or_si128 (
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('<')),
+          _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('&'))),
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (quote)), ctl));
+
+  return _mm_movemask_epi8 (m);
+}
+
+TARGET ("avx2") static inline guint
+avx2_data_mask (__m256i v,
+    guchar quote)
+{
+  __m256i ctl, m;
+
+  ctl = _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, _mm256_set1_epi8 (0x1f)), v);
+
+  if (quote == '\0')
+    ctl = _mm256_andnot_si256 (
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')),
+            _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n'))), ctl);
+
+  m = _mm256_or_si256 (
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('<')),
+          _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('&'))),
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (quote)),
+          ctl));
+
+  return _mm256_movemask_epi8 (m);
+}
+
+TARGET ("sse2") static gsize
+sse2_ascii_span (const guchar *s,
+    gsize len)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      guint mask = _mm_movemask_epi8 (
+          _mm_or_si128 (v, _mm_cmpeq_epi8 (v, zero)));
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  return i + scalar_ascii_span (s + i, len - i);
+}
+
+TARGET ("sse2") static gsize
+sse2_plain_span (const guchar *s,
+    gsize len,
+    WockyTextEscape mode)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      guint mask = sse2_escape_mask (v, mode);
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  return i + scalar_plain_span (s + i, len - i, mode);
+}
+
+TARGET ("sse2") static gsize
+sse2_data_span (const guchar *s,
+    gsize len,
+    guchar quote)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      guint mask = sse2_data_mask (v, quote);
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  return i + scalar_data_span (s + i, len - i, quote);
+}
+
+TARGET ("avx2") static gsize
+avx2_ascii_span (const guchar *s,
+    gsize len)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  gsize i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      guint mask = _mm256_movemask_epi8 (
+          _mm256_or_si256 (v, _mm256_cmpeq_epi8 (v, zero)));
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  /* The tail is left to the SSE2 version, which isn't VEX-encoded: clear
+   * the upper halves first, or every switch between the two costs dearly */
+  _mm256_zeroupper ();
+
+  return i + sse2_ascii_span (s + i, len - i);
+}
+
+TARGET ("avx2") static gsize
+avx2_plain_span (const guchar *s,
+    gsize len,
+    WockyTextEscape mode)
+{
+  gsize i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      guint mask = avx2_escape_mask (v, mode);
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  _mm256_zeroupper ();
+
+  return i + sse2_plain_span (s + i, len - i, mode);
+}
+
+TARGET ("avx2") static gsize
+avx2_data_span (const guchar *s,
+    gsize len,
+    guchar quote)
+{
+  gsize i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      guint mask = avx2_data_mask (v, quote);
+
+      if (mask != 0)
+        return i + __builtin_ctz (mask);
+    }
+
+  _mm256_zeroupper ();
+
+  return i + sse2_data_span (s + i, len - i, quote);
+}
+
+/* Base64 after Wojciech Muła and Daniel Lemire, "Faster Base64 Encoding
+ * and Decoding Using AVX2 Instructions": 12 bytes become 16 digits per
+ * step, and back */
+TARGET ("ssse3") static gsize
+ssse3_base64_encode (const guchar *in,
+    gsize len,
+    gchar *out)
+{
+  const __m128i shuffle = _mm_set_epi8 (10, 11, 9, 10, 7, 8, 6, 7,
+      4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i shift = _mm_setr_epi8 ('a' - 26, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  gsize i;
+
+  /* each step reads 16 bytes to use 12 of them */
+  for (i = 0; i + 16 <= len; i += 12, out += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i t, digits;
+
+      /* split every 3 bytes into four 6-bit values, one per byte */
+      v = _mm_shuffle_epi8 (v, shuffle);
+      t = _mm_mulhi_epu16 (_mm_and_si128 (v, _mm_set1_epi32 (0x0fc0fc00)),
+          _mm_set1_epi32 (0x04000040));
+      v = _mm_mullo_epi16 (_mm_and_si128 (v, _mm_set1_epi32 (0x003f03f0)),
+          _mm_set1_epi32 (0x01000010));
+      v = _mm_or_si128 (v, t);
+
+      /* and map them onto the alphabet by the range they fall in */
+      t = _mm_subs_epu8 (v, _mm_set1_epi8 (51));
+      t = _mm_or_si128 (t, _mm_and_si128 (
+              _mm_cmpgt_epi8 (_mm_set1_epi8 (26), v), _mm_set1_epi8 (13)));
+      digits = _mm_add_epi8 (_mm_shuffle_epi8 (shift, t), v);
+
+      _mm_storeu_si128 ((__m128i *) out, digits);
+    }
+
+  return i;
+}
+
+TARGET ("ssse3") static gsize
+ssse3_base64_decode (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  const __m128i lut_lo = _mm_setr_epi8 (0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8 (0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+      0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+      0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+      -1, -1, -1, -1);
+  const __m128i mask_2f = _mm_set1_epi8 (0x2f);
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16, out += 12)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (v, 4), mask_2f);
+      __m128i lo, hi, roll;
+      gint32 tail;
+
+      /* a character is a digit iff its two nibbles' classes don't
+       * overlap */
+      lo = _mm_shuffle_epi8 (lut_lo, _mm_and_si128 (v, mask_2f));
+      hi = _mm_shuffle_epi8 (lut_hi, hi_nibbles);
+
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (lo, hi),
+                  _mm_setzero_si128 ())) != 0xffff)
+        break;
+
+      roll = _mm_shuffle_epi8 (lut_roll,
+          _mm_add_epi8 (_mm_cmpeq_epi8 (v, mask_2f), hi_nibbles));
+      v = _mm_add_epi8 (v, roll);
+
+      /* put four 6-bit values back together into 3 bytes */
+      v = _mm_maddubs_epi16 (v, _mm_set1_epi32 (0x01400140));
+      v = _mm_madd_epi16 (v, _mm_set1_epi32 (0x00011000));
+      v = _mm_shuffle_epi8 (v, pack);
+
+      /* only 12 of the 16 bytes are ours to write */
+      _mm_storel_epi64 ((__m128i *) out, v);
+      tail = _mm_cvtsi128_si32 (_mm_srli_si128 (v, 8));
+      memcpy (out + 8, &tail, 4);
+    }
+
+  return i;
+}
+
+static const Kernels sse2_kernels = {
+  WOCKY_TEXT_ISA_SSE2,
+  sse2_ascii_span,
+  sse2_plain_span,
+  sse2_data_span,
+  scalar_base64_encode,
+  scalar_base64_decode,
+};
+
+static const Kernels ssse3_kernels = {
+  WOCKY_TEXT_ISA_SSSE3,
+  sse2_ascii_span,
+  sse2_plain_span,
+  sse2_data_span,
+  ssse3_base64_encode,
+  ssse3_base64_decode,
+};
+
+/* A 256-bit base64 would need the input shuffled across lanes and isn't
+ * worth it for the amounts XMPP deals in */
+static const Kernels avx2_kernels = {
+  WOCKY_TEXT_ISA_AVX2,
+  avx2_ascii_span,
+  avx2_plain_span,
+  avx2_data_span,
+  ssse3_base64_encode,
+  ssse3_base64_decode,
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+static const gchar base64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static gsize
+neon_ascii_span (const guchar *s,
+    gsize len)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (s + i);
+
+      /* the block's first bad byte is found by the scalar code */
+      if (vmaxvq_u8 (vorrq_u8 (vcgeq_u8 (v, vdupq_n_u8 (0x80)),
+                  vceqq_u8 (v, vdupq_n_u8 (0)))) != 0)
+        break;
+    }
+
+  return i + scalar_ascii_span (s + i, len - i);
+}
+
+static gsize
+neon_plain_span (const guchar *s,
+    gsize len,
+    WockyTextEscape mode)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (s + i);
+      uint8x16_t m;
+
+      m = vorrq_u8 (
+          vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('<')),
+              vceqq_u8 (v, vdupq_n_u8 ('>'))),
+          vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('&')),
+              vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('"')),
+                  vceqq_u8 (v, vdupq_n_u8 ('\r')))));
+
+      if (mode == WOCKY_TEXT_ESCAPE_ATTRIBUTE)
+        m = vorrq_u8 (m, vorrq_u8 (vcgeq_u8 (v, vdupq_n_u8 (0x80)),
+                vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('\n')),
+                    vceqq_u8 (v, vdupq_n_u8 ('\t')))));
+
+      if (vmaxvq_u8 (m) != 0)
+        break;
+    }
+
+  return i + scalar_plain_span (s + i, len - i, mode);
+}
+
+static gsize
+neon_data_span (const guchar *s,
+    gsize len,
+    guchar quote)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (s + i);
+      uint8x16_t ctl = vcltq_u8 (v, vdupq_n_u8 (0x20));
+      uint8x16_t m;
+
+      if (quote == '\0')
+        ctl = vbicq_u8 (ctl, vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('\t')),
+                vceqq_u8 (v, vdupq_n_u8 ('\n'))));
+
+      m = vorrq_u8 (
+          vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('<')),
+              vceqq_u8 (v, vdupq_n_u8 ('&'))),
+          vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 (quote)), ctl));
+
+      if (vmaxvq_u8 (m) != 0)
+        break;
+    }
+
+  return i + scalar_data_span (s + i, len - i, quote);
+}
+
+static uint8x16x4_t
+neon_load_table (const guint8 *table)
+{
+  uint8x16x4_t t;
+
+  t.val[0] = vld1q_u8 (table);
+  t.val[1] = vld1q_u8 (table + 16);
+  t.val[2] = vld1q_u8 (table + 32);
+  t.val[3] = vld1q_u8 (table + 48);
+
+  return t;
+}
+
+/* 48 bytes become 64 digits per step, de-interleaved by the loads and
+ * interleaved again by the stores */
+static gsize
+neon_base64_encode (const guchar *in,
+    gsize len,
+    gchar *out)
+{
+  const uint8x16x4_t alphabet = neon_load_table (
+      (const guint8 *) base64_alphabet);
+  const uint8x16_t mask = vdupq_n_u8 (0x3f);
+  gsize i;
+
+  for (i = 0; i + 48 <= len; i += 48, out += 64)
+    {
+      uint8x16x3_t v = vld3q_u8 (in + i);
+      uint8x16x4_t d;
+
+      d.val[0] = vshrq_n_u8 (v.val[0], 2);
+      d.val[1] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (v.val[0], 4),
+              vshrq_n_u8 (v.val[1], 4)), mask);
+      d.val[2] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (v.val[1], 2),
+              vshrq_n_u8 (v.val[2], 6)), mask);
+      d.val[3] = vandq_u8 (v.val[2], mask);
+
+      d.val[0] = vqtbl4q_u8 (alphabet, d.val[0]);
+      d.val[1] = vqtbl4q_u8 (alphabet, d.val[1]);
+      d.val[2] = vqtbl4q_u8 (alphabet, d.val[2]);
+      d.val[3] = vqtbl4q_u8 (alphabet, d.val[3]);
+
+      vst4q_u8 ((guint8 *) out, d);
+    }
+
+  return i;
+}
+
+/* Each digit's value, or 0xff for characters which aren't digits, for the
+ * first 128 characters */
+static guint8 neon_decode_table[128];
+
+static void
+neon_decode_table_init (void)
+{
+  guint i;
+
+  memset (neon_decode_table, 0xff, sizeof (neon_decode_table));
+
+  for (i = 0; i < 64; i++)
+    neon_decode_table[(guchar) base64_alphabet[i]] = i;
+}
+
+static gsize
+neon_base64_decode (const gchar *in,
+    gsize len,
+    guchar *out)
+{
+  const uint8x16x4_t lo = neon_load_table (neon_decode_table);
+  const uint8x16x4_t hi = neon_load_table (neon_decode_table + 64);
+  gsize i;
+
+  for (i = 0; i + 64 <= len; i += 64, out += 48)
+    {
+      uint8x16x4_t v = vld4q_u8 ((const guint8 *) in + i);
+      uint8x16x3_t b;
+      uint8x16_t bad = vdupq_n_u8 (0);
+      guint j;
+
+      for (j = 0; j < 4; j++)
+        {
+          uint8x16_t c = v.val[j];
+
+          /* characters from 128 up miss both tables, and stay 0 */
+          v.val[j] = vqtbx4q_u8 (vqtbl4q_u8 (lo, c), hi,
+              vsubq_u8 (c, vdupq_n_u8 (64)));
+          bad = vorrq_u8 (bad, vorrq_u8 (vcgeq_u8 (v.val[j], vdupq_n_u8 (64)),
+                  vcgeq_u8 (c, vdupq_n_u8 (0x80))));
+        }
+
+      if (vmaxvq_u8 (bad) != 0)
+        break;
+
+      b.val[0] = vorrq_u8 (vshlq_n_u8 (v.val[0], 2),
+          vshrq_n_u8 (v.val[1], 4));
+      b.val[1] = vorrq_u8 (vshlq_n_u8 (v.val[1], 4),
+          vshrq_n_u8 (v.val[2], 2));
+      b.val[2] = vorrq_u8 (vshlq_n_u8 (v.val[2], 6), v.val[3]);
+
+      vst3q_u8 (out, b);
+    }
+
+  return i;
+}
+
+static const Kernels neon_kernels = {
+  WOCKY_TEXT_ISA_NEON,
+  neon_ascii_span,
+  neon_plain_span,
+  neon_data_span,
+  neon_base64_encode,
+  neon_base64_decode,
+};
+
+#endif /* HAVE_NEON_KERNELS */
+
+static const Kernels *
+kernels_for (WockyTextIsa isa)
+{
+  switch (isa)
+    {
+      case WOCKY_TEXT_ISA_SCALAR:
+        return &scalar_kernels;
+
+#ifdef HAVE_X86_KERNELS
+      case WOCKY_TEXT_ISA_SSE2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("sse2") ? &sse2_kernels : NULL;
+
+      case WOCKY_TEXT_ISA_SSSE3:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("ssse3") ? &ssse3_kernels : NULL;
+
+      case WOCKY_TEXT_ISA_AVX2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("avx2") &&
+            __builtin_cpu_supports ("ssse3") ? &avx2_kernels : NULL;
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+      /* NEON is part of every AArch64 CPU */
+      case WOCKY_TEXT_ISA_NEON:
+        return &neon_kernels;
+#endif
+
+      default:
+        return NULL;
+    }
+}
+
+static const Kernels *current = NULL;
+
+static const Kernels *
+get_kernels (void)
+{
+  const Kernels *k = g_atomic_pointer_get (&current);
+  static gsize initialised = 0;
+
+  if (G_LIKELY (k != NULL))
+    return k;
+
+  if (g_once_init_enter (&initialised))
+    {
+      WockyTextIsa isa;
+
+#ifdef HAVE_NEON_KERNELS
+      neon_decode_table_init ();
+#endif
+
+      for (isa = WOCKY_TEXT_ISA_NEON; isa > WOCKY_TEXT_ISA_SCALAR; isa--)
+        {
+          if ((k = kernels_for (isa)) != NULL)
+            break;
+        }
+
+      if (k == NULL)
+        k = &scalar_kernels;
+
+      g_atomic_pointer_set (&current, k);
+      g_once_init_leave (&initialised, 1);
+    }
+
+  return g_atomic_pointer_get (&current);
+}
+
+WockyTextIsa
+wocky_text_get_isa (void)
+{
+  return get_kernels ()->isa;
+}
+
+gboolean
+wocky_text_set_isa (WockyTextIsa isa)
+{
+  const Kernels *k;
+
+  /* so that the detection doesn't overwrite the choice later */
+  get_kernels ();
+
+  if ((k = kernels_for (isa)) == NULL)
+    return FALSE;
+
+  g_atomic_pointer_set (&current, k);
+  return TRUE;
+}
+
+const gchar *
+wocky_text_isa_name (WockyTextIsa isa)
+{
+  switch (isa)
+    {
+      case WOCKY_TEXT_ISA_SCALAR:
+        return "scalar";
+      case WOCKY_TEXT_ISA_SSE2:
+        return "sse2";
+      case WOCKY_TEXT_ISA_SSSE3:
+        return "ssse3";
+      case WOCKY_TEXT_ISA_AVX2:
+        return "avx2";
+      case WOCKY_TEXT_ISA_NEON:
+        return "neon";
+      default:
+        g_return_val_if_reached (NULL);
+    }
+}
+
+gboolean
+wocky_text_utf8_validate (const gchar *str,
+    gssize len,
+    const gchar **end)
+{
+  const Kernels *k = get_kernels ();
+  const guchar *p = (const guchar *) str;
+  const guchar *stop;
+
+  if (len < 0)
+    len = strlen (str);
+
+  stop = p + len;
+
+  while (p < stop)
+    {
+      const guchar *q;
+      const gchar *bad;
+
+      p += k->ascii_span (p, stop - p);
+
+      if (p == stop)
+        break;
+
+      /* no multi-byte character has ASCII bytes in it, so the run of other
+       * bytes up to the next ASCII one (or a NUL on its own, which is as
+       * invalid to GLib as it is here) can be checked by itself */
+      for (q = p + 1; q < stop && *q >= 0x80; q++)
+        ;
+
+      if (!g_utf8_validate ((const gchar *) p, q - p, &bad))
+        {
+          if (end != NULL)
+            *end = bad;
+
+          return FALSE;
+        }
+
+      p = q;
+    }
+
+  if (end != NULL)
+    *end = (const gchar *) stop;
+
+  return TRUE;
+}
+
+gsize
+wocky_text_escape_scan (const gchar *str,
+    gsize len,
+    WockyTextEscape mode)
+{
+  return get_kernels ()->plain_span ((const guchar *) str, len, mode);
+}
+
+gsize
+wocky_text_markup_scan (const gchar *str,
+    gsize len,
+    gchar quote)
+{
+  return get_kernels ()->data_span ((const guchar *) str, len,
+      (guchar) quote);
+}
+
+void
+wocky_text_escape_append (GString *out,
+    const gchar *str,
+    gsize len)
+{
+  const Kernels *k = get_kernels ();
+
+  while (len > 0)
+    {
+      gsize n = k->plain_span ((const guchar *) str, len,
+          WOCKY_TEXT_ESCAPE_CONTENT);
+
+      g_string_append_len (out, str, n);
+
+      if (n == len)
+        break;
+
+      switch (str[n])
+        {
+          case '<':
+            g_string_append (out, "&lt;");
+            break;
+          case '>':
+            g_string_append (out, "&gt;");
+            break;
+          case '&':
+            g_string_append (out, "&amp;");
+            break;
+          case '"':
+            g_string_append (out, "&quot;");
+            break;
+          case '\r':
+            g_string_append (out, "&#13;");
+            break;
+          default:
+            g_assert_not_reached ();
+        }
+
+      str += n + 1;
+      len -= n + 1;
+    }
+}
+
+gchar *
+wocky_text_base64_encode (const guchar *data,
+    gsize len)
+{
+  gchar *out;
+  gsize done, written;
+  gint state = 0, save = 0;
+
+  /* as much as g_base64_encode_step() asks for, for all of it */
+  out = g_malloc ((len / 3 + 1) * 4 + 4 + 1);
+
+  done = get_kernels ()->base64_encode (data, len, out);
+  written = done / 3 * 4;
+
+  written += g_base64_encode_step (data + done, len - done, FALSE,
+      out + written, &state, &save);
+  written += g_base64_encode_close (FALSE, out + written, &state, &save);
+  out[written] = '\0';
+
+  return out;
+}
+
+guchar *
+wocky_text_base64_decode (const gchar *text,
+    gsize *out_len)
+{
+  guchar *out;
+  gsize len, done, written;
+  gint state = 0;
+  guint save = 0;
+
+  g_return_val_if_fail (text != NULL, NULL);
+  g_return_val_if_fail (out_len != NULL, NULL);
+
+  len = strlen (text);
+
+  /* the same size as g_base64_decode() allocates */
+  out = g_malloc0 ((len * 3) / 4 + 1);
+
+  done = get_kernels ()->base64_decode (text, len, out);
+  written = done / 4 * 3;
+
+  written += g_base64_decode_step (text + done, len - done, out + written,
+      &state, &save);
+  *out_len = written;
+
+  return out;
+}
@@ -0,0 +1,92 @@
+/*
+ * wocky-text.h - Header for vectorised text kernels
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TEXT_H
+#define WOCKY_TEXT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The instruction sets the kernels come in; the best one the CPU has is
+ * picked the first time any of them is used */
+typedef enum
+{
+  WOCKY_TEXT_ISA_SCALAR,
+  WOCKY_TEXT_ISA_SSE2,
+  WOCKY_TEXT_ISA_SSSE3,
+  WOCKY_TEXT_ISA_AVX2,
+  WOCKY_TEXT_ISA_NEON,
+} WockyTextIsa;
+
+WockyTextIsa wocky_text_get_isa (void);
+
+/* Switches to the kernels for @isa, for tests and benchmarks; returns FALSE,
+ * changing nothing, if the CPU doesn't have it */
+gboolean wocky_text_set_isa (WockyTextIsa isa);
+
+const gchar *wocky_text_isa_name (WockyTextIsa isa);
+
+/* Exactly what g_utf8_validate() says, only faster on mostly-ASCII text */
+gboolean wocky_text_utf8_validate (const gchar *str,
+    gssize len,
+    const gchar **end);
+
+/* Which characters need escaping: in element content, those
+ * xmlEncodeSpecialChars() escapes; in attribute values, also the
+ * whitespace and non-ASCII characters libxml2 writes as references */
+typedef enum
+{
+  WOCKY_TEXT_ESCAPE_CONTENT,
+  WOCKY_TEXT_ESCAPE_ATTRIBUTE,
+} WockyTextEscape;
+
+/* Returns the offset of the first character of @str which needs escaping
+ * as @mode says, or @len if none does */
+gsize wocky_text_escape_scan (const gchar *str,
+    gsize len,
+    WockyTextEscape mode);
+
+/* Appends @str to @out, escaped for element content the way
+ * xmlEncodeSpecialChars() does it */
+void wocky_text_escape_append (GString *out,
+    const gchar *str,
+    gsize len);
+
+/* Returns the offset of the first character of @str which ends a run of
+ * plain character data, or @len if none does: '<', '&', @quote unless it is
+ * NUL, and control characters, except for tabs and newlines in text (that
+ * is, when @quote is NUL) */
+gsize wocky_text_markup_scan (const gchar *str,
+    gsize len,
+    gchar quote);
+
+/* Drop-in replacements for g_base64_encode() and g_base64_decode() */
+gchar *wocky_text_base64_encode (const guchar *data,
+    gsize len);
+
+guchar *wocky_text_base64_decode (const gchar *text,
+    gsize *out_len);
+
+G_END_DECLS
+
+#endif /* WOCKY_TEXT_H */
@@ -0,0 +1,355 @@
+/*
+ * wocky-timer-wheel.c - Source for a hierarchical timer wheel
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * A hashed hierarchical timer wheel, used by the porters to enforce IQ
+ * deadlines without arming one GSource per request.
+ *
+ * Time is divided in ticks of @tick_ms milliseconds. Level 0 has one slot per
+ * tick; each following level has slots covering a whole revolution of the
+ * level below. A timer is put in the lowest level able to hold it and is
+ * moved down ("cascaded") when the wheel reaches its slot, so adding,
+ * removing and expiring a timer are all O(1). A single GSource drives the
+ * wheel and only exists while at least one timer is pending.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-timer-wheel.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_PORTER
+#include "wocky-debug-internal.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* With the default tick this is a bit more than 19 days; longer timeouts are
+ * clamped */
+#define WHEEL_MAX_TICKS ((G_GUINT64_CONSTANT (1) << \
+      (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct _WockyTimer
+{
+  WockyTimer *prev;
+  WockyTimer *next;
+  WockyTimer **slot;
+
+  guint64 expires;
+  WockyTimerFunc callback;
+  gpointer user_data;
+};
+
+struct _WockyTimerWheel
+{
+  guint tick_ms;
+  gint64 epoch;
+
+  /* Number of ticks processed since @epoch */
+  guint64 now;
+
+  WockyTimer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+  guint n_timers;
+
+  GSource *source;
+};
+
+static guint64
+wheel_current_tick (WockyTimerWheel *wheel)
+{
+  gint64 elapsed = g_get_monotonic_time () - wheel->epoch;
+
+  return (guint64) elapsed / ((guint64) wheel->tick_ms * 1000);
+}
+
+static void
+wheel_link (WockyTimerWheel *wheel,
+    WockyTimer *timer)
+{
+  guint64 delta;
+  guint level;
+  WockyTimer **slot;
+
+  if (timer->expires > wheel->now)
+    delta = timer->expires - wheel->now;
+  else
+    delta = 0;
+
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+      if (delta < (G_GUINT64_CONSTANT (1) << (WHEEL_BITS * (level + 1))))
+        break;
+    }
+
+  slot = &wheel->slots[level][
+      (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = *slot;
+
+  if (*slot != NULL)
+    (*slot)->prev = timer;
+
+  *slot = timer;
+}
+
+static void
+wheel_unlink (WockyTimer *timer)
+{
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    *timer->slot = timer->next;
+
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+
+  timer->prev = timer->next = NULL;
+  timer->slot = NULL;
+}
+
+/* Move every timer of a higher-level slot to the level now able to hold it */
+static void
+wheel_cascade (WockyTimerWheel *wheel,
+    guint level)
+{
+  WockyTimer **slot = &wheel->slots[level][
+      (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  WockyTimer *timer = *slot;
+
+  *slot = NULL;
+
+  while (timer != NULL)
+    {
+      WockyTimer *next = timer->next;
+
+      wheel_link (wheel, timer);
+      timer = next;
+    }
+}
+
+static void
+wheel_advance (WockyTimerWheel *wheel)
+{
+  WockyTimer **slot;
+  guint level;
+
+  wheel->now++;
+
+  /* When a level wraps, the matching slot of the level above is due */
+  for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      if ((wheel->now & ((G_GUINT64_CONSTANT (1) << (WHEEL_BITS * level)) - 1))
+          != 0)
+        break;
+
+      wheel_cascade (wheel, level);
+    }
+
+  slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+
+  /* The callbacks may add and remove timers, but new timers always expire at
+   * least one tick in the future so they never land in this slot. */
+  while (*slot != NULL)
+    {
+      WockyTimer *timer = *slot;
+      WockyTimerFunc callback = timer->callback;
+      gpointer user_data = timer->user_data;
+
+      wheel_unlink (timer);
+      wheel->n_timers--;
+      g_slice_free (WockyTimer, timer);
+
+      callback (user_data);
+    }
+}
+
+static void wheel_stop (WockyTimerWheel *wheel);
+
+static gboolean
+wheel_tick_cb (gpointer user_data)
+{
+  WockyTimerWheel *wheel = user_data;
+  guint64 target = wheel_current_tick (wheel);
+
+  while (wheel->now < target && wheel->n_timers > 0)
+    wheel_advance (wheel);
+
+  if (wheel->n_timers == 0)
+    {
+      /* Nothing left to wait for; don't wake up until a timer is added */
+      wheel_stop (wheel);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+wheel_stop (WockyTimerWheel *wheel)
+{
+  if (wheel->source == NULL)
+    return;
+
+  g_source_destroy (wheel->source);
+  g_source_unref (wheel->source);
+  wheel->source = NULL;
+}
+
+static void
+wheel_start (WockyTimerWheel *wheel)
+{
+  g_assert (wheel->source == NULL);
+
+  wheel->source = g_timeout_source_new (wheel->tick_ms);
+  g_source_set_callback (wheel->source, wheel_tick_cb, wheel, NULL);
+  g_source_attach (wheel->source, g_main_context_get_thread_default ());
+}
+
+WockyTimerWheel *
+wocky_timer_wheel_new (guint tick_ms)
+{
+  WockyTimerWheel *wheel;
+
+  g_return_val_if_fail (tick_ms > 0, NULL);
+
+  wheel = g_slice_new0 (WockyTimerWheel);
+  wheel->tick_ms = tick_ms;
+  wheel->epoch = g_get_monotonic_time ();
+
+  return wheel;
+}
+
+void
+wocky_timer_wheel_free (WockyTimerWheel *wheel)
+{
+  guint level, i;
+
+  if (wheel == NULL)
+    return;
+
+  wheel_stop (wheel);
+
+  if (wheel->n_timers > 0)
+    DEBUG ("dropping %u pending timers", wheel->n_timers);
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      for (i = 0; i < WHEEL_SIZE; i++)
+        {
+          WockyTimer *timer = wheel->slots[level][i];
+
+          while (timer != NULL)
+            {
+              WockyTimer *next = timer->next;
+
+              g_slice_free (WockyTimer, timer);
+              timer = next;
+            }
+        }
+    }
+
+  g_slice_free (WockyTimerWheel, wheel);
+}
+
+/*
+ * wocky_timer_wheel_add:
+ * @wheel: a #WockyTimerWheel
+ * @timeout_ms: the delay after which @callback is called, in milliseconds
+ * @callback: the function to call once @timeout_ms has elapsed
+ * @user_data: data passed to @callback
+ *
+ * Arms a one-shot timer. The delay is rounded up to the tick of @wheel.
+ *
+ * Returns: a handle which can be passed to wocky_timer_wheel_remove() until
+ *  @callback has been called.
+ */
+WockyTimer *
+wocky_timer_wheel_add (WockyTimerWheel *wheel,
+    guint timeout_ms,
+    WockyTimerFunc callback,
+    gpointer user_data)
+{
+  WockyTimer *timer;
+  guint64 ticks, current;
+
+  g_return_val_if_fail (wheel != NULL, NULL);
+  g_return_val_if_fail (callback != NULL, NULL);
+
+  if (wheel->source == NULL)
+    {
+      /* The wheel is idle, so it's safe to jump straight to the present */
+      g_assert (wheel->n_timers == 0);
+      wheel->now = wheel_current_tick (wheel);
+      wheel_start (wheel);
+    }
+
+  ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  ticks = CLAMP (ticks, 1, WHEEL_MAX_TICKS);
+
+  /* If the main loop has been held up, the wheel hasn't caught up with the
+   * present yet: count from the present, not from the last tick processed,
+   * or the timer would fire early. The wheel can't hold it further away
+   * than WHEEL_MAX_TICKS from the last tick processed, though. */
+  current = wheel_current_tick (wheel);
+
+  timer = g_slice_new0 (WockyTimer);
+  timer->expires = MIN (current + ticks, wheel->now + WHEEL_MAX_TICKS);
+  timer->callback = callback;
+  timer->user_data = user_data;
+
+  wheel_link (wheel, timer);
+  wheel->n_timers++;
+
+  return timer;
+}
+
+/*
+ * wocky_timer_wheel_remove:
+ * @wheel: a #WockyTimerWheel
+ * @timer: a pending timer returned by wocky_timer_wheel_add()
+ *
+ * Disarms @timer, which is freed. Its callback will not be called.
+ */
+void
+wocky_timer_wheel_remove (WockyTimerWheel *wheel,
+    WockyTimer *timer)
+{
+  g_return_if_fail (wheel != NULL);
+  g_return_if_fail (timer != NULL && timer->slot != NULL);
+
+  wheel_unlink (timer);
+  wheel->n_timers--;
+  g_slice_free (WockyTimer, timer);
+
+  /* The GSource is dropped lazily by the next tick, so a burst of IQs
+   * answered within a tick doesn't keep re-creating it. */
+}
+
+guint
+wocky_timer_wheel_get_n_timers (WockyTimerWheel *wheel)
+{
+  g_return_val_if_fail (wheel != NULL, 0);
+
+  return wheel->n_timers;
+}
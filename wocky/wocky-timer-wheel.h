@@ -0,0 +1,62 @@
+/*
+ * wocky-timer-wheel.h - Header for a hierarchical timer wheel
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TIMER_WHEEL_H
+#define WOCKY_TIMER_WHEEL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WockyTimerWheel WockyTimerWheel;
+typedef struct _WockyTimer WockyTimer;
+
+/* Called once when a timer expires. The timer has already been removed from
+ * the wheel and must not be passed to wocky_timer_wheel_remove(). */
+typedef void (*WockyTimerFunc) (
+    gpointer user_data);
+
+/* Granularity used by the porters for IQ deadlines, in milliseconds */
+#define WOCKY_TIMER_WHEEL_DEFAULT_TICK 100
+
+WockyTimerWheel *wocky_timer_wheel_new (
+    guint tick_ms);
+
+void wocky_timer_wheel_free (
+    WockyTimerWheel *wheel);
+
+WockyTimer *wocky_timer_wheel_add (
+    WockyTimerWheel *wheel,
+    guint timeout_ms,
+    WockyTimerFunc callback,
+    gpointer user_data);
+
+void wocky_timer_wheel_remove (
+    WockyTimerWheel *wheel,
+    WockyTimer *timer);
+
+guint wocky_timer_wheel_get_n_timers (
+    WockyTimerWheel *wheel);
+
+G_END_DECLS
+
+#endif /* WOCKY_TIMER_WHEEL_H */
@@ -32,6 +32,8 @@
 #include "wocky-connector.h"
 #include "wocky-tls.h"
 #include "wocky-tls-handler.h"
+#include "wocky-tls-trust-store.h"
+#include "wocky-tls-worker.h"
 #include "wocky-utils.h"
 #include "wocky-xmpp-connection.h"
 
@@ -39,6 +41,7 @@ struct _WockyTLSConnectorPrivate {
   gboolean legacy_ssl;
   gchar *peername;
   GStrv extra_identities;
+  gchar *alpn_protocol;
 
   WockyTLSHandler *handler;
   WockyTLSSession *session;
@@ -47,6 +50,9 @@ struct _WockyTLSConnectorPrivate {
 
   GSimpleAsyncResult *secure_result;
   GCancellable *cancellable;
+
+  /* the key exchange of the handshake runs on the TLS worker pool */
+  gboolean worker_pool;
 };
 
 enum {
@@ -108,6 +114,7 @@ wocky_tls_connector_finalize (GObject *object)
   WockyTLSConnector *self = WOCKY_TLS_CONNECTOR (object);
 
   g_free (self->priv->peername);
+  g_free (self->priv->alpn_protocol);
   g_strfreev (self->priv->extra_identities);
 
   if (self->priv->session != NULL)
@@ -164,39 +171,36 @@ wocky_tls_connector_init (WockyTLSConnector *self)
   self->priv->secure_result = NULL;
 }
 
-static void
-add_ca (gpointer data,
-    gpointer user_data)
-{
-  WockyTLSSession *session = user_data;
-  const gchar *path = data;
-
-  wocky_tls_session_add_ca (session, path);
-}
-
-static void
-add_crl (gpointer data,
-    gpointer user_data)
-{
-  WockyTLSSession *session = user_data;
-  const gchar *path = data;
-
-  wocky_tls_session_add_crl (session, path);
-}
-
-
-
 static void
 prepare_session (WockyTLSConnector *self)
 {
   GSList *cas;
   GSList *crl;
+  WockyTLSTrust *trust;
+  gboolean kernel_offload;
 
   cas = wocky_tls_handler_get_cas (self->priv->handler);
   crl = wocky_tls_handler_get_crl (self->priv->handler);
 
-  g_slist_foreach (cas, add_ca, self->priv->session);
-  g_slist_foreach (crl, add_crl, self->priv->session);
+  /* parsed once for all the connections using these CAs and CRLs */
+  trust = wocky_tls_trust_store_lookup (cas, crl);
+  wocky_tls_session_set_trust (self->priv->session, trust);
+  wocky_tls_trust_unref (trust);
+
+  g_object_get (self->priv->handler, "kernel-offload", &kernel_offload, NULL);
+  wocky_tls_session_set_kernel_offload (self->priv->session, kernel_offload);
+
+  /* Direct TLS: tell the server who we want to talk to, and in which
+   * protocol, as it can't learn that from a stream header yet */
+  if (self->priv->alpn_protocol != NULL)
+    {
+      if (self->priv->peername != NULL)
+        wocky_tls_session_set_server_name (self->priv->session,
+            self->priv->peername);
+
+      wocky_tls_session_set_alpn_protocol (self->priv->session,
+          self->priv->alpn_protocol);
+    }
 }
 
 static void
@@ -248,6 +252,20 @@ report_error_in_idle_gerror (WockyTLSConnector *self,
     }
 }
 
+static void
+start_handshake (WockyTLSConnector *self,
+    gint io_priority)
+{
+  g_object_get (self->priv->handler,
+      "worker-pool", &self->priv->worker_pool,
+      NULL);
+
+  wocky_tls_session_set_worker_pool (self->priv->session,
+      self->priv->worker_pool);
+  wocky_tls_session_handshake_async (self->priv->session,
+      io_priority, self->priv->cancellable, session_handshake_cb, self);
+}
+
 static void
 do_handshake (WockyTLSConnector *self)
 {
@@ -268,9 +286,7 @@ do_handshake (WockyTLSConnector *self)
     }
 
   prepare_session (self);
-
-  wocky_tls_session_handshake_async (self->priv->session,
-      G_PRIORITY_DEFAULT, self->priv->cancellable, session_handshake_cb, self);
+  start_handshake (self, G_PRIORITY_DEFAULT);
 }
 
 static void
@@ -318,6 +334,7 @@ session_handshake_cb (GObject *source,
   const gchar *tls_type;
 
   tls_type = self->priv->legacy_ssl ? "SSL" : "TLS";
+
   tls_conn = wocky_tls_session_handshake_finish (self->priv->session,
       res, &error);
 
@@ -332,6 +349,10 @@ session_handshake_cb (GObject *source,
 
   DEBUG ("Completed %s handshake", tls_type);
 
+  if (self->priv->alpn_protocol != NULL)
+    DEBUG ("ALPN protocol: %s", wocky_tls_session_get_alpn_protocol (
+        self->priv->session));
+
   self->priv->tls_connection = wocky_xmpp_connection_new (
       G_IO_STREAM (tls_conn));
   g_object_unref (tls_conn);
@@ -402,9 +423,7 @@ starttls_recv_cb (GObject *source,
       prepare_session (self);
 
       DEBUG ("Starting client TLS handshake %p", self->priv->session);
-      wocky_tls_session_handshake_async (self->priv->session,
-          G_PRIORITY_HIGH, self->priv->cancellable,
-          session_handshake_cb, self);
+      start_handshake (self, G_PRIORITY_HIGH);
     }
 
  out:
@@ -490,6 +509,25 @@ wocky_tls_connector_secure_async (WockyTLSConnector *self,
     do_starttls (self);
 }
 
+/**
+ * wocky_tls_connector_set_alpn_protocol:
+ * @self: a #WockyTLSConnector
+ * @protocol: an application protocol name, such as "xmpp-client", or %NULL
+ *
+ * Makes the handshakes started by wocky_tls_connector_secure_async ()
+ * negotiate @protocol using ALPN, and send the peer name using SNI, as
+ * Direct TLS (XEP-0368) requires.
+ */
+void
+wocky_tls_connector_set_alpn_protocol (WockyTLSConnector *self,
+    const gchar *protocol)
+{
+  g_return_if_fail (WOCKY_IS_TLS_CONNECTOR (self));
+
+  g_free (self->priv->alpn_protocol);
+  self->priv->alpn_protocol = g_strdup (protocol);
+}
+
 WockyXmppConnection *
 wocky_tls_connector_secure_finish (WockyTLSConnector *self,
     GAsyncResult *result,
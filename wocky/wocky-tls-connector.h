@@ -81,6 +81,9 @@ void wocky_tls_connector_secure_async (WockyTLSConnector *self,
     GAsyncReadyCallback callback,
     gpointer user_data);
 
+void wocky_tls_connector_set_alpn_protocol (WockyTLSConnector *self,
+    const gchar *protocol);
+
 WockyXmppConnection *
 wocky_tls_connector_secure_finish (WockyTLSConnector *self,
     GAsyncResult *res,
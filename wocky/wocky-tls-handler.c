@@ -22,6 +22,8 @@
 #include <config.h>
 
 #include "wocky-tls-handler.h"
+#include "wocky-tls-verify-cache.h"
+#include "wocky-tls-worker.h"
 #include "wocky-utils.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_TLS
@@ -44,10 +46,22 @@ G_DEFINE_TYPE (WockyTLSHandler, wocky_tls_handler, G_TYPE_OBJECT)
 
 enum {
   PROP_TLS_INSECURE_OK = 1,
+  PROP_WORKER_POOL,
+  PROP_VERIFY_CACHE,
+  PROP_VERIFY_CACHE_HITS,
+  PROP_VERIFY_CACHE_MISSES,
+  PROP_KERNEL_OFFLOAD,
 };
 
 struct _WockyTLSHandlerPrivate {
   gboolean ignore_ssl_errors;
+  gboolean worker_pool;
+  gboolean verify_cache;
+  gboolean kernel_offload;
+
+  /* updated from the worker threads too */
+  volatile gint verify_cache_hits;
+  volatile gint verify_cache_misses;
 
   GSList *cas;
   GSList *crl;
@@ -66,6 +80,23 @@ wocky_tls_handler_get_property (GObject *object,
       case PROP_TLS_INSECURE_OK:
         g_value_set_boolean (value, self->priv->ignore_ssl_errors);
         break;
+      case PROP_WORKER_POOL:
+        g_value_set_boolean (value, self->priv->worker_pool);
+        break;
+      case PROP_VERIFY_CACHE:
+        g_value_set_boolean (value, self->priv->verify_cache);
+        break;
+      case PROP_VERIFY_CACHE_HITS:
+        g_value_set_uint (value,
+            g_atomic_int_get (&self->priv->verify_cache_hits));
+        break;
+      case PROP_VERIFY_CACHE_MISSES:
+        g_value_set_uint (value,
+            g_atomic_int_get (&self->priv->verify_cache_misses));
+        break;
+      case PROP_KERNEL_OFFLOAD:
+        g_value_set_boolean (value, self->priv->kernel_offload);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -85,6 +116,15 @@ wocky_tls_handler_set_property (GObject *object,
       case PROP_TLS_INSECURE_OK:
         self->priv->ignore_ssl_errors = g_value_get_boolean (value);
         break;
+      case PROP_WORKER_POOL:
+        self->priv->worker_pool = g_value_get_boolean (value);
+        break;
+      case PROP_VERIFY_CACHE:
+        self->priv->verify_cache = g_value_get_boolean (value);
+        break;
+      case PROP_KERNEL_OFFLOAD:
+        self->priv->kernel_offload = g_value_get_boolean (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -137,6 +177,75 @@ wocky_tls_handler_class_init (WockyTLSHandlerClass *klass)
       "Whether recoverable TLS errors should be ignored", FALSE,
       (G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (oclass, PROP_TLS_INSECURE_OK, pspec);
+
+  /**
+   * WockyTLSHandler:worker-pool:
+   *
+   * Whether to do the CPU-heavy parts of TLS on a small pool of worker
+   * threads shared by the whole process, rather than in the main loop:
+   * the key exchange of the handshakes of the
+   * #WockyTLSConnector<!-- -->s using this handler, and the default
+   * implementation of certificate verification. The handshakes' network
+   * I/O still happens in the main loop. With many connections being set up
+   * at once, this keeps the established ones responsive.
+   */
+  pspec = g_param_spec_boolean ("worker-pool", "Worker pool",
+      "Whether to run TLS handshakes and verification on worker threads",
+      FALSE, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_WORKER_POOL, pspec);
+
+  /**
+   * WockyTLSHandler:verify-cache:
+   *
+   * Whether the default implementation of certificate verification may
+   * reuse the outcome of verifying the same certificates for the same
+   * names earlier on, rather than checking them again. Outcomes are shared
+   * by the whole process, and forgotten when the certificates expire or
+   * any of the CAs or CRLs change.
+   */
+  pspec = g_param_spec_boolean ("verify-cache", "Verification cache",
+      "Whether to reuse earlier certificate verification outcomes",
+      FALSE, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_VERIFY_CACHE, pspec);
+
+  /**
+   * WockyTLSHandler:verify-cache-hits:
+   *
+   * How many certificate verifications by this handler were answered from
+   * the cache enabled by #WockyTLSHandler:verify-cache.
+   */
+  pspec = g_param_spec_uint ("verify-cache-hits", "Verification cache hits",
+      "Number of certificate verifications answered from the cache",
+      0, G_MAXUINT, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_VERIFY_CACHE_HITS, pspec);
+
+  /**
+   * WockyTLSHandler:verify-cache-misses:
+   *
+   * How many certificate verifications by this handler could have been
+   * answered from the cache enabled by #WockyTLSHandler:verify-cache, but
+   * had to be done in full.
+   */
+  pspec = g_param_spec_uint ("verify-cache-misses",
+      "Verification cache misses",
+      "Number of certificate verifications not found in the cache",
+      0, G_MAXUINT, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_VERIFY_CACHE_MISSES, pspec);
+
+  /**
+   * WockyTLSHandler:kernel-offload:
+   *
+   * Whether the #WockyTLSConnector<!-- -->s using this handler should try
+   * to have the kernel encrypt and decrypt the records of each session once
+   * it is established, which takes less CPU per byte for bulk transfers.
+   * This only works on Linux with the "tls" module available, for some
+   * cipher suites; otherwise, sessions silently carry on as usual. See
+   * wocky_tls_session_set_kernel_offload().
+   */
+  pspec = g_param_spec_boolean ("kernel-offload", "Kernel offload",
+      "Whether to try handing established sessions to kernel TLS",
+      FALSE, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (oclass, PROP_KERNEL_OFFLOAD, pspec);
 }
 
 static void
@@ -150,22 +259,20 @@ wocky_tls_handler_init (WockyTLSHandler *self)
 #endif
 }
 
+/* Sets the outcome of verifying @tls_session on @result; this may be called
+ * from a worker thread */
 static void
-real_verify_async (WockyTLSHandler *self,
+verify (WockyTLSHandler *self,
     WockyTLSSession *tls_session,
     const gchar *peername,
     GStrv extra_identities,
-    GAsyncReadyCallback callback,
-    gpointer user_data)
+    GSimpleAsyncResult *result)
 {
-  GSimpleAsyncResult *result;
   glong flags = WOCKY_TLS_VERIFY_NORMAL;
   WockyTLSCertStatus status = WOCKY_TLS_CERT_UNKNOWN_ERROR;
   const gchar *verify_peername = NULL;
   GStrv verify_extra_identities = NULL;
-
-  result = g_simple_async_result_new (G_OBJECT (self),
-      callback, user_data, wocky_tls_handler_verify_async);
+  gchar *cache_key = NULL;
 
   /* When ignore_ssl_errors is true, don't check the peername. Otherwise:
    * - Under legacy SSL, the connect hostname is the preferred peername;
@@ -184,8 +291,29 @@ real_verify_async (WockyTLSHandler *self,
   DEBUG ("Verifying certificate (peername: %s)",
       (verify_peername == NULL) ? "-" : verify_peername);
 
-  wocky_tls_session_verify_peer (tls_session, verify_peername,
-      verify_extra_identities, flags, &status);
+  if (self->priv->verify_cache)
+    cache_key = wocky_tls_verify_cache_key (tls_session, verify_peername,
+        verify_extra_identities, flags);
+
+  if (cache_key != NULL &&
+      wocky_tls_verify_cache_lookup (cache_key, &status))
+    {
+      DEBUG ("Reusing the earlier outcome");
+      g_atomic_int_inc (&self->priv->verify_cache_hits);
+    }
+  else
+    {
+      wocky_tls_session_verify_peer (tls_session, verify_peername,
+          verify_extra_identities, flags, &status);
+
+      if (cache_key != NULL)
+        {
+          g_atomic_int_inc (&self->priv->verify_cache_misses);
+          wocky_tls_verify_cache_add (cache_key, tls_session, status);
+        }
+    }
+
+  g_free (cache_key);
 
   if (status != WOCKY_TLS_CERT_OK)
     {
@@ -235,10 +363,6 @@ real_verify_async (WockyTLSHandler *self,
           g_simple_async_result_set_from_error (result, cert_error);
 
           g_error_free (cert_error);
-          g_simple_async_result_complete_in_idle (result);
-          g_object_unref (result);
-
-          return;
         }
       else
         {
@@ -249,8 +373,67 @@ real_verify_async (WockyTLSHandler *self,
           g_free (err);
         }
     }
+}
+
+typedef struct
+{
+  WockyTLSHandler *self;
+  WockyTLSSession *tls_session;
+  gchar *peername;
+  GStrv extra_identities;
+} VerifyData;
+
+static void
+verify_data_free (VerifyData *data)
+{
+  g_object_unref (data->self);
+  g_object_unref (data->tls_session);
+  g_free (data->peername);
+  g_strfreev (data->extra_identities);
+  g_slice_free (VerifyData, data);
+}
+
+static void
+verify_in_thread (GSimpleAsyncResult *result,
+    gpointer data,
+    GCancellable *cancellable)
+{
+  VerifyData *d = data;
+
+  verify (d->self, d->tls_session, d->peername, d->extra_identities, result);
+}
+
+static void
+real_verify_async (WockyTLSHandler *self,
+    WockyTLSSession *tls_session,
+    const gchar *peername,
+    GStrv extra_identities,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *result;
+
+  result = g_simple_async_result_new (G_OBJECT (self),
+      callback, user_data, wocky_tls_handler_verify_async);
+
+  if (self->priv->worker_pool)
+    {
+      VerifyData *data = g_slice_new0 (VerifyData);
+
+      data->self = g_object_ref (self);
+      data->tls_session = g_object_ref (tls_session);
+      data->peername = g_strdup (peername);
+      data->extra_identities = g_strdupv (extra_identities);
+
+      wocky_tls_worker_run (result, verify_in_thread, data,
+          (GDestroyNotify) verify_data_free, NULL);
+    }
+  else
+    {
+      verify (self, tls_session, peername, extra_identities, result);
+      g_simple_async_result_complete_in_idle (result);
+    }
 
-  g_simple_async_result_complete_in_idle (result);
   g_object_unref (result);
 }
 
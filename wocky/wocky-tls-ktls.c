@@ -0,0 +1,489 @@
+/*
+ * wocky-tls-ktls.c - Source for offloading TLS records to the kernel
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Once a session is established, Linux can encrypt and decrypt its records
+ * itself, given the keys, IVs and sequence numbers: the TLS backends dig
+ * those out of their library, and then read and write plaintext straight
+ * from and to the socket through the functions here.
+ *
+ * Records which aren't application data still reach us when the kernel
+ * decrypts: a close_notify alert is reported as the end of the stream and
+ * TLS 1.3 session tickets are dropped, as Wocky never resumes sessions, but
+ * anything else (notably a TLS 1.3 KeyUpdate, which would need the new keys
+ * to be handed to the kernel) is an error.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-tls-ktls.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX_TLS_H
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
+
+#include "wocky-tls.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_TLS
+#include "wocky-debug-internal.h"
+
+#ifdef HAVE_LINUX_TLS_H
+
+/* older libc headers lack these */
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* record content types */
+#define RECORD_ALERT 21
+#define RECORD_HANDSHAKE 22
+#define RECORD_APPLICATION_DATA 23
+
+#define ALERT_CLOSE_NOTIFY 0
+
+/* handshake messages which can follow the handshake */
+#define HANDSHAKE_NEW_SESSION_TICKET 4
+#define HANDSHAKE_KEY_UPDATE 24
+
+#endif /* HAVE_LINUX_TLS_H */
+
+GSocket *
+wocky_tls_ktls_get_socket (GIOStream *stream)
+{
+#ifdef HAVE_LINUX_TLS_H
+  GSocket *socket;
+
+  if (!G_IS_SOCKET_CONNECTION (stream))
+    return NULL;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream));
+
+  if (g_socket_get_protocol (socket) != G_SOCKET_PROTOCOL_TCP)
+    return NULL;
+
+  return socket;
+#else
+  return NULL;
+#endif
+}
+
+gboolean
+wocky_tls_ktls_start (GSocket *socket,
+    gboolean tx,
+    gboolean tls13,
+    WockyTLSKtlsCipher cipher,
+    const guint8 *key,
+    const guint8 *iv,
+    const guint8 *seq)
+{
+#ifdef HAVE_LINUX_TLS_H
+  union {
+    struct tls12_crypto_info_aes_gcm_128 aes_128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 aes_256;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+  } info;
+  socklen_t len;
+  guint16 version;
+  gint fd = g_socket_get_fd (socket);
+  gboolean ok;
+
+  if (tls13)
+    {
+#ifdef TLS_1_3_VERSION
+      version = TLS_1_3_VERSION;
+#else
+      DEBUG ("TLS 1.3 is too new for these kernel headers");
+      return FALSE;
+#endif
+    }
+  else
+    {
+      version = TLS_1_2_VERSION;
+    }
+
+  memset (&info, 0, sizeof (info));
+
+  switch (cipher)
+    {
+      case WOCKY_TLS_KTLS_AES_128_GCM:
+        info.aes_128.info.version = version;
+        info.aes_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy (info.aes_128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy (info.aes_128.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+            TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy (info.aes_128.key, key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+        memcpy (info.aes_128.rec_seq, seq,
+            TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof (info.aes_128);
+        break;
+
+#ifdef TLS_CIPHER_AES_GCM_256
+      case WOCKY_TLS_KTLS_AES_256_GCM:
+        info.aes_256.info.version = version;
+        info.aes_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy (info.aes_256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy (info.aes_256.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+            TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy (info.aes_256.key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+        memcpy (info.aes_256.rec_seq, seq,
+            TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof (info.aes_256);
+        break;
+#endif
+
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+      case WOCKY_TLS_KTLS_CHACHA20_POLY1305:
+        info.chacha.info.version = version;
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy (info.chacha.iv, iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy (info.chacha.key, key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+        memcpy (info.chacha.rec_seq, seq,
+            TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+        len = sizeof (info.chacha);
+        break;
+#endif
+
+      default:
+        DEBUG ("cipher %u is not supported by these kernel headers", cipher);
+        return FALSE;
+    }
+
+  /* the "tls" upper layer protocol is only attached once per socket, so
+   * it's already there if the other direction was offloaded first */
+  if (setsockopt (fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof ("tls")) != 0 &&
+      errno != EEXIST)
+    {
+      DEBUG ("kernel TLS is not available: %s", g_strerror (errno));
+      memset (&info, 0, sizeof (info));
+      return FALSE;
+    }
+
+  ok = (setsockopt (fd, SOL_TLS, tx ? TLS_TX : TLS_RX, &info, len) == 0);
+
+  if (!ok)
+    DEBUG ("kernel refused to take over %s: %s", tx ? "sending" : "receiving",
+        g_strerror (errno));
+
+  memset (&info, 0, sizeof (info));
+  return ok;
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef HAVE_LINUX_TLS_H
+
+/* Throws away the last @len bytes of a record which didn't fit in the
+ * caller's buffer. The kernel decrypted it as a whole, so they are all
+ * there already. */
+static gboolean
+discard (gint fd,
+    gsize len,
+    GError **error)
+{
+  guint8 scratch[256];
+  guint8 control[CMSG_SPACE (sizeof (guint8))];
+
+  while (len > 0)
+    {
+      /* without room for the record type, the kernel refuses to return
+       * anything but application data */
+      struct iovec iov = { scratch, MIN (len, sizeof (scratch)) };
+      struct msghdr msg;
+      gssize n;
+
+      memset (&msg, 0, sizeof (msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+
+      n = recvmsg (fd, &msg, MSG_DONTWAIT);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        {
+          g_set_error (error, WOCKY_TLS_ERROR, 0,
+              "Truncated TLS record from the kernel");
+          return FALSE;
+        }
+
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/* Returns the number of bytes of application data read, 0 at the end of
+ * the stream, or -1 either with @error set or, if not, when there is
+ * nothing to return yet */
+static gssize
+ktls_recv (GSocket *socket,
+    void *buffer,
+    gsize count,
+    GError **error)
+{
+  gint fd = g_socket_get_fd (socket);
+  guint8 control[CMSG_SPACE (sizeof (guint8))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  guint8 type = RECORD_APPLICATION_DATA;
+  const guint8 *data = buffer;
+  gssize n;
+  gssize pos;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = buffer;
+  iov.iov_len = count;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  do
+    n = recvmsg (fd, &msg, MSG_DONTWAIT);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      int errsv = errno;
+
+      if (errsv == EAGAIN || errsv == EWOULDBLOCK)
+        return -1;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+          "Error receiving data: %s", g_strerror (errsv));
+      return -1;
+    }
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_TLS &&
+          cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+        type = *(guint8 *) CMSG_DATA (cmsg);
+    }
+
+  if (type == RECORD_APPLICATION_DATA)
+    return n;
+
+  if (type == RECORD_ALERT && n >= 2 && data[1] == ALERT_CLOSE_NOTIFY)
+    {
+      DEBUG ("peer closed the TLS session");
+      return 0;
+    }
+
+  if (type != RECORD_HANDSHAKE)
+    {
+      g_set_error (error, WOCKY_TLS_ERROR, 0,
+          "Unexpected TLS record (type %u, %u)", type,
+          n > 1 ? data[1] : 0);
+      return -1;
+    }
+
+  /* a record can hold several handshake messages */
+  for (pos = 0; pos + 4 <= n; )
+    {
+      gsize len = (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+
+      if (data[pos] != HANDSHAKE_NEW_SESSION_TICKET)
+        {
+          g_set_error (error, WOCKY_TLS_ERROR, 0,
+              data[pos] == HANDSHAKE_KEY_UPDATE ?
+                "TLS key updates can't be offloaded to the kernel" :
+                "Unexpected TLS handshake message %u", data[pos]);
+          return -1;
+        }
+
+      DEBUG ("dropping a session ticket");
+      pos += 4 + len;
+    }
+
+  if (pos > n && !discard (fd, pos - n, error))
+    return -1;
+
+  return -1;
+}
+
+#endif /* HAVE_LINUX_TLS_H */
+
+gssize
+wocky_tls_ktls_read (GSocket *socket,
+    void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error)
+{
+#ifdef HAVE_LINUX_TLS_H
+  while (TRUE)
+    {
+      GError *err = NULL;
+      gssize n = ktls_recv (socket, buffer, count, &err);
+
+      if (n >= 0)
+        return n;
+
+      if (err != NULL)
+        {
+          g_propagate_error (error, err);
+          return -1;
+        }
+
+      if (!g_socket_condition_wait (socket, G_IO_IN, cancellable, error))
+        return -1;
+    }
+#else
+  g_return_val_if_reached (-1);
+#endif
+}
+
+typedef struct {
+  GSimpleAsyncResult *result;
+  GCancellable *cancellable;
+  void *buffer;
+  gsize count;
+} ReadData;
+
+static void
+read_data_free (ReadData *data)
+{
+  g_object_unref (data->result);
+
+  if (data->cancellable != NULL)
+    g_object_unref (data->cancellable);
+
+  g_slice_free (ReadData, data);
+}
+
+static gboolean
+read_ready_cb (GSocket *socket,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  ReadData *data = user_data;
+  GError *error = NULL;
+  gssize n = -1;
+
+  if (!g_cancellable_set_error_if_cancelled (data->cancellable, &error))
+    {
+#ifdef HAVE_LINUX_TLS_H
+      n = ktls_recv (socket, data->buffer, data->count, &error);
+#endif
+
+      /* wait for the next record */
+      if (n < 0 && error == NULL)
+        return TRUE;
+    }
+
+  if (error != NULL)
+    g_simple_async_result_take_error (data->result, error);
+  else
+    g_simple_async_result_set_op_res_gssize (data->result, n);
+
+  g_simple_async_result_complete (data->result);
+  return FALSE;
+}
+
+void
+wocky_tls_ktls_read_async (GSocket *socket,
+    GObject *source_object,
+    gpointer source_tag,
+    void *buffer,
+    gsize count,
+    gint io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  ReadData *data = g_slice_new0 (ReadData);
+  GSource *source;
+
+  data->result = g_simple_async_result_new (source_object, callback,
+      user_data, source_tag);
+  data->buffer = buffer;
+  data->count = count;
+
+  if (cancellable != NULL)
+    data->cancellable = g_object_ref (cancellable);
+
+  source = g_socket_create_source (socket, G_IO_IN, cancellable);
+  g_source_set_priority (source, io_priority);
+  g_source_set_callback (source, (GSourceFunc) read_ready_cb, data,
+      (GDestroyNotify) read_data_free);
+  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
+}
+
+static void
+write_cb (GObject *source,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *result = user_data;
+  GError *error = NULL;
+  gssize n;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source), res, &error);
+
+  if (n < 0)
+    g_simple_async_result_take_error (result, error);
+  else
+    g_simple_async_result_set_op_res_gssize (result, n);
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+}
+
+void
+wocky_tls_ktls_write_async (GIOStream *stream,
+    GObject *source_object,
+    gpointer source_tag,
+    const void *buffer,
+    gsize count,
+    gint io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *result = g_simple_async_result_new (source_object,
+      callback, user_data, source_tag);
+
+  g_output_stream_write_async (g_io_stream_get_output_stream (stream),
+      buffer, count, io_priority, cancellable, write_cb, result);
+}
@@ -0,0 +1,91 @@
+/*
+ * wocky-tls-ktls.h - Header for offloading TLS records to the kernel
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TLS_KTLS_H
+#define WOCKY_TLS_KTLS_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* The AEAD ciphers the kernel can take over records for */
+typedef enum
+{
+  WOCKY_TLS_KTLS_AES_128_GCM,
+  WOCKY_TLS_KTLS_AES_256_GCM,
+  WOCKY_TLS_KTLS_CHACHA20_POLY1305,
+} WockyTLSKtlsCipher;
+
+#define WOCKY_TLS_KTLS_IV_SIZE 12
+#define WOCKY_TLS_KTLS_SEQ_SIZE 8
+
+/* Borrowed; the socket under @stream, or NULL if it isn't a socket or the
+ * kernel can't do TLS at all */
+GSocket *wocky_tls_ktls_get_socket (GIOStream *stream);
+
+/* Hands one direction of an established session to the kernel. @key is 16
+ * or 32 bytes long depending on @cipher; @iv is the 12-byte nonce base,
+ * made of the 4-byte salt and the 8-byte explicit nonce for TLS 1.2 with
+ * AES-GCM; @seq is the big-endian number of the next record. Returns FALSE,
+ * leaving the socket usable as it was, if the kernel won't take it. */
+gboolean wocky_tls_ktls_start (GSocket *socket,
+    gboolean tx,
+    gboolean tls13,
+    WockyTLSKtlsCipher cipher,
+    const guint8 *key,
+    const guint8 *iv,
+    const guint8 *seq);
+
+/* Reading from a socket whose received records the kernel decrypts: the
+ * results are reported as if by @source_object's read_async(), with
+ * @source_tag, so its read_finish() can be used as it is */
+gssize wocky_tls_ktls_read (GSocket *socket,
+    void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error);
+
+void wocky_tls_ktls_read_async (GSocket *socket,
+    GObject *source_object,
+    gpointer source_tag,
+    void *buffer,
+    gsize count,
+    gint io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/* Likewise for writing plaintext to @stream's output stream once the
+ * kernel encrypts what is sent */
+void wocky_tls_ktls_write_async (GIOStream *stream,
+    GObject *source_object,
+    gpointer source_tag,
+    const void *buffer,
+    gsize count,
+    gint io_priority,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+G_END_DECLS
+
+#endif /* WOCKY_TLS_KTLS_H */
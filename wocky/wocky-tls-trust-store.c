@@ -0,0 +1,382 @@
+/*
+ * wocky-tls-trust-store.c - Source for the process-wide TLS trust store
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Parsing the system CA bundle takes tens of milliseconds and a fair amount
+ * of memory, which used to be paid by every TLS session. Instead, the CAs
+ * and CRLs configured on a WockyTLSHandler are parsed once, and every
+ * session using the same set of paths shares the result.
+ *
+ * The store keeps what it parsed until one of the paths changes on disk, so
+ * that reconnecting doesn't parse anything again. Each path is watched, and
+ * the trust is dropped when any of them changes: sessions which already hold
+ * it keep using it, and the next one parses the paths again. Each trust the
+ * store hands out carries the generation of its paths, which only moves on
+ * when one of them changes, so that what was verified against a trust still
+ * holds for the next one parsed from the same files.
+ *
+ * The file monitors belong to a main context owned by the store, run by a
+ * thread of its own until wocky_tls_trust_store_clear(), so that they work
+ * whichever thread, and whichever main context, the sessions are set up in.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-tls-trust-store.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_TLS
+#include "wocky-debug-internal.h"
+
+typedef struct
+{
+  /* These two never change once the entry is made */
+  gchar *key;
+  /* owned gchar *, CA paths then CRL paths */
+  GSList *paths;
+
+  /* These are only accessed with the store lock held */
+  /* owned; NULL until the paths are parsed, and after one of them changed */
+  WockyTLSTrust *trust;
+  /* of the paths as they are now: a new one is taken whenever one changes */
+  guint generation;
+
+  /* Only accessed in the store's thread: owned GFileMonitor, one per path */
+  GSList *monitors;
+} StoreEntry;
+
+G_LOCK_DEFINE_STATIC (store);
+
+/* Only accessed with the lock held; all NULL until the first lookup, and
+ * again after wocky_tls_trust_store_clear() */
+/* owned gchar * => owned StoreEntry */
+static GHashTable *entries = NULL;
+static GMainContext *store_context = NULL;
+static GMainLoop *store_loop = NULL;
+static GThread *store_thread_handle = NULL;
+/* never reset, so that no two sets of paths ever share a generation */
+static guint next_generation = 1;
+
+static gpointer
+store_thread (gpointer data)
+{
+  GMainLoop *loop = data;
+  GMainContext *context = g_main_loop_get_context (loop);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (loop);
+
+  /* the entries dropped last are still to be freed */
+  while (g_main_context_iteration (context, FALSE))
+    ;
+
+  g_main_context_pop_thread_default (context);
+  g_main_loop_unref (loop);
+  return NULL;
+}
+
+/* Called with the lock held */
+static void
+store_start (void)
+{
+  entries = g_hash_table_new (g_str_hash, g_str_equal);
+  store_context = g_main_context_new ();
+  store_loop = g_main_loop_new (store_context, FALSE);
+
+  store_thread_handle = g_thread_new ("wocky-tls-trust-store", store_thread,
+      g_main_loop_ref (store_loop));
+}
+
+static gboolean
+store_stop_cb (gpointer data)
+{
+  g_main_loop_quit (data);
+  return FALSE;
+}
+
+/* Unlike g_main_context_invoke(), never calls @func straight away, even from
+ * the store's own thread: it may be emitting a monitor's signal, with the
+ * lock held */
+static void
+store_invoke (GSourceFunc func,
+    gpointer data)
+{
+  GSource *source = g_idle_source_new ();
+
+  g_source_set_callback (source, func, data, NULL);
+  g_source_attach (source, store_context);
+  g_source_unref (source);
+}
+
+/* Runs in the store's thread */
+static gboolean
+store_entry_free_cb (gpointer data)
+{
+  StoreEntry *entry = data;
+  GSList *l;
+
+  for (l = entry->monitors; l != NULL; l = l->next)
+    {
+      g_signal_handlers_disconnect_matched (l->data, G_SIGNAL_MATCH_DATA,
+          0, 0, NULL, NULL, entry);
+      g_file_monitor_cancel (l->data);
+      g_object_unref (l->data);
+    }
+
+  g_slist_free (entry->monitors);
+  g_slist_foreach (entry->paths, (GFunc) g_free, NULL);
+  g_slist_free (entry->paths);
+  g_free (entry->key);
+  g_slice_free (StoreEntry, entry);
+  return FALSE;
+}
+
+static gchar *
+store_key (GSList *cas,
+    GSList *crl)
+{
+  GString *key = g_string_new ("");
+  GSList *l;
+
+  for (l = cas; l != NULL; l = l->next)
+    g_string_append_printf (key, "ca:%s\n", (const gchar *) l->data);
+
+  for (l = crl; l != NULL; l = l->next)
+    g_string_append_printf (key, "crl:%s\n", (const gchar *) l->data);
+
+  return g_string_free (key, FALSE);
+}
+
+/* Runs in the store's thread, where @entry is only freed */
+static void
+path_changed_cb (GFileMonitor *monitor,
+    GFile *file,
+    GFile *other_file,
+    GFileMonitorEvent event_type,
+    gpointer user_data)
+{
+  StoreEntry *entry = user_data;
+  WockyTLSTrust *stale = NULL;
+
+  if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+      event_type == G_FILE_MONITOR_EVENT_PRE_UNMOUNT)
+    return;
+
+  G_LOCK (store);
+
+  /* the store may have been cleared, and the entry only be waiting to be
+   * freed */
+  if (entries != NULL && g_hash_table_lookup (entries, entry->key) == entry)
+    {
+      DEBUG ("trusted certificates changed; they will be loaded again");
+      entry->generation = next_generation++;
+      stale = entry->trust;
+      entry->trust = NULL;
+    }
+
+  G_UNLOCK (store);
+
+  if (stale != NULL)
+    wocky_tls_trust_unref (stale);
+}
+
+/* Runs in the store's thread, so that the monitors are attached to its
+ * context */
+static gboolean
+store_entry_watch_cb (gpointer data)
+{
+  StoreEntry *entry = data;
+  GSList *l;
+
+  for (l = entry->paths; l != NULL; l = l->next)
+    {
+      GFile *file = g_file_new_for_path (l->data);
+      GError *error = NULL;
+      GFileMonitor *monitor;
+
+      monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, &error);
+
+      if (monitor == NULL)
+        {
+          DEBUG ("can't watch %s: %s", (const gchar *) l->data,
+              error->message);
+          g_clear_error (&error);
+        }
+      else
+        {
+          g_signal_connect (monitor, "changed",
+              G_CALLBACK (path_changed_cb), entry);
+          entry->monitors = g_slist_prepend (entry->monitors, monitor);
+        }
+
+      g_object_unref (file);
+    }
+
+  return FALSE;
+}
+
+/* Called with the lock held */
+static StoreEntry *
+store_entry_new (const gchar *key,
+    GSList *cas,
+    GSList *crl)
+{
+  StoreEntry *entry = g_slice_new0 (StoreEntry);
+  GSList *l;
+
+  if (entries == NULL)
+    store_start ();
+
+  entry->key = g_strdup (key);
+  entry->generation = next_generation++;
+
+  for (l = cas; l != NULL; l = l->next)
+    entry->paths = g_slist_prepend (entry->paths, g_strdup (l->data));
+
+  for (l = crl; l != NULL; l = l->next)
+    entry->paths = g_slist_prepend (entry->paths, g_strdup (l->data));
+
+  entry->paths = g_slist_reverse (entry->paths);
+
+  g_hash_table_insert (entries, entry->key, entry);
+  store_invoke (store_entry_watch_cb, entry);
+
+  return entry;
+}
+
+WockyTLSTrust *
+wocky_tls_trust_store_lookup (GSList *cas,
+    GSList *crl)
+{
+  gchar *key = store_key (cas, crl);
+  StoreEntry *entry;
+  WockyTLSTrust *trust = NULL;
+  WockyTLSTrust *loaded;
+  guint generation;
+
+  G_LOCK (store);
+
+  entry = (entries == NULL) ? NULL : g_hash_table_lookup (entries, key);
+
+  if (entry == NULL)
+    entry = store_entry_new (key, cas, crl);
+
+  if (entry->trust != NULL)
+    {
+      trust = wocky_tls_trust_ref (entry->trust);
+      G_UNLOCK (store);
+      g_free (key);
+      return trust;
+    }
+
+  generation = entry->generation;
+
+  G_UNLOCK (store);
+
+  /* Sessions set up at the same time may each parse the paths, but none
+   * of them waits for another, nor holds up the ones which can share a
+   * trust that's already loaded */
+  DEBUG ("loading %u CA and %u CRL paths", g_slist_length (cas),
+      g_slist_length (crl));
+  loaded = wocky_tls_trust_new (cas, crl);
+
+  G_LOCK (store);
+
+  /* looked up again: the store may have been cleared meanwhile */
+  entry = (entries == NULL) ? NULL : g_hash_table_lookup (entries, key);
+
+  if (entry != NULL && entry->trust != NULL)
+    {
+      /* another session got there first */
+      trust = wocky_tls_trust_ref (entry->trust);
+    }
+  else if (entry != NULL && entry->generation == generation)
+    {
+      wocky_tls_trust_set_generation (loaded, generation);
+      entry->trust = wocky_tls_trust_ref (loaded);
+      trust = loaded;
+      loaded = NULL;
+    }
+  else
+    {
+      /* A path changed while it was being parsed: the session can still
+       * use what was parsed, but nothing verified against it can be taken
+       * for what holds against the paths as they are now */
+      wocky_tls_trust_set_generation (loaded, next_generation++);
+      trust = loaded;
+      loaded = NULL;
+    }
+
+  G_UNLOCK (store);
+
+  if (loaded != NULL)
+    wocky_tls_trust_unref (loaded);
+
+  g_free (key);
+  return trust;
+}
+
+void
+wocky_tls_trust_store_clear (void)
+{
+  GHashTableIter iter;
+  gpointer value;
+  GSList *stale = NULL;
+  GThread *thread;
+
+  G_LOCK (store);
+
+  if (entries == NULL)
+    {
+      G_UNLOCK (store);
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, entries);
+
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      StoreEntry *entry = value;
+
+      if (entry->trust != NULL)
+        stale = g_slist_prepend (stale, entry->trust);
+
+      entry->trust = NULL;
+      store_invoke (store_entry_free_cb, entry);
+    }
+
+  store_invoke (store_stop_cb, store_loop);
+  g_hash_table_unref (entries);
+  entries = NULL;
+  g_main_context_unref (store_context);
+  store_context = NULL;
+  g_main_loop_unref (store_loop);
+  store_loop = NULL;
+  thread = store_thread_handle;
+  store_thread_handle = NULL;
+
+  G_UNLOCK (store);
+
+  /* its monitors' callbacks take the lock */
+  g_thread_join (thread);
+
+  g_slist_foreach (stale, (GFunc) wocky_tls_trust_unref, NULL);
+  g_slist_free (stale);
+}
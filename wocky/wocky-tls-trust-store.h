@@ -0,0 +1,79 @@
+/*
+ * wocky-tls-trust-store.h - Header for the process-wide TLS trust store
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TLS_TRUST_STORE_H
+#define WOCKY_TLS_TRUST_STORE_H
+
+#include <gio/gio.h>
+
+#include "wocky-tls.h"
+
+G_BEGIN_DECLS
+
+/* CA certificates and CRLs, parsed by the TLS backend, which any number of
+ * client sessions (in any thread) can verify their peer against */
+typedef struct _WockyTLSTrust WockyTLSTrust;
+
+/* Implemented by the TLS backend. @cas and @crl are lists of file or
+ * directory paths, as for wocky_tls_session_add_ca() and
+ * wocky_tls_session_add_crl(). */
+WockyTLSTrust *wocky_tls_trust_new (GSList *cas,
+    GSList *crl);
+
+WockyTLSTrust *wocky_tls_trust_ref (WockyTLSTrust *trust);
+
+void wocky_tls_trust_unref (WockyTLSTrust *trust);
+
+/* Makes a client session verify its peer against @trust rather than the CAs
+ * and CRLs added to it, which are ignored. It must be called before the
+ * handshake. */
+void wocky_tls_session_set_trust (WockyTLSSession *session,
+    WockyTLSTrust *trust);
+
+/* Set by the trust store before @trust is shared. Two trusts only have the
+ * same generation if they were parsed from the same paths, with none of
+ * them changing in between, so that results computed against one still
+ * hold for the other. Trusts not from the store have generation 0. */
+void wocky_tls_trust_set_generation (WockyTLSTrust *trust,
+    guint generation);
+
+guint wocky_tls_trust_get_generation (WockyTLSTrust *trust);
+
+/* Borrowed; NULL unless wocky_tls_session_set_trust() was called */
+WockyTLSTrust *wocky_tls_session_get_trust (WockyTLSSession *session);
+
+/* The earliest expiry of the certificates the peer presented, in the same
+ * units as g_get_real_time(), or 0 if there are none or it can't be told */
+gint64 wocky_tls_session_get_peers_expiry (WockyTLSSession *session);
+
+/* Returns a new reference to the trust for @cas and @crl, which is only
+ * parsed again when one of the paths changes on disk */
+WockyTLSTrust *wocky_tls_trust_store_lookup (GSList *cas,
+    GSList *crl);
+
+/* Drops every trust the store keeps, and stops watching their paths; the
+ * sessions using them are unaffected. Called by wocky_deinit(). */
+void wocky_tls_trust_store_clear (void);
+
+G_END_DECLS
+
+#endif /* WOCKY_TLS_TRUST_STORE_H */
@@ -0,0 +1,210 @@
+/*
+ * wocky-tls-verify-cache.c - Source for the peer verification cache
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Outcomes of wocky_tls_session_verify_peer(), shared by the whole process,
+ * for the WockyTLSHandlers which ask for it. Reconnecting to a server which
+ * presents the same chain under the same name can then skip building the
+ * chain, checking the CRLs and matching the names.
+ *
+ * An outcome is keyed by everything it depends on: the certificates, the
+ * names they were checked against, the verification level and the
+ * generation of the WockyTLSTrust they were checked with. Trusts parsed
+ * from the same paths share a generation until one of the paths changes, so
+ * outcomes survive reconnecting, but those computed against the old files
+ * are never found again. They are kept until the earliest expiry of the
+ * certificates, and never more than WOCKY_TLS_VERIFY_CACHE_MAX_AGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-tls-verify-cache.h"
+
+#include "wocky-tls-trust-store.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_TLS
+#include "wocky-debug-internal.h"
+
+typedef struct
+{
+  WockyTLSCertStatus status;
+  /* Real time, in microseconds */
+  gint64 expires;
+} CacheEntry;
+
+G_LOCK_DEFINE_STATIC (cache);
+
+/* Only accessed with the lock held */
+/* owned gchar * => owned CacheEntry */
+static GHashTable *outcomes = NULL;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_slice_free (CacheEntry, entry);
+}
+
+gchar *
+wocky_tls_verify_cache_key (WockyTLSSession *session,
+    const gchar *peername,
+    GStrv extra_identities,
+    WockyTLSVerificationLevel level)
+{
+  WockyTLSTrust *trust = wocky_tls_session_get_trust (session);
+  GPtrArray *certificates;
+  GChecksum *leaf;
+  GChecksum *chain;
+  GString *key;
+  guint i;
+
+  if (trust == NULL)
+    return NULL;
+
+  certificates = wocky_tls_session_get_peers_certificate (session, NULL);
+
+  if (certificates == NULL || certificates->len == 0)
+    {
+      if (certificates != NULL)
+        g_ptr_array_unref (certificates);
+
+      return NULL;
+    }
+
+  leaf = g_checksum_new (G_CHECKSUM_SHA256);
+  chain = g_checksum_new (G_CHECKSUM_SHA256);
+
+  for (i = 0; i < certificates->len; i++)
+    {
+      GArray *cert = g_ptr_array_index (certificates, i);
+
+      g_checksum_update (i == 0 ? leaf : chain, (const guchar *) cert->data,
+          cert->len);
+    }
+
+  key = g_string_new ("");
+  g_string_append_printf (key, "%u %d %s %s %s",
+      wocky_tls_trust_get_generation (trust), level,
+      g_checksum_get_string (leaf), g_checksum_get_string (chain),
+      peername != NULL ? peername : "");
+
+  for (i = 0; extra_identities != NULL && extra_identities[i] != NULL; i++)
+    g_string_append_printf (key, " %s", extra_identities[i]);
+
+  g_checksum_free (leaf);
+  g_checksum_free (chain);
+  g_ptr_array_unref (certificates);
+
+  return g_string_free (key, FALSE);
+}
+
+gboolean
+wocky_tls_verify_cache_lookup (const gchar *key,
+    WockyTLSCertStatus *status)
+{
+  CacheEntry *entry;
+  gboolean found = FALSE;
+
+  G_LOCK (cache);
+
+  entry = (outcomes == NULL) ? NULL : g_hash_table_lookup (outcomes, key);
+
+  if (entry != NULL)
+    {
+      if (entry->expires <= g_get_real_time ())
+        {
+          g_hash_table_remove (outcomes, key);
+        }
+      else
+        {
+          *status = entry->status;
+          found = TRUE;
+        }
+    }
+
+  G_UNLOCK (cache);
+
+  return found;
+}
+
+static gboolean
+entry_expired (gpointer key,
+    gpointer value,
+    gpointer user_data)
+{
+  CacheEntry *entry = value;
+  gint64 *now = user_data;
+
+  return entry->expires <= *now;
+}
+
+void
+wocky_tls_verify_cache_add (const gchar *key,
+    WockyTLSSession *session,
+    WockyTLSCertStatus status)
+{
+  CacheEntry *entry;
+  gint64 now = g_get_real_time ();
+  gint64 expires = wocky_tls_session_get_peers_expiry (session);
+  gint64 max = now + WOCKY_TLS_VERIFY_CACHE_MAX_AGE * G_USEC_PER_SEC;
+
+  switch (status)
+    {
+      /* These say nothing about the certificates themselves */
+      case WOCKY_TLS_CERT_NO_CERTIFICATE:
+      case WOCKY_TLS_CERT_MAYBE_DOS:
+      case WOCKY_TLS_CERT_INTERNAL_ERROR:
+      case WOCKY_TLS_CERT_UNKNOWN_ERROR:
+        return;
+      default:
+        break;
+    }
+
+  if (expires == 0 || expires > max)
+    expires = max;
+
+  if (expires <= now)
+    return;
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->status = status;
+  entry->expires = expires;
+
+  G_LOCK (cache);
+
+  if (outcomes == NULL)
+    outcomes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+        (GDestroyNotify) cache_entry_free);
+
+  if (g_hash_table_size (outcomes) >= WOCKY_TLS_VERIFY_CACHE_SIZE)
+    {
+      g_hash_table_foreach_remove (outcomes, entry_expired, &now);
+
+      if (g_hash_table_size (outcomes) >= WOCKY_TLS_VERIFY_CACHE_SIZE)
+        {
+          DEBUG ("cache full; forgetting everything");
+          g_hash_table_remove_all (outcomes);
+        }
+    }
+
+  g_hash_table_replace (outcomes, g_strdup (key), entry);
+
+  G_UNLOCK (cache);
+}
@@ -0,0 +1,56 @@
+/*
+ * wocky-tls-verify-cache.h - Header for the peer verification cache
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TLS_VERIFY_CACHE_H
+#define WOCKY_TLS_VERIFY_CACHE_H
+
+#include <glib.h>
+
+#include "wocky-tls.h"
+
+G_BEGIN_DECLS
+
+/* How long an outcome is kept at most, in seconds, whatever the expiry of
+ * the certificates: this bounds how stale the CRLs it was checked against
+ * can get */
+#define WOCKY_TLS_VERIFY_CACHE_MAX_AGE (60 * 60)
+
+/* Outcomes kept at most; expired ones are dropped first when it's full */
+#define WOCKY_TLS_VERIFY_CACHE_SIZE 256
+
+/* Returns NULL if the outcome of verifying @session can't be cached (for
+ * instance, if it isn't using a shared WockyTLSTrust) */
+gchar *wocky_tls_verify_cache_key (WockyTLSSession *session,
+    const gchar *peername,
+    GStrv extra_identities,
+    WockyTLSVerificationLevel level);
+
+gboolean wocky_tls_verify_cache_lookup (const gchar *key,
+    WockyTLSCertStatus *status);
+
+void wocky_tls_verify_cache_add (const gchar *key,
+    WockyTLSSession *session,
+    WockyTLSCertStatus status);
+
+G_END_DECLS
+
+#endif /* WOCKY_TLS_VERIFY_CACHE_H */
@@ -0,0 +1,111 @@
+/*
+ * wocky-tls-worker.c - Source for the TLS worker thread pool
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * A bounded pool of threads, shared by the whole process, to run the
+ * CPU-heavy parts of TLS (the key exchange of the handshake, and walking the
+ * peer's certificate chain) away from the main loop: with hundreds of
+ * connections being set up at once, they would otherwise delay the stanzas
+ * of every established connection sharing it.
+ *
+ * Jobs only ever compute: a handshake runs each step of the key exchange
+ * here (see wocky_tls_session_set_worker_pool()), but its reads and writes
+ * are started from, and completed in, the main context of the caller, like
+ * any other async handshake. A thread is never held up waiting for the
+ * network, so a few of them are enough for any number of connections.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-tls-worker.h"
+
+#define WOCKY_DEBUG_FLAG WOCKY_DEBUG_TLS
+#include "wocky-debug-internal.h"
+
+typedef struct
+{
+  GSimpleAsyncResult *result;
+  WockyTLSWorkerFunc func;
+  gpointer data;
+  GDestroyNotify destroy;
+  GCancellable *cancellable;
+} Job;
+
+static void
+run_job (gpointer data,
+    gpointer user_data)
+{
+  Job *job = data;
+
+  job->func (job->result, job->data, job->cancellable);
+
+  /* back to the main context the result was created in */
+  g_simple_async_result_complete_in_idle (job->result);
+
+  g_object_unref (job->result);
+
+  if (job->destroy != NULL)
+    job->destroy (job->data);
+
+  if (job->cancellable != NULL)
+    g_object_unref (job->cancellable);
+
+  g_slice_free (Job, job);
+}
+
+static GThreadPool *
+get_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GError *error = NULL;
+      GThreadPool *p = g_thread_pool_new (run_job, NULL,
+          WOCKY_TLS_WORKER_MAX_THREADS, FALSE, &error);
+
+      /* only exclusive pools can fail to be created */
+      g_assert_no_error (error);
+      g_once_init_leave (&pool, (gsize) p);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+void
+wocky_tls_worker_run (GSimpleAsyncResult *result,
+    WockyTLSWorkerFunc func,
+    gpointer data,
+    GDestroyNotify destroy,
+    GCancellable *cancellable)
+{
+  Job *job = g_slice_new0 (Job);
+
+  job->result = g_object_ref (result);
+  job->func = func;
+  job->data = data;
+  job->destroy = destroy;
+
+  if (cancellable != NULL)
+    job->cancellable = g_object_ref (cancellable);
+
+  g_thread_pool_push (get_pool (), job, NULL);
+}
@@ -0,0 +1,58 @@
+/*
+ * wocky-tls-worker.h - Header for the TLS worker thread pool
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_TLS_WORKER_H
+#define WOCKY_TLS_WORKER_H
+
+#include <gio/gio.h>
+
+#include "wocky-tls.h"
+
+G_BEGIN_DECLS
+
+/* How many handshake steps or verifications may run at once; any more wait
+ * for a thread to be free */
+#define WOCKY_TLS_WORKER_MAX_THREADS 4
+
+/* Called in a worker thread; it should set the outcome of the operation on
+ * @result, which is then completed in the main context it was created in.
+ * It must not block on I/O. */
+typedef void (*WockyTLSWorkerFunc) (GSimpleAsyncResult *result,
+    gpointer data,
+    GCancellable *cancellable);
+
+void wocky_tls_worker_run (GSimpleAsyncResult *result,
+    WockyTLSWorkerFunc func,
+    gpointer data,
+    GDestroyNotify destroy,
+    GCancellable *cancellable);
+
+/* Implemented by the TLS backend. Makes wocky_tls_session_handshake_async()
+ * run the CPU-heavy steps of the handshake on the worker pool, while its I/O
+ * stays in the caller's main context. It must be called before the
+ * handshake. */
+void wocky_tls_session_set_worker_pool (WockyTLSSession *session,
+    gboolean worker_pool);
+
+G_END_DECLS
+
+#endif /* WOCKY_TLS_WORKER_H */
@@ -49,6 +49,9 @@
 #endif
 
 #include "wocky-tls.h"
+#include "wocky-tls-trust-store.h"
+#include "wocky-tls-ktls.h"
+#include "wocky-tls-worker.h"
 
 #include <gnutls/x509.h>
 #include <gnutls/openpgp.h>
@@ -100,6 +103,17 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
+
+/* ALPN appeared in gnutls 3.2.0 */
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+#define HAVE_TLS_ALPN 1
+#endif
+
+/* the keys of an established session can be read from gnutls 3.4.0 on */
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+#define HAVE_TLS_RECORD_STATE 1
+#endif
+
 enum
 {
   PROP_S_NONE,
@@ -150,6 +164,9 @@ typedef enum
 typedef enum
 {
   WOCKY_TLS_OP_STATE_IDLE,
+  /* asked for by a handshake step on the worker pool, to be started once
+   * the step is back in the main context */
+  WOCKY_TLS_OP_STATE_QUEUED,
   WOCKY_TLS_OP_STATE_ACTIVE,
   WOCKY_TLS_OP_STATE_DONE
 } WockyTLSOpState;
@@ -205,6 +222,11 @@ struct _WockyTLSSession
   GError *error;
   gboolean async;
 
+  /* whether the steps of the async handshake run on the worker pool, and
+   * whether one is running there now */
+  gboolean worker_pool;
+  gboolean in_worker;
+
   /* tls server support */
   gboolean server;
   gnutls_dh_params_t dh_params;
@@ -212,6 +234,11 @@ struct _WockyTLSSession
   gchar *key_file;
   gchar *cert_file;
 
+  /* application protocol we offer (or, as a server, accept), and the one
+   * which was negotiated */
+  gchar *alpn_protocol;
+  gchar *alpn_selected;
+
   /* frontend jobs */
   WockyTLSJobHandshake handshake_job;
   WockyTLSJobRead      read_job;
@@ -224,6 +251,26 @@ struct _WockyTLSSession
   gnutls_session_t session;
 
   gnutls_certificate_credentials_t gnutls_cert_cred;
+
+  /* shared CAs and CRLs used instead of gnutls_cert_cred, if set */
+  WockyTLSTrust *trust;
+
+  /* whether to hand the records to the kernel after the handshake, and in
+   * which directions it took them: those go straight to ktls_socket */
+  gboolean kernel_offload;
+  GSocket *ktls_socket;
+  gboolean ktls_tx;
+  gboolean ktls_rx;
+};
+
+struct _WockyTLSTrust
+{
+  volatile gint ref_count;
+  guint generation;
+  gnutls_certificate_credentials_t cred;
+  /* the verification flags live in the credentials, so sessions sharing
+   * them have to take turns verifying */
+  GMutex verify_lock;
 };
 
 typedef struct
@@ -384,11 +431,22 @@ wocky_tls_job_result_boolean (WockyTLSJob *job,
     }
 }
 
+static void wocky_tls_session_start_read (WockyTLSSession *session,
+                                          WockyTLSJob     *active_job);
+static void wocky_tls_session_start_write (WockyTLSSession *session,
+                                           WockyTLSJob     *active_job);
+static void wocky_tls_session_queue_handshake_step (WockyTLSSession *session);
+
 static void
 wocky_tls_session_try_operation (WockyTLSSession   *session,
                                  WockyTLSOperation  operation)
 {
-  if (session->handshake_job.job.active)
+  if (session->handshake_job.job.active && session->worker_pool)
+    {
+      wocky_tls_session_queue_handshake_step (session);
+    }
+
+  else if (session->handshake_job.job.active)
     {
       gint result;
       DEBUG ("session %p: async job handshake", session);
@@ -460,6 +518,88 @@ wocky_tls_session_try_operation (WockyTLSSession   *session,
     }
 }
 
+/* The key exchange and signatures of the handshake happen within
+ * gnutls_handshake (), so with a worker pool, each call of it runs there.
+ * The transport never blocks in the worker: reads and writes it asks for are
+ * queued, and started once the step is back in the main context; the step
+ * after that is only run when they are over. */
+static void
+handshake_step_in_thread (GSimpleAsyncResult *result,
+                          gpointer            data,
+                          GCancellable       *cancellable)
+{
+  WockyTLSSession *session = WOCKY_TLS_SESSION (data);
+  gint code;
+
+  code = gnutls_handshake (session->session);
+  g_assert (code != GNUTLS_E_INTERRUPTED);
+
+  g_simple_async_result_set_op_res_gssize (result, code);
+}
+
+static void
+handshake_step_done (GObject      *source,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  WockyTLSSession *session = WOCKY_TLS_SESSION (source);
+  WockyTLSJob *job = &session->handshake_job.job;
+  gint result;
+
+  result = g_simple_async_result_get_op_res_gssize (
+      G_SIMPLE_ASYNC_RESULT (res));
+
+  if (tls_debug_level >= DEBUG_HANDSHAKE_LEVEL)
+    DEBUG ("session %p: handshake step: %d %s", session,
+        result, error_to_string (result));
+
+  session->in_worker = FALSE;
+  session->async = FALSE;
+
+  if (session->write_op.state == WOCKY_TLS_OP_STATE_QUEUED)
+    wocky_tls_session_start_write (session, job);
+
+  if (session->read_op.state == WOCKY_TLS_OP_STATE_QUEUED)
+    wocky_tls_session_start_read (session, job);
+
+  /* anything still in flight calls wocky_tls_session_try_operation () once
+   * it's over, which runs the next step */
+  if (result == GNUTLS_E_AGAIN &&
+      (session->write_op.state == WOCKY_TLS_OP_STATE_DONE ||
+       session->read_op.state == WOCKY_TLS_OP_STATE_DONE))
+    wocky_tls_session_queue_handshake_step (session);
+  else
+    wocky_tls_job_result_boolean (job, result);
+}
+
+static void
+wocky_tls_session_queue_handshake_step (WockyTLSSession *session)
+{
+  GSimpleAsyncResult *result;
+
+  g_assert (!session->in_worker);
+
+  /* the ready callbacks of the reads and writes don't run another step
+   * while this one is going */
+  session->async = TRUE;
+  session->in_worker = TRUE;
+
+  result = g_simple_async_result_new (G_OBJECT (session),
+      handshake_step_done, NULL, wocky_tls_session_queue_handshake_step);
+  wocky_tls_worker_run (result, handshake_step_in_thread,
+      g_object_ref (session), g_object_unref, NULL);
+  g_object_unref (result);
+}
+
+void
+wocky_tls_session_set_worker_pool (WockyTLSSession *session,
+                                   gboolean         worker_pool)
+{
+  g_return_if_fail (!session->handshake_job.job.active);
+
+  session->worker_pool = worker_pool;
+}
+
 static void
 wocky_tls_job_start (WockyTLSJob             *job,
                      gpointer             source_object,
@@ -516,15 +656,16 @@ wocky_tls_session_handshake (WockyTLSSession   *session,
   else if (wocky_tls_set_error (error, result))
     return NULL;
 
+  ktls_offload (session);
   return g_object_new (WOCKY_TYPE_TLS_CONNECTION, "session", session, NULL);
 }
 
 /* ************************************************************************* */
 /* adding CA certificates lists for peer certificate verification    */
 
-void
-wocky_tls_session_add_ca (WockyTLSSession *session,
-                          const gchar *ca_path)
+static void
+add_ca (gnutls_certificate_credentials_t cred,
+        const gchar *ca_path)
 {
   int n = 0;
   struct stat target;
@@ -552,7 +693,7 @@ wocky_tls_session_add_ca (WockyTLSSession *session,
 
           if ((stat (path, &file) == 0) && S_ISREG (file.st_mode))
             n += gnutls_certificate_set_x509_trust_file (
-                session->gnutls_cert_cred, path, GNUTLS_X509_FMT_PEM);
+                cred, path, GNUTLS_X509_FMT_PEM);
 
           g_free (path);
         }
@@ -562,14 +703,15 @@ wocky_tls_session_add_ca (WockyTLSSession *session,
     }
   else if (S_ISREG (target.st_mode))
     {
-      n = gnutls_certificate_set_x509_trust_file (session->gnutls_cert_cred,
+      n = gnutls_certificate_set_x509_trust_file (cred,
           ca_path, GNUTLS_X509_FMT_PEM);
       DEBUG ("+ %s: %d certs from file", ca_path, n);
     }
 }
 
-void
-wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *crl_path)
+static void
+add_crl (gnutls_certificate_credentials_t cred,
+         const gchar *crl_path)
 {
   int n = 0;
   struct stat target;
@@ -598,7 +740,7 @@ wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *crl_path)
           if ((stat (path, &file) == 0) && S_ISREG (file.st_mode))
             {
               int x = gnutls_certificate_set_x509_crl_file (
-                session->gnutls_cert_cred, path, GNUTLS_X509_FMT_PEM);
+                cred, path, GNUTLS_X509_FMT_PEM);
 
               if (x < 0)
                 DEBUG ("Error loading %s: %d %s", path, x, gnutls_strerror (x));
@@ -614,7 +756,7 @@ wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *crl_path)
     }
   else if (S_ISREG (target.st_mode))
     {
-      n = gnutls_certificate_set_x509_trust_file (session->gnutls_cert_cred,
+      n = gnutls_certificate_set_x509_trust_file (cred,
           crl_path, GNUTLS_X509_FMT_PEM);
 
       if (n < 0)
@@ -624,6 +766,365 @@ wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *crl_path)
     }
 }
 
+void
+wocky_tls_session_add_ca (WockyTLSSession *session,
+                          const gchar *ca_path)
+{
+  add_ca (session->gnutls_cert_cred, ca_path);
+}
+
+void
+wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *crl_path)
+{
+  add_crl (session->gnutls_cert_cred, crl_path);
+}
+
+/* ************************************************************************* */
+/* CA certificates & CRLs shared between sessions: see wocky-tls-trust-store */
+
+WockyTLSTrust *
+wocky_tls_trust_new (GSList *cas,
+                     GSList *crl)
+{
+  WockyTLSTrust *trust = g_slice_new0 (WockyTLSTrust);
+  GSList *l;
+
+  trust->ref_count = 1;
+  g_mutex_init (&trust->verify_lock);
+  gnutls_certificate_allocate_credentials (&trust->cred);
+
+  for (l = cas; l != NULL; l = l->next)
+    add_ca (trust->cred, l->data);
+
+  for (l = crl; l != NULL; l = l->next)
+    add_crl (trust->cred, l->data);
+
+  return trust;
+}
+
+WockyTLSTrust *
+wocky_tls_trust_ref (WockyTLSTrust *trust)
+{
+  g_atomic_int_inc (&trust->ref_count);
+  return trust;
+}
+
+void
+wocky_tls_trust_unref (WockyTLSTrust *trust)
+{
+  if (!g_atomic_int_dec_and_test (&trust->ref_count))
+    return;
+
+  gnutls_certificate_free_credentials (trust->cred);
+  g_mutex_clear (&trust->verify_lock);
+  g_slice_free (WockyTLSTrust, trust);
+}
+
+void
+wocky_tls_session_set_trust (WockyTLSSession *session,
+                             WockyTLSTrust *trust)
+{
+  gint code;
+
+  g_return_if_fail (!session->server);
+  g_return_if_fail (session->trust == NULL);
+
+  session->trust = wocky_tls_trust_ref (trust);
+
+  code = gnutls_credentials_set (session->session, GNUTLS_CRD_CERTIFICATE,
+                                 trust->cred);
+  if (code != GNUTLS_E_SUCCESS)
+    DEBUG ("could not set shared credentials: %s", error_to_string (code));
+}
+
+void
+wocky_tls_trust_set_generation (WockyTLSTrust *trust,
+                                guint generation)
+{
+  trust->generation = generation;
+}
+
+guint
+wocky_tls_trust_get_generation (WockyTLSTrust *trust)
+{
+  return trust->generation;
+}
+
+WockyTLSTrust *
+wocky_tls_session_get_trust (WockyTLSSession *session)
+{
+  return session->trust;
+}
+
+gint64
+wocky_tls_session_get_peers_expiry (WockyTLSSession *session)
+{
+  const gnutls_datum_t *peers;
+  guint n_peers;
+  guint i;
+  gint64 earliest = 0;
+
+  peers = gnutls_certificate_get_peers (session->session, &n_peers);
+
+  if (peers == NULL ||
+      gnutls_certificate_type_get (session->session) != GNUTLS_CRT_X509)
+    return 0;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      gnutls_x509_crt_t x509;
+      time_t expiry = -1;
+
+      if (gnutls_x509_crt_init (&x509) != GNUTLS_E_SUCCESS)
+        return 0;
+
+      if (gnutls_x509_crt_import (x509, &peers[i], GNUTLS_X509_FMT_DER) ==
+          GNUTLS_E_SUCCESS)
+        expiry = gnutls_x509_crt_get_expiration_time (x509);
+
+      gnutls_x509_crt_deinit (x509);
+
+      if (expiry == (time_t) -1)
+        return 0;
+
+      if (earliest == 0 || (gint64) expiry * G_USEC_PER_SEC < earliest)
+        earliest = (gint64) expiry * G_USEC_PER_SEC;
+    }
+
+  return earliest;
+}
+
+/* ************************************************************************* */
+/* TLS extensions: these must be set before the handshake                    */
+
+/**
+ * wocky_tls_session_set_server_name:
+ * @session: a client #WockyTLSSession
+ * @hostname: the name of the server we are connecting to
+ *
+ * Sends @hostname to the server using the Server Name Indication extension,
+ * so that it can pick the right certificate.
+ */
+void
+wocky_tls_session_set_server_name (WockyTLSSession *session,
+                                   const gchar *hostname)
+{
+  g_return_if_fail (!session->server);
+  g_return_if_fail (hostname != NULL);
+
+  gnutls_server_name_set (session->session, GNUTLS_NAME_DNS, hostname,
+                          strlen (hostname));
+}
+
+/**
+ * wocky_tls_session_set_alpn_protocol:
+ * @session: a #WockyTLSSession
+ * @protocol: an application protocol name, such as "xmpp-client"
+ *
+ * Negotiates @protocol using the Application-Layer Protocol Negotiation
+ * extension: a client offers it, and a server accepts it if offered.
+ * This does nothing if the TLS library is too old to support ALPN.
+ */
+void
+wocky_tls_session_set_alpn_protocol (WockyTLSSession *session,
+                                     const gchar *protocol)
+{
+#ifdef HAVE_TLS_ALPN
+  gnutls_datum_t datum;
+  gint code;
+#endif
+
+  g_return_if_fail (protocol != NULL && *protocol != '\0');
+
+  g_free (session->alpn_protocol);
+  session->alpn_protocol = g_strdup (protocol);
+
+#ifdef HAVE_TLS_ALPN
+  datum.data = (unsigned char *) session->alpn_protocol;
+  datum.size = strlen (session->alpn_protocol);
+
+  code = gnutls_alpn_set_protocols (session->session, &datum, 1, 0);
+  if (code != GNUTLS_E_SUCCESS)
+    DEBUG ("could not set ALPN protocol: %s", error_to_string (code));
+#else
+  DEBUG ("ALPN not supported by this version of gnutls; not offering %s",
+         protocol);
+#endif
+}
+
+/**
+ * wocky_tls_session_get_alpn_protocol:
+ * @session: a #WockyTLSSession
+ *
+ * Returns: the application protocol negotiated during the handshake, or
+ *  %NULL if none was
+ */
+const gchar *
+wocky_tls_session_get_alpn_protocol (WockyTLSSession *session)
+{
+#ifdef HAVE_TLS_ALPN
+  gnutls_datum_t datum;
+
+  if (session->alpn_selected == NULL &&
+      gnutls_alpn_get_selected_protocol (session->session, &datum) ==
+        GNUTLS_E_SUCCESS)
+    session->alpn_selected = g_strndup ((const gchar *) datum.data,
+                                        datum.size);
+#endif
+
+  return session->alpn_selected;
+}
+
+/**
+ * wocky_tls_session_set_kernel_offload:
+ * @session: a #WockyTLSSession
+ * @enabled: whether to try offloading
+ *
+ * Once the handshake is over, tries to have the kernel encrypt and decrypt
+ * the session's records, so that data is written to and read from the
+ * underlying socket as it is. This only works on Linux, with the "tls"
+ * kernel module, for a TCP connection and an AES-GCM or ChaCha20-Poly1305
+ * cipher suite: otherwise, or if the kernel turns down either direction,
+ * that direction is handled by gnutls as usual.
+ */
+void
+wocky_tls_session_set_kernel_offload (WockyTLSSession *session,
+                                      gboolean enabled)
+{
+  session->kernel_offload = enabled;
+}
+
+/**
+ * wocky_tls_session_is_kernel_offloaded:
+ * @session: a #WockyTLSSession
+ *
+ * Returns: %TRUE if the kernel took over sending or receiving records after
+ *  wocky_tls_session_set_kernel_offload() was used
+ */
+gboolean
+wocky_tls_session_is_kernel_offloaded (WockyTLSSession *session)
+{
+  return session->ktls_tx || session->ktls_rx;
+}
+
+#ifdef HAVE_TLS_RECORD_STATE
+static gboolean
+ktls_start (WockyTLSSession *session,
+            GSocket *socket,
+            gboolean tx,
+            gboolean tls13,
+            WockyTLSKtlsCipher cipher)
+{
+  gnutls_datum_t key;
+  gnutls_datum_t iv;
+  guint8 seq[WOCKY_TLS_KTLS_SEQ_SIZE];
+  guint8 nonce[WOCKY_TLS_KTLS_IV_SIZE];
+  gint code;
+
+  code = gnutls_record_get_state (session->session, !tx, NULL, &iv, &key,
+                                  seq);
+
+  if (code != GNUTLS_E_SUCCESS)
+    {
+      DEBUG ("can't get the record state: %s", error_to_string (code));
+      return FALSE;
+    }
+
+  if (!tls13 && cipher != WOCKY_TLS_KTLS_CHACHA20_POLY1305)
+    {
+      /* TLS 1.2 AES-GCM only has a 4-byte implicit salt; the rest of the
+       * nonce is sent with each record and just has to be unique, so the
+       * sequence number will do, as gnutls does */
+      if (iv.size != 4)
+        return FALSE;
+
+      memcpy (nonce, iv.data, 4);
+      memcpy (nonce + 4, seq, WOCKY_TLS_KTLS_SEQ_SIZE);
+    }
+  else
+    {
+      if (iv.size != WOCKY_TLS_KTLS_IV_SIZE)
+        return FALSE;
+
+      memcpy (nonce, iv.data, WOCKY_TLS_KTLS_IV_SIZE);
+    }
+
+  return wocky_tls_ktls_start (socket, tx, tls13, cipher, key.data, nonce,
+                               seq);
+}
+#endif
+
+/* called once the handshake succeeded, before any application data */
+static void
+ktls_offload (WockyTLSSession *session)
+{
+#ifdef HAVE_TLS_RECORD_STATE
+  GSocket *socket;
+  WockyTLSKtlsCipher cipher;
+  gboolean tls13;
+
+  if (!session->kernel_offload)
+    return;
+
+  socket = wocky_tls_ktls_get_socket (session->stream);
+
+  if (socket == NULL)
+    {
+      DEBUG ("not a TCP connection: not offloading");
+      return;
+    }
+
+  switch (gnutls_cipher_get (session->session))
+    {
+      case GNUTLS_CIPHER_AES_128_GCM:
+        cipher = WOCKY_TLS_KTLS_AES_128_GCM;
+        break;
+      case GNUTLS_CIPHER_AES_256_GCM:
+        cipher = WOCKY_TLS_KTLS_AES_256_GCM;
+        break;
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+      case GNUTLS_CIPHER_CHACHA20_POLY1305:
+        cipher = WOCKY_TLS_KTLS_CHACHA20_POLY1305;
+        break;
+#endif
+      default:
+        DEBUG ("%s can't be offloaded",
+            gnutls_cipher_get_name (gnutls_cipher_get (session->session)));
+        return;
+    }
+
+  switch (gnutls_protocol_get_version (session->session))
+    {
+      case GNUTLS_TLS1_2:
+        tls13 = FALSE;
+        break;
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+      case GNUTLS_TLS1_3:
+        tls13 = TRUE;
+        break;
+#endif
+      default:
+        DEBUG ("only TLS 1.2 and 1.3 can be offloaded");
+        return;
+    }
+
+  /* records gnutls has already pulled in would be lost to the kernel */
+  session->ktls_tx = ktls_start (session, socket, TRUE, tls13, cipher);
+
+  if (gnutls_record_check_pending (session->session) == 0 &&
+      session->read_op.state == WOCKY_TLS_OP_STATE_IDLE)
+    session->ktls_rx = ktls_start (session, socket, FALSE, tls13, cipher);
+
+  DEBUG ("kernel offload: sending %s, receiving %s",
+      session->ktls_tx ? "yes" : "no", session->ktls_rx ? "yes" : "no");
+
+  if (session->ktls_tx || session->ktls_rx)
+    session->ktls_socket = g_object_ref (socket);
+#else
+  DEBUG ("gnutls is too old for kernel offload");
+#endif
+}
+
 /* ************************************************************************* */
 
 void
@@ -661,6 +1162,7 @@ wocky_tls_session_handshake_finish (WockyTLSSession   *session,
     return NULL;
 
   DEBUG ("connection OK");
+  ktls_offload (session);
   return g_object_new (WOCKY_TYPE_TLS_CONNECTION, "session", session, NULL);
 }
 
@@ -826,8 +1328,20 @@ wocky_tls_session_verify_peer (WockyTLSSession    *session,
 
   DEBUG ("setting gnutls verify flags level to: %s",
       wocky_enum_to_nick (WOCKY_TYPE_TLS_VERIFICATION_LEVEL, level));
-  gnutls_certificate_set_verify_flags (session->gnutls_cert_cred, check);
-  rval = gnutls_certificate_verify_peers2 (session->session, &peer_cert_status);
+  if (session->trust != NULL)
+    {
+      g_mutex_lock (&session->trust->verify_lock);
+      gnutls_certificate_set_verify_flags (session->trust->cred, check);
+      rval = gnutls_certificate_verify_peers2 (session->session,
+          &peer_cert_status);
+      g_mutex_unlock (&session->trust->verify_lock);
+    }
+  else
+    {
+      gnutls_certificate_set_verify_flags (session->gnutls_cert_cred, check);
+      rval = gnutls_certificate_verify_peers2 (session->session,
+          &peer_cert_status);
+    }
 
   if (rval != GNUTLS_E_SUCCESS)
     {
@@ -1008,6 +1522,10 @@ wocky_tls_input_stream_read (GInputStream  *stream,
   WockyTLSSession *session = WOCKY_TLS_INPUT_STREAM (stream)->session;
   gssize result;
 
+  if (session->ktls_rx)
+    return wocky_tls_ktls_read (session->ktls_socket, buffer, count,
+                                cancellable, error);
+
   session->cancellable = cancellable;
   result = gnutls_record_recv (session->session, buffer, count);
   g_assert (result != GNUTLS_E_INTERRUPTED);
@@ -1037,6 +1555,15 @@ wocky_tls_input_stream_read_async (GInputStream        *stream,
 {
   WockyTLSSession *session = WOCKY_TLS_INPUT_STREAM (stream)->session;
 
+  if (session->ktls_rx)
+    {
+      wocky_tls_ktls_read_async (session->ktls_socket, G_OBJECT (stream),
+                                 wocky_tls_input_stream_read_async, buffer,
+                                 count, io_priority, cancellable, callback,
+                                 user_data);
+      return;
+    }
+
   wocky_tls_job_start (&session->read_job.job, stream,
                        io_priority, cancellable, callback, user_data,
                        wocky_tls_input_stream_read_async);
@@ -1081,6 +1608,11 @@ wocky_tls_output_stream_write (GOutputStream  *stream,
   WockyTLSSession *session = WOCKY_TLS_OUTPUT_STREAM (stream)->session;
   gssize result;
 
+  if (session->ktls_tx)
+    return g_output_stream_write (
+        g_io_stream_get_output_stream (session->stream), buffer, count,
+        cancellable, error);
+
   session->cancellable = cancellable;
   result = gnutls_record_send (session->session, buffer, count);
   g_assert (result != GNUTLS_E_INTERRUPTED);
@@ -1110,6 +1642,15 @@ wocky_tls_output_stream_write_async (GOutputStream       *stream,
 {
   WockyTLSSession *session = WOCKY_TLS_OUTPUT_STREAM (stream)->session;
 
+  if (session->ktls_tx)
+    {
+      wocky_tls_ktls_write_async (session->stream, G_OBJECT (stream),
+                                  wocky_tls_output_stream_write_async, buffer,
+                                  count, io_priority, cancellable, callback,
+                                  user_data);
+      return;
+    }
+
   wocky_tls_job_start (&session->write_job.job, stream,
                    io_priority, cancellable, callback, user_data,
                    wocky_tls_output_stream_write_async);
@@ -1341,6 +1882,60 @@ wocky_tls_session_write_ready (GObject      *object,
     wocky_tls_session_try_operation (session, WOCKY_TLS_OP_WRITE);
 }
 
+static void
+wocky_tls_session_start_write (WockyTLSSession *session,
+                               WockyTLSJob     *active_job)
+{
+  GOutputStream *stream = g_io_stream_get_output_stream (session->stream);
+
+  g_assert (session->write_op.state == WOCKY_TLS_OP_STATE_QUEUED);
+  session->write_op.state = WOCKY_TLS_OP_STATE_ACTIVE;
+
+  g_output_stream_write_async (stream,
+                               session->write_op.buffer,
+                               session->write_op.requested,
+                               active_job->io_priority,
+                               active_job->cancellable,
+                               wocky_tls_session_write_ready,
+                               session);
+
+  if G_UNLIKELY (session->write_op.state != WOCKY_TLS_OP_STATE_ACTIVE)
+    g_warning ("The underlying stream '%s' used by the WockyTLSSession "
+               "called the GAsyncResultCallback recursively.  This "
+               "is an error in the underlying implementation: in "
+               "some cases it may lead to unbounded recursion.  "
+               "Result callbacks should always be dispatched from "
+               "the mainloop.",
+               G_OBJECT_TYPE_NAME (stream));
+}
+
+static void
+wocky_tls_session_start_read (WockyTLSSession *session,
+                              WockyTLSJob     *active_job)
+{
+  GInputStream *stream = g_io_stream_get_input_stream (session->stream);
+
+  g_assert (session->read_op.state == WOCKY_TLS_OP_STATE_QUEUED);
+  session->read_op.state = WOCKY_TLS_OP_STATE_ACTIVE;
+
+  g_input_stream_read_async (stream,
+                             session->read_op.buffer,
+                             session->read_op.requested,
+                             active_job->io_priority,
+                             active_job->cancellable,
+                             wocky_tls_session_read_ready,
+                             session);
+
+  if G_UNLIKELY (session->read_op.state != WOCKY_TLS_OP_STATE_ACTIVE)
+    g_warning ("The underlying stream '%s' used by the WockyTLSSession "
+               "called the GAsyncResultCallback recursively.  This "
+               "is an error in the underlying implementation: in "
+               "some cases it may lead to unbounded recursion.  "
+               "Result callbacks should always be dispatched from "
+               "the mainloop.",
+               G_OBJECT_TYPE_NAME (stream));
+}
+
 static ssize_t
 wocky_tls_session_push_func (gpointer    user_data,
                              const void *buffer,
@@ -1367,28 +1962,15 @@ wocky_tls_session_push_func (gpointer    user_data,
 
       if (session->write_op.state == WOCKY_TLS_OP_STATE_IDLE)
         {
-          session->write_op.state = WOCKY_TLS_OP_STATE_ACTIVE;
+          session->write_op.state = WOCKY_TLS_OP_STATE_QUEUED;
           session->write_op.buffer = g_memdup (buffer, count);
           session->write_op.requested = count;
           session->write_op.error = NULL;
           session->write_op.result = 0;
 
-          g_output_stream_write_async (stream,
-                                       session->write_op.buffer,
-                                       session->write_op.requested,
-                                       active_job->io_priority,
-                                       active_job->cancellable,
-                                       wocky_tls_session_write_ready,
-                                       session);
-
-          if G_UNLIKELY (session->write_op.state != WOCKY_TLS_OP_STATE_ACTIVE)
-            g_warning ("The underlying stream '%s' used by the WockyTLSSession "
-                       "called the GAsyncResultCallback recursively.  This "
-                       "is an error in the underlying implementation: in "
-                       "some cases it may lead to unbounded recursion.  "
-                       "Result callbacks should always be dispatched from "
-                       "the mainloop.",
-                       G_OBJECT_TYPE_NAME (stream));
+          /* otherwise, handshake_step_done () starts it */
+          if (!session->in_worker)
+            wocky_tls_session_start_write (session, active_job);
         }
 
       g_assert (session->write_op.state != WOCKY_TLS_OP_STATE_IDLE);
@@ -1460,27 +2042,14 @@ wocky_tls_session_pull_func (gpointer  user_data,
 
       if (session->read_op.state == WOCKY_TLS_OP_STATE_IDLE)
         {
-          session->read_op.state = WOCKY_TLS_OP_STATE_ACTIVE;
+          session->read_op.state = WOCKY_TLS_OP_STATE_QUEUED;
           session->read_op.buffer = g_malloc (count);
           session->read_op.requested = count;
           session->read_op.error = NULL;
 
-          g_input_stream_read_async (stream,
-                                     session->read_op.buffer,
-                                     session->read_op.requested,
-                                     active_job->io_priority,
-                                     active_job->cancellable,
-                                     wocky_tls_session_read_ready,
-                                     session);
-
-          if G_UNLIKELY (session->read_op.state != WOCKY_TLS_OP_STATE_ACTIVE)
-            g_warning ("The underlying stream '%s' used by the WockyTLSSession "
-                       "called the GAsyncResultCallback recursively.  This "
-                       "is an error in the underlying implementation: in "
-                       "some cases it may lead to unbounded recursion.  "
-                       "Result callbacks should always be dispatched from "
-                       "the mainloop.",
-                       G_OBJECT_TYPE_NAME (stream));
+          /* otherwise, handshake_step_done () starts it */
+          if (!session->in_worker)
+            wocky_tls_session_start_read (session, active_job);
         }
 
       g_assert (session->read_op.state != WOCKY_TLS_OP_STATE_IDLE);
@@ -1694,7 +2263,14 @@ wocky_tls_session_finalize (GObject *object)
 
   gnutls_deinit (session->session);
   gnutls_certificate_free_credentials (session->gnutls_cert_cred);
+
+  if (session->trust != NULL)
+    wocky_tls_trust_unref (session->trust);
+  if (session->ktls_socket != NULL)
+    g_object_unref (session->ktls_socket);
   g_object_unref (session->stream);
+  g_free (session->alpn_protocol);
+  g_free (session->alpn_selected);
 
   G_OBJECT_CLASS (wocky_tls_session_parent_class)
     ->finalize (object);
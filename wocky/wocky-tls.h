@@ -110,6 +110,16 @@ wocky_tls_session_handshake_finish (WockyTLSSession   *session,
 void wocky_tls_session_add_ca (WockyTLSSession *session, const gchar *path);
 void wocky_tls_session_add_crl (WockyTLSSession *session, const gchar *path);
 
+void wocky_tls_session_set_server_name (WockyTLSSession *session,
+                                        const gchar *hostname);
+void wocky_tls_session_set_alpn_protocol (WockyTLSSession *session,
+                                          const gchar *protocol);
+const gchar *wocky_tls_session_get_alpn_protocol (WockyTLSSession *session);
+
+void wocky_tls_session_set_kernel_offload (WockyTLSSession *session,
+                                           gboolean enabled);
+gboolean wocky_tls_session_is_kernel_offloaded (WockyTLSSession *session);
+
 WockyTLSSession *wocky_tls_session_new (GIOStream *stream);
 
 WockyTLSSession *wocky_tls_session_server_new (GIOStream   *stream,
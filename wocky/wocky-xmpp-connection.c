@@ -46,6 +46,7 @@
 
 #include "wocky-xmpp-reader.h"
 #include "wocky-xmpp-writer.h"
+#include "wocky-xmpp-pool.h"
 #include "wocky-stanza.h"
 #include "wocky-utils.h"
 
@@ -61,6 +62,7 @@ G_DEFINE_TYPE(WockyXmppConnection, wocky_xmpp_connection, G_TYPE_OBJECT)
 enum
 {
   PROP_BASE_STREAM = 1,
+  PROP_POOLED,
 };
 
 /* private structure */
@@ -69,6 +71,8 @@ struct _WockyXmppConnectionPrivate
   gboolean dispose_has_run;
   WockyXmppReader *reader;
   WockyXmppWriter *writer;
+  /* reader and writer come from, and go back to, the pool */
+  gboolean pooled;
 
   GIOStream *stream;
 
@@ -124,12 +128,29 @@ wocky_xmpp_connection_init (WockyXmppConnection *self)
       WockyXmppConnectionPrivate);
   priv = self->priv;
 
-  priv->writer = wocky_xmpp_writer_new ();
-  priv->reader = wocky_xmpp_reader_new ();
-
   priv->sm_enabled = FALSE;
 }
 
+static void
+wocky_xmpp_connection_constructed (GObject *object)
+{
+  WockyXmppConnection *self = WOCKY_XMPP_CONNECTION (object);
+  WockyXmppConnectionPrivate *priv = self->priv;
+
+  if (G_OBJECT_CLASS (wocky_xmpp_connection_parent_class)->constructed)
+    G_OBJECT_CLASS (wocky_xmpp_connection_parent_class)->constructed (object);
+
+  if (priv->pooled)
+    {
+      wocky_xmpp_pool_take (&priv->reader, &priv->writer);
+    }
+  else
+    {
+      priv->writer = wocky_xmpp_writer_new ();
+      priv->reader = wocky_xmpp_reader_new ();
+    }
+}
+
 static void wocky_xmpp_connection_dispose (GObject *object);
 static void wocky_xmpp_connection_finalize (GObject *object);
 
@@ -150,6 +171,9 @@ wocky_xmpp_connection_set_property (GObject *object,
         priv->stream = g_value_dup_object (value);
         g_assert (priv->stream != NULL);
         break;
+      case PROP_POOLED:
+        priv->pooled = g_value_get_boolean (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -171,6 +195,9 @@ wocky_xmpp_connection_get_property (GObject *object,
       case PROP_BASE_STREAM:
         g_value_set_object (value, priv->stream);
         break;
+      case PROP_POOLED:
+        g_value_set_boolean (value, priv->pooled);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -187,6 +214,7 @@ wocky_xmpp_connection_class_init (
   g_type_class_add_private (wocky_xmpp_connection_class,
       sizeof (WockyXmppConnectionPrivate));
 
+  object_class->constructed = wocky_xmpp_connection_constructed;
   object_class->set_property = wocky_xmpp_connection_set_property;
   object_class->get_property = wocky_xmpp_connection_get_property;
   object_class->dispose = wocky_xmpp_connection_dispose;
@@ -199,6 +227,22 @@ wocky_xmpp_connection_class_init (
     G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
   g_object_class_install_property (object_class, PROP_BASE_STREAM, spec);
+
+  /**
+   * WockyXmppConnection:pooled:
+   *
+   * Whether the connection's XML reader and writer are taken from a pool
+   * shared by the whole process, and given back to it once the connection
+   * is disposed. This saves setting them up for connections which are
+   * short-lived and numerous, such as link-local ones.
+   */
+  spec = g_param_spec_boolean ("pooled", "pooled",
+    "whether the XML reader and writer are recycled between connections",
+    FALSE,
+    G_PARAM_READWRITE |
+    G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_property (object_class, PROP_POOLED, spec);
 }
 
 void
@@ -221,6 +265,13 @@ wocky_xmpp_connection_dispose (GObject *object)
       priv->stream = NULL;
     }
 
+  if (priv->pooled && priv->reader != NULL && priv->writer != NULL)
+    {
+      wocky_xmpp_pool_give (priv->reader, priv->writer);
+      priv->reader = NULL;
+      priv->writer = NULL;
+    }
+
   if (priv->reader != NULL)
     {
       g_object_unref (priv->reader);
@@ -288,6 +339,24 @@ wocky_xmpp_connection_new (GIOStream *stream)
   return result;
 }
 
+/**
+ * wocky_xmpp_connection_new_pooled:
+ * @stream: GIOStream over wich all the data will be sent/received.
+ *
+ * Convenience function to create a new #WockyXmppConnection with
+ * #WockyXmppConnection:pooled set.
+ *
+ * Returns: a new #WockyXmppConnection.
+ */
+WockyXmppConnection *
+wocky_xmpp_connection_new_pooled (GIOStream *stream)
+{
+  return g_object_new (WOCKY_TYPE_XMPP_CONNECTION,
+    "base-stream", stream,
+    "pooled", TRUE,
+    NULL);
+}
+
 static void
 wocky_xmpp_connection_write_cb (GObject *source,
     GAsyncResult *res,
@@ -831,6 +900,10 @@ wocky_xmpp_connection_recv_stanza_async (WockyXmppConnection *connection,
   g_assert (priv->input_result == NULL);
   g_assert (priv->input_cancellable == NULL);
 
+  /* The stanzas received so far have been dealt with: stream management
+   * requests and acks which followed them can be reported */
+  wocky_xmpp_reader_emit_sm_events (priv->reader);
+
   priv->input_result = g_simple_async_result_new (G_OBJECT (connection),
     callback, user_data, wocky_xmpp_connection_recv_stanza_async);
 
@@ -1255,3 +1328,52 @@ wocky_xmpp_connection_set_sm_enabled (WockyXmppConnection *connection, gboolean
 {
   connection->priv->sm_enabled = sm;
 }
+
+/**
+ * wocky_xmpp_connection_set_sm_func:
+ * @connection: a #WockyXmppConnection
+ * @func: (allow-none): the function to report stream management requests
+ *  and acks to, or %NULL
+ * @user_data: data to pass to @func
+ *
+ * Makes stream management requests and acks received on @connection be
+ * reported to @func as they are read, rather than be returned by
+ * wocky_xmpp_connection_recv_stanza_async(); see
+ * wocky_xmpp_reader_set_sm_func().
+ */
+void
+wocky_xmpp_connection_set_sm_func (WockyXmppConnection *connection,
+    WockyXmppReaderSmFunc func,
+    gpointer user_data)
+{
+  wocky_xmpp_reader_set_sm_func (connection->priv->reader, func, user_data);
+}
+
+/**
+ * wocky_xmpp_connection_set_limits:
+ * @connection: a #WockyXmppConnection
+ * @max_stanza_size: the most bytes of names, attribute values and text a
+ *  stanza may have, or 0
+ * @max_depth: how deeply elements may be nested in a stanza, or 0
+ * @max_attributes: the most attributes an element may have, or 0
+ * @max_children: the most children an element may have, or 0
+ *
+ * Bounds the memory a stanza received on @connection can take up: as soon
+ * as one goes over a limit, receiving fails with
+ * %WOCKY_XMPP_READER_ERROR_LIMIT_EXCEEDED. A limit of 0 means none. See
+ * #WockyXmppReader:max-stanza-size and the other limits of the reader.
+ */
+void
+wocky_xmpp_connection_set_limits (WockyXmppConnection *connection,
+    guint max_stanza_size,
+    guint max_depth,
+    guint max_attributes,
+    guint max_children)
+{
+  g_object_set (connection->priv->reader,
+      "max-stanza-size", max_stanza_size,
+      "max-depth", max_depth,
+      "max-attributes", max_attributes,
+      "max-children", max_children,
+      NULL);
+}
@@ -27,6 +27,7 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 #include "wocky-stanza.h"
+#include "wocky-xmpp-reader.h"
 
 G_BEGIN_DECLS
 
@@ -104,6 +105,7 @@ GType wocky_xmpp_connection_get_type (void);
    WockyXmppConnectionClass))
 
 WockyXmppConnection *wocky_xmpp_connection_new (GIOStream *stream);
+WockyXmppConnection *wocky_xmpp_connection_new_pooled (GIOStream *stream);
 
 void wocky_xmpp_connection_send_open_async (WockyXmppConnection *connection,
     const gchar *to,
@@ -195,6 +197,14 @@ void wocky_xmpp_connection_set_stanza_recv_count (WockyXmppConnection *connectio
 
 gboolean wocky_xmpp_connection_get_sm_enabled (WockyXmppConnection *connection);
 void wocky_xmpp_connection_set_sm_enabled (WockyXmppConnection *connection, gboolean sm);
+void wocky_xmpp_connection_set_sm_func (WockyXmppConnection *connection,
+    WockyXmppReaderSmFunc func,
+    gpointer user_data);
+void wocky_xmpp_connection_set_limits (WockyXmppConnection *connection,
+    guint max_stanza_size,
+    guint max_depth,
+    guint max_attributes,
+    guint max_children);
 G_END_DECLS
 
 #endif /* #ifndef __WOCKY_XMPP_CONNECTION_H__*/
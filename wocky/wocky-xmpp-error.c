@@ -28,6 +28,7 @@
 #include <stdio.h>
 
 #include "wocky-namespaces.h"
+#include "wocky-node-private.h"
 #include "wocky-utils.h"
 
 /* Definitions of XMPP core stanza errors, as per RFC 3920 §9.3; plus the
@@ -357,6 +358,8 @@ xmpp_error_from_node_for_ns (
 {
   GSList *l;
 
+  _wocky_node_ensure_children (node);
+
   for (l = node->children; l != NULL; l = l->next)
     {
       WockyNode *child = l->data;
@@ -474,6 +477,8 @@ wocky_xmpp_error_extract (WockyNode *error,
         }
     }
 
+  _wocky_node_ensure_children (error);
+
   for (l = error->children; l != NULL; l = g_slist_next (l))
     {
       WockyNode *child = l->data;
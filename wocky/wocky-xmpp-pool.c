@@ -0,0 +1,138 @@
+/*
+ * wocky-xmpp-pool.c - Source for recycling XMPP readers and writers
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Link-local XMPP sets up a connection, with its own reader and writer, for
+ * every contact we exchange a few stanzas with, and drops it again shortly
+ * after. Connections created with WockyXmppConnection:pooled hand their
+ * reader and writer back here when they go away, so that the next one can
+ * reuse the parser context and buffers rather than build them again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-xmpp-pool.h"
+
+/* Pairs kept for later; more than this many connections going away at once
+ * are freed as usual */
+#define POOL_SIZE 8
+
+typedef struct
+{
+  WockyXmppReader *reader;
+  WockyXmppWriter *writer;
+} Pair;
+
+G_LOCK_DEFINE_STATIC (pool);
+
+/* Only accessed with the lock held */
+static Pair pool[POOL_SIZE];
+static guint pooled = 0;
+
+void
+wocky_xmpp_pool_take (WockyXmppReader **reader,
+    WockyXmppWriter **writer)
+{
+  G_LOCK (pool);
+
+  if (pooled > 0)
+    {
+      pooled--;
+      *reader = pool[pooled].reader;
+      *writer = pool[pooled].writer;
+      pool[pooled].reader = NULL;
+      pool[pooled].writer = NULL;
+    }
+  else
+    {
+      *reader = NULL;
+      *writer = NULL;
+    }
+
+  G_UNLOCK (pool);
+
+  if (*reader == NULL)
+    {
+      *reader = wocky_xmpp_reader_new ();
+      *writer = wocky_xmpp_writer_new ();
+    }
+}
+
+void
+wocky_xmpp_pool_give (WockyXmppReader *reader,
+    WockyXmppWriter *writer)
+{
+  gboolean kept = FALSE;
+
+  /* Someone else still using either of them would see its state reset
+   * under their feet */
+  if (G_OBJECT (reader)->ref_count == 1 &&
+      G_OBJECT (writer)->ref_count == 1 &&
+      wocky_xmpp_reader_recycle (reader) &&
+      wocky_xmpp_writer_recycle (writer))
+    {
+      G_LOCK (pool);
+
+      if (pooled < POOL_SIZE)
+        {
+          pool[pooled].reader = reader;
+          pool[pooled].writer = writer;
+          pooled++;
+          kept = TRUE;
+        }
+
+      G_UNLOCK (pool);
+    }
+
+  if (!kept)
+    {
+      g_object_unref (reader);
+      g_object_unref (writer);
+    }
+}
+
+void
+wocky_xmpp_pool_clear (void)
+{
+  Pair kept[POOL_SIZE];
+  guint n, i;
+
+  G_LOCK (pool);
+
+  n = pooled;
+
+  for (i = 0; i < n; i++)
+    {
+      kept[i] = pool[i];
+      pool[i].reader = NULL;
+      pool[i].writer = NULL;
+    }
+
+  pooled = 0;
+
+  G_UNLOCK (pool);
+
+  for (i = 0; i < n; i++)
+    {
+      g_object_unref (kept[i].reader);
+      g_object_unref (kept[i].writer);
+    }
+}
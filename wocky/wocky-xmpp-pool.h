@@ -0,0 +1,55 @@
+/*
+ * wocky-xmpp-pool.h - Header for recycling XMPP readers and writers
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_XMPP_POOL_H
+#define WOCKY_XMPP_POOL_H
+
+#include <glib-object.h>
+
+#include "wocky-xmpp-reader.h"
+#include "wocky-xmpp-writer.h"
+
+G_BEGIN_DECLS
+
+/* Sets @reader and @writer to new references to a streaming-mode pair, as
+ * wocky_xmpp_reader_new() and wocky_xmpp_writer_new() would return, taken
+ * from the pool if it has one */
+void wocky_xmpp_pool_take (WockyXmppReader **reader,
+    WockyXmppWriter **writer);
+
+/* Steals the references to @reader and @writer, keeping them for the next
+ * wocky_xmpp_pool_take() if nobody else holds them and the pool isn't full */
+void wocky_xmpp_pool_give (WockyXmppReader *reader,
+    WockyXmppWriter *writer);
+
+/* Frees every pair the pool kept. Called by wocky_deinit(), before libxml2
+ * is cleaned up, since the readers hold parser contexts. */
+void wocky_xmpp_pool_clear (void);
+
+/* Implemented by the reader and writer: reset to the state of a new object,
+ * or return FALSE if the object isn't one the pool should keep */
+gboolean wocky_xmpp_reader_recycle (WockyXmppReader *reader);
+gboolean wocky_xmpp_writer_recycle (WockyXmppWriter *writer);
+
+G_END_DECLS
+
+#endif /* WOCKY_XMPP_POOL_H */
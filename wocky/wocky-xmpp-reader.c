@@ -38,16 +38,23 @@
 #include <libxml/parser.h>
 
 #include "wocky-xmpp-reader.h"
+#include "wocky-xmpp-pool.h"
+#include "wocky-xmpp-tokenizer.h"
 #include "wocky-signals-marshal.h"
 #include "wocky-utils.h"
 
 #include "wocky-namespaces.h"
 
 #include "wocky-stanza.h"
+#include "wocky-node-private.h"
 
 #define WOCKY_DEBUG_FLAG WOCKY_DEBUG_XMPP_READER
 #include "wocky-debug-internal.h"
 
+/* Past this many interned names, a reset drops the parser rather than keep
+ * carrying whatever a peer sent */
+#define MAX_DICT_SIZE 4096
+
 /* properties */
 enum {
   PROP_STREAMING_MODE = 1,
@@ -57,6 +64,12 @@ enum {
   PROP_VERSION,
   PROP_LANG,
   PROP_ID,
+  PROP_NATIVE_TOKENIZER,
+  PROP_LAZY_SUBTREES,
+  PROP_MAX_STANZA_SIZE,
+  PROP_MAX_DEPTH,
+  PROP_MAX_ATTRIBUTES,
+  PROP_MAX_CHILDREN,
 };
 
 G_DEFINE_TYPE (WockyXmppReader, wocky_xmpp_reader, G_TYPE_OBJECT)
@@ -74,6 +87,14 @@ static void _characters (void *user_data, const xmlChar *ch, int len);
 
 static void _error (void *user_data, xmlErrorPtr error);
 
+static void native_start_element (gpointer user_data, const gchar *localname,
+    const gchar *prefix, const gchar *uri, gint n_attributes,
+    const gchar **attributes);
+static void native_end_element (gpointer user_data);
+static void native_characters (gpointer user_data, const gchar *text,
+    gsize len);
+static void native_error (gpointer user_data, const gchar *message);
+
 static xmlSAXHandler parser_handler = {
   /* internalSubset         */ NULL,
   /* isStandalone           */ NULL,
@@ -109,14 +130,63 @@ static xmlSAXHandler parser_handler = {
   /* serror                 */ _error
 };
 
+static const WockyXmppTokenizerFuncs tokenizer_funcs = {
+  native_start_element,
+  native_end_element,
+  native_characters,
+  native_error
+};
+
+/* A stream management request or ack, to be reported in stream order: once
+ * the stanzas which came before it have been popped */
+typedef struct
+{
+  WockyStanzaType type;
+  guint h;
+  /* how many of the stanzas queued before it are still to be popped */
+  guint ahead;
+} SmEvent;
+
+typedef struct
+{
+  guint id;
+  GQuark ns;
+  gchar *name;
+  gboolean base64;
+  WockyXmppReaderContentFunc func;
+  gpointer user_data;
+  GDestroyNotify notify;
+} ContentSink;
+
+typedef struct
+{
+  guint id;
+  /* the top-level element, or NULL for any */
+  gchar *name;
+  GQuark ns;
+  /* the namespace of its first child, or 0 for any */
+  GQuark child_ns;
+  gchar *attribute;
+  gchar *value;
+  /* whether the stanza being held matched everything but child_ns */
+  gboolean candidate;
+} StanzaFilter;
+
 /* private structure */
 struct _WockyXmppReaderPrivate
 {
   xmlParserCtxtPtr parser;
+  /* used instead of parser if native_tokenizer is set */
+  gboolean native_tokenizer;
+  WockyXmppTokenizer *tokenizer;
+  gboolean lazy_subtrees;
   guint depth;
   WockyStanza *stanza;
   WockyNode *node;
   GQueue *nodes;
+  /* text received for text_node, which is node or NULL */
+  WockyNodeText text;
+  WockyNode *text_node;
   gchar *to;
   gchar *from;
   gchar *version;
@@ -129,6 +199,64 @@ struct _WockyXmppReaderPrivate
   GQueue *stanzas;
   WockyXmppReaderState state;
   guint stanza_recv_count;
+
+  WockyXmppReaderSmFunc sm_func;
+  gpointer sm_data;
+  /* The stream management element being skipped, or
+   * WOCKY_STANZA_TYPE_NONE */
+  WockyStanzaType sideband;
+  guint sideband_h;
+  /* SmEvent */
+  GArray *sm_events;
+
+  /* owned ContentSink */
+  GSList *sinks;
+  guint last_sink_id;
+  /* the sink the text of sink_node goes to, if any */
+  ContentSink *sink;
+  WockyNode *sink_node;
+  gsize sink_length;
+  gint sink_state;
+  guint sink_save;
+  GByteArray *sink_buffer;
+
+  /* owned StanzaFilter */
+  GSList *filters;
+  guint last_filter_id;
+  guint filtered_count;
+  /* whether the rest of a rejected stanza is being skipped, and whether it
+   * counts as a received stanza */
+  gboolean filtering;
+  gboolean filtering_counts;
+  /* The top-level element held back until its first child says whether the
+   * stanza is wanted: its name, namespace and attributes are NUL-terminated
+   * strings in held_buffer, at the offsets in held_offsets (-1 for NULL),
+   * and the text before the child is in text */
+  gboolean held;
+  gboolean held_text;
+  GByteArray *held_buffer;
+  GArray *held_offsets;
+  GPtrArray *held_attributes;
+
+  /* In lazy-subtrees mode, what is below the child of the top-level element
+   * being parsed, and how deep into it the parser is */
+  GByteArray *record;
+  guint record_depth;
+
+  /* limits on each stanza, or 0 */
+  guint max_stanza_size;
+  guint max_depth;
+  guint max_attributes;
+  guint max_children;
+  /* the size of the stanza being parsed so far, and the number of children
+   * of each of its elements which haven't ended yet, outermost first */
+  gsize stanza_size;
+  GArray *open_children;
+  /* the most reached since the reader was created */
+  gsize peak_stanza_size;
+  guint peak_depth;
+  guint peak_attributes;
+  guint peak_children;
 };
 
 /**
@@ -149,12 +277,54 @@ wocky_xmpp_reader_error_quark (void)
   return quark;
 }
 
+static void
+content_sink_free (ContentSink *sink)
+{
+  if (sink->notify != NULL)
+    sink->notify (sink->user_data);
+
+  g_free (sink->name);
+  g_slice_free (ContentSink, sink);
+}
+
+static void
+stanza_filter_free (StanzaFilter *filter)
+{
+  g_free (filter->name);
+  g_free (filter->attribute);
+  g_free (filter->value);
+  g_slice_free (StanzaFilter, filter);
+}
+
+static void
+sink_finish (WockyXmppReader *self)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  ContentSink *sink = priv->sink;
+  WockyNode *node = priv->sink_node;
+  gchar *length;
+
+  priv->sink = NULL;
+  priv->sink_node = NULL;
+
+  sink->func (self, priv->stanza, node, NULL, 0, sink->user_data);
+
+  length = g_strdup_printf ("%" G_GSIZE_FORMAT, priv->sink_length);
+  wocky_node_set_attribute_ns (node, "length", length,
+      WOCKY_XMPP_READER_NS_STREAMED);
+  g_free (length);
+}
+
 /* clear parser state */
 static void
 wocky_xmpp_reader_clear_parser_state (WockyXmppReader *self)
 {
   WockyXmppReaderPrivate *priv = self->priv;
 
+  /* before the stanza the element is in goes */
+  if (priv->sink != NULL)
+    sink_finish (self);
+
   while (!g_queue_is_empty (priv->stanzas)) {
     gpointer stanza;
     stanza = g_queue_pop_head (priv->stanzas);
@@ -170,6 +340,9 @@ wocky_xmpp_reader_clear_parser_state (WockyXmppReader *self)
   priv->node = NULL;
   priv->depth = 0;
 
+  _wocky_node_text_reset (&priv->text);
+  priv->text_node = NULL;
+
   g_free (priv->to);
   priv->to = NULL;
 
@@ -189,9 +362,20 @@ wocky_xmpp_reader_clear_parser_state (WockyXmppReader *self)
     g_error_free (priv->error);
   priv->error = NULL;
 
-  if (priv->parser != NULL)
-    xmlFreeParserCtxt (priv->parser);
-  priv->parser = NULL;
+  priv->sideband = WOCKY_STANZA_TYPE_NONE;
+  g_array_set_size (priv->sm_events, 0);
+
+  priv->filtering = FALSE;
+  priv->held = FALSE;
+  priv->held_text = FALSE;
+
+  if (priv->record != NULL)
+    g_byte_array_unref (priv->record);
+  priv->record = NULL;
+  priv->record_depth = 0;
+
+  priv->stanza_size = 0;
+  g_array_set_size (priv->open_children, 0);
 
   priv->state = WOCKY_XMPP_READER_STATE_CLOSED;
 }
@@ -201,10 +385,36 @@ wocky_init_xml_parser (WockyXmppReader *obj)
 {
   WockyXmppReaderPrivate *priv = obj->priv;
 
-  priv->parser = xmlCreatePushParserCtxt (&parser_handler, obj, NULL, 0, NULL);
-  xmlCtxtUseOptions (priv->parser, XML_PARSE_NOENT);
   priv->state = priv->stream_mode ? WOCKY_XMPP_READER_STATE_INITIAL :
       WOCKY_XMPP_READER_STATE_OPENED;
+
+  if (priv->native_tokenizer)
+    {
+      if (priv->tokenizer == NULL)
+        priv->tokenizer = wocky_xmpp_tokenizer_new (&tokenizer_funcs, obj);
+      else
+        wocky_xmpp_tokenizer_reset (priv->tokenizer);
+
+      return;
+    }
+
+  /* Streams are restarted after STARTTLS and SASL: resetting the parser in
+   * place keeps its buffers and the dictionary of element and attribute
+   * names, which is mostly the same from one stream to the next */
+  if (priv->parser != NULL &&
+      xmlDictSize (priv->parser->dict) > MAX_DICT_SIZE)
+    {
+      xmlFreeParserCtxt (priv->parser);
+      priv->parser = NULL;
+    }
+
+  if (priv->parser == NULL)
+    priv->parser = xmlCreatePushParserCtxt (&parser_handler, obj, NULL, 0,
+        NULL);
+  else
+    xmlCtxtResetPush (priv->parser, NULL, 0, NULL, NULL);
+
+  xmlCtxtUseOptions (priv->parser, XML_PARSE_NOENT);
 }
 
 static void
@@ -225,6 +435,14 @@ wocky_xmpp_reader_init (WockyXmppReader *self)
   priv->nodes = g_queue_new ();
   priv->stanzas = g_queue_new ();
   priv->stanza_recv_count = 0;
+  priv->sideband = WOCKY_STANZA_TYPE_NONE;
+  priv->sm_events = g_array_new (FALSE, FALSE, sizeof (SmEvent));
+  _wocky_node_text_init (&priv->text);
+  priv->sink_buffer = g_byte_array_new ();
+  priv->held_buffer = g_byte_array_new ();
+  priv->held_offsets = g_array_new (FALSE, FALSE, sizeof (gssize));
+  priv->held_attributes = g_ptr_array_new ();
+  priv->open_children = g_array_new (FALSE, FALSE, sizeof (guint));
 }
 
 static void wocky_xmpp_reader_dispose (GObject *object);
@@ -301,6 +519,52 @@ wocky_xmpp_reader_class_init (WockyXmppReaderClass *wocky_xmpp_reader_class)
     NULL,
     G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_ID, param_spec);
+
+  param_spec = g_param_spec_boolean ("native-tokenizer", "native tokenizer",
+    "Whether to parse with Wocky's own tokenizer for the subset of XML "
+    "that XMPP uses, rather than with libxml2",
+    FALSE,
+    G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_NATIVE_TOKENIZER,
+    param_spec);
+
+  param_spec = g_param_spec_boolean ("lazy-subtrees", "lazy subtrees",
+    "Whether to only build the top-level element of each stanza and its "
+    "children while parsing, and build the rest when it is first looked at",
+    FALSE,
+    G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LAZY_SUBTREES,
+    param_spec);
+
+  param_spec = g_param_spec_uint ("max-stanza-size", "maximum stanza size",
+    "How many bytes of names, attribute values and text a stanza may have, "
+    "or 0 for no limit",
+    0, G_MAXUINT, 0,
+    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_STANZA_SIZE,
+    param_spec);
+
+  param_spec = g_param_spec_uint ("max-depth", "maximum depth",
+    "How deeply elements may be nested in a stanza, its top-level element "
+    "being at depth 1, or 0 for no limit",
+    0, G_MAXUINT, 0,
+    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_DEPTH,
+    param_spec);
+
+  param_spec = g_param_spec_uint ("max-attributes", "maximum attributes",
+    "How many attributes an element of a stanza may have, or 0 for no limit",
+    0, G_MAXUINT, 0,
+    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_ATTRIBUTES,
+    param_spec);
+
+  param_spec = g_param_spec_uint ("max-children", "maximum children",
+    "How many children an element of a stanza may have, or 0 for no limit",
+    0, G_MAXUINT, 0,
+    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_CHILDREN,
+    param_spec);
 }
 
 void
@@ -317,6 +581,20 @@ wocky_xmpp_reader_dispose (GObject *object)
   /* release any references held by the object here */
   wocky_xmpp_reader_clear_parser_state (self);
 
+  g_slist_free_full (priv->sinks, (GDestroyNotify) content_sink_free);
+  priv->sinks = NULL;
+
+  g_slist_free_full (priv->filters, (GDestroyNotify) stanza_filter_free);
+  priv->filters = NULL;
+
+  if (priv->parser != NULL)
+    xmlFreeParserCtxt (priv->parser);
+  priv->parser = NULL;
+
+  if (priv->tokenizer != NULL)
+    wocky_xmpp_tokenizer_free (priv->tokenizer);
+  priv->tokenizer = NULL;
+
   if (G_OBJECT_CLASS (wocky_xmpp_reader_parent_class)->dispose)
     G_OBJECT_CLASS (wocky_xmpp_reader_parent_class)->dispose (object);
 }
@@ -330,6 +608,13 @@ wocky_xmpp_reader_finalize (GObject *object)
   /* free any data held directly by the object here */
   g_queue_free (priv->stanzas);
   g_queue_free (priv->nodes);
+  g_array_unref (priv->sm_events);
+  _wocky_node_text_clear (&priv->text);
+  g_byte_array_unref (priv->sink_buffer);
+  g_byte_array_unref (priv->held_buffer);
+  g_array_unref (priv->held_offsets);
+  g_ptr_array_unref (priv->held_attributes);
+  g_array_unref (priv->open_children);
 
   if (priv->error != NULL)
     g_error_free (priv->error);
@@ -358,6 +643,24 @@ wocky_xmpp_reader_set_property (GObject *object,
         if (priv->default_namespace == NULL)
           priv->default_namespace = g_strdup ("");
 
+        break;
+      case PROP_NATIVE_TOKENIZER:
+        priv->native_tokenizer = g_value_get_boolean (value);
+        break;
+      case PROP_LAZY_SUBTREES:
+        priv->lazy_subtrees = g_value_get_boolean (value);
+        break;
+      case PROP_MAX_STANZA_SIZE:
+        priv->max_stanza_size = g_value_get_uint (value);
+        break;
+      case PROP_MAX_DEPTH:
+        priv->max_depth = g_value_get_uint (value);
+        break;
+      case PROP_MAX_ATTRIBUTES:
+        priv->max_attributes = g_value_get_uint (value);
+        break;
+      case PROP_MAX_CHILDREN:
+        priv->max_children = g_value_get_uint (value);
         break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -397,6 +700,24 @@ wocky_xmpp_reader_get_property (GObject *object,
       case PROP_ID:
         g_value_set_string (value, priv->id);
         break;
+      case PROP_NATIVE_TOKENIZER:
+        g_value_set_boolean (value, priv->native_tokenizer);
+        break;
+      case PROP_LAZY_SUBTREES:
+        g_value_set_boolean (value, priv->lazy_subtrees);
+        break;
+      case PROP_MAX_STANZA_SIZE:
+        g_value_set_uint (value, priv->max_stanza_size);
+        break;
+      case PROP_MAX_DEPTH:
+        g_value_set_uint (value, priv->max_depth);
+        break;
+      case PROP_MAX_ATTRIBUTES:
+        g_value_set_uint (value, priv->max_attributes);
+        break;
+      case PROP_MAX_CHILDREN:
+        g_value_set_uint (value, priv->max_children);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -602,158 +923,888 @@ handle_regular_element (
         }
      }
 
+  if (priv->sinks != NULL && priv->sink == NULL)
+    {
+      GSList *l;
+
+      for (l = priv->sinks; l != NULL; l = l->next)
+        {
+          ContentSink *sink = l->data;
+
+          if (sink->ns == priv->node->ns && !strcmp (sink->name, localname))
+            {
+              priv->sink = sink;
+              priv->sink_node = priv->node;
+              priv->sink_length = 0;
+              priv->sink_state = 0;
+              priv->sink_save = 0;
+              break;
+            }
+        }
+    }
+
   priv->depth++;
 }
 
-static void
-_start_element_ns (void *user_data, const xmlChar *localname,
-    const xmlChar *prefix, const xmlChar *ns_uri, int nb_namespaces,
-    const xmlChar **namespaces, int nb_attributes, int nb_defaulted,
-    const xmlChar **attributes)
+/* Parses the h attribute of an ack, which isn't NUL-terminated */
+static gboolean
+parse_h (const gchar *value,
+    gsize len,
+    guint *h)
 {
-  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
-  WockyXmppReaderPrivate *priv = self->priv;
-  gchar *uri = NULL;
+  guint64 n = 0;
+  gsize i;
 
-  if (ns_uri != NULL)
-    uri = g_strstrip (g_strdup ((const gchar *) ns_uri));
+  if (len == 0 || len > 10)
+    return FALSE;
 
-  if (priv->stream_mode && G_UNLIKELY (priv->depth == 0))
-    handle_stream_open (self, (const gchar *) localname, uri,
-        (const gchar *) prefix, nb_attributes, attributes);
-  else
-    handle_regular_element (self, (const gchar *) localname, uri,
-        nb_attributes, attributes);
+  for (i = 0; i < len; i++)
+    {
+      if (!g_ascii_isdigit (value[i]))
+        return FALSE;
 
-  g_free (uri);
+      n = n * 10 + (value[i] - '0');
+    }
+
+  if (n > G_MAXUINT)
+    return FALSE;
+
+  *h = n;
+  return TRUE;
 }
 
-static void
-_characters (void *user_data, const xmlChar *ch, int len)
+/* Stream management requests and acks are the most frequent elements on a
+ * stream where it is enabled, and carry next to nothing: rather than build
+ * a stanza for them, the reader notes what they say and reports it to the
+ * sm_func. Returns FALSE if the element isn't one of them, or not one which
+ * can be summed up that way. */
+static gboolean
+sideband_start (WockyXmppReader *self,
+    const gchar *localname,
+    const gchar *uri,
+    int nb_attributes,
+    const xmlChar **attributes)
 {
-  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
   WockyXmppReaderPrivate *priv = self->priv;
+  int i;
+
+  if (wocky_strdiff (uri, WOCKY_XMPP_NS_STREAM_MANAGEMENT))
+    return FALSE;
 
-  if (priv->node != NULL)
+  if (!strcmp (localname, "r"))
     {
-      wocky_node_append_content_n (priv->node, (const gchar *)ch,
-          (gsize)len);
+      priv->sideband = WOCKY_STANZA_TYPE_SM_R;
+      priv->sideband_h = 0;
+      return TRUE;
+    }
+
+  if (strcmp (localname, "a"))
+    return FALSE;
+
+  for (i = 0; i < nb_attributes * 5; i+=5)
+    {
+      const gchar *attr_name = (const gchar *) attributes[i];
+      const gchar *attr_uri = (const gchar *) attributes[i+2];
+      gsize value_len = attributes[i+4] - attributes[i+3];
+
+      if (attr_uri == NULL && !strcmp (attr_name, "h"))
+        {
+          if (!parse_h ((const gchar *) attributes[i+3], value_len,
+                  &priv->sideband_h))
+            return FALSE;
+
+          priv->sideband = WOCKY_STANZA_TYPE_SM_A;
+          return TRUE;
+        }
     }
+
+  return FALSE;
 }
 
+/* Stops parsing, a stanza having gone over one of the limits */
+static void limit_exceeded (WockyXmppReader *self,
+    const gchar *format,
+    ...) G_GNUC_PRINTF (2, 3);
+
 static void
-_end_element_ns (void *user_data, const xmlChar *localname,
-    const xmlChar *prefix, const xmlChar *uri)
+limit_exceeded (WockyXmppReader *self,
+    const gchar *format,
+    ...)
 {
-  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
   WockyXmppReaderPrivate *priv = self->priv;
+  va_list ap;
 
-  priv->depth--;
+  if (priv->error != NULL)
+    return;
 
-  if (priv->stream_mode && priv->depth == 0)
+  va_start (ap, format);
+  priv->error = g_error_new_valist (WOCKY_XMPP_READER_ERROR,
+      WOCKY_XMPP_READER_ERROR_LIMIT_EXCEEDED, format, ap);
+  va_end (ap);
+
+  DEBUG ("%s", priv->error->message);
+  g_queue_push_tail (priv->stanzas, NULL);
+
+  if (priv->parser != NULL)
+    xmlStopParser (priv->parser);
+}
+
+/* Accounts for @size more bytes of the stanza being parsed; returns FALSE if
+ * that's too many */
+static gboolean
+add_stanza_size (WockyXmppReader *self,
+    gsize size)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+
+  priv->stanza_size += size;
+  priv->peak_stanza_size = MAX (priv->peak_stanza_size, priv->stanza_size);
+
+  if (priv->max_stanza_size > 0 && priv->stanza_size > priv->max_stanza_size)
     {
-      DEBUG ("Stream ended");
-      g_queue_push_tail (priv->stanzas, NULL);
+      limit_exceeded (self, "Stanza larger than %u bytes",
+          priv->max_stanza_size);
+      return FALSE;
     }
-  else if (priv->depth == (priv->stream_mode ? 1 : 0))
+
+  return TRUE;
+}
+
+/* Checks an element of a stanza against the limits as it starts, whether it
+ * is to be built or not; returns FALSE if it goes over one of them */
+static gboolean
+check_element_limits (WockyXmppReader *self,
+    const gchar *localname,
+    int nb_attributes,
+    const xmlChar **attributes)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  guint depth = priv->open_children->len + 1;
+  guint none = 0;
+  gsize size = strlen (localname);
+  int i;
+
+  if (depth > 1)
     {
-      g_assert (g_queue_get_length (priv->nodes) == 0);
-      DEBUG_STANZA (priv->stanza, "Received stanza");
+      guint *siblings = &g_array_index (priv->open_children, guint,
+          depth - 2);
 
-      if ((!wocky_stanza_has_type (priv->stanza, WOCKY_STANZA_TYPE_SM_R))
-          && (!wocky_stanza_has_type (priv->stanza, WOCKY_STANZA_TYPE_SM_A)))
+      (*siblings)++;
+      priv->peak_children = MAX (priv->peak_children, *siblings);
+
+      if (priv->max_children > 0 && *siblings > priv->max_children)
         {
-          priv->stanza_recv_count ++;
+          limit_exceeded (self, "Element with more than %u children",
+              priv->max_children);
+          return FALSE;
         }
+    }
 
-      wocky_stanza_set_recv_count (priv->stanza, priv->stanza_recv_count);
-
-      g_queue_push_tail (priv->stanzas, priv->stanza);
+  g_array_append_val (priv->open_children, none);
+  priv->peak_depth = MAX (priv->peak_depth, depth);
 
-      priv->stanza = NULL;
-      priv->node = NULL;
+  if (priv->max_depth > 0 && depth > priv->max_depth)
+    {
+      limit_exceeded (self, "Stanza nested deeper than %u elements",
+          priv->max_depth);
+      return FALSE;
     }
-  else
+
+  priv->peak_attributes = MAX (priv->peak_attributes, (guint) nb_attributes);
+
+  if (priv->max_attributes > 0 && (guint) nb_attributes > priv->max_attributes)
     {
-      priv->node = (WockyNode *) g_queue_pop_tail (priv->nodes);
+      limit_exceeded (self, "Element with more than %u attributes",
+          priv->max_attributes);
+      return FALSE;
     }
+
+  for (i = 0; i < nb_attributes * 5; i+=5)
+    size += strlen ((const gchar *) attributes[i]) +
+        (attributes[i+4] - attributes[i+3]);
+
+  return add_stanza_size (self, size);
 }
 
+/* Moves the text gathered so far into the node it was received for */
 static void
-_error (void *user_data, xmlErrorPtr error)
+flush_text (WockyXmppReader *self)
 {
-  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
   WockyXmppReaderPrivate *priv = self->priv;
 
-  if (error->level < XML_ERR_FATAL)
+  if (priv->text_node != NULL)
     {
-      DEBUG ("Ignoring parser %s: %s",
-       error->level == XML_ERR_WARNING ? "warning" : "recoverable error",
-       error->message);
-      return;
+      _wocky_node_text_finish (&priv->text, priv->text_node);
+      priv->text_node = NULL;
     }
-
-  priv->error = g_error_new_literal (WOCKY_XMPP_READER_ERROR,
-    WOCKY_XMPP_READER_ERROR_PARSE_ERROR, error->message);
-
-  DEBUG ("Parsing failed %s", error->message);
-  g_queue_push_tail (priv->stanzas, NULL);
 }
 
-/**
- * wocky_xmpp_reader_get_state:
- * @reader: a #WockyXmppReader
- *
- * Returns: The current state of the reader
- */
-WockyXmppReaderState
-wocky_xmpp_reader_get_state (WockyXmppReader *reader)
+static gboolean
+filter_attribute_matches (StanzaFilter *filter,
+    int nb_attributes,
+    const xmlChar **attributes)
 {
-  WockyXmppReaderPrivate *priv = reader->priv;
+  int i;
 
-  return priv->state;
+  if (filter->attribute == NULL)
+    return TRUE;
+
+  for (i = 0; i < nb_attributes * 5; i+=5)
+    {
+      const gchar *attr_name = (const gchar *) attributes[i];
+      const gchar *attr_uri = (const gchar *) attributes[i+2];
+      /* Not NULL-terminated! */
+      const gchar *attr_value = (const gchar *) attributes[i+3];
+      gsize value_len = attributes[i+4] - attributes[i+3];
+
+      if (attr_uri == NULL && !strcmp (attr_name, filter->attribute))
+        return filter->value == NULL ||
+            (strlen (filter->value) == value_len &&
+             !memcmp (filter->value, attr_value, value_len));
+    }
+
+  return FALSE;
 }
 
-/* When the end of stream is reached the parser puts a NULL entry on the
- * queue. When that's the only entry left, go into either closed or ready state
- * (depending if an error was hit)
- */
 static void
-wocky_xmpp_reader_check_eos (WockyXmppReader *reader)
+hold_string (WockyXmppReader *self,
+    const gchar *str,
+    gsize len)
 {
-  WockyXmppReaderPrivate *priv = reader->priv;
+  WockyXmppReaderPrivate *priv = self->priv;
+  gssize offset = -1;
 
-  if (!g_queue_is_empty (priv->stanzas)
-      && g_queue_peek_head (priv->stanzas) == NULL)
+  if (str != NULL)
     {
-      priv->state = priv->error ? WOCKY_XMPP_READER_STATE_ERROR :
-        WOCKY_XMPP_READER_STATE_CLOSED;
+      offset = priv->held_buffer->len;
+      g_byte_array_append (priv->held_buffer, (const guint8 *) str, len);
+      g_byte_array_append (priv->held_buffer, (const guint8 *) "", 1);
     }
+
+  g_array_append_val (priv->held_offsets, offset);
 }
 
-/**
- * wocky_xmpp_reader_push:
- * @reader: a WockyXmppReader
- * @data: Data to read
- * @length: Size of @data
- *
- * Push an amount of data to parse.
- */
-void
-wocky_xmpp_reader_push (WockyXmppReader *reader, const guint8 *data,
-    gsize length)
+/* Copies a top-level element out of the parser's buffers, to be built once
+ * its first child has been seen */
+static void
+hold_element (WockyXmppReader *self,
+    const gchar *localname,
+    const gchar *uri,
+    int nb_attributes,
+    const xmlChar **attributes)
 {
-  WockyXmppReaderPrivate *priv = reader->priv;
-  xmlParserCtxtPtr parser;
-
-  g_return_if_fail (priv->state < WOCKY_XMPP_READER_STATE_CLOSED);
+  WockyXmppReaderPrivate *priv = self->priv;
+  int i;
 
-#ifdef ENABLE_DEBUG
-  wocky_debug (WOCKY_DEBUG_NET, "Parsing chunk: %.*s", (int)length, data);
-#endif
+  g_byte_array_set_size (priv->held_buffer, 0);
+  g_array_set_size (priv->held_offsets, 0);
 
-  parser = priv->parser;
-  xmlParseChunk (parser, (const char*)data, length, FALSE);
+  hold_string (self, localname, strlen (localname));
+  hold_string (self, uri, uri != NULL ? strlen (uri) : 0);
+
+  for (i = 0; i < nb_attributes * 5; i+=5)
+    {
+      const gchar *attr_name = (const gchar *) attributes[i];
+      const gchar *attr_prefix = (const gchar *) attributes[i+1];
+      const gchar *attr_uri = (const gchar *) attributes[i+2];
+      gsize value_len = attributes[i+4] - attributes[i+3];
+      gssize value_end;
+
+      hold_string (self, attr_name, strlen (attr_name));
+      hold_string (self, attr_prefix,
+          attr_prefix != NULL ? strlen (attr_prefix) : 0);
+      hold_string (self, attr_uri, attr_uri != NULL ? strlen (attr_uri) : 0);
+      hold_string (self, (const gchar *) attributes[i+3], value_len);
+      value_end = g_array_index (priv->held_offsets, gssize,
+          priv->held_offsets->len - 1) + value_len;
+      g_array_append_val (priv->held_offsets, value_end);
+    }
+
+  priv->held = TRUE;
+  priv->held_text = FALSE;
+}
+
+/* Builds the top-level element that was held back, as if it had just
+ * started, along with the text received since */
+static void
+release_held_element (WockyXmppReader *self)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  const gchar *base = (const gchar *) priv->held_buffer->data;
+  gssize *offsets = (gssize *) priv->held_offsets->data;
+  guint n = priv->held_offsets->len - 2;
+  guint i;
+
+  priv->held = FALSE;
+
+  g_ptr_array_set_size (priv->held_attributes, n);
+
+  for (i = 0; i < n; i++)
+    g_ptr_array_index (priv->held_attributes, i) =
+        offsets[i + 2] < 0 ? NULL : (gpointer) (base + offsets[i + 2]);
+
+  priv->depth--;
+  handle_regular_element (self, base + offsets[0],
+      offsets[1] < 0 ? NULL : base + offsets[1], n / 5,
+      (const xmlChar **) priv->held_attributes->pdata);
+
+  if (priv->held_text)
+    priv->text_node = priv->node;
+}
+
+static void
+reject_stanza (WockyXmppReader *self,
+    gboolean counts)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+
+  if (priv->held_text)
+    _wocky_node_text_reset (&priv->text);
+
+  priv->held = FALSE;
+  priv->held_text = FALSE;
+  priv->filtering = TRUE;
+  priv->filtering_counts = counts;
+  priv->depth++;
+}
+
+/* Runs the filters over an element, before anything is built for it.
+ * Returns TRUE if the element was rejected or held back, or FALSE if it
+ * should be built as usual. */
+static gboolean
+filter_element (WockyXmppReader *self,
+    const gchar *localname,
+    const gchar *uri,
+    int nb_attributes,
+    const xmlChar **attributes)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  GQuark ns = g_quark_try_string (uri);
+  gboolean hold = FALSE;
+  gboolean counts;
+  GSList *l;
+
+  /* The first child of a held element decides the rest */
+  if (priv->held)
+    {
+      for (l = priv->filters; l != NULL; l = l->next)
+        {
+          StanzaFilter *filter = l->data;
+
+          if (filter->candidate && filter->child_ns == ns)
+            {
+              reject_stanza (self, priv->filtering_counts);
+              return TRUE;
+            }
+        }
+
+      release_held_element (self);
+      flush_text (self);
+      return FALSE;
+    }
+
+  if (priv->filters == NULL || !priv->stream_mode || priv->depth != 1)
+    return FALSE;
+
+  /* Stream management requests and acks aren't stanzas, as far as the count
+   * of them is concerned */
+  counts = wocky_strdiff (uri, WOCKY_XMPP_NS_STREAM_MANAGEMENT) ||
+      (strcmp (localname, "r") && strcmp (localname, "a"));
+
+  for (l = priv->filters; l != NULL; l = l->next)
+    {
+      StanzaFilter *filter = l->data;
+
+      filter->candidate = FALSE;
+
+      if (filter->name != NULL &&
+          (filter->ns != ns || strcmp (filter->name, localname)))
+        continue;
+
+      if (!filter_attribute_matches (filter, nb_attributes, attributes))
+        continue;
+
+      if (filter->child_ns == 0)
+        {
+          reject_stanza (self, counts);
+          return TRUE;
+        }
+
+      filter->candidate = hold = TRUE;
+    }
+
+  if (!hold)
+    return FALSE;
+
+  hold_element (self, localname, uri, nb_attributes, attributes);
+  priv->filtering_counts = counts;
+  priv->depth++;
+  return TRUE;
+}
+
+static void
+_start_element_ns (void *user_data, const xmlChar *localname,
+    const xmlChar *prefix, const xmlChar *ns_uri, int nb_namespaces,
+    const xmlChar **namespaces, int nb_attributes, int nb_defaulted,
+    const xmlChar **attributes)
+{
+  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
+  WockyXmppReaderPrivate *priv = self->priv;
+  gchar *uri = NULL;
+
+  /* nothing more is built once an error has been found */
+  if (priv->error != NULL)
+    return;
+
+  flush_text (self);
+
+  if (!(priv->stream_mode && priv->depth == 0) &&
+      !check_element_limits (self, (const gchar *) localname, nb_attributes,
+          attributes))
+    return;
+
+  /* Anything inside a skipped element is skipped too */
+  if (priv->sideband != WOCKY_STANZA_TYPE_NONE || priv->filtering)
+    {
+      priv->depth++;
+      return;
+    }
+
+  if (priv->sm_func != NULL && priv->stream_mode && priv->depth == 1 &&
+      sideband_start (self, (const gchar *) localname,
+          (const gchar *) ns_uri, nb_attributes, attributes))
+    {
+      priv->depth++;
+      return;
+    }
+
+  if (ns_uri != NULL)
+    uri = g_strstrip (g_strdup ((const gchar *) ns_uri));
+
+  /* Below the children of the top-level element, a lazy reader only notes
+   * what it sees, for the child to build its descendants from later */
+  if (priv->record_depth > 0 || (priv->lazy_subtrees &&
+          priv->stanza != NULL && g_queue_get_length (priv->nodes) == 1))
+    {
+      if (priv->record == NULL)
+        priv->record = g_byte_array_new ();
+
+      _wocky_node_record_start (priv->record, (const gchar *) localname, uri,
+          nb_attributes, (const gchar **) attributes);
+      priv->record_depth++;
+      priv->depth++;
+    }
+  else if (priv->stream_mode && G_UNLIKELY (priv->depth == 0))
+    handle_stream_open (self, (const gchar *) localname, uri,
+        (const gchar *) prefix, nb_attributes, attributes);
+  else if (!filter_element (self, (const gchar *) localname, uri,
+          nb_attributes, attributes))
+    handle_regular_element (self, (const gchar *) localname, uri,
+        nb_attributes, attributes);
+
+  g_free (uri);
+}
+
+static void
+_characters (void *user_data, const xmlChar *ch, int len)
+{
+  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
+  WockyXmppReaderPrivate *priv = self->priv;
+
+  if (priv->error != NULL)
+    return;
+
+  if (priv->record_depth > 0)
+    {
+      if (add_stanza_size (self, len))
+        _wocky_node_record_text (priv->record, (const gchar *) ch, len);
+    }
+  else if (priv->sink != NULL && priv->node == priv->sink_node)
+    {
+      ContentSink *sink = priv->sink;
+      const guint8 *data = ch;
+      gsize size = len;
+
+      if (sink->base64)
+        {
+          g_byte_array_set_size (priv->sink_buffer, (len / 4) * 3 + 3);
+          size = g_base64_decode_step ((const gchar *) ch, len,
+              priv->sink_buffer->data, &priv->sink_state, &priv->sink_save);
+          data = priv->sink_buffer->data;
+        }
+
+      if (size > 0)
+        {
+          priv->sink_length += size;
+          sink->func (self, priv->stanza, priv->node, data, size,
+              sink->user_data);
+        }
+    }
+  else if (priv->held)
+    {
+      if (!add_stanza_size (self, len))
+        return;
+
+      priv->held_text = TRUE;
+      _wocky_node_text_append (&priv->text, (const gchar *)ch, (gsize)len);
+    }
+  else if (priv->node != NULL)
+    {
+      if (!add_stanza_size (self, len))
+        return;
+
+      priv->text_node = priv->node;
+      _wocky_node_text_append (&priv->text, (const gchar *)ch, (gsize)len);
+    }
+}
+
+static void
+_end_element_ns (void *user_data, const xmlChar *localname,
+    const xmlChar *prefix, const xmlChar *uri)
+{
+  WockyXmppReader *self = WOCKY_XMPP_READER (user_data);
+  WockyXmppReaderPrivate *priv = self->priv;
+
+  if (priv->error != NULL)
+    return;
+
+  if (priv->open_children->len > 0)
+    {
+      g_array_set_size (priv->open_children, priv->open_children->len - 1);
+
+      if (priv->open_children->len == 0)
+        priv->stanza_size = 0;
+    }
+
+  if (priv->record_depth > 0)
+    {
+      _wocky_node_record_end (priv->record);
+      priv->record_depth--;
+      priv->depth--;
+      return;
+    }
+
+  /* a held element without children can't have been filtered out */
+  if (priv->held)
+    release_held_element (self);
+
+  flush_text (self);
+
+  if (priv->sink != NULL && priv->node == priv->sink_node)
+    sink_finish (self);
+
+  priv->depth--;
+
+  if (priv->sideband != WOCKY_STANZA_TYPE_NONE)
+    {
+      if (priv->depth == 1)
+        {
+          SmEvent event = { priv->sideband, priv->sideband_h,
+              g_queue_get_length (priv->stanzas) };
+
+          /* A request is answered with the count as of when it arrived */
+          if (event.type == WOCKY_STANZA_TYPE_SM_R)
+            event.h = priv->stanza_recv_count;
+
+          g_array_append_val (priv->sm_events, event);
+          priv->sideband = WOCKY_STANZA_TYPE_NONE;
+        }
+
+      return;
+    }
+
+  if (priv->filtering)
+    {
+      if (priv->depth == 1)
+        {
+          if (priv->filtering_counts)
+            priv->stanza_recv_count++;
+
+          priv->filtered_count++;
+          priv->filtering = FALSE;
+        }
+
+      return;
+    }
+
+  if (priv->stream_mode && priv->depth == 0)
+    {
+      DEBUG ("Stream ended");
+      g_queue_push_tail (priv->stanzas, NULL);
+    }
+  else if (priv->depth == (priv->stream_mode ? 1 : 0))
+    {
+      g_assert (g_queue_get_length (priv->nodes) == 0);
+      DEBUG_STANZA (priv->stanza, "Received stanza");
+
+      if ((!wocky_stanza_has_type (priv->stanza, WOCKY_STANZA_TYPE_SM_R))
+          && (!wocky_stanza_has_type (priv->stanza, WOCKY_STANZA_TYPE_SM_A)))
+        {
+          priv->stanza_recv_count ++;
+        }
+
+      wocky_stanza_set_recv_count (priv->stanza, priv->stanza_recv_count);
+
+      g_queue_push_tail (priv->stanzas, priv->stanza);
+
+      priv->stanza = NULL;
+      priv->node = NULL;
+    }
+  else
+    {
+      if (priv->record != NULL)
+        {
+          _wocky_node_set_record (priv->node, priv->record);
+          priv->record = NULL;
+        }
+
+      priv->node = (WockyNode *) g_queue_pop_tail (priv->nodes);
+    }
+}
+
+static void
+parse_error (WockyXmppReader *self,
+    const gchar *message)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+
+  priv->error = g_error_new_literal (WOCKY_XMPP_READER_ERROR,
+    WOCKY_XMPP_READER_ERROR_PARSE_ERROR, message);
+
+  DEBUG ("Parsing failed %s", message);
+  g_queue_push_tail (priv->stanzas, NULL);
+}
+
+static void
+_error (void *user_data, xmlErrorPtr error)
+{
+  if (error->level < XML_ERR_FATAL)
+    {
+      DEBUG ("Ignoring parser %s: %s",
+       error->level == XML_ERR_WARNING ? "warning" : "recoverable error",
+       error->message);
+      return;
+    }
+
+  parse_error (WOCKY_XMPP_READER (user_data), error->message);
+}
+
+/* The native tokenizer reports what it finds the way libxml2 does, so it goes
+ * through the same handlers */
+static void
+native_start_element (gpointer user_data,
+    const gchar *localname,
+    const gchar *prefix,
+    const gchar *uri,
+    gint n_attributes,
+    const gchar **attributes)
+{
+  _start_element_ns (user_data, (const xmlChar *) localname,
+      (const xmlChar *) prefix, (const xmlChar *) uri, 0, NULL,
+      n_attributes, 0, (const xmlChar **) attributes);
+}
+
+static void
+native_end_element (gpointer user_data)
+{
+  _end_element_ns (user_data, NULL, NULL, NULL);
+}
+
+static void
+native_characters (gpointer user_data,
+    const gchar *text,
+    gsize len)
+{
+  _characters (user_data, (const xmlChar *) text, len);
+}
+
+static void
+native_error (gpointer user_data,
+    const gchar *message)
+{
+  parse_error (WOCKY_XMPP_READER (user_data), message);
+}
+
+/**
+ * wocky_xmpp_reader_get_state:
+ * @reader: a #WockyXmppReader
+ *
+ * Returns: The current state of the reader
+ */
+WockyXmppReaderState
+wocky_xmpp_reader_get_state (WockyXmppReader *reader)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  return priv->state;
+}
+
+/* When the end of stream is reached the parser puts a NULL entry on the
+ * queue. When that's the only entry left, go into either closed or ready state
+ * (depending if an error was hit)
+ */
+static void
+wocky_xmpp_reader_check_eos (WockyXmppReader *reader)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  if (!g_queue_is_empty (priv->stanzas)
+      && g_queue_peek_head (priv->stanzas) == NULL)
+    {
+      priv->state = priv->error ? WOCKY_XMPP_READER_STATE_ERROR :
+        WOCKY_XMPP_READER_STATE_CLOSED;
+    }
+}
+
+/* Whitespace keepalives sent between stanzas mean nothing to the reader, so
+ * there is no need to wake the parser up for them; but only when it isn't
+ * holding on to the start of a tag, where whitespace does matter */
+static gboolean
+is_keepalive (WockyXmppReader *self,
+    const guint8 *data,
+    gsize length)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  gsize i;
+
+  if (!priv->stream_mode || priv->depth != 1 ||
+      priv->state != WOCKY_XMPP_READER_STATE_OPENED)
+    return FALSE;
+
+  if (priv->native_tokenizer)
+    {
+      if (!wocky_xmpp_tokenizer_is_idle (priv->tokenizer))
+        return FALSE;
+    }
+  else
+    {
+      xmlParserInputPtr input = priv->parser->input;
+
+      if (priv->parser->instate != XML_PARSER_CONTENT ||
+          input == NULL || input->cur != input->end)
+        return FALSE;
+    }
+
+  for (i = 0; i < length; i++)
+    {
+      if (data[i] != ' ' && data[i] != '\t' && data[i] != '\r' &&
+          data[i] != '\n')
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Text and markup which the parser is holding on to, the end of the token
+ * they're part of not having arrived yet, count towards the size of the
+ * stanza too: otherwise a stanza could grow without bounds by never ending
+ * its start tag */
+static void
+check_buffered_size (WockyXmppReader *self)
+{
+  WockyXmppReaderPrivate *priv = self->priv;
+  gsize buffered = 0;
+
+  if (priv->native_tokenizer)
+    {
+      buffered = wocky_xmpp_tokenizer_get_pending_size (priv->tokenizer);
+    }
+  else if (priv->parser->input != NULL)
+    {
+      xmlParserInputPtr input = priv->parser->input;
+
+      buffered = input->end - input->cur;
+    }
+
+  if (priv->stanza_size + buffered > priv->max_stanza_size)
+    limit_exceeded (self, "Stanza larger than %u bytes",
+        priv->max_stanza_size);
+}
+
+/**
+ * wocky_xmpp_reader_emit_sm_events:
+ * @reader: a #WockyXmppReader
+ *
+ * Reports the stream management requests and acks which came after stanzas
+ * that have all been popped already to the function set with
+ * wocky_xmpp_reader_set_sm_func(). Whoever pops the stanzas calls this once
+ * it's done with the last one and ready for more, so that a request is only
+ * answered once the stanzas before it have been handled.
+ * wocky_xmpp_reader_push() and wocky_xmpp_reader_pop_stanza() call it too.
+ */
+void
+wocky_xmpp_reader_emit_sm_events (WockyXmppReader *reader)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  if (priv->sm_events->len == 0 ||
+      g_array_index (priv->sm_events, SmEvent, 0).ahead > 0)
+    return;
+
+  /* the callback may well drop the last reference to whoever owns us */
+  g_object_ref (reader);
+
+  while (priv->sm_events->len > 0 && priv->sm_func != NULL)
+    {
+      SmEvent event = g_array_index (priv->sm_events, SmEvent, 0);
+
+      if (event.ahead > 0)
+        break;
+
+      g_array_remove_index (priv->sm_events, 0);
+      priv->sm_func (reader, event.type, event.h, priv->sm_data);
+    }
+
+  if (priv->sm_func == NULL)
+    g_array_set_size (priv->sm_events, 0);
+
+  g_object_unref (reader);
+}
+
+/**
+ * wocky_xmpp_reader_push:
+ * @reader: a WockyXmppReader
+ * @data: Data to read
+ * @length: Size of @data
+ *
+ * Push an amount of data to parse.
+ */
+void
+wocky_xmpp_reader_push (WockyXmppReader *reader, const guint8 *data,
+    gsize length)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  g_return_if_fail (priv->state < WOCKY_XMPP_READER_STATE_CLOSED);
+
+#ifdef ENABLE_DEBUG
+  wocky_debug (WOCKY_DEBUG_NET, "Parsing chunk: %.*s", (int)length, data);
+#endif
+
+  if (is_keepalive (reader, data, length))
+    return;
+
+  /* after an error, the parser has nothing more to say until it's reset */
+  if (priv->error == NULL)
+    {
+      if (priv->native_tokenizer)
+        wocky_xmpp_tokenizer_push (priv->tokenizer, (const gchar *) data,
+            length);
+      else
+        xmlParseChunk (priv->parser, (const char*)data, length, FALSE);
+
+      if (priv->max_stanza_size > 0 && priv->error == NULL)
+        check_buffered_size (reader);
+    }
+
+  if (priv->sm_events->len > 0)
+    {
+      g_object_ref (reader);
+      wocky_xmpp_reader_emit_sm_events (reader);
+      wocky_xmpp_reader_check_eos (reader);
+      g_object_unref (reader);
+      return;
+    }
 
   wocky_xmpp_reader_check_eos (reader);
 }
@@ -792,12 +1843,24 @@ wocky_xmpp_reader_pop_stanza (WockyXmppReader *reader)
 {
   WockyXmppReaderPrivate *priv = reader->priv;
   WockyStanza *s;
+  guint i;
 
   if (g_queue_is_empty (priv->stanzas))
     return NULL;
 
+  /* whoever pops this one is done with the previous ones */
+  wocky_xmpp_reader_emit_sm_events (reader);
+
   s = g_queue_pop_head (priv->stanzas);
 
+  for (i = 0; i < priv->sm_events->len; i++)
+    {
+      SmEvent *event = &g_array_index (priv->sm_events, SmEvent, i);
+
+      if (event->ahead > 0)
+        event->ahead--;
+    }
+
   wocky_xmpp_reader_check_eos (reader);
 
   if (!priv->stream_mode)
@@ -840,6 +1903,44 @@ wocky_xmpp_reader_reset (WockyXmppReader *reader)
   wocky_xmpp_reader_clear_parser_state (reader);
   wocky_init_xml_parser (reader);
 }
+
+/* Gets @reader ready for a new connection; only plain streaming readers are
+ * worth keeping, and only those which parse with libxml2 and build whole
+ * stanzas, as the pool's readers are expected to */
+gboolean
+wocky_xmpp_reader_recycle (WockyXmppReader *reader)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  if (G_OBJECT_TYPE (reader) != WOCKY_TYPE_XMPP_READER ||
+      !priv->stream_mode || priv->native_tokenizer || priv->lazy_subtrees ||
+      priv->dispose_has_run)
+    return FALSE;
+
+  wocky_xmpp_reader_reset (reader);
+  priv->stanza_recv_count = 0;
+  priv->sm_func = NULL;
+  priv->sm_data = NULL;
+
+  g_slist_free_full (priv->sinks, (GDestroyNotify) content_sink_free);
+  priv->sinks = NULL;
+
+  g_slist_free_full (priv->filters, (GDestroyNotify) stanza_filter_free);
+  priv->filters = NULL;
+  priv->filtered_count = 0;
+
+  priv->max_stanza_size = 0;
+  priv->max_depth = 0;
+  priv->max_attributes = 0;
+  priv->max_children = 0;
+  priv->peak_stanza_size = 0;
+  priv->peak_depth = 0;
+  priv->peak_attributes = 0;
+  priv->peak_children = 0;
+
+  return TRUE;
+}
+
 /**
  * wocky_xmpp_reader_get_recv_count:
  * @reader: a #WockyXmppReader
@@ -865,3 +1966,258 @@ wocky_xmpp_reader_set_recv_count (WockyXmppReader *reader, guint count)
 {
   reader->priv->stanza_recv_count = count;
 }
+
+/**
+ * wocky_xmpp_reader_add_content_sink:
+ * @reader: a #WockyXmppReader
+ * @ns: the namespace of the elements whose text should be streamed
+ * @name: the name of those elements
+ * @base64: whether to decode the text from base64 before passing it on
+ * @func: the function to pass the text to
+ * @user_data: data to pass to @func
+ * @notify: (allow-none): called on @user_data once the sink is removed
+ *
+ * Makes the text of every @name element in @ns, at any depth in a stanza,
+ * be passed to @func as it is parsed instead of being stored in the
+ * element's #WockyNode, so that large payloads such as in-band bytestream
+ * data or vCard photos never have to be held in memory as a whole.
+ *
+ * @func is called with each piece of text, decoded if @base64 is %TRUE, and
+ * with @data set to %NULL once the element ends, or the stream is reset
+ * before it does. The element is then given a "length" attribute in the
+ * %WOCKY_XMPP_READER_NS_STREAMED namespace holding the number of bytes
+ * passed, and no content. Removing the sink while it receives text puts the
+ * rest of the text back in the element.
+ *
+ * A reader with #WockyXmppReader:lazy-subtrees set only streams the text of
+ * the top-level element of a stanza and of its children, the rest being
+ * built after the stanza has been parsed.
+ *
+ * Returns: an id for wocky_xmpp_reader_remove_content_sink()
+ */
+guint
+wocky_xmpp_reader_add_content_sink (WockyXmppReader *reader,
+    const gchar *ns,
+    const gchar *name,
+    gboolean base64,
+    WockyXmppReaderContentFunc func,
+    gpointer user_data,
+    GDestroyNotify notify)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+  ContentSink *sink;
+
+  g_return_val_if_fail (ns != NULL, 0);
+  g_return_val_if_fail (name != NULL, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  sink = g_slice_new0 (ContentSink);
+  sink->id = ++priv->last_sink_id;
+  sink->ns = g_quark_from_string (ns);
+  sink->name = g_strdup (name);
+  sink->base64 = base64;
+  sink->func = func;
+  sink->user_data = user_data;
+  sink->notify = notify;
+
+  priv->sinks = g_slist_append (priv->sinks, sink);
+
+  return sink->id;
+}
+
+/**
+ * wocky_xmpp_reader_remove_content_sink:
+ * @reader: a #WockyXmppReader
+ * @id: the id returned by wocky_xmpp_reader_add_content_sink()
+ *
+ * Stops streaming the text of the elements the sink was added for.
+ */
+void
+wocky_xmpp_reader_remove_content_sink (WockyXmppReader *reader,
+    guint id)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+  GSList *l;
+
+  for (l = priv->sinks; l != NULL; l = l->next)
+    {
+      ContentSink *sink = l->data;
+
+      if (sink->id == id)
+        {
+          if (priv->sink == sink)
+            {
+              priv->sink = NULL;
+              priv->sink_node = NULL;
+            }
+
+          priv->sinks = g_slist_delete_link (priv->sinks, l);
+          content_sink_free (sink);
+          return;
+        }
+    }
+}
+
+/**
+ * wocky_xmpp_reader_set_sm_func:
+ * @reader: a #WockyXmppReader
+ * @func: (allow-none): the function to report stream management requests
+ *  and acks to, or %NULL
+ * @user_data: data to pass to @func
+ *
+ * Once @func is set, XEP-0198 &lt;r/&gt; and &lt;a/&gt; elements at the top
+ * level of the stream are no longer turned into #WockyStanza<!-- -->s: they
+ * are reported to @func instead, in stream order: once the stanzas which
+ * came before them have been popped, when the next one is popped, or when
+ * wocky_xmpp_reader_emit_sm_events() is called. Acks without a valid h
+ * attribute are still turned into stanzas.
+ * This only applies in streaming mode.
+ */
+void
+wocky_xmpp_reader_set_sm_func (WockyXmppReader *reader,
+    WockyXmppReaderSmFunc func,
+    gpointer user_data)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  priv->sm_func = func;
+  priv->sm_data = user_data;
+}
+
+/**
+ * wocky_xmpp_reader_add_filter:
+ * @reader: a #WockyXmppReader
+ * @type: the type of stanza to filter out, or %WOCKY_STANZA_TYPE_NONE for
+ *  any
+ * @child_ns: (allow-none): the namespace the first child of the stanza must
+ *  be in, or %NULL for any
+ * @attribute: (allow-none): the name of an attribute, not in any namespace,
+ *  the stanza must have, or %NULL
+ * @value: (allow-none): the value @attribute must have, or %NULL for any
+ *
+ * Makes the reader drop the stanzas matching all of the given criteria, for
+ * instance chat state notifications or the pubsub events of nodes nobody
+ * cares about, as soon as their first child starts and before any
+ * #WockyNode is built for them. They still count towards
+ * wocky_xmpp_reader_get_recv_count(), as the stream management code expects.
+ * Stanzas without children only match filters whose @child_ns is %NULL.
+ *
+ * Filters only apply in streaming mode, to stanzas starting after they were
+ * added.
+ *
+ * Returns: an id for wocky_xmpp_reader_remove_filter()
+ */
+guint
+wocky_xmpp_reader_add_filter (WockyXmppReader *reader,
+    WockyStanzaType type,
+    const gchar *child_ns,
+    const gchar *attribute,
+    const gchar *value)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+  StanzaFilter *filter;
+
+  g_return_val_if_fail (type < WOCKY_STANZA_TYPE_UNKNOWN, 0);
+  g_return_val_if_fail (attribute != NULL || value == NULL, 0);
+
+  filter = g_slice_new0 (StanzaFilter);
+  filter->id = ++priv->last_filter_id;
+
+  if (type != WOCKY_STANZA_TYPE_NONE)
+    {
+      WockyStanza *stanza = wocky_stanza_build (type,
+          WOCKY_STANZA_SUB_TYPE_NONE, NULL, NULL, NULL);
+      WockyNode *top = wocky_stanza_get_top_node (stanza);
+
+      filter->name = g_strdup (top->name);
+      filter->ns = top->ns;
+      g_object_unref (stanza);
+    }
+
+  if (child_ns != NULL)
+    filter->child_ns = g_quark_from_string (child_ns);
+
+  filter->attribute = g_strdup (attribute);
+  filter->value = g_strdup (value);
+
+  priv->filters = g_slist_append (priv->filters, filter);
+
+  return filter->id;
+}
+
+/**
+ * wocky_xmpp_reader_remove_filter:
+ * @reader: a #WockyXmppReader
+ * @id: the id returned by wocky_xmpp_reader_add_filter()
+ *
+ * Stops dropping the stanzas the filter was added for.
+ */
+void
+wocky_xmpp_reader_remove_filter (WockyXmppReader *reader,
+    guint id)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+  GSList *l;
+
+  for (l = priv->filters; l != NULL; l = l->next)
+    {
+      StanzaFilter *filter = l->data;
+
+      if (filter->id == id)
+        {
+          priv->filters = g_slist_delete_link (priv->filters, l);
+          stanza_filter_free (filter);
+          return;
+        }
+    }
+}
+
+/**
+ * wocky_xmpp_reader_get_filtered_count:
+ * @reader: a #WockyXmppReader
+ *
+ * Get the number of stanzas dropped by the filters added with
+ * wocky_xmpp_reader_add_filter().
+ *
+ * Returns: the number of stanzas filtered out
+ */
+guint
+wocky_xmpp_reader_get_filtered_count (WockyXmppReader *reader)
+{
+  return reader->priv->filtered_count;
+}
+
+/**
+ * wocky_xmpp_reader_get_peaks:
+ * @reader: a #WockyXmppReader
+ * @stanza_size: (out) (allow-none): the size of the largest stanza, as
+ *  #WockyXmppReader:max-stanza-size counts it
+ * @depth: (out) (allow-none): the deepest nesting of elements in a stanza
+ * @attributes: (out) (allow-none): the most attributes an element had
+ * @children: (out) (allow-none): the most children an element had
+ *
+ * Gets the most @reader has seen of what its limits apply to, since it was
+ * created, whether limits are set or not; for instance, to pick limits
+ * which the traffic of a deployment stays well within.
+ */
+void
+wocky_xmpp_reader_get_peaks (WockyXmppReader *reader,
+    gsize *stanza_size,
+    guint *depth,
+    guint *attributes,
+    guint *children)
+{
+  WockyXmppReaderPrivate *priv = reader->priv;
+
+  if (stanza_size != NULL)
+    *stanza_size = priv->peak_stanza_size;
+
+  if (depth != NULL)
+    *depth = priv->peak_depth;
+
+  if (attributes != NULL)
+    *attributes = priv->peak_attributes;
+
+  if (children != NULL)
+    *children = priv->peak_children;
+}
@@ -76,12 +76,15 @@ typedef enum {
  * WockyXmppReaderError:
  * @WOCKY_XMPP_READER_ERROR_INVALID_STREAM_START : invalid start of xmpp stream
  * @WOCKY_XMPP_READER_ERROR_PARSE_ERROR          : error in parsing the XML
+ * @WOCKY_XMPP_READER_ERROR_LIMIT_EXCEEDED       : a stanza went over one of
+ *  the limits set on the reader, such as #WockyXmppReader:max-stanza-size
  *
  * The different errors that can occur while reading a stream
  */
 typedef enum {
   WOCKY_XMPP_READER_ERROR_INVALID_STREAM_START,
   WOCKY_XMPP_READER_ERROR_PARSE_ERROR,
+  WOCKY_XMPP_READER_ERROR_LIMIT_EXCEEDED,
 } WockyXmppReaderError;
 
 GQuark wocky_xmpp_reader_error_quark (void);
@@ -93,6 +96,50 @@ GQuark wocky_xmpp_reader_error_quark (void);
  */
 #define WOCKY_XMPP_READER_ERROR (wocky_xmpp_reader_error_quark ())
 
+/**
+ * WockyXmppReaderSmFunc:
+ * @reader: the #WockyXmppReader
+ * @type: %WOCKY_STANZA_TYPE_SM_R for a request, %WOCKY_STANZA_TYPE_SM_A for
+ *  an ack
+ * @h: for an ack, its h attribute; for a request, the number of stanzas the
+ *  reader had received when it arrived
+ * @user_data: the data passed to wocky_xmpp_reader_set_sm_func()
+ *
+ * The type of the function which stream management requests and acks are
+ * reported to; see wocky_xmpp_reader_set_sm_func().
+ */
+typedef void (*WockyXmppReaderSmFunc) (WockyXmppReader *reader,
+    WockyStanzaType type,
+    guint h,
+    gpointer user_data);
+
+/**
+ * WockyXmppReaderContentFunc:
+ * @reader: the #WockyXmppReader
+ * @stanza: the stanza being parsed, which the reader owns
+ * @node: the element whose text this is
+ * @data: a piece of the text, or %NULL once the element has ended
+ * @length: the size of @data
+ * @user_data: the data passed to wocky_xmpp_reader_add_content_sink()
+ *
+ * The type of the functions the text of large elements is streamed to; see
+ * wocky_xmpp_reader_add_content_sink().
+ */
+typedef void (*WockyXmppReaderContentFunc) (WockyXmppReader *reader,
+    WockyStanza *stanza,
+    WockyNode *node,
+    const guint8 *data,
+    gsize length,
+    gpointer user_data);
+
+/**
+ * WOCKY_XMPP_READER_NS_STREAMED:
+ *
+ * The namespace of the "length" attribute given to elements whose text was
+ * passed to a content sink.
+ */
+#define WOCKY_XMPP_READER_NS_STREAMED "urn:x-wocky:streamed"
+
 GType wocky_xmpp_reader_get_type (void);
 
 /* TYPE MACROS */
@@ -132,6 +179,32 @@ GError *wocky_xmpp_reader_get_error (WockyXmppReader *reader);
 void wocky_xmpp_reader_reset (WockyXmppReader *reader);
 guint wocky_xmpp_reader_get_recv_count (WockyXmppReader *reader);
 void wocky_xmpp_reader_set_recv_count (WockyXmppReader *reader, guint count);
+guint wocky_xmpp_reader_add_content_sink (WockyXmppReader *reader,
+    const gchar *ns,
+    const gchar *name,
+    gboolean base64,
+    WockyXmppReaderContentFunc func,
+    gpointer user_data,
+    GDestroyNotify notify);
+void wocky_xmpp_reader_remove_content_sink (WockyXmppReader *reader,
+    guint id);
+void wocky_xmpp_reader_set_sm_func (WockyXmppReader *reader,
+    WockyXmppReaderSmFunc func,
+    gpointer user_data);
+void wocky_xmpp_reader_emit_sm_events (WockyXmppReader *reader);
+guint wocky_xmpp_reader_add_filter (WockyXmppReader *reader,
+    WockyStanzaType type,
+    const gchar *child_ns,
+    const gchar *attribute,
+    const gchar *value);
+void wocky_xmpp_reader_remove_filter (WockyXmppReader *reader,
+    guint id);
+guint wocky_xmpp_reader_get_filtered_count (WockyXmppReader *reader);
+void wocky_xmpp_reader_get_peaks (WockyXmppReader *reader,
+    gsize *stanza_size,
+    guint *depth,
+    guint *attributes,
+    guint *children);
 
 G_END_DECLS
 
@@ -0,0 +1,1238 @@
+/*
+ * wocky-xmpp-tokenizer.c - Source for the native XMPP tokenizer
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * XMPP only uses a small part of XML (RFC 6120 §11): no DTDs, so no entities
+ * beyond the five predefined ones, no processing instructions, and UTF-8
+ * only. This tokenizer handles that part and nothing else, which lets it
+ * skip most of what libxml2's push parser does for every byte: text and
+ * attribute values are scanned a vector at a time for the few characters
+ * which matter, and passed on as they are whenever they don't need
+ * decoding.
+ *
+ * Text is reported as it arrives. Markup is reported once the whole of it
+ * has been pushed: a tag cut in two by the end of a push is kept until the
+ * rest of it comes, and the search for its end picks up where it left off.
+ *
+ * Comments are skipped, as libxml2 does, and CDATA sections are reported as
+ * text. Anything else outside the subset is an error.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wocky-xmpp-tokenizer.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "wocky-text.h"
+
+#define XML_NS "http://www.w3.org/XML/1998/namespace"
+
+/* Longer than any well-formed reference, leading zeros aside */
+#define MAX_REFERENCE 16
+
+/* Past this size, the buffer for a token cut in two is given back after a
+ * reset rather than kept for the next stream */
+#define MAX_PENDING_KEPT (64 * 1024)
+
+typedef struct
+{
+  /* where the element's qualified name starts in qnames, and its length */
+  gsize qname;
+  gsize qname_len;
+  /* how many bindings were in scope before the element's own */
+  guint bindings;
+} Element;
+
+typedef struct
+{
+  /* interned; NULL for the default namespace */
+  const gchar *prefix;
+  /* interned; NULL when there is no default namespace */
+  const gchar *uri;
+} Binding;
+
+/* An attribute as it appears in the tag, in the tokenizer's copy of it */
+typedef struct
+{
+  gchar *name;
+  gsize name_len;
+  gchar *value;
+  gsize value_len;
+  gchar quote;
+  gboolean decode;
+  /* whether it declares a namespace */
+  gboolean xmlns;
+} RawAttribute;
+
+struct _WockyXmppTokenizer
+{
+  const WockyXmppTokenizerFuncs *funcs;
+  gpointer user_data;
+
+  /* what was left over from earlier pushes: a token cut short */
+  GString *pending;
+  /* how far into that token the search for its end has got, and the quote
+   * of the attribute value it was in, if any */
+  gsize scanned;
+  gchar scanned_quote;
+
+  gboolean failed;
+  /* whether anything at all has been seen, for the XML declaration */
+  gboolean started;
+  /* whether the root element has ended */
+  gboolean done;
+
+  /* the qualified names of the open elements, one after the other */
+  GString *qnames;
+  /* Element */
+  GArray *elements;
+  /* Binding */
+  GArray *bindings;
+
+  /* for the tag being handled: a copy of it, and its attributes */
+  GString *scratch;
+  GArray *raw;
+  GPtrArray *attributes;
+};
+
+WockyXmppTokenizer *
+wocky_xmpp_tokenizer_new (const WockyXmppTokenizerFuncs *funcs,
+    gpointer user_data)
+{
+  WockyXmppTokenizer *self = g_slice_new0 (WockyXmppTokenizer);
+
+  self->funcs = funcs;
+  self->user_data = user_data;
+  self->pending = g_string_new ("");
+  self->qnames = g_string_new ("");
+  self->elements = g_array_new (FALSE, FALSE, sizeof (Element));
+  self->bindings = g_array_new (FALSE, FALSE, sizeof (Binding));
+  self->raw = g_array_new (FALSE, FALSE, sizeof (RawAttribute));
+  self->scratch = g_string_new ("");
+  self->attributes = g_ptr_array_new ();
+
+  return self;
+}
+
+void
+wocky_xmpp_tokenizer_free (WockyXmppTokenizer *self)
+{
+  g_string_free (self->pending, TRUE);
+  g_string_free (self->qnames, TRUE);
+  g_array_unref (self->elements);
+  g_array_unref (self->bindings);
+  g_array_unref (self->raw);
+  g_string_free (self->scratch, TRUE);
+  g_ptr_array_unref (self->attributes);
+  g_slice_free (WockyXmppTokenizer, self);
+}
+
+void
+wocky_xmpp_tokenizer_reset (WockyXmppTokenizer *self)
+{
+  if (self->pending->allocated_len > MAX_PENDING_KEPT)
+    {
+      g_string_free (self->pending, TRUE);
+      self->pending = g_string_new ("");
+    }
+
+  g_string_truncate (self->pending, 0);
+  self->scanned = 0;
+  self->scanned_quote = '\0';
+  self->failed = FALSE;
+  self->started = FALSE;
+  self->done = FALSE;
+
+  g_string_truncate (self->qnames, 0);
+  g_array_set_size (self->elements, 0);
+  g_array_set_size (self->bindings, 0);
+}
+
+gboolean
+wocky_xmpp_tokenizer_is_idle (WockyXmppTokenizer *self)
+{
+  return !self->failed && self->pending->len == 0;
+}
+
+gsize
+wocky_xmpp_tokenizer_get_pending_size (WockyXmppTokenizer *self)
+{
+  return self->pending->len;
+}
+
+static gboolean fail (WockyXmppTokenizer *self,
+    const gchar *format,
+    ...) G_GNUC_PRINTF (2, 3);
+
+/* Always returns FALSE */
+static gboolean
+fail (WockyXmppTokenizer *self,
+    const gchar *format,
+    ...)
+{
+  va_list ap;
+  gchar *message;
+
+  va_start (ap, format);
+  message = g_strdup_vprintf (format, ap);
+  va_end (ap);
+
+  self->failed = TRUE;
+  self->funcs->error (self->user_data, message);
+  g_free (message);
+
+  return FALSE;
+}
+
+static inline gboolean
+is_space (gchar c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* The length of the name at the start of @s, or 0 if there is none; any
+ * character from U+0080 up is taken to be allowed in names */
+static gsize
+name_length (const gchar *s,
+    gsize len)
+{
+  gsize i;
+
+  if (len == 0 || !(g_ascii_isalpha (s[0]) || s[0] == '_' || s[0] == ':' ||
+          (guchar) s[0] >= 0x80))
+    return 0;
+
+  for (i = 1; i < len; i++)
+    {
+      gchar c = s[i];
+
+      if (!(g_ascii_isalnum (c) || c == '_' || c == ':' || c == '-' ||
+              c == '.' || (guchar) c >= 0x80))
+        break;
+    }
+
+  return i;
+}
+
+/* Splits a qualified name at its colon, if it has one; returns FALSE if it
+ * isn't a valid qualified name */
+static gboolean
+split_qname (const gchar *name,
+    gsize len,
+    gsize *prefix_len)
+{
+  const gchar *colon = memchr (name, ':', len);
+
+  if (colon == NULL)
+    {
+      *prefix_len = 0;
+      return TRUE;
+    }
+
+  *prefix_len = colon - name;
+
+  return colon != name && colon + 1 != name + len &&
+      memchr (colon + 1, ':', name + len - colon - 1) == NULL;
+}
+
+static const gchar *
+find (const gchar *s,
+    gsize len,
+    const gchar *needle)
+{
+  gsize n = strlen (needle);
+  const gchar *end = s + len;
+  const gchar *p = s;
+
+  while ((p = memchr (p, needle[0], end - p)) != NULL)
+    {
+      if ((gsize) (end - p) < n)
+        return NULL;
+
+      if (!memcmp (p, needle, n))
+        return p;
+
+      p++;
+    }
+
+  return NULL;
+}
+
+static gboolean
+is_xml_char (gunichar c)
+{
+  return c == 0x9 || c == 0xa || c == 0xd ||
+      (c >= 0x20 && c <= 0xd7ff) ||
+      (c >= 0xe000 && c <= 0xfffd) ||
+      (c >= 0x10000 && c <= 0x10ffff);
+}
+
+/* Decodes the entity or character reference at the start of @s into @out,
+ * which must have room for 6 bytes. Returns the length of the reference, 0
+ * if it is cut short by the end of @s, or -1 if it isn't valid. */
+static gssize
+parse_reference (const gchar *s,
+    gsize len,
+    gchar *out,
+    gsize *out_len)
+{
+  const gchar *semi = memchr (s, ';', MIN (len, MAX_REFERENCE));
+  const gchar *name = s + 1;
+  gsize n;
+
+  if (semi == NULL)
+    {
+      /* Give up early if what there is of it can't be a reference */
+      for (n = 1; n < MIN (len, MAX_REFERENCE); n++)
+        {
+          if (!g_ascii_isalnum (s[n]) && s[n] != '#')
+            return -1;
+        }
+
+      return len < MAX_REFERENCE ? 0 : -1;
+    }
+
+  n = semi - name;
+
+  if (n >= 2 && name[0] == '#')
+    {
+      gboolean hex = (name[1] == 'x');
+      gunichar c = 0;
+      gsize i;
+
+      if (hex && n == 2)
+        return -1;
+
+      for (i = hex ? 2 : 1; i < n; i++)
+        {
+          gint digit = hex ? g_ascii_xdigit_value (name[i]) :
+              g_ascii_digit_value (name[i]);
+
+          if (digit < 0)
+            return -1;
+
+          c = c * (hex ? 16 : 10) + digit;
+
+          if (c > 0x10ffff)
+            return -1;
+        }
+
+      if (!is_xml_char (c))
+        return -1;
+
+      *out_len = g_unichar_to_utf8 (c, out);
+    }
+  else if (n == 2 && !memcmp (name, "lt", 2))
+    {
+      *out = '<';
+      *out_len = 1;
+    }
+  else if (n == 2 && !memcmp (name, "gt", 2))
+    {
+      *out = '>';
+      *out_len = 1;
+    }
+  else if (n == 3 && !memcmp (name, "amp", 3))
+    {
+      *out = '&';
+      *out_len = 1;
+    }
+  else if (n == 4 && !memcmp (name, "quot", 4))
+    {
+      *out = '"';
+      *out_len = 1;
+    }
+  else if (n == 4 && !memcmp (name, "apos", 4))
+    {
+      *out = '\'';
+      *out_len = 1;
+    }
+  else
+    {
+      return -1;
+    }
+
+  return semi - s + 1;
+}
+
+/* Reports @n bytes of text. If @at_end, a character cut short at the end is
+ * held back for the next push. Returns how much was taken, or -1. */
+static gssize
+emit_text (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize n,
+    gboolean at_end)
+{
+  const gchar *end;
+  gsize i;
+
+  if (n == 0)
+    return 0;
+
+  if (!wocky_text_utf8_validate (s, n, &end))
+    {
+      if (!at_end ||
+          g_utf8_get_char_validated (end, s + n - end) != (gunichar) -2)
+        {
+          fail (self, "Input is not proper UTF-8");
+          return -1;
+        }
+
+      n = end - s;
+    }
+
+  if (self->elements->len > 0)
+    {
+      if (n > 0)
+        self->funcs->characters (self->user_data, s, n);
+
+      return n;
+    }
+
+  /* Outside the root element, only whitespace is allowed */
+  for (i = 0; i < n; i++)
+    {
+      if (!is_space (s[i]))
+        {
+          fail (self, self->done ? "Extra content at the end of the document"
+              : "Start tag expected, '<' not found");
+          return -1;
+        }
+    }
+
+  return n;
+}
+
+/* Character data, up to the next markup. Returns how much was taken, or
+ * -1. */
+static gssize
+parse_text (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len)
+{
+  gsize i = 0;
+
+  while (i < len)
+    {
+      gsize run = wocky_text_markup_scan (s + i, len - i, '\0');
+      gchar ref[6];
+      gsize ref_len;
+      gssize n;
+
+      n = emit_text (self, s + i, run, i + run == len);
+
+      if (n < 0)
+        return -1;
+
+      i += n;
+
+      if ((gsize) n < run || i == len)
+        break;
+
+      switch (s[i])
+        {
+          case '<':
+            return i;
+
+          /* line ends are normalised to a single \n */
+          case '\r':
+            if (i + 1 == len)
+              return i;
+
+            if (emit_text (self, "\n", 1, FALSE) < 0)
+              return -1;
+
+            i += (s[i + 1] == '\n') ? 2 : 1;
+            break;
+
+          case '&':
+            if (self->elements->len == 0)
+              {
+                fail (self, "Reference outside the root element");
+                return -1;
+              }
+
+            n = parse_reference (s + i, len - i, ref, &ref_len);
+
+            if (n == 0)
+              return i;
+
+            if (n < 0)
+              {
+                fail (self, "Invalid entity or character reference");
+                return -1;
+              }
+
+            if (emit_text (self, ref, ref_len, FALSE) < 0)
+              return -1;
+
+            i += n;
+            break;
+
+          default:
+            fail (self, "Invalid character 0x%02x in content", (guchar) s[i]);
+            return -1;
+        }
+    }
+
+  return i;
+}
+
+/* The contents of a CDATA section, which are all text */
+static gboolean
+emit_cdata (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len)
+{
+  gsize i = 0;
+
+  while (i < len)
+    {
+      gsize run = wocky_text_markup_scan (s + i, len - i, '\0');
+
+      if (emit_text (self, s + i, run, FALSE) < 0)
+        return FALSE;
+
+      i += run;
+
+      if (i == len)
+        break;
+
+      switch (s[i])
+        {
+          case '<':
+          case '&':
+            if (emit_text (self, s + i, 1, FALSE) < 0)
+              return FALSE;
+
+            i++;
+            break;
+
+          case '\r':
+            if (emit_text (self, "\n", 1, FALSE) < 0)
+              return FALSE;
+
+            i += (i + 1 < len && s[i + 1] == '\n') ? 2 : 1;
+            break;
+
+          default:
+            return fail (self, "Invalid character 0x%02x in CDATA section",
+                (guchar) s[i]);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Decodes the attribute value @v where it is, references and all, and
+ * normalises its whitespace; the result is never longer */
+static gboolean
+decode_value (WockyXmppTokenizer *self,
+    gchar *v,
+    gsize *len,
+    gchar quote)
+{
+  gsize r = 0, w = 0;
+
+  while (r < *len)
+    {
+      gsize run = wocky_text_markup_scan (v + r, *len - r, quote);
+      gchar ref[6];
+      gsize ref_len;
+      gssize n;
+
+      memmove (v + w, v + r, run);
+      w += run;
+      r += run;
+
+      if (r == *len)
+        break;
+
+      switch (v[r])
+        {
+          case '&':
+            n = parse_reference (v + r, *len - r, ref, &ref_len);
+
+            if (n <= 0)
+              return fail (self, "Invalid entity or character reference in "
+                  "attribute value");
+
+            memcpy (v + w, ref, ref_len);
+            w += ref_len;
+            r += n;
+            break;
+
+          case '\t':
+          case '\n':
+            v[w++] = ' ';
+            r++;
+            break;
+
+          case '\r':
+            v[w++] = ' ';
+            r += (r + 1 < *len && v[r + 1] == '\n') ? 2 : 1;
+            break;
+
+          case '<':
+            return fail (self,
+                "Unescaped '<' not allowed in attribute values");
+
+          default:
+            return fail (self, "Invalid character 0x%02x in attribute value",
+                (guchar) v[r]);
+        }
+    }
+
+  *len = w;
+
+  return TRUE;
+}
+
+/* The innermost binding of @prefix (of @len bytes, or NULL for the default
+ * namespace), if any */
+static Binding *
+find_binding (WockyXmppTokenizer *self,
+    const gchar *prefix,
+    gsize len)
+{
+  guint i;
+
+  for (i = self->bindings->len; i > 0; i--)
+    {
+      Binding *b = &g_array_index (self->bindings, Binding, i - 1);
+
+      if (prefix == NULL)
+        {
+          if (b->prefix == NULL)
+            return b;
+        }
+      else if (b->prefix != NULL && !strncmp (b->prefix, prefix, len) &&
+          b->prefix[len] == '\0')
+        {
+          return b;
+        }
+    }
+
+  return NULL;
+}
+
+static const gchar *
+lookup (WockyXmppTokenizer *self,
+    const gchar *prefix,
+    gsize len)
+{
+  Binding *b;
+
+  if (prefix != NULL && len == 3 && !memcmp (prefix, "xml", 3))
+    return g_intern_static_string (XML_NS);
+
+  b = find_binding (self, prefix, len);
+
+  return b != NULL ? b->uri : NULL;
+}
+
+/* Takes the namespace declarations out of the tag's attributes */
+static gboolean
+bind_namespaces (WockyXmppTokenizer *self)
+{
+  guint i;
+
+  for (i = 0; i < self->raw->len; i++)
+    {
+      RawAttribute *a = &g_array_index (self->raw, RawAttribute, i);
+      const gchar *prefix = NULL;
+      gsize prefix_len = 0;
+      Binding *bound;
+      Binding b = { NULL, NULL };
+
+      if (!a->xmlns)
+        continue;
+
+      if (a->decode &&
+          !decode_value (self, a->value, &a->value_len, a->quote))
+        return FALSE;
+
+      a->value[a->value_len] = '\0';
+
+      if (a->name_len > 5)
+        {
+          a->name[a->name_len] = '\0';
+          prefix = a->name + 6;
+          prefix_len = a->name_len - 6;
+
+          if (a->value_len == 0)
+            return fail (self, "Empty namespace for the prefix %s", prefix);
+        }
+
+      /* Stanzas mostly restate the namespace they are already in, which
+       * saves interning it again */
+      bound = find_binding (self, prefix, prefix_len);
+
+      if (prefix != NULL)
+        b.prefix = bound != NULL ? bound->prefix : g_intern_string (prefix);
+
+      if (a->value_len == 0)
+        b.uri = NULL;
+      else if (bound != NULL && bound->uri != NULL &&
+          !strcmp (bound->uri, a->value))
+        b.uri = bound->uri;
+      else
+        b.uri = g_intern_string (a->value);
+
+      g_array_append_val (self->bindings, b);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+handle_start_tag (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len)
+{
+  gchar *tag, *end, *p, *qname;
+  const gchar *localname, *prefix, *uri;
+  const gchar **attributes;
+  gsize qname_len, prefix_len;
+  gboolean empty = FALSE;
+  guint i, n_attributes = 0;
+  Element element;
+
+  if (self->done)
+    return fail (self, "Extra content at the end of the document");
+
+  if (!wocky_text_utf8_validate (s, len, NULL))
+    return fail (self, "Input is not proper UTF-8");
+
+  /* Work on a copy of the tag, so names can be NUL-terminated and values
+   * decoded where they are */
+  g_string_truncate (self->scratch, 0);
+  g_string_append_len (self->scratch, s, len);
+  tag = self->scratch->str;
+  end = tag + len - 1;
+  p = qname = tag + 1;
+
+  qname_len = name_length (p, end - p);
+
+  if (qname_len == 0)
+    return fail (self, "Invalid element name");
+
+  p += qname_len;
+  g_array_set_size (self->raw, 0);
+
+  while (TRUE)
+    {
+      RawAttribute a;
+      gboolean space = FALSE;
+      gchar *close;
+
+      while (p < end && is_space (*p))
+        {
+          p++;
+          space = TRUE;
+        }
+
+      if (p == end)
+        break;
+
+      if (*p == '/' && p + 1 == end)
+        {
+          empty = TRUE;
+          break;
+        }
+
+      if (!space)
+        return fail (self, "Attributes construct error in <%.*s>",
+            (int) qname_len, qname);
+
+      a.name = p;
+      a.name_len = name_length (p, end - p);
+
+      if (a.name_len == 0)
+        return fail (self, "Invalid attribute name in <%.*s>",
+            (int) qname_len, qname);
+
+      p += a.name_len;
+
+      while (p < end && is_space (*p))
+        p++;
+
+      if (p == end || *p != '=')
+        return fail (self, "Specification mandates value for attribute %.*s",
+            (int) a.name_len, a.name);
+
+      p++;
+
+      while (p < end && is_space (*p))
+        p++;
+
+      if (p == end || (*p != '\'' && *p != '"'))
+        return fail (self, "AttValue: \" or ' expected");
+
+      a.quote = *p++;
+      close = memchr (p, a.quote, end - p);
+
+      if (close == NULL)
+        return fail (self, "AttValue: ' expected");
+
+      for (i = 0; i < self->raw->len; i++)
+        {
+          RawAttribute *other = &g_array_index (self->raw, RawAttribute, i);
+
+          if (other->name_len == a.name_len &&
+              !memcmp (other->name, a.name, a.name_len))
+            return fail (self, "Attribute %.*s redefined", (int) a.name_len,
+                a.name);
+        }
+
+      a.value = p;
+      a.value_len = close - p;
+      a.decode = wocky_text_markup_scan (a.value, a.value_len, a.quote) <
+          a.value_len;
+      a.xmlns = (a.name_len == 5 && !memcmp (a.name, "xmlns", 5)) ||
+          (a.name_len > 6 && !memcmp (a.name, "xmlns:", 6));
+
+      if (!a.xmlns)
+        n_attributes++;
+
+      g_array_append_val (self->raw, a);
+
+      p = close + 1;
+    }
+
+  element.bindings = self->bindings->len;
+
+  if (!bind_namespaces (self))
+    return FALSE;
+
+  /* The element's own name; what follows it is whitespace, '/' or '>' */
+  if (!split_qname (qname, qname_len, &prefix_len))
+    return fail (self, "Failed to parse QName '%.*s'", (int) qname_len,
+        qname);
+
+  qname[qname_len] = '\0';
+
+  if (prefix_len > 0)
+    {
+      qname[prefix_len] = '\0';
+      prefix = qname;
+      localname = qname + prefix_len + 1;
+      uri = lookup (self, prefix, prefix_len);
+    }
+  else
+    {
+      prefix = NULL;
+      localname = qname;
+      uri = lookup (self, NULL, 0);
+    }
+
+  /* Its attributes; unprefixed ones are in no namespace. What follows a
+   * name is '=' or whitespace, and what follows a value is its quote. */
+  g_ptr_array_set_size (self->attributes, 5 * n_attributes);
+  attributes = (const gchar **) self->attributes->pdata;
+
+  for (i = 0; i < self->raw->len; i++)
+    {
+      RawAttribute *a = &g_array_index (self->raw, RawAttribute, i);
+
+      if (a->xmlns)
+        continue;
+
+      if (!split_qname (a->name, a->name_len, &prefix_len))
+        return fail (self, "Failed to parse QName '%.*s'", (int) a->name_len,
+            a->name);
+
+      if (a->decode &&
+          !decode_value (self, a->value, &a->value_len, a->quote))
+        return FALSE;
+
+      a->name[a->name_len] = '\0';
+
+      if (prefix_len > 0)
+        {
+          a->name[prefix_len] = '\0';
+          attributes[0] = a->name + prefix_len + 1;
+          attributes[1] = a->name;
+          attributes[2] = lookup (self, a->name, prefix_len);
+        }
+      else
+        {
+          attributes[0] = a->name;
+          attributes[1] = NULL;
+          attributes[2] = NULL;
+        }
+
+      attributes[3] = a->value;
+      attributes[4] = a->value + a->value_len;
+      attributes += 5;
+    }
+
+  element.qname = self->qnames->len;
+  element.qname_len = qname_len;
+  g_string_append_len (self->qnames, s + 1, qname_len);
+  g_array_append_val (self->elements, element);
+
+  self->funcs->start_element (self->user_data, localname, prefix, uri,
+      n_attributes, (const gchar **) self->attributes->pdata);
+
+  if (empty && !self->failed)
+    {
+      g_string_truncate (self->qnames, element.qname);
+      g_array_set_size (self->bindings, element.bindings);
+      g_array_set_size (self->elements, self->elements->len - 1);
+      self->done = (self->elements->len == 0);
+      self->funcs->end_element (self->user_data);
+    }
+
+  return TRUE;
+}
+
+static gssize
+parse_start_tag (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len,
+    gsize resume)
+{
+  gsize i = MAX (resume, 1);
+  gchar quote = resume > 0 ? self->scanned_quote : '\0';
+
+  /* Find the end of the tag, skipping over quoted values, which may have
+   * '>' in them */
+  while (TRUE)
+    {
+      if (quote != '\0')
+        {
+          const gchar *close = memchr (s + i, quote, len - i);
+
+          if (close == NULL)
+            {
+              self->scanned = len;
+              self->scanned_quote = quote;
+              return 0;
+            }
+
+          i = close - s + 1;
+          quote = '\0';
+        }
+
+      while (i < len && s[i] != '>' && s[i] != '\'' && s[i] != '"')
+        i++;
+
+      if (i == len)
+        {
+          self->scanned = len;
+          self->scanned_quote = '\0';
+          return 0;
+        }
+
+      if (s[i] == '>')
+        break;
+
+      quote = s[i++];
+    }
+
+  if (!handle_start_tag (self, s, i + 1))
+    return -1;
+
+  return i + 1;
+}
+
+static gssize
+parse_end_tag (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len,
+    gsize resume)
+{
+  gsize from = MAX (resume, 2);
+  const gchar *end = memchr (s + from, '>', len - from);
+  const gchar *p;
+  gsize name_len;
+  Element *top;
+
+  if (end == NULL)
+    {
+      self->scanned = len;
+      return 0;
+    }
+
+  name_len = name_length (s + 2, end - s - 2);
+
+  for (p = s + 2 + name_len; p < end; p++)
+    {
+      if (!is_space (*p))
+        {
+          fail (self, "Invalid end tag");
+          return -1;
+        }
+    }
+
+  if (self->elements->len == 0)
+    {
+      fail (self, "Unexpected end tag </%.*s>", (int) name_len, s + 2);
+      return -1;
+    }
+
+  top = &g_array_index (self->elements, Element, self->elements->len - 1);
+
+  if (top->qname_len != name_len ||
+      memcmp (self->qnames->str + top->qname, s + 2, name_len))
+    {
+      fail (self, "Opening and ending tag mismatch: %.*s and %.*s",
+          (int) top->qname_len, self->qnames->str + top->qname,
+          (int) name_len, s + 2);
+      return -1;
+    }
+
+  g_string_truncate (self->qnames, top->qname);
+  g_array_set_size (self->bindings, top->bindings);
+  g_array_set_size (self->elements, self->elements->len - 1);
+  self->done = (self->elements->len == 0);
+
+  self->funcs->end_element (self->user_data);
+
+  return end - s + 1;
+}
+
+/* Only the XML declaration is allowed, and only for UTF-8 */
+static gssize
+parse_pi (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len,
+    gsize resume)
+{
+  gsize from = MAX (resume, 2);
+  const gchar *end = find (s + from, len - from, "?>");
+  const gchar *encoding;
+  gsize total;
+
+  if (end == NULL)
+    {
+      self->scanned = MAX (len - 1, 2);
+      return 0;
+    }
+
+  total = end - s + 2;
+
+  if (total < 7 || memcmp (s, "<?xml", 5) || !is_space (s[5]))
+    {
+      fail (self, "Processing instructions are not allowed");
+      return -1;
+    }
+
+  if (self->started)
+    {
+      fail (self, "XML declaration allowed only at the start of the "
+          "document");
+      return -1;
+    }
+
+  encoding = find (s, total, "encoding");
+
+  if (encoding != NULL)
+    {
+      const gchar *p = encoding + strlen ("encoding");
+      const gchar *close;
+
+      while (p < end && is_space (*p))
+        p++;
+
+      if (p < end && *p == '=')
+        p++;
+
+      while (p < end && is_space (*p))
+        p++;
+
+      if (p == end || (*p != '\'' && *p != '"') ||
+          (close = memchr (p + 1, *p, end - p - 1)) == NULL)
+        {
+          fail (self, "Malformed XML declaration");
+          return -1;
+        }
+
+      p++;
+
+      if (close - p != 5 || g_ascii_strncasecmp (p, "UTF-8", 5))
+        {
+          fail (self, "Unsupported encoding %.*s", (int) (close - p), p);
+          return -1;
+        }
+    }
+
+  return total;
+}
+
+/* Comments are skipped; CDATA sections are text; DTDs are refused */
+static gssize
+parse_bang (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len,
+    gsize resume)
+{
+  static const gchar comment[] = "<!--";
+  static const gchar cdata[] = "<![CDATA[";
+  const gchar *end;
+  gsize from;
+
+  if (!memcmp (s, comment, MIN (len, 4)))
+    {
+      if (len < 4)
+        return 0;
+
+      from = MAX (resume, 4);
+      end = find (s + from, len - from, "-->");
+
+      if (end == NULL)
+        {
+          self->scanned = MAX (len - 2, 4);
+          return 0;
+        }
+
+      /* "--" isn't allowed in comments, nor is "--->" at their end */
+      if (find (s + 4, end - s - 4, "--") != NULL ||
+          (end > s + 4 && end[-1] == '-'))
+        {
+          fail (self, "Double hyphen within comment");
+          return -1;
+        }
+
+      if (!wocky_text_utf8_validate (s, end - s, NULL))
+        {
+          fail (self, "Input is not proper UTF-8");
+          return -1;
+        }
+
+      return end - s + 3;
+    }
+
+  if (!memcmp (s, cdata, MIN (len, 9)))
+    {
+      if (len < 9)
+        return 0;
+
+      if (self->elements->len == 0)
+        {
+          fail (self, "CDATA section outside the root element");
+          return -1;
+        }
+
+      from = MAX (resume, 9);
+      end = find (s + from, len - from, "]]>");
+
+      if (end == NULL)
+        {
+          self->scanned = MAX (len - 2, 9);
+          return 0;
+        }
+
+      if (!emit_cdata (self, s + 9, end - s - 9))
+        return -1;
+
+      return end - s + 3;
+    }
+
+  fail (self, "DTDs are not allowed");
+  return -1;
+}
+
+/* Whatever starts with '<'. Returns its length, 0 if it is cut short, or
+ * -1. */
+static gssize
+parse_markup (WockyXmppTokenizer *self,
+    const gchar *s,
+    gsize len,
+    gsize resume)
+{
+  if (len < 2)
+    return 0;
+
+  switch (s[1])
+    {
+      case '/':
+        return parse_end_tag (self, s, len, resume);
+      case '?':
+        return parse_pi (self, s, len, resume);
+      case '!':
+        return parse_bang (self, s, len, resume);
+      default:
+        return parse_start_tag (self, s, len, resume);
+    }
+}
+
+/* Returns how much of @buf was taken; the first token picks up its search
+ * for its end at @resume */
+static gsize
+parse (WockyXmppTokenizer *self,
+    const gchar *buf,
+    gsize len,
+    gsize resume)
+{
+  gsize p = 0;
+
+  while (p < len && !self->failed)
+    {
+      gssize n;
+
+      if (buf[p] == '<')
+        n = parse_markup (self, buf + p, len - p, p == 0 ? resume : 0);
+      else
+        n = parse_text (self, buf + p, len - p);
+
+      if (n <= 0)
+        break;
+
+      p += n;
+      self->started = TRUE;
+      self->scanned = 0;
+    }
+
+  return p;
+}
+
+void
+wocky_xmpp_tokenizer_push (WockyXmppTokenizer *self,
+    const gchar *data,
+    gsize len)
+{
+  gsize taken;
+
+  if (self->failed)
+    return;
+
+  if (self->pending->len == 0)
+    {
+      taken = parse (self, data, len, 0);
+
+      if (!self->failed && taken < len)
+        g_string_append_len (self->pending, data + taken, len - taken);
+
+      return;
+    }
+
+  g_string_append_len (self->pending, data, len);
+  taken = parse (self, self->pending->str, self->pending->len, self->scanned);
+
+  if (self->failed)
+    g_string_truncate (self->pending, 0);
+  else
+    g_string_erase (self->pending, 0, taken);
+}
@@ -0,0 +1,76 @@
+/*
+ * wocky-xmpp-tokenizer.h - Header for the native XMPP tokenizer
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#if !defined (WOCKY_COMPILATION)
+# error "This is an internal header."
+#endif
+
+#ifndef WOCKY_XMPP_TOKENIZER_H
+#define WOCKY_XMPP_TOKENIZER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _WockyXmppTokenizer WockyXmppTokenizer;
+
+/* What the tokenizer found, reported the way libxml2's SAX2 callbacks are:
+ * @attributes holds @n_attributes groups of five pointers, to the local
+ * name, the prefix (or NULL), the namespace (or NULL), and the start and end
+ * of the value, which isn't NUL-terminated. Namespaces are interned strings.
+ * Nothing is reported after an error, until the tokenizer is reset. */
+typedef struct
+{
+  void (*start_element) (gpointer user_data,
+      const gchar *localname,
+      const gchar *prefix,
+      const gchar *uri,
+      gint n_attributes,
+      const gchar **attributes);
+  void (*end_element) (gpointer user_data);
+  void (*characters) (gpointer user_data,
+      const gchar *text,
+      gsize len);
+  void (*error) (gpointer user_data,
+      const gchar *message);
+} WockyXmppTokenizerFuncs;
+
+WockyXmppTokenizer *wocky_xmpp_tokenizer_new (
+    const WockyXmppTokenizerFuncs *funcs,
+    gpointer user_data);
+
+void wocky_xmpp_tokenizer_free (WockyXmppTokenizer *tokenizer);
+
+/* Gets ready for a new document */
+void wocky_xmpp_tokenizer_reset (WockyXmppTokenizer *tokenizer);
+
+void wocky_xmpp_tokenizer_push (WockyXmppTokenizer *tokenizer,
+    const gchar *data,
+    gsize len);
+
+/* Whether the tokenizer is between two pieces of markup, with nothing held
+ * back from earlier pushes */
+gboolean wocky_xmpp_tokenizer_is_idle (WockyXmppTokenizer *tokenizer);
+
+/* How many bytes of a token whose end hasn't arrived yet the tokenizer is
+ * holding on to */
+gsize wocky_xmpp_tokenizer_get_pending_size (WockyXmppTokenizer *tokenizer);
+
+G_END_DECLS
+
+#endif /* WOCKY_XMPP_TOKENIZER_H */
@@ -39,6 +39,10 @@
 #include <libxml/xmlwriter.h>
 
 #include "wocky-xmpp-writer.h"
+#include "wocky-xmpp-pool.h"
+#include "wocky-node-private.h"
+#include "wocky-stanza-private.h"
+#include "wocky-text.h"
 
 G_DEFINE_TYPE (WockyXmppWriter, wocky_xmpp_writer, G_TYPE_OBJECT)
 
@@ -59,6 +63,9 @@ struct _WockyXmppWriterPrivate
   GQuark stream_ns;
   gboolean stream_mode;
   xmlBufferPtr buffer;
+  /* the serialization kept by the last stanza written, held until the next
+   * one in case the stanza is gone before its data is sent */
+  GBytes *last_serialized;
 };
 
 static void
@@ -139,6 +146,9 @@ wocky_xmpp_writer_finalize (GObject *object)
   xmlFreeTextWriter (priv->xmlwriter);
   xmlBufferFree (priv->buffer);
 
+  if (priv->last_serialized != NULL)
+    g_bytes_unref (priv->last_serialized);
+
   G_OBJECT_CLASS (wocky_xmpp_writer_parent_class)->finalize (object);
 }
 
@@ -332,6 +342,57 @@ wocky_xmpp_writer_stream_close (WockyXmppWriter *writer,
 static void
 _xml_write_node (WockyXmppWriter *writer, WockyNode *node);
 
+/* Nearly all attribute values and text need no escaping at all: those are
+ * copied as they are, rather than looked at a character at a time by
+ * libxml2 */
+static void
+_write_attribute (WockyXmppWriterPrivate *priv,
+    const gchar *prefix,
+    const gchar *key,
+    const gchar *ns,
+    const gchar *value)
+{
+  gsize len = strlen (value);
+
+  if (wocky_text_escape_scan (value, len, WOCKY_TEXT_ESCAPE_ATTRIBUTE) < len)
+    {
+      xmlTextWriterWriteAttributeNS (priv->xmlwriter,
+          (const xmlChar *) prefix, (const xmlChar *) key,
+          (const xmlChar *) ns, (const xmlChar *) value);
+      return;
+    }
+
+  xmlTextWriterStartAttributeNS (priv->xmlwriter,
+      (const xmlChar *) prefix, (const xmlChar *) key, (const xmlChar *) ns);
+  xmlTextWriterWriteRawLen (priv->xmlwriter, (const xmlChar *) value, len);
+  xmlTextWriterEndAttribute (priv->xmlwriter);
+}
+
+static void
+_write_text (WockyXmppWriterPrivate *priv,
+    const gchar *content)
+{
+  gsize len = strlen (content);
+  gsize plain;
+  GString *escaped;
+
+  plain = wocky_text_escape_scan (content, len, WOCKY_TEXT_ESCAPE_CONTENT);
+
+  if (plain == len)
+    {
+      xmlTextWriterWriteRawLen (priv->xmlwriter, (const xmlChar *) content,
+          len);
+      return;
+    }
+
+  escaped = g_string_sized_new (len + 16);
+  g_string_append_len (escaped, content, plain);
+  wocky_text_escape_append (escaped, content + plain, len - plain);
+  xmlTextWriterWriteRawLen (priv->xmlwriter, (const xmlChar *) escaped->str,
+      escaped->len);
+  g_string_free (escaped, TRUE);
+}
+
 static gboolean
 _write_attr (const gchar *key, const gchar *value,
     const gchar *prefix, const gchar *ns,
@@ -347,30 +408,12 @@ _write_attr (const gchar *key, const gchar *value,
     }
 
   if (attrns == 0 || attrns == priv->current_ns)
-    {
-      xmlTextWriterWriteAttribute (priv->xmlwriter,
-          (const xmlChar *)key,
-          (const xmlChar *)value);
-    }
+    _write_attribute (priv, NULL, key, NULL, value);
   else if (attrns == priv->stream_ns)
-    {
-      xmlTextWriterWriteAttributeNS (priv->xmlwriter,
-          (const xmlChar *)"stream", (const xmlChar *)key,
-          (const xmlChar *)NULL, (const xmlChar *)value);
-    }
+    _write_attribute (priv, "stream", key, NULL, value);
   else
-    {
-      xmlTextWriterWriteAttributeNS (priv->xmlwriter,
-          (const xmlChar *)prefix, (const xmlChar *)key, (const xmlChar *)ns,
-          (const xmlChar *)value);
-    }
-  return TRUE;
-}
+    _write_attribute (priv, prefix, key, ns, value);
 
-static gboolean
-_write_child (WockyNode *node, gpointer user_data)
-{
-  _xml_write_node (WOCKY_XMPP_WRITER (user_data), node);
   return TRUE;
 }
 
@@ -378,6 +421,7 @@ static void
 _xml_write_node (WockyXmppWriter *writer, WockyNode *node)
 {
   const gchar *l;
+  GSList *c;
   GQuark oldns;
   WockyXmppWriterPrivate *priv = writer->priv;
 
@@ -408,17 +452,18 @@ _xml_write_node (WockyXmppWriter *writer, WockyNode *node)
 
   if (l != NULL)
     {
-      xmlTextWriterWriteAttributeNS(priv->xmlwriter,
-          (const xmlChar *)"xml", (const xmlChar *)"lang", NULL,
-          (const xmlChar *)l);
+      _write_attribute (priv, "xml", "lang", NULL, l);
     }
 
-  wocky_node_each_child (node, _write_child, writer);
+  /* only reading them, so children shared with other nodes can stay so */
+  _wocky_node_ensure_children (node);
+
+  for (c = node->children; c != NULL; c = c->next)
+    _xml_write_node (writer, c->data);
 
   if (node->content != NULL)
     {
-      xmlTextWriterWriteString (priv->xmlwriter,
-        (const xmlChar*)node->content);
+      _write_text (priv, node->content);
     }
 
   xmlTextWriterEndElement (priv->xmlwriter);
@@ -466,7 +511,14 @@ _write_node_tree (WockyXmppWriter *writer,
  * @length: length of the data buffer
  *
  * Serialize the @stanza to XML. The result is available in the
- * @data buffer. The buffer is only valid until the next call to a function
+ * @data buffer. The buffer is only valid until the next call to a function of
+ * the writer.
+ *
+ * While @stanza is held by wocky_stanza_hold_serialization(), the result is
+ * kept by @stanza, and given again as it is, without serializing anything, as
+ * long as the stanza isn't changed and the writer is in the same state:
+ * sending the same stanza to many contacts, or again after a reconnection,
+ * only costs a serialization the first time.
  */
 void
 wocky_xmpp_writer_write_stanza (WockyXmppWriter *writer,
@@ -474,7 +526,41 @@ wocky_xmpp_writer_write_stanza (WockyXmppWriter *writer,
     const guint8 **data,
     gsize *length)
 {
-  _write_node_tree (writer, WOCKY_NODE_TREE (stanza), data, length);
+  WockyXmppWriterPrivate *priv = writer->priv;
+  GBytes *serialized;
+
+  if (priv->last_serialized != NULL)
+    {
+      g_bytes_unref (priv->last_serialized);
+      priv->last_serialized = NULL;
+    }
+
+  if (!_wocky_stanza_get_serialization_held (stanza))
+    {
+      _write_node_tree (writer, WOCKY_NODE_TREE (stanza), data, length);
+      return;
+    }
+
+  serialized = _wocky_stanza_get_serialized (stanza, priv->stream_mode,
+      priv->current_ns, priv->stream_ns);
+
+  if (serialized == NULL)
+    {
+      _write_node_tree (writer, WOCKY_NODE_TREE (stanza), data, length);
+
+      serialized = g_bytes_new (*data, *length);
+      _wocky_stanza_set_serialized (stanza, priv->stream_mode,
+          priv->current_ns, priv->stream_ns, serialized);
+      g_bytes_unref (serialized);
+      return;
+    }
+
+  priv->last_serialized = g_bytes_ref (serialized);
+  *data = g_bytes_get_data (serialized, length);
+
+#ifdef ENABLE_DEBUG
+  wocky_debug (WOCKY_DEBUG_NET, "Writing xml: %.*s", (int)*length, *data);
+#endif
 }
 
 /**
@@ -516,3 +602,33 @@ wocky_xmpp_writer_flush (WockyXmppWriter *writer)
   xmlBufferFree (priv->buffer);
   priv->buffer = xmlBufferCreate ();
 }
+
+/* Past this size, a recycled writer gives its buffer back rather than hold
+ * on to the largest stanza it ever wrote */
+#define MAX_KEPT_BUFFER (64 * 1024)
+
+gboolean
+wocky_xmpp_writer_recycle (WockyXmppWriter *writer)
+{
+  WockyXmppWriterPrivate *priv = writer->priv;
+
+  if (G_OBJECT_TYPE (writer) != WOCKY_TYPE_XMPP_WRITER ||
+      !priv->stream_mode || priv->dispose_has_run)
+    return FALSE;
+
+  priv->current_ns = 0;
+  priv->stream_ns = 0;
+
+  if (priv->last_serialized != NULL)
+    {
+      g_bytes_unref (priv->last_serialized);
+      priv->last_serialized = NULL;
+    }
+
+  if (priv->buffer->size > MAX_KEPT_BUFFER)
+    wocky_xmpp_writer_flush (writer);
+  else
+    xmlBufferEmpty (priv->buffer);
+
+  return TRUE;
+}
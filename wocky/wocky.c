@@ -26,6 +26,8 @@
 
 #include "wocky.h"
 #include "wocky-node.h"
+#include "wocky-tls-trust-store.h"
+#include "wocky-xmpp-pool.h"
 #include "wocky-xmpp-error.h"
 
 /**
@@ -58,6 +60,8 @@ wocky_init (void)
 void
 wocky_deinit (void)
 {
+  wocky_tls_trust_store_clear ();
+  wocky_xmpp_pool_clear ();
   xmlCleanupParser ();
   wocky_node_deinit ();
   wocky_xmpp_error_deinit ();